@@ -0,0 +1,285 @@
+/*
+ * Benchmarks of hook dispatch and the Scheme FFI. The modules of a
+ * directory are loaded through scm_init against an offline connection,
+ * and synthetic messages are driven through exec_hooks the way
+ * handle_message does. Results are printed as JSON:
+ *
+ *     bench_hooks [-c config] [-m module_dir] [-n messages] [-i calls]
+ *
+ * Every message shape in the mix is timed against the loaded modules.
+ * With bench/scheme/bench_hooks.scm among them the cost per irc hook,
+ * command hook and regex hook is also measured with 1 to 500 of them
+ * registered, and the cost per call of each FFI accessor.
+ */
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config/config.h"
+#include "irc/hooks.h"
+#include "irc/irc.h"
+#include "irc/rcu.h"
+#include "log/log.h"
+#include "scheme/scheme.h"
+
+#ifndef BENCH_SCHEME_DIR
+#define BENCH_SCHEME_DIR "bench/scheme"
+#endif
+#define BENCH_ROUNDS 5
+/* Seconds to wait for the modules to load */
+#define BENCH_LOAD_TIMEOUT 60
+
+static const irc_server *server;
+/* Lines sent by the modules, only read for the handshake */
+static FILE *capture;
+static bool first_result = true;
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static irc_msg *
+bench_msg (const char *command, const char *p0, const char *p1)
+{
+	char *params[] = { strdup (p0), strdup (p1) };
+	return irc_msg_new (strdup ("nick!~ident@bench.example"), strdup (command), 2, params);
+}
+
+/* The same hooks handle_message runs for a parsed line */
+static void
+dispatch (const irc_msg *msg)
+{
+	exec_hooks (server, msg->command, msg);
+	exec_hooks (server, "*", msg);
+}
+
+/* Drop what the modules sent, outside of any timing */
+static void
+discard_sent (void)
+{
+	irc_flush_write_queue (server);
+	fflush (capture);
+	if (ftruncate (fileno (capture), 0) == 0)
+		rewind (capture);
+}
+
+/* Median ns per message of BENCH_ROUNDS rounds of n messages */
+static double
+time_dispatch (const irc_msg *msg, int n)
+{
+	uint64_t rounds[BENCH_ROUNDS];
+
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		uint64_t start = now_ns ();
+		for (int i = 0; i < n; i++)
+			dispatch (msg);
+		rounds[r] = now_ns () - start;
+		discard_sent ();
+		rcu_reclaim ();
+	}
+
+	/* Insertion sort, there are only a few */
+	for (int i = 1; i < BENCH_ROUNDS; i++)
+		for (int j = i; j > 0 && rounds[j] < rounds[j - 1]; j--) {
+			uint64_t t = rounds[j];
+			rounds[j] = rounds[j - 1];
+			rounds[j - 1] = t;
+		}
+	return (double)rounds[BENCH_ROUNDS / 2] / n;
+}
+
+static void
+result_begin (const char *path)
+{
+	printf ("%s\n    {\"path\": \"%s\"", first_result ? "" : ",", path);
+	first_result = false;
+}
+
+static bool
+harness_loaded (void)
+{
+	irc_msg *hello = bench_msg ("BENCH-HELLO", "#bench", "hello");
+	dispatch (hello);
+	free_msg (hello);
+
+	irc_flush_write_queue (server);
+	fflush (capture);
+	rewind (capture);
+
+	char line[64];
+	bool ready = false;
+	while (fgets (line, sizeof (line), capture) != NULL)
+		if (strncmp (line, "BENCH-READY", 11) == 0)
+			ready = true;
+	discard_sent ();
+	return ready;
+}
+
+static void
+bench_mix (int n)
+{
+	const char *prefix = get_config ()->cmd_prefix;
+	char command[64];
+	snprintf (command, sizeof (command), "%secho hello", prefix);
+
+	struct
+	{
+		const char *name;
+		irc_msg *msg;
+	} mix[] = {
+		{ "PRIVMSG", bench_msg ("PRIVMSG", "#bench", "just some channel text") },
+		{ "PRIVMSG command", bench_msg ("PRIVMSG", "#bench", command) },
+		{ "NOTICE", bench_msg ("NOTICE", "#bench", "a notice") },
+		{ "JOIN", bench_msg ("JOIN", "#bench", "account") },
+	};
+
+	for (size_t i = 0; i < sizeof (mix) / sizeof (mix[0]); i++) {
+		result_begin ("mix");
+		printf (", \"message\": \"%s\", \"ns_per_msg\": %.1f}", mix[i].name, time_dispatch (mix[i].msg, n));
+		free_msg (mix[i].msg);
+	}
+}
+
+/* Registered hooks are never removed, so every kind grows from 0 */
+static void
+bench_scaling (int n)
+{
+	static const int counts[] = { 1, 10, 50, 100, 250, 500 };
+	char text[64];
+	snprintf (text, sizeof (text), "%sbench", get_config ()->cmd_prefix);
+
+	struct
+	{
+		const char *path;
+		const char *kind;
+		irc_msg *msg;
+	} kinds[] = {
+		{ "irc_hook", "irc", bench_msg ("BENCH", "#bench", "x") },
+		{ "command_hook", "command", bench_msg ("PRIVMSG", "#bench", text) },
+		{ "regex_hook", "regex", bench_msg ("PRIVMSG", "#bench", "bench") },
+	};
+
+	for (size_t k = 0; k < sizeof (kinds) / sizeof (kinds[0]); k++) {
+		int registered = 0;
+		for (size_t c = 0; c < sizeof (counts) / sizeof (counts[0]); c++) {
+			char more[16];
+			snprintf (more, sizeof (more), "%d", counts[c] - registered);
+			irc_msg *grow = bench_msg ("BENCH-GROW", kinds[k].kind, more);
+			dispatch (grow);
+			free_msg (grow);
+			rcu_reclaim ();
+			registered = counts[c];
+
+			double per_msg = time_dispatch (kinds[k].msg, n);
+			result_begin (kinds[k].path);
+			printf (", \"hooks\": %d, \"ns_per_msg\": %.1f, \"ns_per_hook\": %.1f}",
+				registered,
+				per_msg,
+				per_msg / registered);
+		}
+		free_msg (kinds[k].msg);
+	}
+}
+
+/* Cost of one call, the loop itself is measured with "none" */
+static void
+bench_ffi (int calls)
+{
+	static const char *accessors[] = {
+		"none",
+		"get-message-params",
+		"get-message-command",
+		"get-message-source",
+		"get-cmd-prefix",
+		"send-raw",
+	};
+	char n[16];
+	snprintf (n, sizeof (n), "%d", calls);
+
+	double base = 0;
+	for (size_t i = 0; i < sizeof (accessors) / sizeof (accessors[0]); i++) {
+		irc_msg *msg = bench_msg ("BENCH-FFI", accessors[i], n);
+		double per_call = time_dispatch (msg, 1) / calls;
+		free_msg (msg);
+
+		if (i == 0) {
+			base = per_call;
+			continue;
+		}
+		result_begin ("ffi");
+		printf (", \"accessor\": \"%s\", \"ns_per_call\": %.1f}", accessors[i], per_call - base);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *config_path = "./config.json";
+	const char *module_dir = BENCH_SCHEME_DIR;
+	int messages = 2000;
+	int calls = 100000;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "c:m:n:i:")) != -1) {
+		switch (opt) {
+		case 'c':
+			config_path = optarg;
+			break;
+		case 'm':
+			module_dir = optarg;
+			break;
+		case 'n':
+			messages = atoi (optarg);
+			break;
+		case 'i':
+			calls = atoi (optarg);
+			break;
+		default:
+			fprintf (stderr, "usage: %s [-c config] [-m module_dir] [-n messages] [-i calls]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (messages <= 0 || calls <= 0)
+		errx (1, "-n and -i must be positive");
+
+	parse_config (config_path);
+	config_t *config = get_config ();
+	config->scheme_mod_dir = strdup (module_dir);
+	config->scheme_hot_reload = false;
+	/* Module load messages would end up in the JSON on stdout */
+	for (int i = 0; i < LOG_SUBSYS_COUNT; i++)
+		log_levels[i] = LOG_LEVEL_ERROR;
+
+	server = config->server;
+	capture = tmpfile ();
+	if (capture == NULL || irc_server_connect_offline (server, capture) != 0)
+		errx (1, "could not set up the offline connection");
+
+	init_hooks ();
+	scm_init ();
+	for (int waited = 0; !scm_modules_ready (); waited++) {
+		if (waited > BENCH_LOAD_TIMEOUT * 100)
+			errx (1, "modules did not load in %d seconds", BENCH_LOAD_TIMEOUT);
+		usleep (10000);
+	}
+
+	printf ("{\n  \"modules\": \"%s\",\n  \"messages\": %d,\n  \"results\": [", module_dir, messages);
+	bench_mix (messages);
+	if (harness_loaded ()) {
+		bench_scaling (messages);
+		bench_ffi (calls);
+	} else {
+		fprintf (stderr, "bench_hooks.scm is not loaded, only timing the mix\n");
+	}
+	printf ("\n  ]\n}\n");
+	return 0;
+}
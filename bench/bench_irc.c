@@ -0,0 +1,365 @@
+/*
+ * Microbenchmarks of the message hot path: ircmsg_parse with parse_cbs,
+ * ircmsg_serialize with serializer_cbs, irc_msg_new and free_msg, run
+ * over every set of a corpus of real lines. Results are printed as
+ * JSON to compare commits:
+ *
+ *     bench_irc [-r rounds] [corpus]
+ *
+ * Allocations are counted by wrapping the allocator at link time, so
+ * they cover libirc and ircmsg but not libc internals.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "irc/message.h"
+#include "irc/parser.h"
+#include "irc/serializer.h"
+
+#ifndef BENCH_CORPUS
+#define BENCH_CORPUS "bench/corpus/irc.txt"
+#endif
+#define BENCH_DEFAULT_ROUNDS 200
+#define BENCH_MAX_SETS 16
+
+typedef struct corpus_set
+{
+	char *name;
+	char **lines;
+	size_t *lens;
+	size_t n;
+	size_t bytes;
+} corpus_set;
+
+typedef struct bench_result
+{
+	uint64_t *round_ns;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+	uint64_t failures;
+} bench_result;
+
+/* Only counted while a benchmark runs */
+static bool counting;
+static uint64_t allocs;
+static uint64_t alloc_bytes;
+
+void *
+__real_malloc (size_t size);
+void *
+__real_calloc (size_t n, size_t size);
+void *
+__real_realloc (void *p, size_t size);
+
+void *
+__wrap_malloc (size_t size)
+{
+	if (counting) {
+		allocs++;
+		alloc_bytes += size;
+	}
+	return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t n, size_t size)
+{
+	if (counting) {
+		allocs++;
+		alloc_bytes += n * size;
+	}
+	return __real_calloc (n, size);
+}
+
+void *
+__wrap_realloc (void *p, size_t size)
+{
+	if (counting) {
+		allocs++;
+		alloc_bytes += size;
+	}
+	return __real_realloc (p, size);
+}
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+set_append (corpus_set *set, const char *line, size_t len)
+{
+	set->lines = realloc (set->lines, (set->n + 1) * sizeof (char *));
+	set->lens = realloc (set->lens, (set->n + 1) * sizeof (size_t));
+	set->lines[set->n] = strndup (line, len);
+	set->lens[set->n] = len;
+	set->n++;
+	set->bytes += len;
+}
+
+/* Sets start at "## name" lines, other "#" lines are comments */
+static size_t
+load_corpus (const char *path, corpus_set *sets)
+{
+	FILE *f = fopen (path, "r");
+	if (f == NULL) {
+		perror (path);
+		exit (1);
+	}
+
+	size_t n_sets = 0;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline (&line, &cap, f)) > 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+
+		if (strncmp (line, "## ", 3) == 0 && n_sets < BENCH_MAX_SETS) {
+			memset (&sets[n_sets], 0, sizeof (corpus_set));
+			sets[n_sets++].name = strdup (line + 3);
+		} else if (len > 0 && line[0] != '#') {
+			if (n_sets == 0) {
+				memset (&sets[0], 0, sizeof (corpus_set));
+				sets[n_sets++].name = strdup ("default");
+			}
+			set_append (&sets[n_sets - 1], line, len);
+		}
+	}
+	free (line);
+	fclose (f);
+	return n_sets;
+}
+
+static irc_msg *
+parse_line (const corpus_set *set, size_t i, uint64_t *failures)
+{
+	irc_msg *msg = alloc_msg ();
+	/* On errors parse_cbs frees the message itself */
+	if (ircmsg_parse ((const uint8_t *)set->lines[i], set->lens[i], &parse_cbs, msg) == 0) {
+		(*failures)++;
+		return NULL;
+	}
+	return msg;
+}
+
+static void
+bench_begin (bench_result *r, int round)
+{
+	if (round == 0) {
+		allocs = 0;
+		alloc_bytes = 0;
+		counting = true;
+	}
+}
+
+static void
+bench_end (bench_result *r, int round)
+{
+	if (round == 0) {
+		counting = false;
+		r->allocs = allocs;
+		r->alloc_bytes = alloc_bytes;
+	}
+}
+
+static void
+bench_parse (const corpus_set *set, irc_msg **msgs, bench_result *r, int rounds)
+{
+	for (int round = 0; round < rounds; round++) {
+		uint64_t failures = 0;
+		bench_begin (r, round);
+		uint64_t start = now_ns ();
+		for (size_t i = 0; i < set->n; i++)
+			msgs[i] = parse_line (set, i, &failures);
+		r->round_ns[round] = now_ns () - start;
+		bench_end (r, round);
+		r->failures = failures;
+
+		for (size_t i = 0; i < set->n; i++)
+			free_msg (msgs[i]);
+	}
+}
+
+static void
+bench_free (const corpus_set *set, irc_msg **msgs, bench_result *r, int rounds)
+{
+	uint64_t failures = 0;
+	for (int round = 0; round < rounds; round++) {
+		for (size_t i = 0; i < set->n; i++)
+			msgs[i] = parse_line (set, i, &failures);
+
+		bench_begin (r, round);
+		uint64_t start = now_ns ();
+		for (size_t i = 0; i < set->n; i++)
+			free_msg (msgs[i]);
+		r->round_ns[round] = now_ns () - start;
+		bench_end (r, round);
+	}
+}
+
+static void
+bench_serialize (const corpus_set *set, irc_msg **msgs, bench_result *r, int rounds)
+{
+	uint64_t failures = 0;
+	/* Big enough for any IRCv3 line, so it never grows while timed */
+	size_t cap = 8192;
+	uint8_t *buf = malloc (cap);
+
+	for (size_t i = 0; i < set->n; i++)
+		msgs[i] = parse_line (set, i, &failures);
+
+	for (int round = 0; round < rounds; round++) {
+		bench_begin (r, round);
+		uint64_t start = now_ns ();
+		for (size_t i = 0; i < set->n; i++) {
+			if (msgs[i] == NULL)
+				continue;
+			size_t len = ircmsg_serialize_buffer_len (&serializer_cbs, msgs[i]);
+			if (len + 1 > cap) {
+				cap = len + 1;
+				buf = realloc (buf, cap);
+			}
+			ircmsg_serialize (buf, len, &serializer_cbs, msgs[i]);
+		}
+		r->round_ns[round] = now_ns () - start;
+		bench_end (r, round);
+	}
+
+	for (size_t i = 0; i < set->n; i++)
+		free_msg (msgs[i]);
+	free (buf);
+}
+
+/* irc_msg_new borrows the strings, so only its own memory is freed */
+static void
+free_msg_shallow (irc_msg *msg)
+{
+	free (msg->params->params);
+	free (msg->params);
+	free (msg->tags);
+	free (msg);
+}
+
+static void
+bench_new (const corpus_set *set, irc_msg **msgs, bench_result *r, int rounds)
+{
+	uint64_t failures = 0;
+	irc_msg **built = calloc (set->n, sizeof (irc_msg *));
+
+	for (size_t i = 0; i < set->n; i++)
+		msgs[i] = parse_line (set, i, &failures);
+
+	for (int round = 0; round < rounds; round++) {
+		bench_begin (r, round);
+		uint64_t start = now_ns ();
+		for (size_t i = 0; i < set->n; i++) {
+			if (msgs[i] != NULL) {
+				irc_msg_params *p = msgs[i]->params;
+				built[i] = irc_msg_new (msgs[i]->prefix,
+							msgs[i]->command,
+							p != NULL ? p->len : 0,
+							p != NULL ? p->params : NULL);
+			}
+		}
+		r->round_ns[round] = now_ns () - start;
+		bench_end (r, round);
+
+		for (size_t i = 0; i < set->n; i++)
+			if (msgs[i] != NULL)
+				free_msg_shallow (built[i]);
+	}
+
+	for (size_t i = 0; i < set->n; i++)
+		free_msg (msgs[i]);
+	free (built);
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_result (const char *bench, const corpus_set *set, bench_result *r, int rounds, bool *first)
+{
+	/* The median round is the least sensitive to a noisy machine */
+	qsort (r->round_ns, rounds, sizeof (uint64_t), compare_u64);
+	double median = r->round_ns[rounds / 2];
+	double per_msg = set->n > 0 ? median / set->n : 0;
+
+	printf ("%s\n    {\"bench\": \"%s\", \"set\": \"%s\", \"messages\": %zu, ", *first ? "" : ",", bench, set->name, set->n);
+	printf ("\"ns_per_msg\": %.1f, \"min_ns_per_msg\": %.1f, ", per_msg, set->n > 0 ? (double)r->round_ns[0] / set->n : 0);
+	printf ("\"msgs_per_sec\": %.0f, \"mb_per_sec\": %.2f, ", median > 0 ? set->n * 1e9 / median : 0, median > 0 ? set->bytes * 1e3 / median : 0);
+	printf ("\"allocs_per_msg\": %.2f, \"alloc_bytes_per_msg\": %.1f, \"parse_failures\": %llu}",
+		set->n > 0 ? (double)r->allocs / set->n : 0,
+		set->n > 0 ? (double)r->alloc_bytes / set->n : 0,
+		(unsigned long long)r->failures);
+	*first = false;
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *corpus = BENCH_CORPUS;
+	int rounds = BENCH_DEFAULT_ROUNDS;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "r:")) != -1) {
+		if (opt == 'r' && atoi (optarg) > 0) {
+			rounds = atoi (optarg);
+		} else {
+			fprintf (stderr, "usage: %s [-r rounds] [corpus]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		corpus = argv[optind];
+
+	corpus_set sets[BENCH_MAX_SETS];
+	size_t n_sets = load_corpus (corpus, sets);
+
+	static const struct
+	{
+		const char *name;
+		void (*run) (const corpus_set *, irc_msg **, bench_result *, int);
+	} benches[] = {
+		{ "ircmsg_parse", bench_parse },
+		{ "ircmsg_serialize", bench_serialize },
+		{ "irc_msg_new", bench_new },
+		{ "free_msg", bench_free },
+	};
+
+	printf ("{\n  \"corpus\": \"%s\",\n  \"rounds\": %d,\n  \"results\": [", corpus, rounds);
+	bool first = true;
+	for (size_t b = 0; b < sizeof (benches) / sizeof (benches[0]); b++) {
+		for (size_t s = 0; s < n_sets; s++) {
+			irc_msg **msgs = calloc (sets[s].n, sizeof (irc_msg *));
+			bench_result r = { .round_ns = calloc (rounds, sizeof (uint64_t)) };
+			benches[b].run (&sets[s], msgs, &r, rounds);
+			print_result (benches[b].name, &sets[s], &r, rounds, &first);
+			free (r.round_ns);
+			free (msgs);
+		}
+	}
+	printf ("\n  ]\n}\n");
+
+	for (size_t s = 0; s < n_sets; s++) {
+		for (size_t i = 0; i < sets[s].n; i++)
+			free (sets[s].lines[i]);
+		free (sets[s].lines);
+		free (sets[s].lens);
+		free (sets[s].name);
+	}
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Known answer checks of the SASL code: the SCRAM-SHA-256 exchange of
+ * RFC 7677 section 3, the base64 vectors of RFC 4648 section 10 and a
+ * round trip of every length up to a few chunks. Prints each failure
+ * and exits non-zero if there was one:
+ *
+ *     sasl_check
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cap/sasl.h"
+#include "irc/base64.h"
+
+/* Longest input of the round trip, more than one AUTHENTICATE chunk */
+#define CHECK_ROUND_TRIP_MAX 1024
+
+static int failures;
+
+static void
+check (bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf (stderr, "FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static void
+check_scram (void)
+{
+	const char *client_first_bare = "n=user,r=rOprNGfwEbeRWgbNEkqO";
+	const char *server_first = "r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+				   "s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096";
+	const char *client_final = "c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,"
+				   "p=dHzbZapWIk4jUhN+Ute9ytag9zjfMHgsqmmiz7AndVQ=";
+	const char *verifier = "6rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4=";
+	unsigned char signature[SCRAM_HASH_SIZE];
+	const char *why;
+
+	char *final = scram_client_final ("pencil", client_first_bare, server_first, signature, &why);
+	check (final != NULL && strcmp (final, client_final) == 0, "SCRAM-SHA-256 client-final-message");
+	free (final);
+
+	char *signature64 = base64_encode (signature, sizeof (signature));
+	check (strcmp (signature64, verifier) == 0, "SCRAM-SHA-256 server signature");
+	free (signature64);
+
+	/* Again, from the cached salted password */
+	final = scram_client_final ("pencil", client_first_bare, server_first, signature, &why);
+	check (final != NULL && strcmp (final, client_final) == 0, "SCRAM-SHA-256 cached salted password");
+	free (final);
+
+	final = scram_client_final ("pencil", client_first_bare, "r=other,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096", signature, &why);
+	check (final == NULL, "SCRAM-SHA-256 rejects a nonce that does not extend ours");
+	free (final);
+
+	final = scram_client_final ("pencil", client_first_bare, "r=rOprNGfwEbeRWgbNEkqOx,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=99999999", signature, &why);
+	check (final == NULL, "SCRAM-SHA-256 rejects too many iterations");
+	free (final);
+
+	final = scram_client_final ("pencil", client_first_bare, "r=rOprNGfwEbeRWgbNEkqOx,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096x", signature, &why);
+	check (final == NULL, "SCRAM-SHA-256 rejects a malformed iteration count");
+	free (final);
+}
+
+static void
+check_base64 (void)
+{
+	static const char *const vectors[][2] = {
+		{ "", "" },
+		{ "f", "Zg==" },
+		{ "fo", "Zm8=" },
+		{ "foo", "Zm9v" },
+		{ "foob", "Zm9vYg==" },
+		{ "fooba", "Zm9vYmE=" },
+		{ "foobar", "Zm9vYmFy" },
+	};
+	static const char *const invalid[] = { "Zm9", "Zm=v", "Z===", "Zm9v!A==", "=Zm9" };
+
+	for (size_t i = 0; i < sizeof (vectors) / sizeof (vectors[0]); i++) {
+		char *encoded = base64_encode (vectors[i][0], strlen (vectors[i][0]));
+		check (strcmp (encoded, vectors[i][1]) == 0, "base64 encodes the RFC 4648 vectors");
+		free (encoded);
+
+		size_t len;
+		unsigned char *decoded = base64_decode (vectors[i][1], strlen (vectors[i][1]), &len);
+		check (decoded != NULL && len == strlen (vectors[i][0]) && memcmp (decoded, vectors[i][0], len) == 0,
+		       "base64 decodes the RFC 4648 vectors");
+		free (decoded);
+	}
+
+	for (size_t i = 0; i < sizeof (invalid) / sizeof (invalid[0]); i++) {
+		unsigned char *decoded = base64_decode (invalid[i], strlen (invalid[i]), NULL);
+		check (decoded == NULL, "base64 rejects invalid input");
+		free (decoded);
+	}
+
+	unsigned char data[CHECK_ROUND_TRIP_MAX];
+	for (size_t i = 0; i < sizeof (data); i++)
+		data[i] = i * 131 + 7;
+	for (size_t n = 0; n <= sizeof (data); n++) {
+		char *encoded = base64_encode (data, n);
+		size_t len;
+		unsigned char *decoded = base64_decode (encoded, strlen (encoded), &len);
+		if (decoded == NULL || len != n || memcmp (decoded, data, n) != 0) {
+			fprintf (stderr, "FAIL: base64 round trip of %zu bytes\n", n);
+			failures++;
+		}
+		free (decoded);
+		free (encoded);
+	}
+}
+
+int
+main (void)
+{
+	check_scram ();
+	check_base64 ();
+
+	printf ("sasl_check: %s\n", failures == 0 ? "ok" : "failed");
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,32 @@
+;; Harness module of bench_hooks, see bench/bench_hooks.c
+;; It grows the hook tables and calls the FFI in loops on request.
+
+(define (noop) #f)
+
+;; BENCH-GROW <kind> <count>: registers count more no-op hooks of kind
+(define (grow)
+  (let ((kind (car (get-message-params)))
+        (count (string->number (cadr (get-message-params)))))
+    (do ((i 0 (+ i 1))) ((= i count))
+      (cond ((string=? kind "irc") (register-hook "BENCH" noop))
+            ((string=? kind "command") (register-command "bench" noop))
+            ((string=? kind "regex") (register-match "^bench" noop))))))
+
+(define accessors
+  (list (cons "none" (lambda () #f))
+        (cons "get-message-params" get-message-params)
+        (cons "get-message-command" get-message-command)
+        (cons "get-message-source" get-message-source)
+        (cons "get-cmd-prefix" get-cmd-prefix)
+        (cons "send-raw" (lambda () (send-raw "PRIVMSG #bench :x\r\n")))))
+
+;; BENCH-FFI <accessor> <iterations>: calls the accessor in a loop
+(define (ffi)
+  (let ((f (cdr (assoc (car (get-message-params)) accessors)))
+        (n (string->number (cadr (get-message-params)))))
+    (do ((i 0 (+ i 1))) ((= i n))
+      (f))))
+
+(register-hook "BENCH-HELLO" (lambda () (send-raw "BENCH-READY\r\n")))
+(register-hook "BENCH-GROW" grow)
+(register-hook "BENCH-FFI" ffi)
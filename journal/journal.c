@@ -0,0 +1,450 @@
+#include "journal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "CIRCJNL1"
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_NAME_FORMAT "journal-%010u.bin"
+/* Smallest segment, so one holds any line */
+#define JOURNAL_MIN_SEGMENT (1 << 20)
+/* Wait before trying again to open a segment that failed */
+#define JOURNAL_RETRY_SECONDS 10
+
+typedef struct segment_header
+{
+	char magic[8];
+	uint64_t seq;
+	uint64_t created_ns;
+} segment_header;
+
+typedef struct record_header
+{
+	/* Stored last, 0 until the record is complete */
+	_Atomic uint32_t len;
+	uint32_t direction;
+	uint64_t mono_ns;
+	uint64_t wall_ns;
+} record_header;
+
+typedef struct segment
+{
+	char *map;
+	size_t size;
+	unsigned seq;
+	_Atomic size_t used;
+	/* Writers copying into map, it is unmapped once there are none */
+	_Atomic int writers;
+	struct segment *next;
+} segment;
+
+static pthread_mutex_t journal_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic(segment *) current;
+/*
+ * The journal thread opens the segment after current ahead of time, so
+ * the writer that fills current only swaps pointers. When the spare is
+ * not ready yet, or opening it failed and is retried, current is NULL
+ * and lines are dropped until the thread has a segment again.
+ */
+static segment *spare;
+static unsigned next_seq;
+static pthread_t thread;
+static bool thread_running;
+static bool stopping;
+/* Rotated out segments. A writer may hold a pointer to one for as long
+ * as it likes, so they are unmapped when idle but never freed, one small
+ * struct per segment of traffic
+ */
+static segment *retired;
+static char *dir;
+static int keep;
+static size_t segment_size;
+
+static uint64_t
+clock_ns (clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime (clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *
+segment_path (unsigned seq)
+{
+	char name[64];
+	snprintf (name, sizeof (name), JOURNAL_NAME_FORMAT, seq);
+	size_t len = strlen (dir) + strlen (name) + 2;
+	char *path = malloc (len);
+	snprintf (path, len, "%s/%s", dir, name);
+	return path;
+}
+
+static segment *
+segment_open (unsigned seq)
+{
+	char *path = segment_path (seq);
+	/* Raw traffic, only for the bot's user */
+	int fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate (fd, segment_size) != 0) {
+		fprintf (stderr, "Error: journal: %s: %s\n", path, strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		free (path);
+		return NULL;
+	}
+	free (path);
+
+	char *map = mmap (NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "Error: journal: mmap: %s\n", strerror (errno));
+		return NULL;
+	}
+
+	segment_header *h = (segment_header *)map;
+	memcpy (h->magic, JOURNAL_MAGIC, sizeof (h->magic));
+	h->seq = seq;
+	h->created_ns = clock_ns (CLOCK_REALTIME);
+
+	segment *s = malloc (sizeof (segment));
+	s->map = map;
+	s->size = segment_size;
+	s->seq = seq;
+	atomic_init (&s->used, JOURNAL_HEADER_SIZE);
+	atomic_init (&s->writers, 0);
+	s->next = NULL;
+	return s;
+}
+
+/* Must hold journal_mtx */
+static void
+unmap_idle (void)
+{
+	for (segment *s = retired; s != NULL; s = s->next)
+		if (s->map != NULL && atomic_load (&s->writers) == 0) {
+			msync (s->map, s->size, MS_ASYNC);
+			munmap (s->map, s->size);
+			s->map = NULL;
+		}
+}
+
+/* Highest sequence number in dir, so a restart appends after it */
+static unsigned
+last_seq (void)
+{
+	DIR *d = opendir (dir);
+	unsigned last = 0, seq;
+	if (d == NULL)
+		return 0;
+
+	struct dirent *e;
+	while ((e = readdir (d)) != NULL)
+		if (sscanf (e->d_name, JOURNAL_NAME_FORMAT, &seq) == 1 && seq > last)
+			last = seq;
+	closedir (d);
+	return last;
+}
+
+/* Deletes the segments before the newest keep, older runs' included */
+static void
+prune (unsigned newest)
+{
+	DIR *d = opendir (dir);
+	unsigned seq;
+	if (d == NULL || keep <= 0) {
+		if (d != NULL)
+			closedir (d);
+		return;
+	}
+
+	struct dirent *e;
+	while ((e = readdir (d)) != NULL)
+		if (sscanf (e->d_name, JOURNAL_NAME_FORMAT, &seq) == 1 && seq + keep <= newest) {
+			char *old = segment_path (seq);
+			unlink (old);
+			free (old);
+		}
+	closedir (d);
+}
+
+/* Called by the writer whose record crossed the end of full */
+static void
+rotate (segment *full)
+{
+	pthread_mutex_lock (&journal_mtx);
+	if (atomic_load (&current) == full) {
+		/* NULL if the spare is not ready, the thread fills in */
+		atomic_store (&current, spare);
+		spare = NULL;
+
+		full->next = retired;
+		retired = full;
+		pthread_cond_signal (&journal_cond);
+	}
+	pthread_mutex_unlock (&journal_mtx);
+}
+
+/* Opens the next segment ahead, unmaps and prunes the old ones */
+static void *
+journal_thread (void *data)
+{
+	pthread_mutex_lock (&journal_mtx);
+	while (!stopping) {
+		unmap_idle ();
+		if (spare != NULL) {
+			pthread_cond_wait (&journal_cond, &journal_mtx);
+			continue;
+		}
+
+		unsigned seq = next_seq;
+		pthread_mutex_unlock (&journal_mtx);
+		segment *s = segment_open (seq);
+		if (s != NULL)
+			prune (seq - 1);
+		pthread_mutex_lock (&journal_mtx);
+
+		if (s == NULL) {
+			/* segment_open said why */
+			fprintf (stderr, "Error: journal: trying again in %ds\n", JOURNAL_RETRY_SECONDS);
+			struct timespec until;
+			clock_gettime (CLOCK_REALTIME, &until);
+			until.tv_sec += JOURNAL_RETRY_SECONDS;
+			pthread_cond_timedwait (&journal_cond, &journal_mtx, &until);
+			continue;
+		}
+		next_seq = seq + 1;
+		/* Writes resume after a failure, or a rotation the spare missed */
+		if (atomic_load (&current) == NULL)
+			atomic_store (&current, s);
+		else
+			spare = s;
+	}
+	pthread_mutex_unlock (&journal_mtx);
+	return NULL;
+}
+
+void
+journal_write (int direction, const char *line, size_t len)
+{
+	size_t size = (sizeof (record_header) + len + 7) & ~(size_t)7;
+
+	for (;;) {
+		segment *s = atomic_load (&current);
+		if (s == NULL || size > s->size - JOURNAL_HEADER_SIZE)
+			return;
+		/* Still current after registering, so it stays mapped */
+		atomic_fetch_add (&s->writers, 1);
+		if (atomic_load (&current) != s) {
+			atomic_fetch_sub (&s->writers, 1);
+			continue;
+		}
+
+		size_t off = atomic_fetch_add_explicit (&s->used, size, memory_order_relaxed);
+		if (off + size <= s->size) {
+			record_header *r = (record_header *)(s->map + off);
+			r->direction = direction;
+			r->mono_ns = clock_ns (CLOCK_MONOTONIC);
+			r->wall_ns = clock_ns (CLOCK_REALTIME);
+			memcpy (r + 1, line, len);
+			atomic_store_explicit (&r->len, len, memory_order_release);
+			atomic_fetch_sub (&s->writers, 1);
+			return;
+		}
+		atomic_fetch_sub (&s->writers, 1);
+
+		/* Exactly one writer crosses the end, the others wait for it */
+		if (off <= s->size)
+			rotate (s);
+		else
+			while (atomic_load_explicit (&current, memory_order_acquire) == s)
+				sched_yield ();
+	}
+}
+
+void
+journal_init (const journal_options *opts)
+{
+	if (atomic_load (&current) != NULL || thread_running || opts->dir == NULL)
+		return;
+
+	if (mkdir (opts->dir, 0700) != 0 && errno != EEXIST) {
+		fprintf (stderr, "Error: journal: %s: %s\n", opts->dir, strerror (errno));
+		return;
+	}
+	dir = strdup (opts->dir);
+	keep = opts->segments;
+	segment_size = opts->segment_size < JOURNAL_MIN_SEGMENT ? JOURNAL_MIN_SEGMENT : opts->segment_size;
+
+	unsigned seq = last_seq () + 1;
+	segment *s = segment_open (seq);
+	if (s != NULL) {
+		prune (seq);
+		seq++;
+	}
+	atomic_store (&current, s);
+	next_seq = seq;
+
+	/* Without it, there is no spare and no retry after a failure */
+	if (pthread_create (&thread, NULL, journal_thread, NULL) != 0)
+		fprintf (stderr, "Error: journal: can not start its thread\n");
+	else
+		thread_running = true;
+	atexit (journal_shutdown);
+}
+
+void
+journal_shutdown (void)
+{
+	pthread_mutex_lock (&journal_mtx);
+	stopping = true;
+	pthread_cond_signal (&journal_cond);
+	pthread_mutex_unlock (&journal_mtx);
+	if (thread_running) {
+		pthread_join (thread, NULL);
+		thread_running = false;
+	}
+
+	pthread_mutex_lock (&journal_mtx);
+	segment *s = atomic_exchange (&current, NULL);
+	if (s != NULL) {
+		msync (s->map, s->size, MS_SYNC);
+		s->next = retired;
+		retired = s;
+	}
+	/* Never written to, the next run starts at its number */
+	if (spare != NULL) {
+		char *path = segment_path (spare->seq);
+		unlink (path);
+		free (path);
+		munmap (spare->map, spare->size);
+		free (spare);
+		spare = NULL;
+	}
+	unmap_idle ();
+	pthread_mutex_unlock (&journal_mtx);
+}
+
+static void
+dump_line (FILE *out, const record_header *r, bool all)
+{
+	const char *line = (const char *)(r + 1);
+	size_t len = r->len;
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		len--;
+	if (!all && r->direction != JOURNAL_IN)
+		return;
+
+	/* The timestamps of a replay capture */
+	time_t sec = r->wall_ns / 1000000000;
+	struct tm tm;
+	char stamp[32];
+	strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", gmtime_r (&sec, &tm));
+	if (all)
+		fprintf (out, "%s.%06uZ %llu %s %.*s\n", stamp, (unsigned)(r->wall_ns % 1000000000 / 1000), (unsigned long long)r->mono_ns, r->direction == JOURNAL_IN ? "<" : ">", (int)len, line);
+	else
+		fprintf (out, "%s.%06uZ %.*s\n", stamp, (unsigned)(r->wall_ns % 1000000000 / 1000), (int)len, line);
+}
+
+static int
+dump_segment (FILE *out, const char *path, bool all)
+{
+	int fd = open (path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat (fd, &st) != 0 || st.st_size < JOURNAL_HEADER_SIZE) {
+		fprintf (stderr, "Error: journal: %s: not a journal segment\n", path);
+		if (fd >= 0)
+			close (fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	char *map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED || memcmp (map, JOURNAL_MAGIC, strlen (JOURNAL_MAGIC)) != 0) {
+		fprintf (stderr, "Error: journal: %s: not a journal segment\n", path);
+		if (map != MAP_FAILED)
+			munmap (map, size);
+		return -1;
+	}
+
+	size_t off = JOURNAL_HEADER_SIZE;
+	while (off + sizeof (record_header) <= size) {
+		const record_header *r = (const record_header *)(map + off);
+		size_t len = atomic_load_explicit (&((record_header *)r)->len, memory_order_acquire);
+		/* The end, or a record cut short by a crash */
+		if (len == 0 || off + sizeof (record_header) + len > size)
+			break;
+		dump_line (out, r, all);
+		off += (sizeof (record_header) + len + 7) & ~(size_t)7;
+	}
+	munmap (map, size);
+	return 0;
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+	return strcmp (*(char *const *)a, *(char *const *)b);
+}
+
+/* Segments sort by name, the sequence numbers are zero padded */
+static int
+dump_dir (FILE *out, const char *path, bool all)
+{
+	DIR *d = opendir (path);
+	if (d == NULL)
+		return -1;
+
+	char **names = NULL;
+	size_t n = 0;
+	unsigned seq;
+	struct dirent *e;
+	while ((e = readdir (d)) != NULL) {
+		if (sscanf (e->d_name, JOURNAL_NAME_FORMAT, &seq) != 1)
+			continue;
+		names = realloc (names, (n + 1) * sizeof (char *));
+		names[n++] = strdup (e->d_name);
+	}
+	closedir (d);
+	qsort (names, n, sizeof (char *), compare_names);
+
+	int ret = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t len = strlen (path) + strlen (names[i]) + 2;
+		char *file = malloc (len);
+		snprintf (file, len, "%s/%s", path, names[i]);
+		ret |= dump_segment (out, file, all);
+		free (file);
+		free (names[i]);
+	}
+	free (names);
+	return ret;
+}
+
+int
+journal_dump (FILE *out, int n_paths, char **paths, bool all)
+{
+	int ret = 0;
+	for (int i = 0; i < n_paths; i++) {
+		struct stat st;
+		if (stat (paths[i], &st) != 0) {
+			fprintf (stderr, "Error: journal: %s: %s\n", paths[i], strerror (errno));
+			ret = -1;
+		} else if (S_ISDIR (st.st_mode)) {
+			ret |= dump_dir (out, paths[i], all);
+		} else {
+			ret |= dump_segment (out, paths[i], all);
+		}
+	}
+	return ret;
+}
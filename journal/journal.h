@@ -0,0 +1,49 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Raw traffic journal
+ * Every line read from and written to the server is appended with its
+ * CLOCK_MONOTONIC and wall clock times to a memory mapped segment file.
+ * Appending is a reservation with one atomic add and a copy, there is
+ * no syscall per line, and the pages survive a crash of the bot since
+ * the kernel owns them. Full segments are rotated and the oldest ones
+ * deleted.
+ *
+ * A segment is a 64 byte header and then records, each a 24 byte header
+ * and the line padded to 8 bytes. The length in a record header is
+ * stored last, a record with length 0 ends the segment.
+ */
+
+#define JOURNAL_IN 0
+#define JOURNAL_OUT 1
+
+typedef struct journal_options
+{
+	/* Directory of the segments, NULL turns the journal off */
+	const char *dir;
+	size_t segment_size;
+	/* Segments kept, older ones are deleted */
+	int segments;
+} journal_options;
+
+void
+journal_init (const journal_options *opts);
+void
+journal_shutdown (void);
+/* A no-op while the journal is off */
+void
+journal_write (int direction, const char *line, size_t len);
+
+/* Segments at paths, or every segment in a directory, to text: the lines
+ * read as a replay capture, or both directions with all=true. Returns 0
+ * on success
+ */
+int
+journal_dump (FILE *out, int n_paths, char **paths, bool all);
+
+#endif /* JOURNAL_H */
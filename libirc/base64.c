@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "irc/base64.h"
+
+static const char base64_chars[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Value of c, -1 if it is not in the alphabet */
+static int
+base64_value (char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+char *
+base64_encode (const void *data, size_t len)
+{
+	const unsigned char *in = data;
+	char *out = malloc ((len + 2) / 3 * 4 + 1);
+	char *p = out;
+
+	if (out == NULL)
+		return NULL;
+
+	size_t i;
+	for (i = 0; i + 2 < len; i += 3) {
+		uint32_t v = (uint32_t)in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+		*p++ = base64_chars[v >> 18];
+		*p++ = base64_chars[v >> 12 & 63];
+		*p++ = base64_chars[v >> 6 & 63];
+		*p++ = base64_chars[v & 63];
+	}
+	if (i < len) {
+		uint32_t v = (uint32_t)in[i] << 16;
+		if (i + 1 < len)
+			v |= in[i + 1] << 8;
+		*p++ = base64_chars[v >> 18];
+		*p++ = base64_chars[v >> 12 & 63];
+		*p++ = i + 1 < len ? base64_chars[v >> 6 & 63] : '=';
+		*p++ = '=';
+	}
+	*p = '\0';
+
+	return out;
+}
+
+unsigned char *
+base64_decode (const char *s, size_t len, size_t *out_len)
+{
+	if (len % 4 != 0)
+		return NULL;
+
+	size_t padding = 0;
+	if (len > 0 && s[len - 1] == '=')
+		padding++;
+	if (padding > 0 && s[len - 2] == '=')
+		padding++;
+
+	size_t size = len / 4 * 3 - padding;
+	unsigned char *out = malloc (size + 1);
+	if (out == NULL)
+		return NULL;
+
+	size_t o = 0;
+	for (size_t i = 0; i < len; i += 4) {
+		uint32_t v = 0;
+		for (size_t j = 0; j < 4; j++) {
+			int c = base64_value (s[i + j]);
+			/* Padding only at the very end */
+			if (c < 0 && !(s[i + j] == '=' && i + 4 == len && j >= 4 - padding)) {
+				free (out);
+				return NULL;
+			}
+			v = v << 6 | (c < 0 ? 0 : c);
+		}
+		out[o++] = v >> 16;
+		if (o < size)
+			out[o++] = v >> 8 & 0xff;
+		if (o < size)
+			out[o++] = v & 0xff;
+	}
+	out[size] = '\0';
+
+	if (out_len != NULL)
+		*out_len = size;
+	return out;
+}
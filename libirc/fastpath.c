@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "irc/fastpath.h"
+
+#define IRC_CTCP_VERSION "circ"
+/* Targets starting with these are channels, or STATUSMSG to them */
+#define IRC_CHANNEL_PREFIXES "#&+!@%~"
+
+static irc_fast_kind
+ping_reply (const char *params, char *reply);
+static irc_fast_kind
+ctcp_reply (const char *nick, size_t nick_len, const char *params, char *reply);
+
+/* Skips to the next space separated word, *len is its length */
+static const char *
+next_word (const char *p, size_t *len)
+{
+	while (*p == ' ')
+		p++;
+	*len = strcspn (p, " \r\n");
+	return p;
+}
+
+static int
+word_is (const char *word, size_t len, const char *expected)
+{
+	return len == strlen (expected) && strncasecmp (word, expected, len) == 0;
+}
+
+irc_fast_kind
+irc_fast_reply (const char *line, char reply[IRC_FAST_REPLY_SIZE])
+{
+	const char *nick = NULL;
+	size_t nick_len = 0, len;
+	const char *p = line;
+
+	if (*p == '@' && (p = strchr (p, ' ')) == NULL)
+		return IRC_FAST_NONE;
+	p = next_word (p, &len);
+	if (*p == ':') {
+		nick = p + 1;
+		nick_len = strcspn (nick, "! \r\n");
+		p = next_word (p + len, &len);
+	}
+
+	if (word_is (p, len, "PING"))
+		return ping_reply (p + len, reply);
+	if (nick != NULL && nick_len > 0 && word_is (p, len, "PRIVMSG"))
+		return ctcp_reply (nick, nick_len, p + len, reply);
+	return IRC_FAST_NONE;
+}
+
+/* PONG with the first parameter, like ping_hook used to */
+static irc_fast_kind
+ping_reply (const char *params, char *reply)
+{
+	size_t len;
+	const char *token = next_word (params, &len);
+	if (*token == ':') {
+		token++;
+		len = strcspn (token, "\r\n");
+	}
+	if (len == 0)
+		return IRC_FAST_NONE;
+
+	int n = snprintf (reply, IRC_FAST_REPLY_SIZE, "PONG :%.*s\r\n", (int)len, token);
+	return n > 0 && n < IRC_FAST_REPLY_SIZE ? IRC_FAST_PING : IRC_FAST_NONE;
+}
+
+static irc_fast_kind
+ctcp_reply (const char *nick, size_t nick_len, const char *params, char *reply)
+{
+	size_t len;
+	const char *target = next_word (params, &len);
+	/* Answering queries to channels only helps flooding us off */
+	if (len == 0 || strchr (IRC_CHANNEL_PREFIXES, *target) != NULL)
+		return IRC_FAST_NONE;
+
+	const char *text = target + len;
+	while (*text == ' ')
+		text++;
+	if (*text == ':')
+		text++;
+	size_t text_len = strcspn (text, "\r\n");
+	if (text_len < 2 || text[0] != '\x01')
+		return IRC_FAST_NONE;
+
+	/* \x01QUERY [arg]\x01, the closing \x01 is optional */
+	const char *query = text + 1;
+	size_t body_len = text_len - 1;
+	if (query[body_len - 1] == '\x01')
+		body_len--;
+	size_t query_len = strcspn (query, " \x01\r\n");
+	if (query_len > body_len)
+		query_len = body_len;
+	const char *arg = query + query_len;
+	size_t arg_len = body_len - query_len;
+	if (arg_len > 0) {
+		arg++;
+		arg_len--;
+	}
+
+	int n;
+	if (word_is (query, query_len, "VERSION")) {
+		n = snprintf (reply, IRC_FAST_REPLY_SIZE, "NOTICE %.*s :\x01VERSION " IRC_CTCP_VERSION "\x01\r\n", (int)nick_len, nick);
+	} else if (word_is (query, query_len, "PING")) {
+		n = snprintf (reply, IRC_FAST_REPLY_SIZE, "NOTICE %.*s :\x01PING%s%.*s\x01\r\n", (int)nick_len, nick, arg_len > 0 ? " " : "", (int)arg_len, arg);
+	} else if (word_is (query, query_len, "TIME")) {
+		char now[64];
+		time_t t = time (NULL);
+		struct tm tm;
+		strftime (now, sizeof (now), "%a, %d %b %Y %H:%M:%S +0000", gmtime_r (&t, &tm));
+		n = snprintf (reply, IRC_FAST_REPLY_SIZE, "NOTICE %.*s :\x01TIME %s\x01\r\n", (int)nick_len, nick, now);
+	} else {
+		return IRC_FAST_NONE;
+	}
+
+	return n > 0 && n < IRC_FAST_REPLY_SIZE ? IRC_FAST_CTCP : IRC_FAST_NONE;
+}
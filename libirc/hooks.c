@@ -1,18 +1,38 @@
 #include <glib.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #include "hooks.h"
+#include "irc/rcu.h"
+#include "trace/probes.h"
+#include "trace/trace.h"
 
+/*
+ * The hook table is never modified in place. Writers copy the current
+ * version, change the copy and publish it, so exec_hooks can walk the
+ * lists without taking any lock while hooks are added from other
+ * threads. Old versions are freed once no reader can see them anymore.
+ * command -> irc_hook*
+ */
 static GHashTable *hooks;
+static pthread_mutex_t hooks_write_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-void
+_Thread_local bool hooks_stale;
+
+static void
 g_free_irc_hook (gpointer hook);
-void
+static void
 free_irc_hook (irc_hook *hook);
-irc_hook *
-create_irc_hook (const char *command, void (*f) (const irc_server *, const irc_msg *));
+static void
+free_hook_table (void *table);
 static irc_hook *
-get_hooks_private (const char *command);
+create_irc_hook (const char *command, const char *name, void (*f) (const irc_server *, const irc_msg *), int flags);
+static GHashTable *
+new_hook_table (void);
+static GHashTable *
+copy_hook_table (GHashTable *table);
+static void
+publish_hook_table (GHashTable *table);
 static gboolean
 command_strings_equal (gconstpointer a, gconstpointer b);
 
@@ -22,8 +42,7 @@ init_hooks (void)
 	if (hooks != NULL)
 		return;
 
-	hooks = g_hash_table_new_full (
-	  g_str_hash, command_strings_equal, g_free, g_free_irc_hook);
+	rcu_assign_pointer (hooks, new_hook_table ());
 }
 
 static gboolean
@@ -32,68 +51,132 @@ command_strings_equal (gconstpointer a, gconstpointer b)
 	return strcmp ((const char *)a, (const char *)b) == 0;
 }
 
-void
+static GHashTable *
+new_hook_table (void)
+{
+	return g_hash_table_new_full (
+	  g_str_hash, command_strings_equal, g_free, g_free_irc_hook);
+}
+
+static void
 g_free_irc_hook (gpointer hook)
 {
 	free_irc_hook ((irc_hook *)hook);
 }
 
-void
+static void
 free_irc_hook (irc_hook *hook)
 {
 	while (hook != NULL) {
 		irc_hook *tmp = hook;
 		free (hook->command);
-		free (hook->entry);
+		free (hook->name);
 		hook = hook->next;
 		free (tmp);
 	}
 }
 
-irc_hook *
-create_irc_hook (const char *command, void (*f) (const irc_server *, const irc_msg *))
+static void
+free_hook_table (void *table)
+{
+	g_hash_table_destroy ((GHashTable *)table);
+}
+
+static irc_hook *
+create_irc_hook (const char *command, const char *name, void (*f) (const irc_server *, const irc_msg *), int flags)
 {
 	irc_hook *hook = malloc (sizeof (irc_hook));
 	hook->command = strdup (command);
+	hook->name = strdup (name);
 	hook->entry = f;
+	hook->flags = flags;
+	hook->latency = metric_histogram_labeled (
+	  "circ_hook_duration_seconds", "Time spent in IRC hooks", "hook", name);
+	hook->skipped = metric_counter_labeled (
+	  "circ_hook_skipped_total", "Messages a non-essential hook skipped for being late", "hook", name);
 	hook->next = NULL;
 
 	return hook;
 }
 
+/* Copy table and its hook lists, must hold hooks_write_mtx */
+static GHashTable *
+copy_hook_table (GHashTable *table)
+{
+	GHashTable *copy = new_hook_table ();
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, table);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		irc_hook *head = NULL, **tail = &head;
+		for (const irc_hook *hook = value; hook != NULL; hook = hook->next) {
+			*tail = create_irc_hook (hook->command, hook->name, hook->entry, hook->flags);
+			tail = &(*tail)->next;
+		}
+		g_hash_table_insert (copy, g_strdup (key), head);
+	}
+
+	return copy;
+}
+
+/* Replace the current table with table, must hold hooks_write_mtx */
+static void
+publish_hook_table (GHashTable *table)
+{
+	GHashTable *old = hooks;
+	rcu_assign_pointer (hooks, table);
+	rcu_call (free_hook_table, old);
+}
+
 void
-add_hook (const char *command, void (*f) (const irc_server *, const irc_msg *))
+add_hook_named (const char *command, const char *name, void (*f) (const irc_server *, const irc_msg *), int flags)
 {
-	irc_hook *hook = create_irc_hook (command, f);
-	irc_hook *head = get_hooks_private (command);
+	pthread_mutex_lock (&hooks_write_mtx);
+	GHashTable *table = copy_hook_table (hooks);
+
+	irc_hook *hook = create_irc_hook (command, name, f, flags);
+	irc_hook *head = g_hash_table_lookup (table, command);
 	if (head == NULL) {
-		g_hash_table_insert (hooks, hook->command, hook);
-	} else if (head == NULL) {
-		head = hook;
+		g_hash_table_insert (table, g_strdup (command), hook);
 	} else {
 		while (head->next != NULL)
 			head = head->next;
 		head->next = hook;
 	}
-}
 
-static irc_hook *
-get_hooks_private (const char *command)
-{
-	return (irc_hook *)g_hash_table_lookup (hooks, command);
+	publish_hook_table (table);
+	pthread_mutex_unlock (&hooks_write_mtx);
 }
 
+/*
+ * Returns the hooks registered on command, the list may only be used
+ * inside an rcu_read_lock section
+ */
 const irc_hook *
 get_hooks (const char *command)
 {
-	return get_hooks_private (command);
+	return g_hash_table_lookup (rcu_dereference (hooks), command);
 }
 
 void
 exec_hooks (const irc_server *s, const char *command, const irc_msg *msg)
 {
 	const irc_hook *hook;
-	for (hook = get_hooks (command); hook != NULL; hook = hook->next)
-		// FIXME this entry isn't free'd
+
+	rcu_read_lock ();
+	for (hook = get_hooks (command); hook != NULL; hook = hook->next) {
+		if (hooks_stale && (hook->flags & HOOK_NONESSENTIAL)) {
+			metric_inc (hook->skipped);
+			continue;
+		}
+		CIRC_PROBE (hook_entry, command, hook->name);
+		uint64_t start = metric_now_ns ();
 		hook->entry (s, msg);
+		uint64_t end = metric_now_ns ();
+		CIRC_PROBE (hook_return, command, hook->name, end - start);
+		metric_observe_ns (hook->latency, end - start);
+		trace_span (trace_current, "hook", hook->name, start, end);
+	}
+	rcu_read_unlock ();
 }
@@ -1,3 +1,5 @@
+#define LOG_SUBSYS LOG_IRC
+
 #include <ev.h>		   // Event loop
 #include <gnutls/gnutls.h> // TLS support
 #include <netdb.h>	   // getaddrinfo
@@ -7,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h> // pthread_mutex_*
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h> // malloc, free
@@ -16,16 +19,45 @@
 #include <glib.h>
 
 #include "hooks.h"
+#include "irc/fastpath.h"
+#include "irc/rcu.h"
 
-#include "b64/b64.h"
-
+#include "journal/journal.h"
 #include "log/log.h"
+#include "metrics/metrics.h"
+#include "trace/alloc_trace.h"
+#include "trace/probes.h"
+#include "trace/trace.h"
 
 #define IRC_MESSAGE_SIZE 8192 // IRCv3 message size + 1 for '\0'
+/* Lines read per readable event without a queue limit, so a flood
+ * still lets the handlers run
+ */
+#define IRC_READ_BURST 1000
+/* How long the degraded state outlasts the last shed or late line */
+#define IRC_DEGRADED_HOLD_NS 5000000000ULL
+/* Least time between fast path CTCP replies on a connection */
+#define IRC_CTCP_INTERVAL_NS 1000000000ULL
+
+/* Read queue priorities, a full queue sheds the lowest first */
+enum
+{
+	IRC_PRIO_LOW,
+	IRC_PRIO_CHAT,
+	/* Everything else, never shed */
+	IRC_PRIO_PROTOCOL,
+	IRC_PRIO_COUNT
+};
 
 typedef struct message_queue
 {
 	char *message;
+	/* Trace of the inbound message it is, or the reply is caused by */
+	uint64_t trace;
+	uint64_t queued_ns;
+	/* Read order and priority, only set on the read queue */
+	uint64_t seq;
+	int priority;
 	struct message_queue *next;
 } message_queue;
 
@@ -36,15 +68,68 @@ typedef struct
 	gnutls_certificate_credentials_t tls_creds;
 	int socket;
 	bool ev_is_running;
+	/* Set by irc_stop, possibly from a signal handler */
+	_Atomic bool stopping;
+	/* Published once the loop runs, irc_wakeup reads it from any thread */
+	_Atomic (struct ev_loop *) loop;
 	ev_io watcher;
 	ev_timer timer;
-	message_queue *read_queue;
+	ev_async wakeup;
+	/* Read but not taken as lines yet, from in_start to in_len */
+	char in[IRC_MESSAGE_SIZE];
+	size_t in_start;
+	size_t in_len;
+	/* Dropping the rest of a line longer than in */
+	bool in_discard;
+	/* One FIFO per priority, seq keeps the read order across them */
+	message_queue *read_queue[IRC_PRIO_COUNT];
+	message_queue *read_queue_tail[IRC_PRIO_COUNT];
+	size_t read_queue_len;
+	uint64_t read_seq;
 	pthread_mutex_t read_queue_mtx;
+	/* Set by shedding, backpressure and late lines, see update_degraded */
+	bool overloaded;
+	uint64_t overloaded_ns;
+	bool degraded;
+	uint64_t ctcp_next_ns;
 	message_queue *write_queue;
 	pthread_mutex_t write_queue_mtx;
 	ev_io ev_init_watcher;
+	/* No socket, sent lines go to capture, see irc_server_connect_offline */
+	bool offline;
+	FILE *capture;
 } irc_connection;
 
+/* Shared by all connections, set up with the first one */
+static struct
+{
+	metric *lines_received;
+	metric *bytes_received;
+	metric *lines_sent;
+	metric *bytes_sent;
+	metric *parse_failures;
+	metric *read_queue_depth;
+	metric *write_queue_depth;
+	metric *lines_shed[IRC_PRIO_PROTOCOL];
+	metric *fast_replies[IRC_FAST_CTCP + 1];
+	metric *degraded;
+} irc_metrics;
+
+static irc_queue_options queue_opts;
+
+/* Commands that may be shed, all others are protocol traffic */
+static const struct
+{
+	const char *command;
+	int priority;
+} line_priorities[] = {
+	{ "TAGMSG", IRC_PRIO_LOW },
+	{ "JOIN", IRC_PRIO_LOW },
+	{ "PART", IRC_PRIO_LOW },
+	{ "PRIVMSG", IRC_PRIO_CHAT },
+	{ "NOTICE", IRC_PRIO_CHAT },
+};
+
 int
 setnonblock (int fd);
 int
@@ -54,6 +139,28 @@ irc_loop_read_callback (EV_P_ ev_io *w, int re);
 static void
 irc_timeout_callback (EV_P_ ev_timer *w, int re);
 static void
+irc_wakeup_callback (EV_P_ ev_async *w, int re);
+static void
+irc_read_line (irc_connection *conn);
+static bool
+irc_read_pending (irc_connection *conn);
+static int
+irc_line_priority (const char *line);
+static void
+irc_fast_path (irc_connection *conn, const char *line);
+static void
+irc_journal (int direction, const char *buf, size_t len);
+static void
+write_queue_push_front (irc_connection *conn, const char *str);
+static void
+read_queue_push (irc_connection *conn, message_queue *entry);
+static message_queue *
+read_queue_pop (irc_connection *conn);
+static bool
+read_queue_has_room (irc_connection *conn);
+static void
+update_degraded (irc_connection *conn);
+static void
 irc_process_read_message_queue (irc_connection *conn);
 static void
 irc_process_write_message_queue (irc_connection *conn);
@@ -75,6 +182,8 @@ irc_connection *
 create_irc_connection (const irc_server *, int);
 int
 make_irc_connection_entry (irc_connection *);
+static void
+remove_irc_connection_entry (irc_connection *);
 irc_connection *
 get_irc_server_connection (const irc_server *);
 irc_connection *
@@ -84,9 +193,15 @@ server_connected (const irc_server *s);
 bool
 connections_cap_reached (void);
 
-/* conns simply holds the connections we use, it should be replaced later */
+/*
+ * conns simply holds the connections we use, it should be replaced later.
+ * Entries are atomic since irc_wakeup looks them up from other threads.
+ */
 #define MAX_CONNECTIONS 10
-static irc_connection *conns[MAX_CONNECTIONS + 1];
+static irc_connection *_Atomic conns[MAX_CONNECTIONS + 1];
+
+/* An irc_wakeup came before the loop published itself */
+static _Atomic bool wakeup_pending;
 
 // Simply adds O_NONBLOCK to the file descriptor of choice
 int
@@ -194,45 +309,420 @@ irc_do_event_loop (const irc_server *s)
 	ev_timer_init (&conn->timer, irc_timeout_callback, 6, 0);
 	ev_timer_start (loop, &conn->timer);
 
-	while (conn->ev_is_running) {
+	ev_async_start (loop, &conn->wakeup);
+	/* Sequentially consistent with irc_wakeup, one of the two sees the other */
+	atomic_store (&conn->loop, loop);
+	if (atomic_exchange (&wakeup_pending, false))
+		ev_async_send (loop, &conn->wakeup);
+
+	while (conn->ev_is_running && !atomic_load_explicit (&conn->stopping, memory_order_relaxed)) {
 		ev_run (loop, EVRUN_ONCE);
 		irc_process_read_message_queue (conn);
+		/* IDLE hooks run on the loop thread once all read messages
+		 * have been handled, e.g. to flush work queued by other threads
+		 */
+		exec_hooks (conn->server, "IDLE", NULL);
 		irc_process_write_message_queue (conn);
+		/* Free hook tables that were replaced while handling */
+		rcu_reclaim ();
+		/* Lines left in TLS buffers when the queue filled up do not
+		 * make the socket readable again
+		 */
+		if (irc_read_pending (conn))
+			ev_feed_event (loop, &conn->watcher, EV_READ);
 	}
 
+	ev_async_stop (loop, &conn->wakeup);
 	ev_timer_stop (loop, &conn->timer);
 	ev_io_stop (loop, &conn->ev_init_watcher);
 	ev_io_stop (loop, &conn->watcher);
 	ev_loop_destroy (loop);
 }
 
-/* irc_loop_read_callback handles a single IRC message synchronously */
+/*
+ * irc_loop_read_callback reads the lines received so far into the read
+ * queue, as many as fit and at most a queue worth, they are handled once
+ * the loop breaks. What does not fit stays in the socket and pushes back
+ * on the server, the rest is read on the next iteration.
+ */
 static void
 irc_loop_read_callback (EV_P_ ev_io *w, int re)
 {
 	irc_connection *conn = get_irc_connection_from_watcher (w);
+	int burst = queue_opts.max_lines > 0 ? queue_opts.max_lines : IRC_READ_BURST;
+
+	for (int n = 0; n < burst && irc_read_pending (conn); n++) {
+		if (!read_queue_has_room (conn)) {
+			conn->overloaded = true;
+			break;
+		}
+		irc_read_line (conn);
+	}
+
+	ev_break (EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Append what arrived on conn to its line buffer without blocking.
+ * Returns false when nothing did, or the connection is gone.
+ */
+static bool
+irc_read_fill (irc_connection *conn)
+{
+	if (conn->in_start > 0) {
+		conn->in_len -= conn->in_start;
+		memmove (conn->in, conn->in + conn->in_start, conn->in_len);
+		conn->in_start = 0;
+	}
+	if (conn->in_len == sizeof (conn->in)) {
+		log_error ("Dropping a line longer than %d bytes\n", IRC_MESSAGE_SIZE);
+		conn->in_len = 0;
+		conn->in_discard = true;
+	}
+
+	ssize_t n = irc_read_bytes (conn->server, conn->in + conn->in_len, sizeof (conn->in) - conn->in_len);
+	if (n < 0 && (conn->server->secure ? !gnutls_error_is_fatal (n) : errno == EAGAIN || errno == EINTR))
+		return false;
+	if (n <= 0) {
+		log_error ("Connection to %s lost\n", conn->server->host);
+		conn->ev_is_running = false;
+		ev_break (atomic_load_explicit (&conn->loop, memory_order_relaxed), EVBREAK_ALL);
+		return false;
+	}
+
+	if (conn->in_discard) {
+		char *nl = memchr (conn->in, '\n', n);
+		if (nl == NULL)
+			return true;
+		conn->in_discard = false;
+		n -= nl + 1 - conn->in;
+		memmove (conn->in, nl + 1, n);
+	}
+	conn->in_len += n;
+	return true;
+}
+
+/* Whether a whole line can be taken from conn, reads what arrived
+ * meanwhile. Partial lines wait in the buffer for the rest.
+ */
+static bool
+irc_read_pending (irc_connection *conn)
+{
+	if (conn->offline)
+		return false;
+
+	while (memchr (conn->in + conn->in_start, '\n', conn->in_len - conn->in_start) == NULL)
+		if (!irc_read_fill (conn))
+			return false;
+	return true;
+}
+
+static void
+irc_read_line (irc_connection *conn)
+{
 	char *buf = malloc (IRC_MESSAGE_SIZE);
 	memset (buf, 0, IRC_MESSAGE_SIZE);
+	uint64_t trace = trace_begin ();
+	uint64_t start = trace_now_ns ();
 	irc_read_message (conn->server, buf);
 	log_debug ("main loop: %s\n", buf);
+	size_t len = strlen (buf);
+	CIRC_PROBE (line_received, buf, len);
+	irc_journal (JOURNAL_IN, buf, len);
+	metric_inc (irc_metrics.lines_received);
+	metric_add (irc_metrics.bytes_received, len);
+	irc_fast_path (conn, buf);
+
+	message_queue *entry = malloc (sizeof (message_queue));
+	entry->message = buf;
+	entry->trace = trace;
+	entry->queued_ns = trace_now_ns ();
+	entry->priority = irc_line_priority (buf);
+	entry->next = NULL;
+	trace_span (trace, "read", "irc_read_message", start, entry->queued_ns);
+
+	read_queue_push (conn, entry);
+}
+
+/*
+ * Answer PING and CTCP queries as they are read, before the line waits
+ * in the read queue, ahead of the lines in the write queue
+ */
+static void
+irc_fast_path (irc_connection *conn, const char *line)
+{
+	char reply[IRC_FAST_REPLY_SIZE];
+	irc_fast_kind kind = irc_fast_reply (line, reply);
+	if (kind == IRC_FAST_NONE)
+		return;
+
+	/* A flood of queries gets one reply per interval */
+	if (kind == IRC_FAST_CTCP) {
+		uint64_t now = trace_now_ns ();
+		if (now < conn->ctcp_next_ns)
+			return;
+		conn->ctcp_next_ns = now + IRC_CTCP_INTERVAL_NS;
+	}
+
+	size_t len = strlen (reply);
+	int ret = irc_write_bytes (conn->server, reply, len);
+	metric_inc (irc_metrics.fast_replies[kind]);
+	if (ret == (int)len)
+		return;
+
+	/* The rest goes out first on the next flush of the write queue */
+	if (ret > 0)
+		write_queue_push_front (conn, reply + ret);
+	else if (conn->server->secure ? !gnutls_error_is_fatal (ret) : errno == EAGAIN || errno == EINTR)
+		write_queue_push_front (conn, reply);
+	else
+		log_error ("Fast reply to %s failed\n", conn->server->host);
+}
+
+/* Offset of the first word after the tags, prefix and spaces at line */
+static size_t
+irc_skip_prefix (const char *line, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && (line[i] == '@' || line[i] == ':')) {
+		while (i < len && line[i] != ' ')
+			i++;
+		while (i < len && line[i] == ' ')
+			i++;
+	}
+	return i;
+}
+
+/* Whether word, of len bytes up to a space, is name */
+static bool
+irc_word_is (const char *word, size_t len, const char *name)
+{
+	size_t n = strlen (name);
+	return len >= n && g_ascii_strncasecmp (word, name, n) == 0 &&
+	       (len == n || word[n] == ' ' || word[n] == '\r' || word[n] == '\n');
+}
+
+/*
+ * Where the secret in a line starts, len if it has none: SASL payloads,
+ * server passwords and NickServ IDENTIFY, by PRIVMSG or by alias
+ */
+static size_t
+irc_secret_offset (const char *line, size_t len)
+{
+	size_t cmd = irc_skip_prefix (line, len);
+	size_t args = cmd;
+	while (args < len && line[args] != ' ')
+		args++;
+	while (args < len && line[args] == ' ')
+		args++;
+
+	if (irc_word_is (line + cmd, len - cmd, "AUTHENTICATE") ||
+	    irc_word_is (line + cmd, len - cmd, "PASS"))
+		return args;
+
+	size_t text = args;
+	if (irc_word_is (line + cmd, len - cmd, "PRIVMSG") ||
+	    irc_word_is (line + cmd, len - cmd, "NOTICE")) {
+		/* NickServ or NickServ@services... */
+		if (len - args <= 8 || g_ascii_strncasecmp (line + args, "NickServ", 8) != 0 ||
+		    (line[args + 8] != ' ' && line[args + 8] != '@'))
+			return len;
+		while (text < len && line[text] != ' ')
+			text++;
+		while (text < len && (line[text] == ' ' || line[text] == ':'))
+			text++;
+	} else if (!irc_word_is (line + cmd, len - cmd, "NS") &&
+		   !irc_word_is (line + cmd, len - cmd, "NICKSERV")) {
+		return len;
+	}
+
+	if (!irc_word_is (line + text, len - text, "IDENTIFY"))
+		return len;
+	return text + 8 < len ? text + 8 : len;
+}
+
+/* Journal every line of buf on its own, with secrets masked */
+static void
+irc_journal (int direction, const char *buf, size_t len)
+{
+	static const char mask[] = " ***\r\n";
+	char masked[IRC_MESSAGE_SIZE];
+
+	while (len > 0) {
+		const char *nl = memchr (buf, '\n', len);
+		size_t n = nl != NULL ? (size_t)(nl - buf) + 1 : len;
+		size_t secret = irc_secret_offset (buf, n);
+
+		if (secret < n) {
+			if (secret > sizeof (masked) - sizeof (mask))
+				secret = sizeof (masked) - sizeof (mask);
+			/* The space before the secret is part of the mask */
+			while (secret > 0 && buf[secret - 1] == ' ')
+				secret--;
+			memcpy (masked, buf, secret);
+			memcpy (masked + secret, mask, sizeof (mask) - 1);
+			journal_write (direction, masked, secret + sizeof (mask) - 1);
+		} else {
+			journal_write (direction, buf, n);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Priority of a raw line by its command, without parsing all of it */
+static int
+irc_line_priority (const char *line)
+{
+	const char *command = line;
+
+	/* Skip the tags and the prefix */
+	while (*command == '@' || *command == ':') {
+		command = strchr (command, ' ');
+		if (command == NULL)
+			return IRC_PRIO_PROTOCOL;
+		while (*command == ' ')
+			command++;
+	}
+
+	size_t len = strcspn (command, " \r\n");
+	for (size_t i = 0; i < G_N_ELEMENTS (line_priorities); i++)
+		if (strlen (line_priorities[i].command) == len &&
+		    g_ascii_strncasecmp (command, line_priorities[i].command, len) == 0)
+			return line_priorities[i].priority;
+	return IRC_PRIO_PROTOCOL;
+}
+
+/*
+ * Append entry to the read queue. When it is full and the policy is to
+ * shed, the oldest line of the lowest priority queued goes first, or
+ * entry itself if that is lower still. Protocol lines are never shed.
+ */
+static void
+read_queue_push (irc_connection *conn, message_queue *entry)
+{
+	message_queue *shed = NULL;
 
 	pthread_mutex_lock (&conn->read_queue_mtx);
-	message_queue *mq = conn->read_queue;
-	if (mq == NULL) {
-		conn->read_queue = malloc (sizeof (message_queue));
-		conn->read_queue->message = buf;
-		conn->read_queue->next = NULL;
-	} else {
-		while (mq->next != NULL)
-			mq = mq->next;
+	if (queue_opts.policy == IRC_QUEUE_SHED && queue_opts.max_lines > 0 &&
+	    conn->read_queue_len >= (size_t)queue_opts.max_lines) {
+		int p = 0;
+		while (p < IRC_PRIO_PROTOCOL && conn->read_queue[p] == NULL)
+			p++;
+
+		if (p <= entry->priority && p < IRC_PRIO_PROTOCOL) {
+			shed = conn->read_queue[p];
+			conn->read_queue[p] = shed->next;
+			if (shed->next == NULL)
+				conn->read_queue_tail[p] = NULL;
+			conn->read_queue_len--;
+			metric_gauge_add (irc_metrics.read_queue_depth, -1);
+		} else if (entry->priority < IRC_PRIO_PROTOCOL) {
+			shed = entry;
+			entry = NULL;
+		}
+	}
 
-		mq->next = malloc (sizeof (conn->read_queue));
-		mq->next->message = buf;
-		mq->next->next = NULL;
+	if (entry != NULL) {
+		int p = entry->priority;
+		entry->seq = conn->read_seq++;
+		if (conn->read_queue_tail[p] == NULL)
+			conn->read_queue[p] = entry;
+		else
+			conn->read_queue_tail[p]->next = entry;
+		conn->read_queue_tail[p] = entry;
+		conn->read_queue_len++;
+		metric_gauge_add (irc_metrics.read_queue_depth, 1);
 	}
 	pthread_mutex_unlock (&conn->read_queue_mtx);
 
-	ev_break (EV_A_ EVBREAK_ALL);
+	if (shed != NULL) {
+		log_debug ("read queue full, shedding: %s", shed->message);
+		metric_inc (irc_metrics.lines_shed[shed->priority]);
+		conn->overloaded = true;
+		free (shed->message);
+		free (shed);
+	}
+}
+
+/* Remove the line read first from the queue, NULL if it is empty */
+static message_queue *
+read_queue_pop (irc_connection *conn)
+{
+	message_queue *first = NULL;
+
+	pthread_mutex_lock (&conn->read_queue_mtx);
+	for (int p = 0; p < IRC_PRIO_COUNT; p++)
+		if (conn->read_queue[p] != NULL &&
+		    (first == NULL || conn->read_queue[p]->seq < first->seq))
+			first = conn->read_queue[p];
+
+	if (first != NULL) {
+		conn->read_queue[first->priority] = first->next;
+		if (first->next == NULL)
+			conn->read_queue_tail[first->priority] = NULL;
+		conn->read_queue_len--;
+		metric_gauge_add (irc_metrics.read_queue_depth, -1);
+	}
+	pthread_mutex_unlock (&conn->read_queue_mtx);
+
+	return first;
+}
+
+/* Whether another line may be read now rather than left in the socket */
+static bool
+read_queue_has_room (irc_connection *conn)
+{
+	if (queue_opts.max_lines <= 0 ||
+	    conn->read_queue_len < (size_t)queue_opts.max_lines)
+		return true;
+	if (queue_opts.policy != IRC_QUEUE_SHED)
+		return false;
+
+	/* Only a line below protocol traffic can make room */
+	for (int p = 0; p < IRC_PRIO_PROTOCOL; p++)
+		if (conn->read_queue[p] != NULL)
+			return true;
+	return false;
+}
+
+/*
+ * A connection is degraded while it sheds lines, pushes back on the
+ * server or handles lines past the deadline, and for a while after
+ */
+static void
+update_degraded (irc_connection *conn)
+{
+	uint64_t now = trace_now_ns ();
+
+	if (conn->overloaded)
+		conn->overloaded_ns = now;
+	conn->overloaded = false;
+
+	bool degraded = conn->overloaded_ns != 0 &&
+			now - conn->overloaded_ns < IRC_DEGRADED_HOLD_NS;
+	if (degraded == conn->degraded)
+		return;
+
+	conn->degraded = degraded;
+	metric_gauge_add (irc_metrics.degraded, degraded ? 1 : -1);
+	log_info ("%s: %s\n", conn->server->name, degraded ? "falling behind, shedding load" : "caught up");
+}
+
+/* Whether s is shedding load or handling lines late, see update_degraded */
+bool
+irc_degraded (const irc_server *s)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	return c != NULL && c->degraded;
+}
+
+/* Applies to every connection, from the next line read */
+void
+irc_set_queue_options (const irc_queue_options *opts)
+{
+	queue_opts = *opts;
 }
 
 static void
@@ -242,19 +732,67 @@ irc_timeout_callback (EV_P_ ev_timer *w, int re)
 }
 
 static void
-irc_process_read_message_queue (irc_connection *conn)
+irc_wakeup_callback (EV_P_ ev_async *w, int re)
 {
-	message_queue *next;
-	while (conn->read_queue != NULL) {
-		handle_message (conn, conn->read_queue->message);
-		next = conn->read_queue->next;
+	ev_break (EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Wake up the event loop of server s so it runs another iteration.
+ * Safe to call from any thread, and from signal handlers as it takes
+ * no lock.
+ */
+void
+irc_wakeup (const irc_server *s)
+{
+	atomic_store (&wakeup_pending, true);
+
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL)
+		return;
+
+	struct ev_loop *loop = atomic_load (&c->loop);
+	if (loop != NULL)
+		ev_async_send (loop, &c->wakeup);
+}
+
+/*
+ * Make the event loop of server s return once the current iteration is
+ * done. Only sets a flag and wakes the loop, safe in signal handlers.
+ */
+void
+irc_stop (const irc_server *s)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL)
+		return;
 
-		pthread_mutex_lock (&conn->read_queue_mtx);
-		free (conn->read_queue->message);
-		free (conn->read_queue);
-		conn->read_queue = next;
-		pthread_mutex_unlock (&conn->read_queue_mtx);
+	atomic_store_explicit (&c->stopping, true, memory_order_relaxed);
+	irc_wakeup (s);
+}
+
+static void
+irc_process_read_message_queue (irc_connection *conn)
+{
+	uint64_t deadline_ns = (uint64_t)queue_opts.deadline_ms * 1000000;
+	message_queue *entry;
+	while ((entry = read_queue_pop (conn)) != NULL) {
+		uint64_t now = trace_now_ns ();
+		/* Replies pushed while handling it inherit the trace */
+		trace_current = entry->trace;
+		trace_span (trace_current, "read_queue", "read_queue", entry->queued_ns, now);
+		/* Non-essential hooks skip it rather than add to the lag */
+		hooks_stale = deadline_ns > 0 && now - entry->queued_ns > deadline_ns;
+		if (hooks_stale)
+			conn->overloaded = true;
+		handle_message (conn, entry->message);
+		hooks_stale = false;
+		trace_current = 0;
+
+		free (entry->message);
+		free (entry);
 	}
+	update_degraded (conn);
 }
 
 static void
@@ -265,13 +803,18 @@ irc_process_write_message_queue (irc_connection *conn)
 	while (conn->write_queue != NULL) {
 		str = conn->write_queue->message;
 		next = conn->write_queue->next;
+		uint64_t trace = conn->write_queue->trace;
+		uint64_t start = trace_now_ns ();
+		trace_span (trace, "write_queue", "write_queue", conn->write_queue->queued_ns, start);
 		irc_write_bytes (conn->server, str, strlen (str));
+		trace_span (trace, "send", "irc_write_bytes", start, trace_now_ns ());
 
 		pthread_mutex_lock (&conn->write_queue_mtx);
 		free (conn->write_queue->message);
 		free (conn->write_queue);
 		conn->write_queue = next;
 		pthread_mutex_unlock (&conn->write_queue_mtx);
+		metric_gauge_add (irc_metrics.write_queue_depth, -1);
 	}
 }
 
@@ -282,40 +825,52 @@ handle_message (irc_connection *conn, const char *message)
 
 	if (msg_len == 0)
 		return;
+	alloc_trace_message ();
 
 	struct irc_msg *parsed_msg = alloc_msg ();
+	uint64_t start = trace_now_ns ();
 	const int ret = ircmsg_parse (message, msg_len, &parse_cbs, parsed_msg);
+	uint64_t parsed = trace_now_ns ();
+	CIRC_PROBE (parse_done, message, ret != 0, ret != 0 ? parsed_msg->command : NULL);
+	trace_span (trace_current, "parse", "ircmsg_parse", start, parsed);
 
 	if (ret == 0) {
 		log_info ("ERROR: parsing message\n");
+		metric_inc (irc_metrics.parse_failures);
 	} else {
+		metric_inc (metric_counter_labeled ("circ_irc_commands_total",
+						    "IRC messages dispatched by command",
+						    "command",
+						    parsed_msg->command));
 		exec_hooks (conn->server, parsed_msg->command, parsed_msg);
 		exec_hooks (conn->server, "*", parsed_msg);
+		trace_span (trace_current, "dispatch", parsed_msg->command, parsed, trace_now_ns ());
 		free_msg (parsed_msg);
 	}
 }
 
-/* irc_read_message reads an IRC message to a buffer */
+/* irc_read_message takes the next whole line read from s into buf,
+ * returns its length or 0 when none has arrived completely yet
+ */
 int
 irc_read_message (const irc_server *s, char buf[IRC_MESSAGE_SIZE])
 {
-	int n = 1;
-	int i = 0;
-
 	irc_connection *c = get_irc_server_connection (s);
 	if (c == NULL)
 		return -1;
 
-	for (i = 0;
-	     buf[i - 2] != '\r' && buf[i - 1] != '\n' && i < IRC_MESSAGE_SIZE - 1;
-	     i++) {
-		n = irc_read_bytes (s, buf + i, 1);
-	}
+	char *start = c->in + c->in_start;
+	char *nl = memchr (start, '\n', c->in_len - c->in_start);
+	if (nl == NULL)
+		return 0;
 
-	buf[i] = '\0';
-	buf[IRC_MESSAGE_SIZE - 1] = '\0';
+	size_t len = nl + 1 - start;
+	size_t n = len < IRC_MESSAGE_SIZE ? len : IRC_MESSAGE_SIZE - 1;
+	memcpy (buf, start, n);
+	buf[n] = '\0';
+	c->in_start += len;
 
-	return i;
+	return n;
 }
 
 /* Read nbytes from the irc_server's connection */
@@ -361,21 +916,41 @@ irc_push_string (const irc_server *s, const char *str)
 {
 	irc_connection *c = get_irc_server_connection (s);
 
+	message_queue *entry = malloc (sizeof (message_queue));
+	entry->message = strdup (str);
+	entry->trace = trace_current;
+	entry->queued_ns = trace_now_ns ();
+	entry->next = NULL;
+	CIRC_PROBE (message_enqueue, entry->message, entry->trace);
+
 	pthread_mutex_lock (&c->write_queue_mtx);
 	message_queue *mq;
 	if (c->write_queue == NULL) {
-		c->write_queue = malloc (sizeof (message_queue));
-		c->write_queue->message = strdup (str);
-		c->write_queue->next = NULL;
+		c->write_queue = entry;
 	} else {
 		for (mq = c->write_queue; mq->next != NULL; mq = mq->next)
 			;
-
-		mq->next = malloc (sizeof (message_queue));
-		mq->next->message = strdup (str);
-		mq->next->next = NULL;
+		mq->next = entry;
 	}
 	pthread_mutex_unlock (&c->write_queue_mtx);
+	metric_gauge_add (irc_metrics.write_queue_depth, 1);
+}
+
+/* Queue str ahead of the lines waiting in the write queue */
+static void
+write_queue_push_front (irc_connection *conn, const char *str)
+{
+	message_queue *entry = malloc (sizeof (message_queue));
+	entry->message = strdup (str);
+	entry->trace = trace_current;
+	entry->queued_ns = trace_now_ns ();
+	CIRC_PROBE (message_enqueue, entry->message, entry->trace);
+
+	pthread_mutex_lock (&conn->write_queue_mtx);
+	entry->next = conn->write_queue;
+	conn->write_queue = entry;
+	pthread_mutex_unlock (&conn->write_queue_mtx);
+	metric_gauge_add (irc_metrics.write_queue_depth, 1);
 }
 
 /* Write nbytes to the irc_server's connection */
@@ -393,12 +968,23 @@ irc_write_bytes (const irc_server *s, const char *buf, size_t nbytes)
 	}
 
 	log_debug ("sending command: %s\n", buf);
+	irc_journal (JOURNAL_OUT, buf, nbytes);
 
-	if (s->secure) {
+	if (c->offline) {
+		if (c->capture != NULL)
+			fwrite (buf, 1, nbytes, c->capture);
+		ret = nbytes;
+	} else if (s->secure) {
 		ret = gnutls_record_send (c->tls_session, buf, nbytes);
 	} else {
 		ret = send (c->socket, buf, nbytes, 0);
 	}
+	CIRC_PROBE (bytes_sent, buf, nbytes, ret);
+
+	if (ret > 0) {
+		metric_inc (irc_metrics.lines_sent);
+		metric_add (irc_metrics.bytes_sent, ret);
+	}
 
 	return ret;
 }
@@ -469,6 +1055,59 @@ setup_irc_connection (const irc_server *s, int sock)
 	return 0;
 }
 
+/*
+ * Set up a connection to s without a socket, for benchmarks and replays.
+ * Lines sent on it are written to capture, or dropped if it is NULL.
+ */
+int
+irc_server_connect_offline (const irc_server *s, FILE *capture)
+{
+	if (server_connected (s) || connections_cap_reached ())
+		return -1;
+
+	irc_connection *c = create_irc_connection (s, -1);
+	if (c == NULL)
+		return -1;
+	c->offline = true;
+	c->capture = capture;
+
+	return make_irc_connection_entry (c);
+}
+
+/*
+ * Handle line as if it had been read from s, then run the rest of an
+ * event loop iteration. Replays feed their lines through this.
+ */
+void
+irc_handle_line (const irc_server *s, const char *line)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	if (c == NULL)
+		return;
+
+	size_t len = strlen (line);
+	CIRC_PROBE (line_received, line, len);
+	metric_inc (irc_metrics.lines_received);
+	metric_add (irc_metrics.bytes_received, len);
+	irc_fast_path (c, line);
+
+	trace_current = trace_begin ();
+	handle_message (c, line);
+	trace_current = 0;
+	exec_hooks (c->server, "IDLE", NULL);
+	irc_process_write_message_queue (c);
+	rcu_reclaim ();
+}
+
+/* Send the queued lines of s now rather than on the next loop iteration */
+void
+irc_flush_write_queue (const irc_server *s)
+{
+	irc_connection *c = get_irc_server_connection (s);
+	if (c != NULL)
+		irc_process_write_message_queue (c);
+}
+
 /* Encrypt the irc_connection c with GnuTLS */
 void
 encrypt_irc_connection (irc_connection *c)
@@ -478,6 +1117,15 @@ encrypt_irc_connection (irc_connection *c)
 	/* Initialize the credentials */
 	gnutls_certificate_allocate_credentials (&c->tls_creds);
 
+	/* A client certificate, for SASL EXTERNAL or CertFP */
+	const irc_user *u = c->server->user;
+	if (u != NULL && u->tls_cert != NULL) {
+		ret = gnutls_certificate_set_x509_key_file (
+		  c->tls_creds, u->tls_cert, u->tls_key != NULL ? u->tls_key : u->tls_cert, GNUTLS_X509_FMT_PEM);
+		if (ret < 0)
+			log_error ("client certificate %s: %s\n", u->tls_cert, gnutls_strerror (ret));
+	}
+
 	/* Initialize the session */
 	gnutls_init (&c->tls_session, GNUTLS_CLIENT | GNUTLS_NONBLOCK);
 	gnutls_set_default_priority (c->tls_session);
@@ -496,6 +1144,7 @@ encrypt_irc_connection (irc_connection *c)
 		/* Perform the handshake or die trying */
 		ret = gnutls_handshake (c->tls_session);
 	} while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN);
+	CIRC_PROBE (tls_handshake, c->server->host, ret);
 }
 
 /* Create an irc_connection for irc_server s */
@@ -508,10 +1157,40 @@ create_irc_connection (const irc_server *s, int sock)
 
 	c->server = s;
 	c->socket = sock;
-	c->read_queue = NULL;
+	atomic_init (&c->stopping, false);
+	atomic_init (&c->loop, NULL);
+	ev_async_init (&c->wakeup, irc_wakeup_callback);
+	c->in_start = 0;
+	c->in_len = 0;
+	c->in_discard = false;
+	for (int p = 0; p < IRC_PRIO_COUNT; p++) {
+		c->read_queue[p] = NULL;
+		c->read_queue_tail[p] = NULL;
+	}
+	c->read_queue_len = 0;
+	c->read_seq = 0;
 	pthread_mutex_init (&c->read_queue_mtx, NULL);
+	c->overloaded = false;
+	c->overloaded_ns = 0;
+	c->degraded = false;
+	c->ctcp_next_ns = 0;
 	c->write_queue = NULL;
 	pthread_mutex_init (&c->write_queue_mtx, NULL);
+	c->offline = false;
+	c->capture = NULL;
+
+	irc_metrics.lines_received = metric_counter ("circ_irc_lines_received_total", "IRC lines read from servers");
+	irc_metrics.bytes_received = metric_counter ("circ_irc_bytes_received_total", "Bytes of IRC lines read from servers");
+	irc_metrics.lines_sent = metric_counter ("circ_irc_lines_sent_total", "IRC lines sent to servers");
+	irc_metrics.bytes_sent = metric_counter ("circ_irc_bytes_sent_total", "Bytes sent to servers");
+	irc_metrics.parse_failures = metric_counter ("circ_irc_parse_failures_total", "IRC lines that failed to parse");
+	irc_metrics.read_queue_depth = metric_gauge ("circ_irc_read_queue_depth", "Lines read but not handled yet");
+	irc_metrics.write_queue_depth = metric_gauge ("circ_irc_write_queue_depth", "Lines queued but not sent yet");
+	irc_metrics.lines_shed[IRC_PRIO_LOW] = metric_counter_labeled ("circ_irc_lines_shed_total", "Lines dropped from a full read queue", "priority", "low");
+	irc_metrics.lines_shed[IRC_PRIO_CHAT] = metric_counter_labeled ("circ_irc_lines_shed_total", "Lines dropped from a full read queue", "priority", "chat");
+	irc_metrics.fast_replies[IRC_FAST_PING] = metric_counter_labeled ("circ_irc_fast_replies_total", "Replies sent from the raw line as it was read", "kind", "ping");
+	irc_metrics.fast_replies[IRC_FAST_CTCP] = metric_counter_labeled ("circ_irc_fast_replies_total", "Replies sent from the raw line as it was read", "kind", "ctcp");
+	irc_metrics.degraded = metric_gauge ("circ_irc_degraded", "Connections shedding load or handling lines late");
 
 	return c;
 }
@@ -523,7 +1202,7 @@ make_irc_connection_entry (irc_connection *c)
 	int i;
 	for (i = 0; i < MAX_CONNECTIONS; i++) {
 		if (conns[i] == NULL) {
-			conns[i] = c;
+			atomic_store_explicit (&conns[i], c, memory_order_release);
 			return 0;
 		}
 	}
@@ -538,15 +1217,31 @@ make_irc_connection_entry (irc_connection *c)
 irc_connection *
 get_irc_server_connection (const irc_server *s)
 {
-	int i;
-	for (i = 0; conns[i] != NULL; i++) {
-		if (s == conns[i]->server)
-			return conns[i];
+	irc_connection *c;
+	for (int i = 0; (c = atomic_load (&conns[i])) != NULL; i++) {
+		if (s == c->server)
+			return c;
 	}
 
 	return NULL;
 }
 
+/* Take c out of conns, moving the last entry into its place */
+static void
+remove_irc_connection_entry (irc_connection *c)
+{
+	int i, last;
+	for (last = 0; conns[last + 1] != NULL; last++)
+		;
+	for (i = 0; i <= last; i++) {
+		if (conns[i] == c) {
+			atomic_store_explicit (&conns[i], conns[last], memory_order_release);
+			atomic_store_explicit (&conns[last], NULL, memory_order_release);
+			return;
+		}
+	}
+}
+
 /* Return the irc_connection for the server watched by the given watcher */
 irc_connection *
 get_irc_connection_from_watcher (const ev_io *w)
@@ -581,10 +1276,16 @@ quit_irc_connection (const irc_server *s)
 
 	free (serialize_buf);
 
-	gnutls_deinit (conn->tls_session);
-	gnutls_certificate_free_credentials (conn->tls_creds);
-	gnutls_global_deinit ();
-	close (conn->socket);
+	/* No more wakeups from other threads, the QUIT went out above */
+	remove_irc_connection_entry (conn);
+	atomic_store_explicit (&conn->loop, NULL, memory_order_release);
+
+	if (!conn->offline) {
+		gnutls_deinit (conn->tls_session);
+		gnutls_certificate_free_credentials (conn->tls_creds);
+		gnutls_global_deinit ();
+		close (conn->socket);
+	}
 	free (conn);
 }
 
@@ -0,0 +1,18 @@
+#ifndef IRC_BASE64_H
+#define IRC_BASE64_H
+
+#include <stddef.h>
+
+/*
+ * Base64 as SASL uses it in AUTHENTICATE, standard alphabet with
+ * padding. Both allocate the exact result once, plus a '\0'.
+ */
+
+/* Encoded len bytes of data */
+char *
+base64_encode (const void *data, size_t len);
+/* Decoded s, NULL if it is not valid base64, *out_len is the size */
+unsigned char *
+base64_decode (const char *s, size_t len, size_t *out_len);
+
+#endif /* IRC_BASE64_H */
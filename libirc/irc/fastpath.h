@@ -0,0 +1,28 @@
+#ifndef IRC_FASTPATH_H
+#define IRC_FASTPATH_H
+
+#include <stddef.h>
+
+/*
+ * Protocol queries answered straight from the raw line as it is read,
+ * ahead of the read queue and whatever hooks are backlogged in it.
+ * The line is still queued for the hooks afterwards.
+ */
+
+/* RFC 1459 limit, longer replies are not sent */
+#define IRC_FAST_REPLY_SIZE 512
+
+typedef enum irc_fast_kind
+{
+	IRC_FAST_NONE,
+	/* PING from the server */
+	IRC_FAST_PING,
+	/* CTCP VERSION, PING or TIME sent to us rather than a channel */
+	IRC_FAST_CTCP
+} irc_fast_kind;
+
+/* Writes the reply to line, with \r\n, to reply and returns its kind */
+irc_fast_kind
+irc_fast_reply (const char *line, char reply[IRC_FAST_REPLY_SIZE]);
+
+#endif /* IRC_FASTPATH_H */
@@ -2,18 +2,36 @@
 #define IRC_HOOKS_H
 
 #include "irc.h"
+#include "metrics/metrics.h"
+
+/* Skipped for messages that waited longer than the read queue deadline,
+ * for work like logging that is not worth falling further behind for
+ */
+#define HOOK_NONESSENTIAL 1
 
 typedef struct irc_hook
 {
 	char *command;
+	/* Function name of entry, labels its latency */
+	char *name;
 	void (*entry) (const irc_server *, const irc_msg *msg);
+	int flags;
+	metric *latency;
+	metric *skipped;
 	struct irc_hook *next;
 } irc_hook;
 
+/* Set while dispatching a message that is past the deadline */
+extern _Thread_local bool hooks_stale;
+
 void
 init_hooks (void);
+/* Hooks are named after their function in the metrics */
+#define add_hook(command, f) add_hook_named ((command), #f, (f), 0)
+#define add_hook_nonessential(command, f) \
+	add_hook_named ((command), #f, (f), HOOK_NONESSENTIAL)
 void
-add_hook (const char *command, void (*f) (const irc_server *, const irc_msg *));
+add_hook_named (const char *command, const char *name, void (*f) (const irc_server *, const irc_msg *), int flags);
 const irc_hook *
 get_hooks (const char *command);
 void
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "irc/parser.h"
 #include "irc/serializer.h"
@@ -16,8 +17,13 @@ typedef struct irc_user
 	char *realname;
 
 	bool sasl_enabled;
+	/* PLAIN, EXTERNAL or SCRAM-SHA-256 */
+	char *sasl_mechanism;
 	char *sasl_user;
 	char *sasl_pass;
+	/* PEM client certificate and key, the key may be in the cert file */
+	char *tls_cert;
+	char *tls_key;
 } irc_user;
 
 typedef struct irc_channel
@@ -36,11 +42,41 @@ typedef struct irc_server
 	struct irc_channel *channels;
 } irc_server;
 
+/* What the read loop does when the read queue is full */
+typedef enum irc_queue_policy
+{
+	/* Drop queued lines, TAGMSG, JOIN and PART before PRIVMSG and NOTICE,
+	 * and stop reading when only protocol traffic is left
+	 */
+	IRC_QUEUE_SHED,
+	/* Stop reading, the server's sends back up in TCP */
+	IRC_QUEUE_BLOCK
+} irc_queue_policy;
+
+typedef struct irc_queue_options
+{
+	/* Lines read but not handled yet, 0 for no limit */
+	int max_lines;
+	irc_queue_policy policy;
+	/* Non-essential hooks skip lines queued longer, 0 for never */
+	int deadline_ms;
+} irc_queue_options;
+
 void
 register_core_hooks (void);
+void
+irc_set_queue_options (const irc_queue_options *opts);
+bool
+irc_degraded (const irc_server *s);
 
 int
 irc_server_connect (const irc_server *);
+int
+irc_server_connect_offline (const irc_server *s, FILE *capture);
+void
+irc_flush_write_queue (const irc_server *s);
+void
+irc_handle_line (const irc_server *s, const char *line);
 void
 irc_do_event_loop (const irc_server *);
 void
@@ -51,6 +87,10 @@ void
 irc_push_message (const irc_server *s, irc_msg *message);
 void
 irc_push_string (const irc_server *s, const char *str);
+void
+irc_wakeup (const irc_server *s);
+void
+irc_stop (const irc_server *s);
 const irc_server *
 irc_get_server_from_name (const char *name);
 const char *
@@ -34,5 +34,7 @@ typedef struct irc_msg
 
 irc_msg *
 irc_msg_new (char *prefix, char *command, int params_length, char *params[]);
+irc_msg *
+irc_msg_copy (const irc_msg *msg);
 
 #endif
@@ -0,0 +1,38 @@
+/*
+ * Minimal read-copy-update for the hook tables
+ *
+ * Readers wrap their accesses in rcu_read_lock/rcu_read_unlock, which
+ * never block. Writers build a new version of the data, publish it with
+ * rcu_assign_pointer and hand the old version to rcu_call, which frees
+ * it once every reader that could still see it has left its read-side
+ * section.
+ */
+#ifndef IRC_RCU_H
+#define IRC_RCU_H
+
+#define rcu_dereference(p) __atomic_load_n (&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n (&(p), (v), __ATOMIC_RELEASE)
+
+void
+rcu_read_lock (void);
+void
+rcu_read_unlock (void);
+
+/* Wait until all read-side sections that are running have finished.
+ * Must not be called from inside a read-side section.
+ */
+void
+rcu_synchronize (void);
+
+/* Run func (data) after a grace period, from a later rcu_reclaim */
+void
+rcu_call (void (*func) (void *), void *data);
+
+/* Run the callbacks queued with rcu_call whose grace period is over.
+ * Never waits for readers, the others are left for a later call. Does
+ * nothing when called from inside a read-side section
+ */
+void
+rcu_reclaim (void);
+
+#endif /* IRC_RCU_H */
@@ -1,5 +1,7 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "log/log.h"
 #include "irc/parser.h"
@@ -22,3 +24,36 @@ irc_msg_new (char *prefix, char *command, int params_length, char *params[])
 
 	return msg;
 };
+
+static char *
+strdup_or_null (const char *str)
+{
+	return str != NULL ? strdup (str) : NULL;
+}
+
+/* Deep copy msg, the copy owns all of its strings and is free'd with free_msg */
+irc_msg *
+irc_msg_copy (const irc_msg *msg)
+{
+	irc_msg *copy = alloc_msg ();
+	copy->prefix = strdup_or_null (msg->prefix);
+	copy->command = strdup_or_null (msg->command);
+
+	if (msg->tags != NULL) {
+		copy->tags = allocate_tags ();
+		for (int i = 0; i < msg->tags->len; i++) {
+			irc_msg_tag *tag = calloc (1, sizeof (*tag));
+			tag->name = strdup_or_null (msg->tags->tags[i]->name);
+			tag->value = strdup_or_null (msg->tags->tags[i]->value);
+			append_tag (tag, copy->tags);
+		}
+	}
+
+	if (msg->params != NULL) {
+		copy->params = allocate_params ();
+		for (int i = 0; i < msg->params->len; i++)
+			append_param (strdup_or_null (msg->params->params[i]), copy->params);
+	}
+
+	return copy;
+}
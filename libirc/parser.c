@@ -4,16 +4,6 @@
 #include "irc/parser.h"
 #include "log/log.h"
 
-static size_t
-ptrarr_len (const void **ptrarr)
-{
-	size_t count = 0;
-	for (const void **iter = ptrarr; *iter != NULL; ++iter) {
-		++count;
-	}
-	return count;
-}
-
 static void
 ptrarr_resize (void ***ptrarr, size_t new_size)
 {
@@ -30,11 +20,11 @@ alloc_strlen (const char *str, size_t len)
 	return ret;
 }
 
+/* The caller allocates the message, user_data is already it */
 void
 parse_start_message (void *user_data)
 {
-	struct irc_msg *msg = user_data;
-	msg = alloc_msg ();
+	(void)user_data;
 }
 
 void
@@ -55,7 +45,7 @@ parse_on_tag (const uint8_t *name, size_t name_len, const uint8_t *esc_value, si
 
 	struct irc_msg_tag *tag = NULL;
 	char *current_name = alloc_strlen ((const char *)name, name_len);
-	for (size_t i = 0; i < ptrarr_len ((const void **)msg->tags); ++i) {
+	for (size_t i = 0; i < (size_t)msg->tags->len; ++i) {
 		tag = msg->tags->tags[i];
 		if (strcmp (tag->name, current_name) == 0) {
 			free (current_name);
@@ -178,7 +168,6 @@ void
 append_tag (struct irc_msg_tag *tag, struct irc_msg_tags *tags)
 {
 	size_t new_len = tags->len + 1;
-	puts ("a");
 	ptrarr_resize ((void ***)&tags->tags, new_len);
 	tags->tags[tags->len] = tag;
 	tags->len = new_len;
@@ -203,6 +192,7 @@ free_tags (struct irc_msg_tags *tags)
 				free (tags->tags[i]->value);
 				free (tags->tags[i]);
 			}
+			free (tags->tags);
 		}
 		free (tags);
 	}
@@ -216,6 +206,7 @@ free_params (struct irc_msg_params *params)
 			for (size_t i = 0; i < params->len; ++i) {
 				free (params->params[i]);
 			}
+			free (params->params);
 		}
 		free (params);
 	}
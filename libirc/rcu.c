@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "irc/rcu.h"
+
+/*
+ * Every thread that has ever entered a read-side section has a reader
+ * record. While a thread is inside a section its counter holds the
+ * grace period it entered in, outside of it the counter is 0.
+ * rcu_synchronize starts a new grace period and waits for all readers
+ * that entered during an older one.
+ *
+ * rcu_call starts a new grace period as well and queues the callback
+ * with it. rcu_reclaim never waits: it runs the callbacks whose grace
+ * period no reader is older than, and leaves the rest for a later call.
+ */
+typedef struct rcu_reader
+{
+	atomic_ulong ctr;
+	unsigned int nesting;
+	struct rcu_reader *next;
+} rcu_reader;
+
+typedef struct rcu_callback
+{
+	void (*func) (void *);
+	void *data;
+	/* Grace period started when it was queued */
+	unsigned long gp;
+	struct rcu_callback *next;
+} rcu_callback;
+
+/* Grace period counter, always odd so it's never mistaken for 0 */
+static atomic_ulong rcu_gp = 1;
+
+static rcu_reader *readers;
+static pthread_mutex_t readers_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Oldest first, so grace periods increase along the queue */
+static rcu_callback *callbacks;
+static rcu_callback **callbacks_tail = &callbacks;
+static atomic_bool callbacks_pending;
+static pthread_mutex_t callbacks_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static __thread rcu_reader *self;
+
+static void
+rcu_unregister_reader (void *data)
+{
+	rcu_reader *r = data, **link;
+
+	pthread_mutex_lock (&readers_mtx);
+	for (link = &readers; *link != NULL; link = &(*link)->next)
+		if (*link == r) {
+			*link = r->next;
+			break;
+		}
+	pthread_mutex_unlock (&readers_mtx);
+
+	free (r);
+}
+
+static void
+rcu_make_reader_key (void)
+{
+	pthread_key_create (&reader_key, rcu_unregister_reader);
+}
+
+/* Only taken the first time a thread reads */
+static rcu_reader *
+rcu_register_reader (void)
+{
+	pthread_once (&reader_key_once, rcu_make_reader_key);
+
+	rcu_reader *r = calloc (1, sizeof (rcu_reader));
+	atomic_init (&r->ctr, 0);
+
+	pthread_mutex_lock (&readers_mtx);
+	r->next = readers;
+	readers = r;
+	pthread_mutex_unlock (&readers_mtx);
+
+	pthread_setspecific (reader_key, r);
+	self = r;
+
+	return r;
+}
+
+void
+rcu_read_lock (void)
+{
+	rcu_reader *r = self != NULL ? self : rcu_register_reader ();
+
+	if (r->nesting++ == 0) {
+		atomic_store (&r->ctr, atomic_load (&rcu_gp));
+		atomic_thread_fence (memory_order_seq_cst);
+	}
+}
+
+void
+rcu_read_unlock (void)
+{
+	rcu_reader *r = self;
+
+	if (--r->nesting == 0)
+		atomic_store_explicit (&r->ctr, 0, memory_order_release);
+}
+
+void
+rcu_synchronize (void)
+{
+	atomic_thread_fence (memory_order_seq_cst);
+
+	pthread_mutex_lock (&readers_mtx);
+	unsigned long gp = atomic_fetch_add (&rcu_gp, 2) + 2;
+
+	for (rcu_reader *r = readers; r != NULL; r = r->next) {
+		unsigned long ctr;
+		while ((ctr = atomic_load (&r->ctr)) != 0 && ctr < gp)
+			sched_yield ();
+	}
+	pthread_mutex_unlock (&readers_mtx);
+}
+
+/* Oldest grace period a reader is still in, ULONG_MAX when none is */
+static unsigned long
+rcu_oldest_reader (void)
+{
+	unsigned long oldest = ULONG_MAX;
+
+	atomic_thread_fence (memory_order_seq_cst);
+
+	pthread_mutex_lock (&readers_mtx);
+	for (rcu_reader *r = readers; r != NULL; r = r->next) {
+		unsigned long ctr = atomic_load (&r->ctr);
+		if (ctr != 0 && ctr < oldest)
+			oldest = ctr;
+	}
+	pthread_mutex_unlock (&readers_mtx);
+
+	return oldest;
+}
+
+void
+rcu_call (void (*func) (void *), void *data)
+{
+	rcu_callback *cb = malloc (sizeof (rcu_callback));
+	cb->func = func;
+	cb->data = data;
+	cb->next = NULL;
+
+	/* Readers that enter from here on can't see what func frees */
+	atomic_thread_fence (memory_order_seq_cst);
+
+	pthread_mutex_lock (&callbacks_mtx);
+	cb->gp = atomic_fetch_add (&rcu_gp, 2) + 2;
+	*callbacks_tail = cb;
+	callbacks_tail = &cb->next;
+	atomic_store (&callbacks_pending, true);
+	pthread_mutex_unlock (&callbacks_mtx);
+}
+
+void
+rcu_reclaim (void)
+{
+	if (!atomic_load (&callbacks_pending))
+		return;
+	if (self != NULL && self->nesting > 0)
+		return;
+
+	unsigned long oldest = rcu_oldest_reader ();
+	rcu_callback *done = NULL, **done_tail = &done;
+
+	/* Readers still in an older grace period may see the rest */
+	pthread_mutex_lock (&callbacks_mtx);
+	while (callbacks != NULL && callbacks->gp <= oldest) {
+		*done_tail = callbacks;
+		done_tail = &callbacks->next;
+		callbacks = callbacks->next;
+	}
+	*done_tail = NULL;
+	if (callbacks == NULL) {
+		callbacks_tail = &callbacks;
+		atomic_store (&callbacks_pending, false);
+	}
+	pthread_mutex_unlock (&callbacks_mtx);
+
+	for (rcu_callback *next; done != NULL; done = next) {
+		next = done->next;
+		done->func (done->data);
+		free (done);
+	}
+}
@@ -47,16 +47,6 @@ serializer_on_param (size_t param_idx,
 		     const uint8_t **param,
 		     void *user_data);
 
-static size_t
-ptrarr_len (const void **ptrarr)
-{
-	size_t count = 0;
-	for (const void **iter = ptrarr; *iter != NULL; ++iter) {
-		++count;
-	}
-	return count;
-}
-
 ircmsg_serializer_callbacks serializer_cbs = {
 	.tag_count = serializer_tag_count,
 	.on_tag = serializer_on_tag,
@@ -70,7 +60,7 @@ size_t
 serializer_tag_count (void *user_data)
 {
 	struct irc_msg *msg = user_data;
-	return msg->tags != NULL ? ptrarr_len ((const void **)msg->tags) : 0;
+	return msg->tags != NULL ? msg->tags->len : 0;
 }
 
 void
@@ -1,36 +1,447 @@
-#include "../src/config/config.h"
 #include "log.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Bytes of the ring of each logging thread */
+#define LOG_RING_SIZE (256 * 1024)
+/* Longest message, longer ones are cut */
+#define LOG_LINE_MAX 2048
+/* How long the writer lets records gather after writing some */
+#define LOG_IDLE_NS (5 * 1000 * 1000)
+
+#define LOG_MAGIC "CIRCLOG1"
+/* len of the record that fills the end of the ring before it wraps */
+#define LOG_WRAP UINT32_MAX
+
+/* Ring and binary file record, followed by len bytes of text */
+typedef struct log_record
+{
+	uint32_t len;
+	uint8_t level;
+	uint8_t subsys;
+	uint16_t unused;
+	uint64_t time; /* ns since the epoch */
+} log_record;
+
+#define LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * Single producer, single consumer: head is only written by the owning
+ * thread and tail by the writer thread, both count bytes since the
+ * start and are reduced modulo the ring size to index it.
+ */
+typedef struct log_ring
+{
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	_Atomic uint64_t dropped;
+	/* Set once the owning thread has exited */
+	_Atomic bool orphan;
+	struct log_ring *next;
+	char buf[LOG_RING_SIZE];
+} log_ring;
+
+int log_levels[LOG_SUBSYS_COUNT] = { LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO };
+
+static const char *level_names[] = { "error", "info", "debug" };
+static const char *subsys_names[] = { "core", "irc", "db", "chanlog", "scheme" };
+
+static _Atomic bool running;
+static bool binary;
+static FILE *out;
+static pthread_t writer;
+/* Woken by a thread that finds it asleep, or whose ring is filling up */
+static pthread_mutex_t wake_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic bool writer_asleep;
+/* Serializes output, held by the writer while it writes */
+static pthread_mutex_t emit_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Changes to the list of rings only, the hot path never takes it */
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static log_ring *rings;
+static pthread_key_t ring_key;
+static _Thread_local log_ring *own_ring;
+
+static void *
+log_writer_thread (void *data);
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Destructors running after this one get a new ring if they log */
+static void
+ring_orphan (void *data)
+{
+	log_ring *r = data;
+	own_ring = NULL;
+	atomic_store_explicit (&r->orphan, true, memory_order_release);
+}
+
+static log_ring *
+ring_get (void)
+{
+	if (own_ring != NULL)
+		return own_ring;
+
+	log_ring *r = calloc (1, sizeof (log_ring));
+	if (r == NULL)
+		return NULL;
+	pthread_setspecific (ring_key, r);
+
+	pthread_mutex_lock (&rings_mtx);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock (&rings_mtx);
+
+	own_ring = r;
+	return r;
+}
+
+/* Lock free, drops the message if the writer is that far behind */
+static void
+ring_push (log_ring *r, int level, int subsys, uint64_t time, const char *text, size_t len)
+{
+	uint64_t head = atomic_load_explicit (&r->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+	size_t need = sizeof (log_record) + LOG_ALIGN (len);
+	size_t pos = head % LOG_RING_SIZE;
+	size_t pad = LOG_RING_SIZE - pos < need ? LOG_RING_SIZE - pos : 0;
+
+	if (LOG_RING_SIZE - (head - tail) < pad + need) {
+		atomic_fetch_add_explicit (&r->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	if (pad > 0) {
+		/* Records never wrap, the rest of the ring is skipped */
+		((log_record *)(r->buf + pos))->len = LOG_WRAP;
+		pos = 0;
+	}
+
+	log_record *rec = (log_record *)(r->buf + pos);
+	rec->len = len;
+	rec->level = level;
+	rec->subsys = subsys;
+	rec->time = time;
+	memcpy (rec + 1, text, len);
+
+	atomic_store_explicit (&r->head, head + pad + need, memory_order_release);
+
+	/* Either the writer sees the new head before it sleeps, or this
+	 * sees writer_asleep, see log_writer_thread
+	 */
+	atomic_thread_fence (memory_order_seq_cst);
+	if (atomic_load_explicit (&writer_asleep, memory_order_relaxed) ||
+	    head + pad + need - tail > LOG_RING_SIZE / 2) {
+		pthread_mutex_lock (&wake_mtx);
+		pthread_cond_signal (&wake_cond);
+		pthread_mutex_unlock (&wake_mtx);
+	}
+}
+
+static void
+write_text (FILE *f, const log_record *rec, const char *text)
+{
+	/* Callers hold emit_mtx, or are the single threaded decoder */
+	static time_t last_secs = -1;
+	static char stamp[32];
+	time_t secs = rec->time / 1000000000;
+
+	if (secs != last_secs) {
+		struct tm tm;
+		strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", localtime_r (&secs, &tm));
+		last_secs = secs;
+	}
+	fprintf (f, "%s.%03u %s %s: %.*s",
+		 stamp,
+		 (unsigned)(rec->time / 1000000 % 1000),
+		 rec->level < 3 ? level_names[rec->level] : "?",
+		 rec->subsys < LOG_SUBSYS_COUNT ? subsys_names[rec->subsys] : "?",
+		 (int)rec->len,
+		 text);
+}
+
+/* Callers hold emit_mtx. Once log_shutdown closed out, records go to
+ * stderr or stdout as text
+ */
+static void
+emit (const log_record *rec, const char *text)
+{
+	if (binary && out != NULL) {
+		fwrite (rec, sizeof (log_record), 1, out);
+		fwrite (text, 1, rec->len, out);
+	} else if (out != NULL) {
+		write_text (out, rec, text);
+	} else {
+		write_text (rec->level == LOG_LEVEL_ERROR ? stderr : stdout, rec, text);
+	}
+}
 
 void
-log_debug (char *fmt, ...)
+log_write (int level, int subsys, const char *fmt, ...)
 {
-	if (DEBUG) {
-		va_list argptr;
-		va_start (argptr, fmt);
-		vprintf (fmt, argptr);
-		va_end (argptr);
+	char text[LOG_LINE_MAX];
+	va_list ap;
+
+	va_start (ap, fmt);
+	int n = vsnprintf (text, sizeof (text), fmt, ap);
+	va_end (ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= sizeof (text))
+		n = sizeof (text) - 1;
+
+	log_ring *r;
+	if (!atomic_load_explicit (&running, memory_order_acquire) || (r = ring_get ()) == NULL) {
+		log_record rec = { .len = n, .level = level, .subsys = subsys, .time = now_ns () };
+		pthread_mutex_lock (&emit_mtx);
+		emit (&rec, text);
+		pthread_mutex_unlock (&emit_mtx);
+		return;
 	}
+
+	ring_push (r, level, subsys, now_ns (), text, n);
+}
+
+/* Oldest unread record of r, NULL when it is empty */
+static log_record *
+ring_peek (log_ring *r)
+{
+	uint64_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit (&r->head, memory_order_acquire);
+
+	while (tail != head) {
+		log_record *rec = (log_record *)(r->buf + tail % LOG_RING_SIZE);
+		if (rec->len != LOG_WRAP)
+			return rec;
+		tail += LOG_RING_SIZE - tail % LOG_RING_SIZE;
+		atomic_store_explicit (&r->tail, tail, memory_order_release);
+	}
+	return NULL;
+}
+
+static void
+ring_pop (log_ring *r, log_record *rec)
+{
+	uint64_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+	atomic_store_explicit (&r->tail, tail + sizeof (log_record) + LOG_ALIGN (rec->len), memory_order_release);
+}
+
+/*
+ * Writes out all records readable now, oldest first across the rings
+ * so lines of different threads stay in order. Returns how many.
+ */
+static size_t
+drain (void)
+{
+	size_t n = 0;
+
+	/* Rings are added at the head and only removed below, by the
+	 * writer, so the list from here on stays valid without the lock
+	 */
+	pthread_mutex_lock (&rings_mtx);
+	log_ring *list = rings;
+	pthread_mutex_unlock (&rings_mtx);
+
+	pthread_mutex_lock (&emit_mtx);
+	for (;;) {
+		log_ring *oldest = NULL;
+		log_record *first = NULL;
+
+		for (log_ring *r = list; r != NULL; r = r->next) {
+			log_record *rec = ring_peek (r);
+			if (rec != NULL && (first == NULL || rec->time < first->time)) {
+				oldest = r;
+				first = rec;
+			}
+		}
+		if (oldest == NULL)
+			break;
+
+		emit (first, (const char *)(first + 1));
+		ring_pop (oldest, first);
+		n++;
+	}
+
+	for (log_ring *r = list; r != NULL; r = r->next) {
+		uint64_t dropped = atomic_exchange_explicit (&r->dropped, 0, memory_order_relaxed);
+		if (dropped > 0) {
+			char text[64];
+			int len = snprintf (text, sizeof (text), "%llu messages dropped\n", (unsigned long long)dropped);
+			log_record rec = { .len = len, .level = LOG_LEVEL_ERROR, .subsys = LOG_CORE, .time = now_ns () };
+			emit (&rec, text);
+		}
+	}
+
+	if (n > 0)
+		fflush (out != NULL ? out : stdout);
+	pthread_mutex_unlock (&emit_mtx);
+
+	/* Rings of exited threads go once they are read */
+	pthread_mutex_lock (&rings_mtx);
+	log_ring **link = &rings;
+	while (*link != NULL) {
+		log_ring *r = *link;
+		if (atomic_load_explicit (&r->orphan, memory_order_acquire) && ring_peek (r) == NULL) {
+			*link = r->next;
+			free (r);
+		} else {
+			link = &r->next;
+		}
+	}
+	pthread_mutex_unlock (&rings_mtx);
+	return n;
+}
+
+static bool
+rings_empty (void)
+{
+	bool empty = true;
+
+	pthread_mutex_lock (&rings_mtx);
+	for (log_ring *r = rings; r != NULL && empty; r = r->next)
+		empty = atomic_load_explicit (&r->tail, memory_order_relaxed) ==
+			atomic_load_explicit (&r->head, memory_order_relaxed);
+	pthread_mutex_unlock (&rings_mtx);
+	return empty;
+}
+
+/*
+ * Sleeps while every ring is empty, a thread that logs wakes it. After
+ * writing it waits LOG_IDLE_NS for more, unless a ring fills up.
+ */
+static void *
+log_writer_thread (void *data)
+{
+	struct timespec deadline;
+
+	while (atomic_load_explicit (&running, memory_order_acquire)) {
+		if (drain () > 0) {
+			clock_gettime (CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_IDLE_NS;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_mutex_lock (&wake_mtx);
+			if (atomic_load (&running))
+				pthread_cond_timedwait (&wake_cond, &wake_mtx, &deadline);
+			pthread_mutex_unlock (&wake_mtx);
+			continue;
+		}
+
+		pthread_mutex_lock (&wake_mtx);
+		atomic_store_explicit (&writer_asleep, true, memory_order_relaxed);
+		atomic_thread_fence (memory_order_seq_cst);
+		if (atomic_load (&running) && rings_empty ())
+			pthread_cond_wait (&wake_cond, &wake_mtx);
+		atomic_store_explicit (&writer_asleep, false, memory_order_relaxed);
+		pthread_mutex_unlock (&wake_mtx);
+	}
+	drain ();
+	return NULL;
 }
 
 void
-log_info (char *fmt, ...)
+log_init (const log_options *opts)
 {
-	va_list argptr;
-	va_start (argptr, fmt);
-	vprintf (fmt, argptr);
-	va_end (argptr);
+	if (atomic_load (&running))
+		return;
+
+	for (int i = 0; i < LOG_SUBSYS_COUNT; i++)
+		log_levels[i] = opts->levels[i] >= 0 ? opts->levels[i] : opts->level;
+
+	binary = opts->binary;
+	out = NULL;
+	if (opts->path != NULL) {
+		out = fopen (opts->path, binary ? "ab" : "a");
+		if (out == NULL)
+			fprintf (stderr, "Error: log: %s: %s\n", opts->path, strerror (errno));
+	}
+	if (binary && out == NULL)
+		out = stdout;
+	if (binary && ftell (out) <= 0)
+		fwrite (LOG_MAGIC, 1, strlen (LOG_MAGIC), out);
+
+	pthread_key_create (&ring_key, ring_orphan);
+	atomic_store (&running, true);
+	if (pthread_create (&writer, NULL, log_writer_thread, NULL) != 0) {
+		atomic_store (&running, false);
+		return;
+	}
+	atexit (log_shutdown);
 }
 
 void
-log_error (char *fmt, ...)
+log_shutdown (void)
+{
+	if (!atomic_exchange (&running, false))
+		return;
+
+	pthread_mutex_lock (&wake_mtx);
+	pthread_cond_signal (&wake_cond);
+	pthread_mutex_unlock (&wake_mtx);
+	pthread_join (writer, NULL);
+	/* Anything logged while the writer stopped */
+	drain ();
+
+	/* Threads still running at exit log synchronously through emit */
+	pthread_mutex_lock (&emit_mtx);
+	if (out != NULL && out != stdout)
+		fclose (out);
+	else
+		fflush (stdout);
+	out = NULL;
+	binary = false;
+	pthread_mutex_unlock (&emit_mtx);
+}
+
+int
+log_level_from_name (const char *name)
+{
+	for (int i = 0; i < 3; i++)
+		if (strcmp (name, level_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+int
+log_subsys_from_name (const char *name)
 {
-	va_list argptr;
-	va_start (argptr, fmt);
+	for (int i = 0; i < LOG_SUBSYS_COUNT; i++)
+		if (strcmp (name, subsys_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+int
+log_decode (FILE *in, FILE *f)
+{
+	char magic[sizeof (LOG_MAGIC) - 1];
+	char text[LOG_LINE_MAX];
+	log_record rec;
 
-	fputs ("Error: ", stderr);
-	vfprintf (stderr, fmt, argptr);
-	va_end (argptr);
-}
\ No newline at end of file
+	if (fread (magic, 1, sizeof (magic), in) != sizeof (magic) ||
+	    memcmp (magic, LOG_MAGIC, sizeof (magic)) != 0)
+		return -1;
+
+	while (fread (&rec, sizeof (rec), 1, in) == 1) {
+		if (rec.len >= sizeof (text) || fread (text, 1, rec.len, in) != rec.len)
+			return -1;
+		write_text (f, &rec, text);
+	}
+	return ferror (in) ? -1 : 0;
+}
@@ -1,17 +1,83 @@
 #ifndef LOG_H
 #define LOG_H
 
-#ifndef DEBUG
-#define DEBUG 1
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Asynchronous logger
+ * Messages are formatted into a ring buffer owned by the calling thread
+ * and written out by a background thread, a slow terminal or pipe never
+ * blocks the caller. A full ring drops the message and counts it.
+ *
+ * Levels above LOG_LEVEL_MAX are compiled out, the rest are filtered at
+ * runtime per subsystem. A file sets its subsystem by defining
+ * LOG_SUBSYS before including any header:
+ *
+ *     #define LOG_SUBSYS LOG_IRC
+ */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
 #endif
 
-void
-log_info (char *fmt, ...);
+#define LOG_CORE 0
+#define LOG_IRC 1
+#define LOG_DB 2
+#define LOG_CHANLOG 3
+#define LOG_SCHEME 4
+#define LOG_SUBSYS_COUNT 5
+
+#ifndef LOG_SUBSYS
+#define LOG_SUBSYS LOG_CORE
+#endif
+
+typedef struct log_options
+{
+	/* Level of subsystems without their own, -1 in levels */
+	int level;
+	int levels[LOG_SUBSYS_COUNT];
+	/* Length prefixed records instead of text, see log_decode */
+	bool binary;
+	/* NULL writes to stdout, and errors to stderr */
+	const char *path;
+} log_options;
 
+/* Runtime level per subsystem, read without locking by every call */
+extern int log_levels[LOG_SUBSYS_COUNT];
+
+#define LOG_AT(level, ...)                                               \
+	do {                                                             \
+		if ((level) <= LOG_LEVEL_MAX && (level) <= log_levels[LOG_SUBSYS]) \
+			log_write ((level), LOG_SUBSYS, __VA_ARGS__);    \
+	} while (0)
+
+#define log_error(...) LOG_AT (LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...) LOG_AT (LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT (LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* Until log_init messages are written synchronously */
 void
-log_debug (char *fmt, ...);
+log_init (const log_options *opts);
+/* Writes out everything logged so far and stops the writer thread */
+void
+log_shutdown (void);
 
 void
-log_error (char *fmt, ...);
+log_write (int level, int subsys, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+int
+log_level_from_name (const char *name);
+int
+log_subsys_from_name (const char *name);
+
+/* Binary log file to text, returns 0 on success */
+int
+log_decode (FILE *in, FILE *out);
 
 #endif /* LOG_H */
@@ -0,0 +1,559 @@
+#include "metrics.h"
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Shards of every counter and gauge, threads beyond share them */
+#define METRICS_SHARDS 16
+/* Histograms are much bigger, so fewer shards */
+#define METRICS_HIST_SHARDS 4
+#define METRICS_CACHELINE 64
+/* Slots of the series table of a family, twice the series cap */
+#define METRICS_SLOTS (2 * METRICS_MAX_SERIES)
+
+/*
+ * Histograms are log-linear like HDR histograms: every power of two is
+ * split into 2^HIST_SUB_BITS buckets, which keeps the relative error
+ * under 25% from 1ns to 2^HIST_MAX_EXP ns (about 36 minutes).
+ */
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 41
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+typedef enum metric_type
+{
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM,
+} metric_type;
+
+static const char *type_names[] = { "counter", "gauge", "histogram" };
+
+typedef struct counter_shard
+{
+	_Alignas (METRICS_CACHELINE) _Atomic uint64_t value;
+} counter_shard;
+
+typedef struct hist_shard
+{
+	_Alignas (METRICS_CACHELINE) _Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t buckets[HIST_BUCKETS];
+} hist_shard;
+
+struct metric
+{
+	metric_type type;
+	/* Label value, "" without a label */
+	char *value;
+	union
+	{
+		counter_shard *shards;
+		hist_shard *hist;
+	};
+};
+
+/*
+ * All series of one metric name. Series are never removed, so the
+ * open addressed table is read without locking and only filled in
+ * under registry_mtx.
+ */
+typedef struct family
+{
+	metric_type type;
+	char *name;
+	char *help;
+	/* NULL without a label */
+	char *label;
+	_Atomic (metric *) slots[METRICS_SLOTS];
+	int count;
+	metric *other;
+	_Atomic (struct family *) next;
+} family;
+
+/* Taken only to register, lookups and recording never lock */
+static pthread_mutex_t registry_mtx = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic (family *) families;
+static family *families_tail;
+
+static _Atomic unsigned next_shard;
+static _Thread_local int own_shard = -1;
+
+static bool running;
+static pthread_t exporter;
+static int listen_fd = -1;
+/* Written to by metrics_shutdown to wake the exporter */
+static int wake_pipe[2] = { -1, -1 };
+static metrics_options options;
+
+static void *
+metrics_thread (void *data);
+
+static unsigned
+shard_index (void)
+{
+	if (own_shard < 0)
+		own_shard = atomic_fetch_add_explicit (&next_shard, 1, memory_order_relaxed) % METRICS_SHARDS;
+	return own_shard;
+}
+
+static uint32_t
+hash_string (const char *s)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+static void *
+zalloc_aligned (size_t size)
+{
+	void *p = aligned_alloc (METRICS_CACHELINE, size);
+	if (p == NULL)
+		err (1, "metrics");
+	memset (p, 0, size);
+	return p;
+}
+
+static metric *
+metric_new (metric_type type, const char *value)
+{
+	metric *m = malloc (sizeof (metric));
+	m->type = type;
+	m->value = strdup (value);
+	if (type == METRIC_HISTOGRAM)
+		m->hist = zalloc_aligned (METRICS_HIST_SHARDS * sizeof (hist_shard));
+	else
+		m->shards = zalloc_aligned (METRICS_SHARDS * sizeof (counter_shard));
+	return m;
+}
+
+static family *
+family_find (const char *name)
+{
+	family *fam = atomic_load_explicit (&families, memory_order_acquire);
+	for (; fam != NULL; fam = atomic_load_explicit (&fam->next, memory_order_acquire))
+		if (strcmp (fam->name, name) == 0)
+			return fam;
+	return NULL;
+}
+
+/* Must hold registry_mtx */
+static family *
+family_new (metric_type type, const char *name, const char *help, const char *label)
+{
+	family *fam = calloc (1, sizeof (family));
+	fam->type = type;
+	fam->name = strdup (name);
+	fam->help = strdup (help);
+	fam->label = label != NULL ? strdup (label) : NULL;
+
+	/* Appended so the export keeps the registration order */
+	if (families_tail == NULL)
+		atomic_store_explicit (&families, fam, memory_order_release);
+	else
+		atomic_store_explicit (&families_tail->next, fam, memory_order_release);
+	families_tail = fam;
+	return fam;
+}
+
+static metric *
+series_find (family *fam, const char *value, uint32_t hash)
+{
+	for (int i = 0; i < METRICS_SLOTS; i++) {
+		metric *m = atomic_load_explicit (&fam->slots[(hash + i) % METRICS_SLOTS], memory_order_acquire);
+		if (m == NULL)
+			return NULL;
+		if (strcmp (m->value, value) == 0)
+			return m;
+	}
+	return NULL;
+}
+
+static metric *
+metric_get (metric_type type, const char *name, const char *help, const char *label, const char *value)
+{
+	if (value == NULL)
+		value = "";
+	uint32_t hash = hash_string (value);
+
+	family *fam = family_find (name);
+	if (fam != NULL && fam->type == type) {
+		metric *m = series_find (fam, value, hash);
+		if (m != NULL)
+			return m;
+	}
+
+	pthread_mutex_lock (&registry_mtx);
+	fam = family_find (name);
+	if (fam == NULL)
+		fam = family_new (type, name, help, label);
+	if (fam->type != type)
+		errx (1, "metrics: %s is a %s", name, type_names[fam->type]);
+
+	metric *m = series_find (fam, value, hash);
+	if (m == NULL && fam->count >= METRICS_MAX_SERIES) {
+		if (fam->other == NULL)
+			fam->other = metric_new (type, "other");
+		m = fam->other;
+	} else if (m == NULL) {
+		m = metric_new (type, value);
+		int i = hash % METRICS_SLOTS;
+		while (atomic_load_explicit (&fam->slots[i], memory_order_relaxed) != NULL)
+			i = (i + 1) % METRICS_SLOTS;
+		atomic_store_explicit (&fam->slots[i], m, memory_order_release);
+		fam->count++;
+	}
+	pthread_mutex_unlock (&registry_mtx);
+	return m;
+}
+
+metric *
+metric_counter (const char *name, const char *help)
+{
+	return metric_get (METRIC_COUNTER, name, help, NULL, NULL);
+}
+
+metric *
+metric_counter_labeled (const char *name, const char *help, const char *label, const char *value)
+{
+	return metric_get (METRIC_COUNTER, name, help, label, value);
+}
+
+metric *
+metric_gauge (const char *name, const char *help)
+{
+	return metric_get (METRIC_GAUGE, name, help, NULL, NULL);
+}
+
+metric *
+metric_histogram (const char *name, const char *help)
+{
+	return metric_get (METRIC_HISTOGRAM, name, help, NULL, NULL);
+}
+
+metric *
+metric_histogram_labeled (const char *name, const char *help, const char *label, const char *value)
+{
+	return metric_get (METRIC_HISTOGRAM, name, help, label, value);
+}
+
+void
+metric_add (metric *m, uint64_t n)
+{
+	atomic_fetch_add_explicit (&m->shards[shard_index ()].value, n, memory_order_relaxed);
+}
+
+void
+metric_gauge_add (metric *m, int64_t n)
+{
+	/* Shards wrap around, their sum is still right */
+	atomic_fetch_add_explicit (&m->shards[shard_index ()].value, (uint64_t)n, memory_order_relaxed);
+}
+
+static unsigned
+bucket_index (uint64_t ns)
+{
+	if (ns < HIST_SUB)
+		return ns;
+
+	unsigned e = 63 - __builtin_clzll (ns);
+	if (e > HIST_MAX_EXP)
+		return HIST_BUCKETS - 1;
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that no longer falls into bucket i */
+static uint64_t
+bucket_end (unsigned i)
+{
+	if (i < HIST_SUB)
+		return i + 1;
+
+	unsigned e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t sub = i & (HIST_SUB - 1);
+	return (HIST_SUB + sub + 1) << (e - HIST_SUB_BITS);
+}
+
+void
+metric_observe_ns (metric *m, uint64_t ns)
+{
+	hist_shard *h = &m->hist[shard_index () % METRICS_HIST_SHARDS];
+	atomic_fetch_add_explicit (&h->buckets[bucket_index (ns)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&h->sum, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit (&h->count, 1, memory_order_relaxed);
+}
+
+uint64_t
+metric_now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+write_name (FILE *f, const family *fam, const metric *m, const char *suffix, const char *le)
+{
+	fprintf (f, "%s%s", fam->name, suffix);
+	if (fam->label == NULL && le == NULL)
+		return;
+
+	fputc ('{', f);
+	if (fam->label != NULL) {
+		fprintf (f, "%s=\"", fam->label);
+		for (const char *c = m->value; *c != '\0'; c++) {
+			if (*c == '\\' || *c == '"')
+				fputc ('\\', f);
+			if (*c == '\n')
+				fputs ("\\n", f);
+			else
+				fputc (*c, f);
+		}
+		fputc ('"', f);
+	}
+	if (le != NULL)
+		fprintf (f, "%sle=\"%s\"", fam->label != NULL ? "," : "", le);
+	fputc ('}', f);
+}
+
+/*
+ * Prometheus wants cumulative buckets on fixed bounds, 1, 2.5 and 5 per
+ * decade from 1us to 10s. A log-linear bucket is counted in the first
+ * bound it lies entirely below, so counts are off by at most 25%.
+ */
+static void
+write_histogram (FILE *f, const family *fam, const metric *m)
+{
+	uint64_t buckets[HIST_BUCKETS] = { 0 };
+	uint64_t count = 0, sum = 0;
+
+	for (int s = 0; s < METRICS_HIST_SHARDS; s++) {
+		hist_shard *h = &m->hist[s];
+		for (int i = 0; i < HIST_BUCKETS; i++)
+			buckets[i] += atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+		count += atomic_load_explicit (&h->count, memory_order_relaxed);
+		sum += atomic_load_explicit (&h->sum, memory_order_relaxed);
+	}
+
+	uint64_t cumulative = 0;
+	int i = 0;
+	for (uint64_t decade = 1000; decade <= 10000000000ull; decade *= 10) {
+		const uint64_t bounds[] = { decade, decade * 5 / 2, decade * 5 };
+		for (int b = 0; b < 3 && (b == 0 || decade < 10000000000ull); b++) {
+			while (i < HIST_BUCKETS && bucket_end (i) <= bounds[b] + 1)
+				cumulative += buckets[i++];
+
+			char le[32];
+			snprintf (le, sizeof (le), "%g", bounds[b] / 1e9);
+			write_name (f, fam, m, "_bucket", le);
+			fprintf (f, " %llu\n", (unsigned long long)cumulative);
+		}
+	}
+	/* Recording is not atomic across fields, keep +Inf consistent */
+	write_name (f, fam, m, "_bucket", "+Inf");
+	fprintf (f, " %llu\n", (unsigned long long)(count > cumulative ? count : cumulative));
+	write_name (f, fam, m, "_sum", NULL);
+	fprintf (f, " %.9f\n", sum / 1e9);
+	write_name (f, fam, m, "_count", NULL);
+	fprintf (f, " %llu\n", (unsigned long long)count);
+}
+
+static void
+write_series (FILE *f, const family *fam, const metric *m)
+{
+	if (fam->type == METRIC_HISTOGRAM) {
+		write_histogram (f, fam, m);
+		return;
+	}
+
+	uint64_t value = 0;
+	for (int s = 0; s < METRICS_SHARDS; s++)
+		value += atomic_load_explicit (&m->shards[s].value, memory_order_relaxed);
+
+	write_name (f, fam, m, "", NULL);
+	if (fam->type == METRIC_GAUGE)
+		fprintf (f, " %lld\n", (long long)(int64_t)value);
+	else
+		fprintf (f, " %llu\n", (unsigned long long)value);
+}
+
+void
+metrics_write (FILE *f)
+{
+	/* Keeps the other series of a family from changing underneath */
+	pthread_mutex_lock (&registry_mtx);
+	for (family *fam = families; fam != NULL; fam = fam->next) {
+		fprintf (f, "# HELP %s %s\n", fam->name, fam->help);
+		fprintf (f, "# TYPE %s %s\n", fam->name, type_names[fam->type]);
+		for (int i = 0; i < METRICS_SLOTS; i++)
+			if (fam->slots[i] != NULL)
+				write_series (f, fam, fam->slots[i]);
+		if (fam->other != NULL)
+			write_series (f, fam, fam->other);
+	}
+	pthread_mutex_unlock (&registry_mtx);
+}
+
+/* Written to a temporary file first so readers never see half of it */
+static void
+write_textfile (void)
+{
+	size_t len = strlen (options.textfile);
+	char *tmp = malloc (len + 5);
+	memcpy (tmp, options.textfile, len);
+	memcpy (tmp + len, ".tmp", 5);
+
+	FILE *f = fopen (tmp, "w");
+	if (f == NULL) {
+		free (tmp);
+		return;
+	}
+	metrics_write (f);
+	if (fclose (f) == 0)
+		rename (tmp, options.textfile);
+	else
+		unlink (tmp);
+	free (tmp);
+}
+
+/* One scrape per connection: the metrics are sent and it is closed */
+static void
+serve_client (void)
+{
+	int fd = accept (listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream (&buf, &len);
+	if (f != NULL) {
+		metrics_write (f);
+		fclose (f);
+	}
+
+	/* A stuck client must not stall the exporter */
+	struct timeval timeout = { .tv_sec = 1 };
+	setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+	for (size_t off = 0; buf != NULL && off < len;) {
+		ssize_t n = send (fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	free (buf);
+	close (fd);
+}
+
+static int
+listen_unix (const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "Error: metrics: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy (addr.sun_path, path);
+
+	int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	/* Left behind by an earlier run */
+	unlink (path);
+	if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen (fd, 8) != 0) {
+		fprintf (stderr, "Error: metrics: %s: %s\n", path, strerror (errno));
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void *
+metrics_thread (void *data)
+{
+	uint64_t next_write = metric_now_ns ();
+
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ .fd = wake_pipe[0], .events = POLLIN },
+			{ .fd = listen_fd, .events = POLLIN },
+		};
+		int timeout = -1;
+		if (options.textfile != NULL) {
+			uint64_t now = metric_now_ns ();
+			timeout = next_write > now ? (next_write - now) / 1000000 + 1 : 0;
+		}
+
+		if (poll (fds, listen_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR)
+			break;
+		if (fds[0].revents & POLLIN)
+			break;
+		if (listen_fd >= 0 && (fds[1].revents & POLLIN))
+			serve_client ();
+
+		if (options.textfile != NULL && metric_now_ns () >= next_write) {
+			write_textfile ();
+			next_write = metric_now_ns () + (uint64_t)options.interval_ms * 1000000;
+		}
+	}
+
+	/* The last values are not lost on a clean exit */
+	if (options.textfile != NULL)
+		write_textfile ();
+	return NULL;
+}
+
+void
+metrics_init (const metrics_options *opts)
+{
+	if (running || (opts->socket == NULL && opts->textfile == NULL))
+		return;
+
+	options = *opts;
+	if (options.interval_ms <= 0)
+		options.interval_ms = 15000;
+	if (options.socket != NULL)
+		listen_fd = listen_unix (options.socket);
+	if (listen_fd < 0 && options.textfile == NULL)
+		return;
+
+	if (pipe (wake_pipe) != 0) {
+		fprintf (stderr, "Error: metrics: %s\n", strerror (errno));
+		return;
+	}
+	running = pthread_create (&exporter, NULL, metrics_thread, NULL) == 0;
+	if (running)
+		atexit (metrics_shutdown);
+}
+
+void
+metrics_shutdown (void)
+{
+	if (!running)
+		return;
+	running = false;
+
+	write (wake_pipe[1], "", 1);
+	pthread_join (exporter, NULL);
+	close (wake_pipe[0]);
+	close (wake_pipe[1]);
+	if (listen_fd >= 0) {
+		close (listen_fd);
+		unlink (options.socket);
+		listen_fd = -1;
+	}
+}
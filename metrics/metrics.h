@@ -0,0 +1,66 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Metrics registry
+ * Counters, gauges and latency histograms, exported in the Prometheus
+ * text format on a Unix socket and to a periodically rewritten file.
+ *
+ * Recording never locks: every value is spread over per-thread shards
+ * of atomics that are only summed up on export. Looking up a metric is
+ * lock free too, but hot paths should keep the returned pointer, it
+ * stays valid until exit.
+ *
+ * A family holds one series per label value. Past METRICS_MAX_SERIES
+ * values new ones are all counted under the value "other".
+ */
+
+#define METRICS_MAX_SERIES 256
+
+typedef struct metric metric;
+
+typedef struct metrics_options
+{
+	/* NULL turns the socket off */
+	const char *socket;
+	/* NULL turns the file off, it is replaced atomically */
+	const char *textfile;
+	int interval_ms;
+} metrics_options;
+
+metric *
+metric_counter (const char *name, const char *help);
+metric *
+metric_counter_labeled (const char *name, const char *help, const char *label, const char *value);
+metric *
+metric_gauge (const char *name, const char *help);
+metric *
+metric_histogram (const char *name, const char *help);
+metric *
+metric_histogram_labeled (const char *name, const char *help, const char *label, const char *value);
+
+void
+metric_add (metric *m, uint64_t n);
+#define metric_inc(m) metric_add ((m), 1)
+void
+metric_gauge_add (metric *m, int64_t n);
+/* Records a duration, exported in seconds */
+void
+metric_observe_ns (metric *m, uint64_t ns);
+/* Monotonic clock for metric_observe_ns */
+uint64_t
+metric_now_ns (void);
+
+/* Starts the export thread, metrics are recorded without it too */
+void
+metrics_init (const metrics_options *opts);
+void
+metrics_shutdown (void);
+/* Writes every metric in the Prometheus text format */
+void
+metrics_write (FILE *f);
+
+#endif /* METRICS_H */
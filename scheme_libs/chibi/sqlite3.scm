@@ -5,29 +5,81 @@
 
 ;;> \section{Simple interface}
 
+;; The cached statement of db for sql, pinned for as long as it is
+;; referenced.  checkout? marks it in use until %sqlite3-stmt-checkin.
+;; #f when it is in use already or can not be prepared.
+
+(define (sqlite3-cache-ref db sql checkout?)
+  (let ((pin (%sqlite3-cache-pin db sql checkout?)))
+    (and pin (%sqlite3-stmt-borrow (%sqlite3-pin-stmt pin) pin))))
+
+;;> Returns the cached prepared statement of \var{db} for the SQL
+;;> string \var{sql}, preparing and caching it on first use.  When the
+;;> cached statement is in use, e.g. by a fold over the same query that
+;;> is still running, a fresh statement is returned instead.  The
+;;> statement stays valid for as long as it is referenced, and must not
+;;> be finalized by the caller.
+
+(define (sqlite3-prepare-cached db sql)
+  (or (sqlite3-cache-ref db sql #f)
+      (sqlite3-prepare db sql)))
+
+;;> Returns a prepared statement for \var{stmt}, which can be a
+;;> prepared statement, a string to parse into a statement, or an SSQL
+;;> sexp.  Strings and SSQL are looked up in the statement cache of
+;;> \var{db}, so repeated queries are only parsed once.
+
+(define (sqlite3-statement db stmt)
+  (let ((stmt* (cond ((string? stmt)
+                      (sqlite3-prepare-cached db stmt))
+                     ((pair? stmt)
+                      (sqlite3-prepare-cached db (ssql->sql stmt)))
+                     (else stmt))))
+    (if (not stmt*)
+        (error "not a sqlite3 statement" stmt (sqlite3-errmsg db)))
+    stmt*))
+
+;; Like sqlite3-statement, but checks the cached statement out so
+;; nothing else steps it until %sqlite3-stmt-checkin.
+
+(define (sqlite3-checkout db stmt)
+  (let* ((sql (cond ((string? stmt) stmt)
+                    ((pair? stmt) (ssql->sql stmt))
+                    (else #f)))
+         (stmt* (if sql
+                    (or (sqlite3-cache-ref db sql #t) (sqlite3-prepare db sql))
+                    stmt)))
+    (if (not stmt*)
+        (error "not a sqlite3 statement" stmt (sqlite3-errmsg db)))
+    stmt*))
+
+(define (sqlite3-start stmt vals)
+  (sqlite3-reset stmt)
+  (sqlite3-clear-bindings stmt)
+  (if (pair? vals)
+      (apply sqlite3-bind-all stmt vals)))
+
 ;;> The fundamental sqlite3 result iterator.  Executes \var{stmt-obj}
 ;;> on \var{db}, binding \var{vals} first if given.  Then iterates on
 ;;> the results, each time calling \var{kons} with two arguments,
 ;;> \var{stmt} and the current accumulator, which starts as
 ;;> \var{knil}.  \var{stmt-obj} can be a prepared statement, a string
-;;> to parse into a statement, or an SSQL sexp.
+;;> to parse into a statement, or an SSQL sexp.  The statement is reset
+;;> however the fold exits, so an error in \var{kons} does not leave a
+;;> read transaction open.
 
 (define (sqlite3-fold kons knil db stmt . vals)
-  (let ((stmt* (cond ((string? stmt)
-                      (sqlite3-prepare db stmt))
-                     ((pair? stmt)
-                      (sqlite3-prepare db (ssql->sql stmt)))
-                     (else stmt))))
-    (if (not stmt*)
-        (error "not a sqlite3 statement" stmt (sqlite3-errmsg db)))
-    (sqlite3-reset stmt*)
-    (if (pair? vals)
-        (apply sqlite3-bind-all stmt* vals))
-    (let lp ((acc knil))
-      (let ((res (sqlite3-step stmt*)))
-        (if (or (eqv? res SQLITE_OK) (eqv? res SQLITE_DONE))
-            acc
-            (lp (kons stmt* acc)))))))
+  (let ((stmt* (sqlite3-checkout db stmt)))
+    (dynamic-wind
+     (lambda () #f)
+     (lambda ()
+       (sqlite3-start stmt* vals)
+       (let lp ((acc knil))
+         (let ((res (sqlite3-step stmt*)))
+           (if (or (eqv? res SQLITE_OK) (eqv? res SQLITE_DONE))
+               acc
+               (lp (kons stmt* acc))))))
+     (lambda () (%sqlite3-stmt-checkin stmt*)))))
 
 ;;> Executes \var{stmt} on \var{db}, binding \var{vals} first if
 ;;> given.  Returns all results as a list, where each row is a vector.
@@ -44,14 +96,78 @@
   (apply sqlite3-fold (lambda (stmt acc) acc) (if #f #f) db stmt vals))
 
 ;;> Executes \var{stmt} on \var{db}, binding \var{vals} first if
-;;> given.  Returns the first column of the first result.
-
-(define sqlite3-get
-  (let* ((first (list 'first))
-         (get-first
-          (lambda (stmt acc) (if (eq? acc first) (sqlite3-column stmt 0) acc))))
-    (lambda (db stmt . vals)
-      (apply sqlite3-fold get-first first db stmt vals))))
+;;> given.  Returns the first column of the first result, or #f if
+;;> there are no results.  Only the first row is stepped.
+
+(define (sqlite3-get db stmt . vals)
+  (let ((cursor (apply sqlite3-cursor db stmt vals)))
+    (dynamic-wind
+     (lambda () #f)
+     (lambda ()
+       (and (sqlite3-cursor-next! cursor)
+            (sqlite3-cursor-ref cursor 0)))
+     (lambda () (sqlite3-cursor-close cursor)))))
+
+;;> \section{Cursors}
+
+;;> A cursor steps through the results of a statement one row at a
+;;> time.  Columns are only converted to Scheme values when asked for
+;;> with \scheme{sqlite3-cursor-ref}, and no row is kept after the
+;;> cursor moves on.  A cursor holds its statement until the results
+;;> are exhausted or it is closed, so one that is stopped early should
+;;> be closed.
+
+(define-record-type Sqlite3-Cursor
+  (make-sqlite3-cursor stmt row? open?)
+  sqlite3-cursor?
+  (stmt sqlite3-cursor-stmt)
+  (row? sqlite3-cursor-row? sqlite3-cursor-row?-set!)
+  (open? sqlite3-cursor-open? sqlite3-cursor-open?-set!))
+
+;;> Executes \var{stmt} on \var{db}, binding \var{vals} first if
+;;> given, and returns a cursor positioned before the first result.
+
+(define (sqlite3-cursor db stmt . vals)
+  (let ((stmt* (sqlite3-checkout db stmt)))
+    (guard (exn (#t (%sqlite3-stmt-checkin stmt*) (raise exn)))
+      (sqlite3-start stmt* vals))
+    (make-sqlite3-cursor stmt* #f #t)))
+
+;;> Advances \var{cursor} to the next result.  Returns #t if there is
+;;> a current row, or #f once the results are exhausted, which closes
+;;> the cursor.
+
+(define (sqlite3-cursor-next! cursor)
+  (if (not (sqlite3-cursor-open? cursor))
+      #f
+      (let ((res (sqlite3-step (sqlite3-cursor-stmt cursor))))
+        (sqlite3-cursor-row?-set! cursor (eqv? res SQLITE_ROW))
+        (if (not (sqlite3-cursor-row? cursor))
+            (sqlite3-cursor-close cursor))
+        (sqlite3-cursor-row? cursor))))
+
+;;> Returns the \var{col}th column of the current row of \var{cursor}.
+
+(define (sqlite3-cursor-ref cursor col)
+  (if (not (sqlite3-cursor-row? cursor))
+      (error "sqlite3 cursor has no current row" cursor))
+  (sqlite3-column (sqlite3-cursor-stmt cursor) col))
+
+;;> Returns the current row of \var{cursor} as a vector.
+
+(define (sqlite3-cursor-row cursor)
+  (if (not (sqlite3-cursor-row? cursor))
+      (error "sqlite3 cursor has no current row" cursor))
+  (sqlite3-columns (sqlite3-cursor-stmt cursor)))
+
+;;> Stops \var{cursor} early, resetting its statement so the cache
+;;> can hand it out again.  Closing twice is harmless.
+
+(define (sqlite3-cursor-close cursor)
+  (sqlite3-cursor-row?-set! cursor #f)
+  (when (sqlite3-cursor-open? cursor)
+    (sqlite3-cursor-open?-set! cursor #f)
+    (%sqlite3-stmt-checkin (sqlite3-cursor-stmt cursor))))
 
 ;;> Example:
 ;;>
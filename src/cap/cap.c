@@ -0,0 +1,299 @@
+#include <glib.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cap.h"
+#include "config/config.h"
+#include "irc/hooks.h"
+#include "irc/irc.h"
+#include "log/log.h"
+#include "sasl.h"
+
+/*
+ * Servers handle lines in order, so the REQ sent with NICK and USER is
+ * answered before registration would finish, and the AUTHENTICATE after
+ * it starts SASL as soon as the server enabled it, without waiting for
+ * the LS reply in between. CAP END follows the ACK, or the end of SASL.
+ *
+ * REQ is all or nothing. When it is refused, the capabilities the LS
+ * reply listed, which arrives first, are requested again, and the
+ * answers to the AUTHENTICATE sent along the refused REQ are ignored.
+ */
+
+/* Capabilities circ uses, sasl only when it is configured */
+static const char *const cap_names[] = {
+	"sasl",
+	"message-tags",
+	"server-time",
+	"batch",
+	"multi-prefix",
+	"labeled-response",
+	"away-notify",
+};
+#define CAP_COUNT G_N_ELEMENTS (cap_names)
+#define CAP_BIT(i) (1u << (i))
+#define CAP_SASL CAP_BIT (0)
+
+static struct
+{
+	/* Sets of CAP_BITs */
+	unsigned wanted;
+	unsigned requested;
+	unsigned available;
+	unsigned enabled;
+	/* From CAP LS, e.g. sasl=PLAIN,EXTERNAL */
+	char *values[CAP_COUNT];
+	/* A refused REQ was sent again */
+	bool retried;
+	/* CAP END sent, or registered without it */
+	bool ended;
+} cap;
+
+static void
+cap_preinit_hook (const irc_server *s, const irc_msg *msg);
+static void
+cap_hook (const irc_server *s, const irc_msg *msg);
+static void
+sasl_auth_hook (const irc_server *s, const irc_msg *msg);
+static void
+sasl_done_hook (const irc_server *s, const irc_msg *msg);
+static void
+sasl_error_hook (const irc_server *s, const irc_msg *msg);
+static void
+registered_hook (const irc_server *s, const irc_msg *msg);
+
+void
+cap_init (void)
+{
+	add_hook ("PREINIT", cap_preinit_hook);
+	add_hook ("CAP", cap_hook);
+	add_hook ("AUTHENTICATE", sasl_auth_hook);
+	add_hook ("903", sasl_done_hook);
+	add_hook ("907", sasl_done_hook);
+	add_hook ("902", sasl_error_hook);
+	add_hook ("904", sasl_error_hook);
+	add_hook ("905", sasl_error_hook);
+	add_hook ("906", sasl_error_hook);
+	add_hook ("001", registered_hook);
+}
+
+static int
+cap_index (const char *name, size_t len)
+{
+	for (size_t i = 0; i < CAP_COUNT; i++)
+		if (strlen (cap_names[i]) == len && strncmp (cap_names[i], name, len) == 0)
+			return i;
+	return -1;
+}
+
+bool
+cap_enabled (const char *name)
+{
+	int i = cap_index (name, strlen (name));
+	return i >= 0 && (cap.enabled & CAP_BIT (i));
+}
+
+const char *
+cap_value (const char *name)
+{
+	int i = cap_index (name, strlen (name));
+	return i >= 0 ? cap.values[i] : NULL;
+}
+
+/*
+ * The capabilities in a CAP list we know of. With values, keeps what
+ * follows the = of each, with removed, the ones prefixed by -
+ */
+static unsigned
+parse_caps (const char *list, bool values, bool removed)
+{
+	unsigned caps = 0;
+	char **names = g_strsplit (list, " ", -1);
+
+	for (char **name = names; *name != NULL; name++) {
+		const char *n = *name;
+		if ((*n == '-') != removed)
+			continue;
+		if (*n == '-')
+			n++;
+
+		size_t len = strcspn (n, "=");
+		int i = cap_index (n, len);
+		if (i < 0)
+			continue;
+		caps |= CAP_BIT (i);
+		if (values && n[len] == '=') {
+			g_free (cap.values[i]);
+			cap.values[i] = g_strdup (n + len + 1);
+		}
+	}
+
+	g_strfreev (names);
+	return caps;
+}
+
+static void
+append_req (const irc_server *s, GString *out, unsigned caps)
+{
+	const char *sep = "";
+
+	g_string_append (out, "CAP REQ :");
+	for (size_t i = 0; i < CAP_COUNT; i++)
+		if (caps & CAP_BIT (i)) {
+			g_string_append_printf (out, "%s%s", sep, cap_names[i]);
+			sep = " ";
+		}
+	g_string_append (out, "\r\n");
+
+	/* Pipelined, the server enables sasl before it gets here */
+	if (caps & CAP_SASL)
+		g_string_append_printf (out, "AUTHENTICATE %s\r\n", sasl_start (s));
+}
+
+static void
+cap_end (const irc_server *s)
+{
+	if (cap.ended)
+		return;
+
+	GString *names = g_string_new (NULL);
+	for (size_t i = 0; i < CAP_COUNT; i++)
+		if (cap.enabled & CAP_BIT (i))
+			g_string_append_printf (names, " %s", cap_names[i]);
+	log_info ("Capabilities:%s\n", names->len > 0 ? names->str : " none");
+	g_string_free (names, true);
+
+	irc_push_string (s, "CAP END\r\n");
+	cap.ended = true;
+}
+
+static void
+cap_preinit_hook (const irc_server *s, const irc_msg *msg)
+{
+	irc_user *user = s->user;
+
+	for (size_t i = 0; i < CAP_COUNT; i++) {
+		g_free (cap.values[i]);
+		cap.values[i] = NULL;
+	}
+	cap.wanted = CAP_BIT (CAP_COUNT) - 1;
+	if (!user->sasl_enabled)
+		cap.wanted &= ~CAP_SASL;
+	cap.requested = cap.wanted;
+	cap.available = cap.enabled = 0;
+	cap.retried = cap.ended = false;
+
+	log_debug ("Registering client...\n");
+
+	/* One write, registration waits for CAP END */
+	GString *out = g_string_new ("CAP LS 302\r\n");
+	g_string_append_printf (out, "NICK %s\r\n", user->nickname);
+	g_string_append_printf (out, "USER %s 0 * :%s\r\n", user->ident, user->realname);
+	append_req (s, out, cap.requested);
+	irc_push_string (s, out->str);
+	g_string_free (out, true);
+}
+
+static void
+cap_nak (const irc_server *s)
+{
+	unsigned caps = cap.wanted & cap.available;
+
+	if ((cap.wanted & CAP_SASL) && !(cap.available & CAP_SASL)) {
+		log_error ("Server does not offer SASL\n");
+		raise (SIGINT);
+		return;
+	}
+	if (cap.retried || caps == 0 || caps == cap.requested) {
+		cap_end (s);
+		return;
+	}
+
+	cap.retried = true;
+	cap.requested = caps;
+	GString *out = g_string_new (NULL);
+	append_req (s, out, caps);
+	irc_push_string (s, out->str);
+	g_string_free (out, true);
+}
+
+/* CAP <nick> LS|ACK|NAK|NEW|DEL [*] :<caps> */
+static void
+cap_hook (const irc_server *s, const irc_msg *msg)
+{
+	if (msg->params == NULL || msg->params->len < 3)
+		return;
+
+	const char *sub = msg->params->params[1];
+	const char *list = msg->params->params[msg->params->len - 1];
+
+	if (strcmp (sub, "LS") == 0) {
+		/* Multiline replies have a * before the list */
+		cap.available |= parse_caps (list, true, false);
+	} else if (strcmp (sub, "ACK") == 0) {
+		unsigned acked = parse_caps (list, false, false);
+		cap.enabled |= acked;
+		cap.enabled &= ~parse_caps (list, false, true);
+		/* With sasl, CAP END waits for the end of the AUTHENTICATE */
+		if (!(acked & CAP_SASL))
+			cap_end (s);
+	} else if (strcmp (sub, "NAK") == 0) {
+		if (!cap.ended)
+			cap_nak (s);
+	} else if (strcmp (sub, "NEW") == 0) {
+		unsigned fresh = parse_caps (list, true, false);
+		cap.available |= fresh;
+		/* Too late for SASL once registered */
+		fresh &= cap.wanted & ~cap.enabled & ~CAP_SASL;
+		if (fresh != 0) {
+			GString *out = g_string_new (NULL);
+			append_req (s, out, fresh);
+			irc_push_string (s, out->str);
+			g_string_free (out, true);
+		}
+	} else if (strcmp (sub, "DEL") == 0) {
+		unsigned gone = parse_caps (list, false, false);
+		cap.available &= ~gone;
+		cap.enabled &= ~gone;
+	}
+}
+
+/* AUTHENTICATE <data> continues the exchange, see sasl.c */
+static void
+sasl_auth_hook (const irc_server *s, const irc_msg *msg)
+{
+	/* The answer to an AUTHENTICATE sent along a refused REQ */
+	if (!(cap.enabled & CAP_SASL) || cap.ended)
+		return;
+	if (msg->params == NULL || msg->params->len < 1)
+		return;
+
+	sasl_step (s, msg->params->params[0]);
+}
+
+/* 903 logged in, or 907 already */
+static void
+sasl_done_hook (const irc_server *s, const irc_msg *msg)
+{
+	cap_end (s);
+}
+
+/* 902 nick locked, 904 failed, 905 too long or 906 aborted */
+static void
+sasl_error_hook (const irc_server *s, const irc_msg *msg)
+{
+	if (!(cap.enabled & CAP_SASL) || cap.ended)
+		return;
+
+	log_error ("Error during SASL Auth\n");
+	raise (SIGINT);
+}
+
+/* Servers without CAP register right away */
+static void
+registered_hook (const irc_server *s, const irc_msg *msg)
+{
+	cap.ended = true;
+}
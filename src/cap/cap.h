@@ -0,0 +1,21 @@
+#ifndef CAP_H
+#define CAP_H
+
+#include <stdbool.h>
+
+/*
+ * Registration with IRCv3 capability negotiation and SASL
+ * The PREINIT hook sends CAP LS 302, NICK, USER, one CAP REQ for every
+ * capability circ can use and, with SASL, AUTHENTICATE in one write.
+ */
+void
+cap_init (void);
+
+/* Whether the server acknowledged capability name */
+bool
+cap_enabled (const char *name);
+/* Value of name in the CAP LS reply, e.g. the SASL mechanisms, or NULL */
+const char *
+cap_value (const char *name);
+
+#endif /* CAP_H */
@@ -0,0 +1,361 @@
+#include <glib.h>
+#include <gnutls/crypto.h>
+#include <gnutls/gnutls.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sasl.h"
+#include "irc/base64.h"
+#include "log/log.h"
+
+/* AUTHENTICATE carries at most this much base64 per line */
+#define SASL_CHUNK 400
+#define SCRAM_NONCE_SIZE 18
+/* Salts and iteration counts remembered, one per server is plenty */
+#define SCRAM_CACHE_SIZE 8
+/* RFC 7677 asks for at least 4096 */
+#define SCRAM_MIN_ITERATIONS 4096
+/* PBKDF2 runs on the loop thread, a server can't make it take longer */
+#define SCRAM_MAX_ITERATIONS (1 << 20)
+
+typedef enum sasl_mech
+{
+	SASL_PLAIN,
+	SASL_EXTERNAL,
+	SASL_SCRAM_SHA_256,
+	SASL_MECH_COUNT
+} sasl_mech;
+
+static const char *const sasl_mech_names[] = {
+	"PLAIN",
+	"EXTERNAL",
+	"SCRAM-SHA-256",
+};
+
+typedef struct scram_cache_entry
+{
+	unsigned char *salt;
+	size_t salt_len;
+	unsigned iterations;
+	/* Of the password it was derived from */
+	unsigned char password[SCRAM_HASH_SIZE];
+	unsigned char salted[SCRAM_HASH_SIZE];
+} scram_cache_entry;
+
+static struct
+{
+	sasl_mech mech;
+	int step;
+	/* Server message so far, long ones come in SASL_CHUNK pieces */
+	GString *in;
+	/* SCRAM */
+	char *client_first_bare;
+	char *nonce;
+	unsigned char server_signature[SCRAM_HASH_SIZE];
+} sasl;
+
+static scram_cache_entry scram_cache[SCRAM_CACHE_SIZE];
+static unsigned scram_cache_next;
+
+static void
+sasl_send (const irc_server *s, const void *data, size_t len);
+static void
+sasl_fail (const irc_server *s, const char *why);
+static void
+scram_step (const irc_server *s, const char *msg);
+
+static int
+sasl_mech_from_name (const char *name)
+{
+	for (int i = 0; i < SASL_MECH_COUNT; i++)
+		if (strcmp (sasl_mech_names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+bool
+sasl_mechanism_supported (const char *name)
+{
+	return sasl_mech_from_name (name) >= 0;
+}
+
+const char *
+sasl_start (const irc_server *s)
+{
+	int mech = sasl_mech_from_name (s->user->sasl_mechanism);
+
+	sasl.mech = mech < 0 ? SASL_PLAIN : mech;
+	sasl.step = 0;
+	if (sasl.in == NULL)
+		sasl.in = g_string_new (NULL);
+	g_string_truncate (sasl.in, 0);
+	g_free (sasl.client_first_bare);
+	g_free (sasl.nonce);
+	sasl.client_first_bare = sasl.nonce = NULL;
+
+	return sasl_mech_names[sasl.mech];
+}
+
+void
+sasl_step (const irc_server *s, const char *data)
+{
+	size_t len = strlen (data);
+
+	/* A full chunk means more follow, + ends them or is empty */
+	if (strcmp (data, "+") != 0)
+		g_string_append (sasl.in, data);
+	if (len == SASL_CHUNK)
+		return;
+
+	size_t msg_len = 0;
+	unsigned char *msg = base64_decode (sasl.in->str, sasl.in->len, &msg_len);
+	g_string_truncate (sasl.in, 0);
+	if (msg == NULL) {
+		sasl_fail (s, "server sent invalid base64");
+		return;
+	}
+
+	switch (sasl.mech) {
+	case SASL_PLAIN: {
+		/* authzid \0 authcid \0 password, authzid empty */
+		const char *user = s->user->sasl_user;
+		const char *pass = s->user->sasl_pass;
+		size_t user_len = strlen (user), pass_len = strlen (pass);
+		size_t n = user_len + pass_len + 2;
+		char *payload = malloc (n);
+		payload[0] = '\0';
+		memcpy (payload + 1, user, user_len + 1);
+		memcpy (payload + user_len + 2, pass, pass_len);
+		sasl_send (s, payload, n);
+		memset (payload, 0, n);
+		free (payload);
+		break;
+	}
+	case SASL_EXTERNAL:
+		/* The identity is the client certificate */
+		sasl_send (s, "", 0);
+		break;
+	case SASL_SCRAM_SHA_256:
+		scram_step (s, (const char *)msg);
+		break;
+	default:
+		break;
+	}
+	free (msg);
+}
+
+/* AUTHENTICATE lines for data, in one write */
+static void
+sasl_send (const irc_server *s, const void *data, size_t len)
+{
+	char *encoded = base64_encode (data, len);
+	size_t encoded_len = strlen (encoded);
+	GString *out = g_string_sized_new (encoded_len + encoded_len / SASL_CHUNK * 16 + 32);
+
+	for (size_t off = 0; off < encoded_len; off += SASL_CHUNK)
+		g_string_append_printf (out, "AUTHENTICATE %.*s\r\n", SASL_CHUNK, encoded + off);
+	/* Empty, or a last chunk that looks like more would follow */
+	if (encoded_len % SASL_CHUNK == 0)
+		g_string_append (out, "AUTHENTICATE +\r\n");
+
+	irc_push_string (s, out->str);
+	g_string_free (out, true);
+	free (encoded);
+}
+
+static void
+sasl_fail (const irc_server *s, const char *why)
+{
+	log_error ("SASL %s: %s\n", sasl_mech_names[sasl.mech], why);
+	irc_push_string (s, "AUTHENTICATE *\r\n");
+	raise (SIGINT);
+}
+
+/* , and = in a SCRAM username are escaped */
+static char *
+scram_escape (const char *name)
+{
+	GString *out = g_string_new (NULL);
+	for (const char *c = name; *c != '\0'; c++)
+		if (*c == ',')
+			g_string_append (out, "=2C");
+		else if (*c == '=')
+			g_string_append (out, "=3D");
+		else
+			g_string_append_c (out, *c);
+	return g_string_free (out, false);
+}
+
+/* Value of attribute name in a SCRAM message, e.g. the s of s=... */
+static char *
+scram_attr (const char *msg, char name)
+{
+	for (const char *a = msg; a != NULL; a = strchr (a, ',')) {
+		if (*a == ',')
+			a++;
+		if (a[0] == name && a[1] == '=')
+			return g_strndup (a + 2, strcspn (a + 2, ","));
+	}
+	return NULL;
+}
+
+/* PBKDF2-HMAC-SHA-256 of the password, or the cached result */
+static int
+scram_salted_password (const char *pass, const unsigned char *salt, size_t salt_len, unsigned iterations, unsigned char out[SCRAM_HASH_SIZE])
+{
+	unsigned char digest[SCRAM_HASH_SIZE];
+	int ret = gnutls_hash_fast (GNUTLS_DIG_SHA256, pass, strlen (pass), digest);
+	if (ret < 0)
+		return ret;
+
+	for (int i = 0; i < SCRAM_CACHE_SIZE; i++) {
+		scram_cache_entry *e = &scram_cache[i];
+		if (e->salt != NULL && e->iterations == iterations && e->salt_len == salt_len &&
+		    memcmp (e->salt, salt, salt_len) == 0 && memcmp (e->password, digest, sizeof (digest)) == 0) {
+			memcpy (out, e->salted, SCRAM_HASH_SIZE);
+			return 0;
+		}
+	}
+
+	gnutls_datum_t key = { (unsigned char *)pass, strlen (pass) };
+	gnutls_datum_t salt_datum = { (unsigned char *)salt, salt_len };
+	ret = gnutls_pbkdf2 (GNUTLS_MAC_SHA256, &key, &salt_datum, iterations, out, SCRAM_HASH_SIZE);
+	if (ret < 0)
+		return ret;
+
+	scram_cache_entry *e = &scram_cache[scram_cache_next++ % SCRAM_CACHE_SIZE];
+	free (e->salt);
+	e->salt = malloc (salt_len);
+	memcpy (e->salt, salt, salt_len);
+	e->salt_len = salt_len;
+	e->iterations = iterations;
+	memcpy (e->password, digest, sizeof (digest));
+	memcpy (e->salted, out, SCRAM_HASH_SIZE);
+	return 0;
+}
+
+/* Client and server proofs of auth_message, see RFC 5802 */
+static int
+scram_proofs (const unsigned char salted[SCRAM_HASH_SIZE], const char *auth_message, unsigned char proof[SCRAM_HASH_SIZE], unsigned char server_signature[SCRAM_HASH_SIZE])
+{
+	unsigned char client_key[SCRAM_HASH_SIZE], stored_key[SCRAM_HASH_SIZE];
+	unsigned char signature[SCRAM_HASH_SIZE], server_key[SCRAM_HASH_SIZE];
+	size_t len = strlen (auth_message);
+	int ret;
+
+	if ((ret = gnutls_hmac_fast (GNUTLS_MAC_SHA256, salted, SCRAM_HASH_SIZE, "Client Key", 10, client_key)) >= 0 &&
+	    (ret = gnutls_hash_fast (GNUTLS_DIG_SHA256, client_key, sizeof (client_key), stored_key)) >= 0 &&
+	    (ret = gnutls_hmac_fast (GNUTLS_MAC_SHA256, stored_key, sizeof (stored_key), auth_message, len, signature)) >= 0 &&
+	    (ret = gnutls_hmac_fast (GNUTLS_MAC_SHA256, salted, SCRAM_HASH_SIZE, "Server Key", 10, server_key)) >= 0 &&
+	    (ret = gnutls_hmac_fast (GNUTLS_MAC_SHA256, server_key, sizeof (server_key), auth_message, len, server_signature)) >= 0) {
+		for (size_t i = 0; i < SCRAM_HASH_SIZE; i++)
+			proof[i] = client_key[i] ^ signature[i];
+	}
+
+	memset (client_key, 0, sizeof (client_key));
+	return ret < 0 ? ret : 0;
+}
+
+char *
+scram_client_final (const char *pass, const char *client_first_bare, const char *server_first, unsigned char server_signature[SCRAM_HASH_SIZE], const char **why)
+{
+	char *client_nonce = scram_attr (client_first_bare, 'r');
+	char *nonce = scram_attr (server_first, 'r');
+	char *salt64 = scram_attr (server_first, 's');
+	char *iter = scram_attr (server_first, 'i');
+	char *end = NULL;
+	unsigned long iterations = iter != NULL ? strtoul (iter, &end, 10) : 0;
+	size_t salt_len = 0;
+	unsigned char *salt = salt64 != NULL ? base64_decode (salt64, strlen (salt64), &salt_len) : NULL;
+	char *final = NULL;
+
+	*why = NULL;
+	if (client_nonce == NULL || nonce == NULL || salt == NULL || iterations == 0 || *end != '\0' ||
+	    strncmp (nonce, client_nonce, strlen (client_nonce)) != 0) {
+		*why = "bad server-first-message";
+	} else if (iterations > SCRAM_MAX_ITERATIONS) {
+		*why = "too many iterations";
+	} else {
+		if (iterations < SCRAM_MIN_ITERATIONS)
+			log_info ("SASL SCRAM-SHA-256: only %lu iterations\n", iterations);
+
+		unsigned char salted[SCRAM_HASH_SIZE], proof[SCRAM_HASH_SIZE];
+		/* biws is n,, in base64 */
+		char *final_bare = g_strdup_printf ("c=biws,r=%s", nonce);
+		char *auth_message = g_strdup_printf ("%s,%s,%s", client_first_bare, server_first, final_bare);
+
+		if (scram_salted_password (pass, salt, salt_len, iterations, salted) < 0) {
+			*why = "PBKDF2 failed";
+		} else if (scram_proofs (salted, auth_message, proof, server_signature) < 0) {
+			*why = "HMAC failed";
+		} else {
+			char *proof64 = base64_encode (proof, sizeof (proof));
+			final = g_strdup_printf ("%s,p=%s", final_bare, proof64);
+			free (proof64);
+		}
+		memset (salted, 0, sizeof (salted));
+		memset (proof, 0, sizeof (proof));
+		g_free (auth_message);
+		g_free (final_bare);
+	}
+
+	g_free (client_nonce);
+	g_free (nonce);
+	g_free (salt64);
+	g_free (iter);
+	free (salt);
+	return final;
+}
+
+static void
+scram_step (const irc_server *s, const char *msg)
+{
+	switch (sasl.step++) {
+	case 0: {
+		unsigned char nonce[SCRAM_NONCE_SIZE];
+		gnutls_rnd (GNUTLS_RND_NONCE, nonce, sizeof (nonce));
+		sasl.nonce = base64_encode (nonce, sizeof (nonce));
+
+		char *user = scram_escape (s->user->sasl_user);
+		sasl.client_first_bare = g_strdup_printf ("n=%s,r=%s", user, sasl.nonce);
+		char *first = g_strdup_printf ("n,,%s", sasl.client_first_bare);
+		sasl_send (s, first, strlen (first));
+		g_free (first);
+		g_free (user);
+		break;
+	}
+	case 1: {
+		const char *why;
+		char *final = scram_client_final (s->user->sasl_pass, sasl.client_first_bare, msg, sasl.server_signature, &why);
+		if (final == NULL) {
+			sasl_fail (s, why);
+			break;
+		}
+		sasl_send (s, final, strlen (final));
+		g_free (final);
+		break;
+	}
+	case 2: {
+		/* The server proves it knows the password too */
+		char *verifier64 = scram_attr (msg, 'v');
+		size_t len = 0;
+		unsigned char *verifier = verifier64 != NULL ? base64_decode (verifier64, strlen (verifier64), &len) : NULL;
+		unsigned char diff = len != SCRAM_HASH_SIZE;
+		for (size_t i = 0; verifier != NULL && i < len && i < SCRAM_HASH_SIZE; i++)
+			diff |= verifier[i] ^ sasl.server_signature[i];
+
+		if (verifier == NULL || diff != 0)
+			sasl_fail (s, "server signature does not match");
+		else
+			sasl_send (s, "", 0);
+		free (verifier);
+		g_free (verifier64);
+		break;
+	}
+	default:
+		sasl_fail (s, "unexpected message");
+		break;
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef SASL_H
+#define SASL_H
+
+#include <stdbool.h>
+
+#include "irc/irc.h"
+
+#define SCRAM_HASH_SIZE 32
+
+/*
+ * Client side of the SASL mechanisms: PLAIN, EXTERNAL with the TLS
+ * client certificate, and SCRAM-SHA-256, which never sends the password
+ * and checks that the server knows it too. The salted password SCRAM
+ * derives is cached per salt and iteration count, so reconnecting does
+ * not run PBKDF2 again.
+ */
+
+bool
+sasl_mechanism_supported (const char *name);
+/* Starts an exchange with the configured mechanism, returns its name */
+const char *
+sasl_start (const irc_server *s);
+/* Answers the parameter of an AUTHENTICATE from the server */
+void
+sasl_step (const irc_server *s, const char *data);
+
+/*
+ * SCRAM-SHA-256 as in RFC 5802, without channel binding. Returns the
+ * client-final-message answering server_first and stores the server
+ * signature to expect, or returns NULL and sets *why.
+ */
+char *
+scram_client_final (const char *pass, const char *client_first_bare, const char *server_first, unsigned char server_signature[SCRAM_HASH_SIZE], const char **why);
+
+#endif /* SASL_H */
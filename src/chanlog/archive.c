@@ -0,0 +1,678 @@
+#define LOG_SUBSYS LOG_CHANLOG
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "chanlog.h"
+#include "log/log.h"
+
+/*
+ * Archive file format, all integers little endian:
+ *
+ *   header   magic "CIRCARC1", u32 version, u32 blocks, u64 rows,
+ *            u64 dictionary offset, u64 index offset
+ *   blocks   zlib compressed, up to ARCHIVE_BLOCK_ROWS rows each
+ *   dict     u32 count, then count strings as varint length + bytes
+ *   index    per block u64 offset, u32 compressed size, u32 raw size,
+ *            u32 rows, u32 unused, i64 first id, i64 last id,
+ *            i64 first time, i64 last time
+ *
+ * A block holds its rows column by column: ids and unix times as a
+ * first value then zigzag varint deltas, server, channel and nick as
+ * varint dictionary indexes, the action flags as a bitmap and last the
+ * messages as varint length + bytes.
+ */
+
+#define ARCHIVE_MAGIC "CIRCARC1"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BLOCK_ROWS 4096
+#define ARCHIVE_HEADER_SIZE 40
+#define ARCHIVE_INDEX_ENTRY_SIZE 56
+
+/* One batch of the export, a block worth of rows after the id ?1 */
+#define ARCHIVE_EXPORT                                                   \
+	"SELECT id, time, server, channel, nick, message, action FROM %s " \
+	"WHERE id > ?1 ORDER BY id LIMIT ?2"
+
+typedef struct archive_block
+{
+	uint64_t offset;
+	uint32_t compressed_size;
+	uint32_t raw_size;
+	uint32_t rows;
+	int64_t first_id;
+	int64_t last_id;
+	int64_t first_time;
+	int64_t last_time;
+} archive_block;
+
+struct chanlog_archive
+{
+	const uint8_t *map;
+	size_t size;
+	uint32_t n_blocks;
+	archive_block *blocks;
+	uint32_t n_dict;
+	char **dict;
+};
+
+/* Columns of the block being built */
+typedef struct block_builder
+{
+	GByteArray *ids;
+	GByteArray *times;
+	GByteArray *servers;
+	GByteArray *channels;
+	GByteArray *nicks;
+	GByteArray *actions;
+	GByteArray *messages;
+	archive_block info;
+	int64_t prev_id;
+	int64_t prev_time;
+} block_builder;
+
+static void
+put_varint (GByteArray *buf, uint64_t v)
+{
+	uint8_t b;
+
+	while (v >= 0x80) {
+		b = (v & 0x7f) | 0x80;
+		g_byte_array_append (buf, &b, 1);
+		v >>= 7;
+	}
+	b = v;
+	g_byte_array_append (buf, &b, 1);
+}
+
+static void
+put_svarint (GByteArray *buf, int64_t v)
+{
+	put_varint (buf, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void
+put_le (GByteArray *buf, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		uint8_t b = v >> (8 * i);
+		g_byte_array_append (buf, &b, 1);
+	}
+}
+
+/* Returns false if the varint runs past end */
+static bool
+get_varint (const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		uint8_t b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static bool
+get_svarint (const uint8_t **p, const uint8_t *end, int64_t *v)
+{
+	uint64_t u;
+	if (!get_varint (p, end, &u))
+		return false;
+	*v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+	return true;
+}
+
+static uint64_t
+get_le (const uint8_t *p, int bytes)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+static int64_t
+parse_time (const char *time)
+{
+	struct tm tm = { 0 };
+	if (time == NULL || sscanf (time, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return 0;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return timegm (&tm);
+}
+
+static void
+format_time (int64_t t, char *buf, size_t len)
+{
+	time_t tt = t;
+	struct tm tm;
+	strftime (buf, len, "%Y-%m-%d %H:%M:%S", gmtime_r (&tt, &tm));
+}
+
+static uint32_t
+dict_index (GHashTable *dict, GPtrArray *strings, const char *s)
+{
+	gpointer idx;
+
+	if (s == NULL)
+		s = "";
+	if (g_hash_table_lookup_extended (dict, s, NULL, &idx))
+		return GPOINTER_TO_UINT (idx);
+
+	char *copy = g_strdup (s);
+	g_ptr_array_add (strings, copy);
+	g_hash_table_insert (dict, copy, GUINT_TO_POINTER (strings->len - 1));
+	return strings->len - 1;
+}
+
+static void
+block_reset (block_builder *b)
+{
+	GByteArray **cols[] = { &b->ids, &b->times, &b->servers, &b->channels, &b->nicks, &b->actions, &b->messages };
+
+	for (size_t i = 0; i < G_N_ELEMENTS (cols); i++) {
+		if (*cols[i] == NULL)
+			*cols[i] = g_byte_array_new ();
+		else
+			g_byte_array_set_size (*cols[i], 0);
+	}
+	memset (&b->info, 0, sizeof (b->info));
+	b->prev_id = 0;
+	b->prev_time = 0;
+}
+
+static void
+block_free (block_builder *b)
+{
+	GByteArray *cols[] = { b->ids, b->times, b->servers, b->channels, b->nicks, b->actions, b->messages };
+
+	for (size_t i = 0; i < G_N_ELEMENTS (cols); i++)
+		g_byte_array_free (cols[i], true);
+}
+
+/* Compress the block and append it to out, records it in index */
+static bool
+block_flush (block_builder *b, FILE *out, uint64_t *offset, GByteArray *index)
+{
+	GByteArray *cols[] = { b->ids, b->times, b->servers, b->channels, b->nicks, b->actions, b->messages };
+
+	if (b->info.rows == 0)
+		return true;
+
+	GByteArray *raw = g_byte_array_new ();
+	for (size_t i = 0; i < G_N_ELEMENTS (cols); i++)
+		g_byte_array_append (raw, cols[i]->data, cols[i]->len);
+
+	uLongf compressed_size = compressBound (raw->len);
+	uint8_t *compressed = malloc (compressed_size);
+	bool ok = compress2 (compressed, &compressed_size, raw->data, raw->len, Z_BEST_COMPRESSION) == Z_OK &&
+		  fwrite (compressed, 1, compressed_size, out) == compressed_size;
+
+	if (ok) {
+		put_le (index, *offset, 8);
+		put_le (index, compressed_size, 4);
+		put_le (index, raw->len, 4);
+		put_le (index, b->info.rows, 4);
+		put_le (index, 0, 4);
+		put_le (index, b->info.first_id, 8);
+		put_le (index, b->info.last_id, 8);
+		put_le (index, b->info.first_time, 8);
+		put_le (index, b->info.last_time, 8);
+		*offset += compressed_size;
+	}
+
+	free (compressed);
+	g_byte_array_free (raw, true);
+	block_reset (b);
+	return ok;
+}
+
+int
+chanlog_archive_export (const char *table, const char *path, int64_t *last_id)
+{
+	char *tmp_path = g_strdup_printf ("%s.tmp", path);
+	FILE *out = fopen (tmp_path, "wb");
+	if (out == NULL) {
+		log_error ("archive: %s: %s\n", tmp_path, strerror (errno));
+		g_free (tmp_path);
+		return -1;
+	}
+	char *sql = g_strdup_printf (ARCHIVE_EXPORT, table);
+
+	GHashTable *dict = g_hash_table_new (g_str_hash, g_str_equal);
+	GPtrArray *strings = g_ptr_array_new_with_free_func (g_free);
+	GByteArray *index = g_byte_array_new ();
+	block_builder b = { 0 };
+	uint64_t offset = ARCHIVE_HEADER_SIZE, rows = 0;
+	uint32_t n_blocks = 0;
+	uint8_t action_bits = 0;
+	bool ok = true;
+
+	block_reset (&b);
+	/* Header is rewritten once the offsets are known */
+	static const uint8_t zero[ARCHIVE_HEADER_SIZE];
+	ok = fwrite (zero, 1, sizeof (zero), out) == sizeof (zero);
+
+	/* A reader per batch, so neither the pool nor the WAL is held for
+	 * the whole export. Imported ids are negative, the first batch
+	 * starts below all of them.
+	 */
+	int64_t after = INT64_MIN;
+	bool more = ok;
+	while (more) {
+		db_conn *conn = db_reader_acquire ();
+		sqlite3_stmt *stmt = conn != NULL ? db_conn_prepare (conn, sql) : NULL;
+		if (stmt == NULL) {
+			log_error ("archive: %s: %s\n", table, conn != NULL ? sqlite3_errmsg (db_conn_handle (conn)) : "no reader");
+			if (conn != NULL)
+				db_reader_release (conn);
+			ok = false;
+			break;
+		}
+		sqlite3_bind_int64 (stmt, 1, after);
+		sqlite3_bind_int (stmt, 2, ARCHIVE_BLOCK_ROWS);
+
+		int rc, batch = 0;
+		while (ok && (rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+			int64_t id = sqlite3_column_int64 (stmt, 0);
+			int64_t t = parse_time ((const char *)sqlite3_column_text (stmt, 1));
+			uint32_t n = b.info.rows;
+
+			if (n == 0) {
+				b.info.first_id = id;
+				b.info.first_time = t;
+			}
+			put_svarint (b.ids, id - b.prev_id);
+			put_svarint (b.times, t - b.prev_time);
+			b.prev_id = b.info.last_id = id;
+			b.prev_time = b.info.last_time = t;
+
+			put_varint (b.servers, dict_index (dict, strings, (const char *)sqlite3_column_text (stmt, 2)));
+			put_varint (b.channels, dict_index (dict, strings, (const char *)sqlite3_column_text (stmt, 3)));
+			put_varint (b.nicks, dict_index (dict, strings, (const char *)sqlite3_column_text (stmt, 4)));
+
+			if (sqlite3_column_int (stmt, 6))
+				action_bits |= 1 << (n % 8);
+			if (n % 8 == 7) {
+				g_byte_array_append (b.actions, &action_bits, 1);
+				action_bits = 0;
+			}
+
+			int len = sqlite3_column_bytes (stmt, 5);
+			put_varint (b.messages, len);
+			g_byte_array_append (b.messages, sqlite3_column_text (stmt, 5), len);
+
+			b.info.rows++;
+			rows++;
+			batch++;
+			after = id;
+
+			if (b.info.rows == ARCHIVE_BLOCK_ROWS) {
+				ok = block_flush (&b, out, &offset, index);
+				n_blocks++;
+			}
+		}
+		if (ok && rc != SQLITE_DONE) {
+			log_error ("archive: %s: %s\n", table, sqlite3_errmsg (db_conn_handle (conn)));
+			ok = false;
+		}
+		sqlite3_reset (stmt);
+		db_reader_release (conn);
+		more = ok && batch == ARCHIVE_BLOCK_ROWS;
+	}
+	if (ok && rows > 0 && last_id != NULL)
+		*last_id = after;
+	g_free (sql);
+
+	if (ok && b.info.rows > 0) {
+		if (b.info.rows % 8 != 0)
+			g_byte_array_append (b.actions, &action_bits, 1);
+		ok = block_flush (&b, out, &offset, index);
+		n_blocks++;
+	}
+
+	GByteArray *tail = g_byte_array_new ();
+	uint64_t dict_offset = offset;
+	put_le (tail, strings->len, 4);
+	for (guint i = 0; i < strings->len; i++) {
+		const char *s = g_ptr_array_index (strings, i);
+		put_varint (tail, strlen (s));
+		g_byte_array_append (tail, (const uint8_t *)s, strlen (s));
+	}
+	uint64_t index_offset = dict_offset + tail->len;
+	g_byte_array_append (tail, index->data, index->len);
+
+	GByteArray *header = g_byte_array_new ();
+	g_byte_array_append (header, (const uint8_t *)ARCHIVE_MAGIC, 8);
+	put_le (header, ARCHIVE_VERSION, 4);
+	put_le (header, n_blocks, 4);
+	put_le (header, rows, 8);
+	put_le (header, dict_offset, 8);
+	put_le (header, index_offset, 8);
+
+	ok = ok && fwrite (tail->data, 1, tail->len, out) == tail->len &&
+	     fseek (out, 0, SEEK_SET) == 0 &&
+	     fwrite (header->data, 1, header->len, out) == header->len &&
+	     fflush (out) == 0 && fsync (fileno (out)) == 0;
+	ok = fclose (out) == 0 && ok;
+
+	/* Only a complete archive ever appears under its final name */
+	if (ok && rename (tmp_path, path) != 0) {
+		log_error ("archive: %s: %s\n", path, strerror (errno));
+		ok = false;
+	}
+	if (!ok)
+		unlink (tmp_path);
+
+	g_byte_array_free (header, true);
+	g_byte_array_free (tail, true);
+	g_byte_array_free (index, true);
+	g_hash_table_destroy (dict);
+	g_ptr_array_free (strings, true);
+	block_free (&b);
+	g_free (tmp_path);
+
+	if (ok)
+		log_info ("archive: %s: %" G_GUINT64_FORMAT " rows in %u blocks\n", path, rows, n_blocks);
+	return ok ? 0 : -1;
+}
+
+chanlog_archive *
+chanlog_archive_open (const char *path)
+{
+	int fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_error ("archive: %s: %s\n", path, strerror (errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat (fd, &st) != 0 || st.st_size < ARCHIVE_HEADER_SIZE) {
+		close (fd);
+		return NULL;
+	}
+
+	void *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	chanlog_archive *a = calloc (1, sizeof (chanlog_archive));
+	a->map = map;
+	a->size = st.st_size;
+
+	const uint8_t *h = a->map;
+	uint64_t dict_offset = get_le (h + 24, 8);
+	uint64_t index_offset = get_le (h + 32, 8);
+	a->n_blocks = get_le (h + 12, 4);
+
+	if (memcmp (h, ARCHIVE_MAGIC, 8) != 0 || get_le (h + 8, 4) != ARCHIVE_VERSION ||
+	    dict_offset + 4 > a->size || index_offset > a->size ||
+	    (uint64_t)a->n_blocks * ARCHIVE_INDEX_ENTRY_SIZE > a->size - index_offset) {
+		log_error ("archive: %s: not a valid archive\n", path);
+		chanlog_archive_close (a);
+		return NULL;
+	}
+
+	a->blocks = calloc (a->n_blocks ? a->n_blocks : 1, sizeof (archive_block));
+	for (uint32_t i = 0; i < a->n_blocks; i++) {
+		const uint8_t *e = a->map + index_offset + (uint64_t)i * ARCHIVE_INDEX_ENTRY_SIZE;
+		archive_block *blk = &a->blocks[i];
+		blk->offset = get_le (e, 8);
+		blk->compressed_size = get_le (e + 8, 4);
+		blk->raw_size = get_le (e + 12, 4);
+		blk->rows = get_le (e + 16, 4);
+		blk->first_id = get_le (e + 24, 8);
+		blk->last_id = get_le (e + 32, 8);
+		blk->first_time = get_le (e + 40, 8);
+		blk->last_time = get_le (e + 48, 8);
+		if (blk->offset + blk->compressed_size > dict_offset) {
+			log_error ("archive: %s: block %u out of bounds\n", path, i);
+			chanlog_archive_close (a);
+			return NULL;
+		}
+	}
+
+	const uint8_t *p = a->map + dict_offset, *end = a->map + index_offset;
+	a->n_dict = get_le (p, 4);
+	p += 4;
+	a->dict = calloc (a->n_dict ? a->n_dict : 1, sizeof (char *));
+	for (uint32_t i = 0; i < a->n_dict; i++) {
+		uint64_t len;
+		if (!get_varint (&p, end, &len) || len > (uint64_t)(end - p)) {
+			log_error ("archive: %s: bad dictionary\n", path);
+			chanlog_archive_close (a);
+			return NULL;
+		}
+		a->dict[i] = g_strndup ((const char *)p, len);
+		p += len;
+	}
+
+	return a;
+}
+
+void
+chanlog_archive_close (chanlog_archive *a)
+{
+	if (a == NULL)
+		return;
+
+	for (uint32_t i = 0; i < a->n_dict; i++)
+		g_free (a->dict[i]);
+	free (a->dict);
+	free (a->blocks);
+	munmap ((void *)a->map, a->size);
+	free (a);
+}
+
+static int64_t
+dict_lookup (const chanlog_archive *a, const char *s)
+{
+	for (uint32_t i = 0; i < a->n_dict; i++)
+		if (strcmp (a->dict[i], s) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Archives have no FTS index, an FTS5 query is reduced to its terms,
+ * every one of which must appear in the message, ignoring ASCII case.
+ */
+static char **
+query_terms (const char *query)
+{
+	GPtrArray *terms = g_ptr_array_new ();
+	char **words = g_strsplit_set (query, " \t", -1);
+
+	for (char **w = words; *w != NULL; w++) {
+		if (**w == '\0' || strcmp (*w, "AND") == 0 || strcmp (*w, "OR") == 0 || strcmp (*w, "NOT") == 0)
+			continue;
+
+		GString *term = g_string_new (NULL);
+		for (const char *c = *w; *c != '\0'; c++) {
+			if (*c == '"' && c[1] == '"')
+				g_string_append_c (term, *c++);
+			else if (*c != '"' && *c != '*')
+				g_string_append_c (term, g_ascii_tolower (*c));
+		}
+		if (term->len > 0)
+			g_ptr_array_add (terms, g_string_free (term, false));
+		else
+			g_string_free (term, true);
+	}
+
+	g_strfreev (words);
+	g_ptr_array_add (terms, NULL);
+	return (char **)g_ptr_array_free (terms, false);
+}
+
+static bool
+message_matches (char **terms, const uint8_t *msg, size_t len, GString *scratch)
+{
+	g_string_truncate (scratch, 0);
+	for (size_t i = 0; i < len; i++)
+		g_string_append_c (scratch, g_ascii_tolower (msg[i]));
+
+	for (char **t = terms; *t != NULL; t++)
+		if (strstr (scratch->str, *t) == NULL)
+			return false;
+	return true;
+}
+
+/* Decoded columns of one block */
+typedef struct block_rows
+{
+	int64_t *ids;
+	int64_t *times;
+	uint32_t *servers;
+	uint32_t *channels;
+	uint32_t *nicks;
+	const uint8_t *actions;
+	const uint8_t **messages;
+	size_t *message_lens;
+} block_rows;
+
+static bool
+decode_block (const chanlog_archive *a, const archive_block *blk, uint8_t *raw, block_rows *r)
+{
+	uLongf raw_size = blk->raw_size;
+	if (uncompress (raw, &raw_size, a->map + blk->offset, blk->compressed_size) != Z_OK || raw_size != blk->raw_size)
+		return false;
+
+	const uint8_t *p = raw, *end = raw + raw_size;
+	int64_t id = 0, t = 0, d;
+	uint64_t v;
+
+	for (uint32_t i = 0; i < blk->rows; i++) {
+		if (!get_svarint (&p, end, &d))
+			return false;
+		r->ids[i] = id += d;
+	}
+	for (uint32_t i = 0; i < blk->rows; i++) {
+		if (!get_svarint (&p, end, &d))
+			return false;
+		r->times[i] = t += d;
+	}
+	uint32_t *dict_cols[] = { r->servers, r->channels, r->nicks };
+	for (int c = 0; c < 3; c++) {
+		for (uint32_t i = 0; i < blk->rows; i++) {
+			if (!get_varint (&p, end, &v) || v >= a->n_dict)
+				return false;
+			dict_cols[c][i] = v;
+		}
+	}
+	size_t bitmap_len = (blk->rows + 7) / 8;
+	if ((size_t)(end - p) < bitmap_len)
+		return false;
+	r->actions = p;
+	p += bitmap_len;
+	for (uint32_t i = 0; i < blk->rows; i++) {
+		if (!get_varint (&p, end, &v) || v > (uint64_t)(end - p))
+			return false;
+		r->messages[i] = p;
+		r->message_lens[i] = v;
+		p += v;
+	}
+	return true;
+}
+
+/*
+ * Same contract as chanlog_search on one archive, before is an id of it.
+ * Blocks are visited newest first and skipped through the index when
+ * before excludes them, only blocks that can hold results are
+ * decompressed.
+ */
+int
+chanlog_archive_search (chanlog_archive *a, const char *server, const char *channel, const char *query, int64_t before, int limit, chanlog_row_fn fn, void *data)
+{
+	int64_t server_idx = dict_lookup (a, server);
+	int64_t channel_idx = channel != NULL ? dict_lookup (a, channel) : -1;
+	if (server_idx < 0 || (channel != NULL && channel_idx < 0) || limit <= 0)
+		return 0;
+
+	char **terms = query_terms (query);
+	GString *scratch = g_string_new (NULL);
+	uint8_t *raw = NULL;
+	size_t raw_cap = 0;
+	block_rows r = {
+		.ids = malloc (ARCHIVE_BLOCK_ROWS * sizeof (int64_t)),
+		.times = malloc (ARCHIVE_BLOCK_ROWS * sizeof (int64_t)),
+		.servers = malloc (ARCHIVE_BLOCK_ROWS * sizeof (uint32_t)),
+		.channels = malloc (ARCHIVE_BLOCK_ROWS * sizeof (uint32_t)),
+		.nicks = malloc (ARCHIVE_BLOCK_ROWS * sizeof (uint32_t)),
+		.messages = malloc (ARCHIVE_BLOCK_ROWS * sizeof (uint8_t *)),
+		.message_lens = malloc (ARCHIVE_BLOCK_ROWS * sizeof (size_t)),
+	};
+	int n = 0;
+
+	for (int64_t b = (int64_t)a->n_blocks - 1; b >= 0 && n >= 0 && n < limit; b--) {
+		const archive_block *blk = &a->blocks[b];
+		if (blk->first_id >= before || blk->rows > ARCHIVE_BLOCK_ROWS)
+			continue;
+
+		if (blk->raw_size > raw_cap) {
+			uint8_t *grown = realloc (raw, blk->raw_size);
+			if (grown == NULL) {
+				log_error ("archive: out of memory for block %" G_GINT64_FORMAT "\n", b);
+				n = -1;
+				break;
+			}
+			raw = grown;
+			raw_cap = blk->raw_size;
+		}
+		if (!decode_block (a, blk, raw, &r)) {
+			log_error ("archive: corrupt block %" G_GINT64_FORMAT "\n", b);
+			n = -1;
+			break;
+		}
+
+		for (int64_t i = (int64_t)blk->rows - 1; i >= 0 && n < limit; i--) {
+			if (r.ids[i] >= before || r.servers[i] != server_idx ||
+			    (channel_idx >= 0 && r.channels[i] != channel_idx) ||
+			    !message_matches (terms, r.messages[i], r.message_lens[i], scratch))
+				continue;
+
+			char time[20];
+			format_time (r.times[i], time, sizeof (time));
+			char *message = g_strndup ((const char *)r.messages[i], r.message_lens[i]);
+			chanlog_row row = {
+				.id = r.ids[i],
+				.time = time,
+				.channel = a->dict[r.channels[i]],
+				.nick = a->dict[r.nicks[i]],
+				.message = message,
+				.action = (r.actions[i / 8] >> (i % 8)) & 1,
+			};
+			fn (&row, data);
+			g_free (message);
+			n++;
+		}
+	}
+
+	free (r.ids);
+	free (r.times);
+	free (r.servers);
+	free (r.channels);
+	free (r.nicks);
+	free (r.messages);
+	free (r.message_lens);
+	free (raw);
+	g_string_free (scratch, true);
+	g_strfreev (terms);
+	return n;
+}
@@ -0,0 +1,158 @@
+#define LOG_SUBSYS LOG_CHANLOG
+
+#include <glib.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chanlog.h"
+#include "config/config.h"
+#include "db/db.h"
+#include "irc/hooks.h"
+#include "log/log.h"
+
+#define CHANLOG_INSERT                                               \
+	"INSERT INTO %s (id, time, server, channel, nick, message, action) " \
+	"VALUES (?, ?, ?, ?, ?, ?, ?)"
+
+#define CHANLOG_ROLLUP                                                   \
+	"INSERT INTO irc_log_rollup (server, channel, hour, nick, messages) " \
+	"VALUES (?, ?, substr(?, 1, 13), ?, 1) "                            \
+	"ON CONFLICT DO UPDATE SET messages = messages + 1"
+
+typedef struct log_row
+{
+	char time[20]; /* YYYY-MM-DD HH:MM:SS, like CURRENT_TIMESTAMP */
+	char *server;
+	char *channel;
+	char *nick;
+	char *message;
+	bool action;
+} log_row;
+
+static void
+chanlog_hook (const irc_server *s, const irc_msg *msg);
+static void
+chanlog_create_table (db_conn *conn, void *data);
+static void
+chanlog_write_row (db_conn *conn, void *data);
+static void
+free_log_row (void *data);
+
+void
+chanlog_init (void)
+{
+	config_t *config = get_config ();
+
+	if (!config->chanlog_enabled)
+		return;
+
+	db_write (chanlog_create_table, NULL, NULL);
+	db_on_idle (chanlog_maintain, NULL);
+	add_hook_nonessential ("PRIVMSG", chanlog_hook);
+	chanlog_search_init ();
+	chanlog_stats_init ();
+}
+
+static void
+chanlog_create_table (db_conn *conn, void *data)
+{
+	chanlog_schema_init (db_conn_handle (conn));
+}
+
+static char *
+nick_from_prefix (const char *prefix)
+{
+	if (prefix == NULL)
+		return strdup ("");
+
+	const char *bang = strchr (prefix, '!');
+	return bang != NULL ? strndup (prefix, bang - prefix) : strdup (prefix);
+}
+
+/* Build a row for msg on the loop thread, the db write is queued */
+static void
+chanlog_hook (const irc_server *s, const irc_msg *msg)
+{
+	if (msg->params == NULL || msg->params->len < 2)
+		return;
+
+	const char *target = msg->params->params[0];
+	const char *text = msg->params->params[1];
+	size_t text_len = strlen (text);
+
+	log_row *row = malloc (sizeof (log_row));
+	time_t now = time (NULL);
+	struct tm tm;
+	strftime (row->time, sizeof (row->time), "%Y-%m-%d %H:%M:%S", gmtime_r (&now, &tm));
+
+	row->server = strdup (irc_get_server_name (s));
+	row->nick = nick_from_prefix (msg->prefix);
+	/* Queries are logged under the nick of the other side */
+	row->channel = target[0] == '#' ? strdup (target) : strdup (row->nick);
+
+	row->action = text_len >= 9 && text[0] == '\x01' &&
+		      text[text_len - 1] == '\x01' &&
+		      strncmp (text + 1, "ACTION ", 7) == 0;
+	row->message = row->action ? strndup (text + 8, text_len - 9) : strdup (text);
+
+	db_write (chanlog_write_row, row, free_log_row);
+}
+
+/* Runs on the database writer thread, inside its batch transaction */
+static void
+chanlog_write_row (db_conn *conn, void *data)
+{
+	log_row *row = data;
+	sqlite3 *db = db_conn_handle (conn);
+
+	const char *table = chanlog_partition_for (db, row->time);
+	if (table == NULL)
+		return;
+
+	char *sql = g_strdup_printf (CHANLOG_INSERT, table);
+	sqlite3_stmt *stmt = db_conn_prepare (conn, sql);
+	g_free (sql);
+	if (stmt == NULL)
+		return;
+
+	sqlite3_bind_int64 (stmt, 1, chanlog_next_id ());
+	sqlite3_bind_text (stmt, 2, row->time, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 3, row->server, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 4, row->channel, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 5, row->nick, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 6, row->message, -1, SQLITE_STATIC);
+	sqlite3_bind_int (stmt, 7, row->action);
+
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		log_error ("chanlog: %s\n", sqlite3_errmsg (db));
+	sqlite3_reset (stmt);
+
+	stmt = db_conn_prepare (conn, CHANLOG_ROLLUP);
+	if (stmt == NULL)
+		return;
+
+	sqlite3_bind_text (stmt, 1, row->server, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 2, row->channel, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 3, row->time, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 4, row->nick, -1, SQLITE_STATIC);
+
+	if (sqlite3_step (stmt) != SQLITE_DONE)
+		log_error ("chanlog: rollup: %s\n", sqlite3_errmsg (db));
+	sqlite3_reset (stmt);
+}
+
+static void
+free_log_row (void *data)
+{
+	log_row *row = data;
+
+	free (row->server);
+	free (row->channel);
+	free (row->nick);
+	free (row->message);
+	free (row);
+}
@@ -0,0 +1,134 @@
+#ifndef CHANLOG_H
+#define CHANLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db/db.h"
+#include "irc/irc.h"
+
+/*
+ * Channel logger
+ * Queues every PRIVMSG as a row of the current monthly partition on the
+ * write queue of the database service.
+ */
+void
+chanlog_init (void);
+/* Waits for an archive export still running, before db_shutdown */
+void
+chanlog_shutdown (void);
+
+/* Partitions, retention and compaction, writer thread only */
+void
+chanlog_schema_init (sqlite3 *db);
+/* Table of the partition holding rows logged at time, created if
+ * needed, NULL if that month has been archived
+ */
+const char *
+chanlog_partition_for (sqlite3 *db, const char *time);
+int64_t
+chanlog_next_id (void);
+/* Partitions chanlog_partition_for creates between begin and end are
+ * written without indexes and FTS triggers, end builds them. Rows
+ * loaded meanwhile take their ids from chanlog_next_import_id, the
+ * range of the month of the last chanlog_partition_for
+ */
+void
+chanlog_bulk_begin (sqlite3 *db);
+void
+chanlog_bulk_end (sqlite3 *db);
+int64_t
+chanlog_next_import_id (void);
+void
+chanlog_maintain (db_conn *conn, void *data);
+
+typedef struct chanlog_partition
+{
+	char *name;
+	char month[8];
+	bool compacted;
+	char *archive; /* path of the archive file once archived, or NULL */
+} chanlog_partition;
+
+/* Catalog of partitions in month order, free with chanlog_free_partitions */
+GPtrArray *
+chanlog_list_partitions (sqlite3 *db, bool newest_first);
+void
+chanlog_free_partitions (GPtrArray *parts);
+
+/* One matched row, only valid for the duration of the callback */
+typedef struct chanlog_row
+{
+	int64_t id;
+	const char *month; /* of its partition, YYYY-MM */
+	const char *time;
+	const char *channel;
+	const char *nick;
+	const char *message;
+	bool action;
+} chanlog_row;
+
+typedef void (*chanlog_row_fn) (const chanlog_row *row, void *data);
+
+/*
+ * Where a page of search results ended, the month and id of its last
+ * row. Ids only order the rows of one partition, imported months have
+ * negative ones, so the month picks the partition to continue in.
+ * Written as <month>:<id> in commands.
+ */
+typedef struct chanlog_cursor
+{
+	char month[8];
+	int64_t id;
+} chanlog_cursor;
+
+#define CHANLOG_CURSOR_FORMAT "%s:%" G_GINT64_FORMAT
+
+bool
+chanlog_cursor_parse (const char *text, chanlog_cursor *cursor);
+
+/*
+ * Full-text search on the reader conn, newest first. query is an FTS5
+ * query, channel may be NULL for all channels of server. Pages are
+ * chained by passing the cursor of the last row seen as before, NULL
+ * for the first page. Returns the number of rows passed to fn or -1 on
+ * error.
+ */
+int
+chanlog_search (db_conn *conn, const char *server, const char *channel, const char *query, const chanlog_cursor *before, int limit, chanlog_row_fn fn, void *data);
+/* Quote every word of text as an FTS5 string, so user input can not
+ * form a malformed query
+ */
+char *
+chanlog_quote_query (const char *text);
+void
+chanlog_search_init (void);
+
+/*
+ * Archives
+ * Closed partitions exported to a compressed columnar file, read in
+ * place through mmap.
+ */
+typedef struct chanlog_archive chanlog_archive;
+
+/* Write table to path, atomically, returns 0 on success. Reads in
+ * batches, each on its own reader.
+ */
+int
+chanlog_archive_export (const char *table, const char *path, int64_t *last_id);
+chanlog_archive *
+chanlog_archive_open (const char *path);
+void
+chanlog_archive_close (chanlog_archive *a);
+/* Rows of one archive with ids below before, INT64_MAX for all */
+int
+chanlog_archive_search (chanlog_archive *a, const char *server, const char *channel, const char *query, int64_t before, int limit, chanlog_row_fn fn, void *data);
+
+void
+chanlog_stats_init (void);
+
+/* circ --import, loads client log files offline */
+int
+chanlog_import_main (int argc, char **argv);
+
+#endif /* CHANLOG_H */
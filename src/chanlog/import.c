@@ -0,0 +1,852 @@
+#define LOG_SUBSYS LOG_CHANLOG
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chanlog.h"
+#include "config/config.h"
+#include "db/db.h"
+#include "irc/parser.h"
+#include "log/log.h"
+
+/*
+ * Offline import of client logs. Files are mapped and cut into chunks
+ * at line boundaries, a thread pool parses the chunks into batches of
+ * rows and the database writer inserts each batch in one go. Indexes
+ * and FTS triggers of the partitions written to are dropped for the
+ * load and built once at the end.
+ */
+
+/* Bytes of a file parsed by one worker, formats with state per file
+ * are never split
+ */
+#define IMPORT_CHUNK_SIZE (8 << 20)
+/* Rows per job of the database writer */
+#define IMPORT_BATCH_ROWS 16384
+/* Batches parsed ahead of the writer, bounds the memory used */
+#define IMPORT_IN_FLIGHT 8
+
+#define IMPORT_INSERT                                                 \
+	"INSERT INTO %s (id, time, server, channel, nick, message, action) " \
+	"VALUES (?, ?, ?, ?, ?, ?, ?)"
+
+#define IMPORT_ROLLUP                                                    \
+	"INSERT INTO irc_log_rollup (server, channel, hour, nick, messages) " \
+	"VALUES (?, ?, ?, ?, ?) "                                            \
+	"ON CONFLICT DO UPDATE SET messages = messages + excluded.messages"
+
+typedef struct import_row
+{
+	char time[20];
+	const char *channel;
+	const char *nick;
+	const char *message;
+	bool action;
+} import_row;
+
+/* Rows and the strings they point into, freed together */
+typedef struct import_batch
+{
+	GArray *rows;
+	GStringChunk *strings;
+} import_batch;
+
+typedef struct import_file
+{
+	char *path;
+	const char *map;
+	size_t size;
+	char *channel;
+	/* Date of the first line, for formats without one per line */
+	int year, month, day;
+	gint chunks_left;
+} import_file;
+
+typedef struct import_chunk
+{
+	import_file *file;
+	const char *start;
+	size_t len;
+} import_chunk;
+
+/* Worker state while parsing one chunk */
+typedef struct import_parser
+{
+	const import_file *file;
+	int year, month, day;
+	/* Local to UTC offset, looked up once per hour of log time */
+	int64_t offset_hour;
+	time_t utc_offset;
+	import_batch *batch;
+	uint64_t lines;
+	uint64_t rows;
+} import_parser;
+
+typedef struct import_format
+{
+	const char *name;
+	bool split;
+	/* Fills in channel and date from the path, false skips the file */
+	bool (*file_init) (import_file *f);
+	void (*parse_line) (import_parser *p, const char *line, size_t len);
+} import_format;
+
+static bool
+irssi_file_init (import_file *f);
+static void
+irssi_parse_line (import_parser *p, const char *line, size_t len);
+static bool
+weechat_file_init (import_file *f);
+static void
+weechat_parse_line (import_parser *p, const char *line, size_t len);
+static bool
+znc_file_init (import_file *f);
+static void
+znc_parse_line (import_parser *p, const char *line, size_t len);
+static bool
+raw_file_init (import_file *f);
+static void
+raw_parse_line (import_parser *p, const char *line, size_t len);
+
+static const import_format formats[] = {
+	{ "irssi", false, irssi_file_init, irssi_parse_line },
+	{ "weechat", true, weechat_file_init, weechat_parse_line },
+	{ "znc", true, znc_file_init, znc_parse_line },
+	{ "raw", true, raw_file_init, raw_parse_line },
+};
+
+static const char *import_server;
+
+/* Batches handed to the writer and not freed yet */
+static pthread_mutex_t in_flight_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t in_flight_cond = PTHREAD_COND_INITIALIZER;
+static int in_flight;
+
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t total_lines;
+static uint64_t total_rows;
+/* Writer thread only */
+static uint64_t rows_archived;
+/* Set by the writer when a batch could not be written */
+static bool import_failed;
+
+static import_batch *
+import_batch_new (void)
+{
+	import_batch *b = malloc (sizeof (import_batch));
+	b->rows = g_array_sized_new (false, false, sizeof (import_row), IMPORT_BATCH_ROWS);
+	b->strings = g_string_chunk_new (1 << 20);
+	return b;
+}
+
+static void
+import_batch_free (void *data)
+{
+	import_batch *b = data;
+
+	g_array_free (b->rows, true);
+	g_string_chunk_free (b->strings);
+	free (b);
+
+	pthread_mutex_lock (&in_flight_mtx);
+	in_flight--;
+	pthread_cond_signal (&in_flight_cond);
+	pthread_mutex_unlock (&in_flight_mtx);
+}
+
+/* Runs on the database writer thread, inside its batch transaction */
+static void
+import_write_batch (db_conn *conn, void *data)
+{
+	import_batch *b = data;
+	sqlite3 *db = db_conn_handle (conn);
+	sqlite3_stmt *insert = NULL;
+	char *table = NULL;
+	/* Rollup counts of the batch, one upsert per hour, nick and channel */
+	GHashTable *rollup;
+
+	/* The rest is parsed but no longer written */
+	if (import_failed)
+		return;
+
+	rollup = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	for (guint i = 0; i < b->rows->len; i++) {
+		import_row *row = &g_array_index (b->rows, import_row, i);
+
+		const char *part = chanlog_partition_for (db, row->time);
+		if (part == NULL) {
+			rows_archived++;
+			continue;
+		}
+		if (table == NULL || strcmp (table, part) != 0) {
+			g_free (table);
+			table = g_strdup (part);
+			char *sql = g_strdup_printf (IMPORT_INSERT, table);
+			insert = db_conn_prepare (conn, sql);
+			g_free (sql);
+		}
+		if (insert == NULL) {
+			log_error ("import: %s: %s\n", table, sqlite3_errmsg (db));
+			import_failed = true;
+			break;
+		}
+
+		sqlite3_bind_int64 (insert, 1, chanlog_next_import_id ());
+		sqlite3_bind_text (insert, 2, row->time, -1, SQLITE_STATIC);
+		sqlite3_bind_text (insert, 3, import_server, -1, SQLITE_STATIC);
+		sqlite3_bind_text (insert, 4, row->channel, -1, SQLITE_STATIC);
+		sqlite3_bind_text (insert, 5, row->nick, -1, SQLITE_STATIC);
+		sqlite3_bind_text (insert, 6, row->message, -1, SQLITE_STATIC);
+		sqlite3_bind_int (insert, 7, row->action);
+		if (sqlite3_step (insert) != SQLITE_DONE) {
+			log_error ("import: %s: %s\n", table, sqlite3_errmsg (db));
+			import_failed = true;
+			sqlite3_reset (insert);
+			break;
+		}
+		sqlite3_reset (insert);
+
+		char *key = g_strdup_printf ("%s\n%.13s\n%s", row->channel, row->time, row->nick);
+		guint n = GPOINTER_TO_UINT (g_hash_table_lookup (rollup, key));
+		g_hash_table_replace (rollup, key, GUINT_TO_POINTER (n + 1));
+	}
+	g_free (table);
+
+	GHashTableIter iter;
+	gpointer key, count;
+	g_hash_table_iter_init (&iter, rollup);
+	while (g_hash_table_iter_next (&iter, &key, &count)) {
+		sqlite3_stmt *stmt = db_conn_prepare (conn, IMPORT_ROLLUP);
+		if (stmt == NULL)
+			break;
+
+		char **fields = g_strsplit (key, "\n", 3);
+		sqlite3_bind_text (stmt, 1, import_server, -1, SQLITE_STATIC);
+		sqlite3_bind_text (stmt, 2, fields[0], -1, SQLITE_STATIC);
+		sqlite3_bind_text (stmt, 3, fields[1], -1, SQLITE_STATIC);
+		sqlite3_bind_text (stmt, 4, fields[2], -1, SQLITE_STATIC);
+		sqlite3_bind_int (stmt, 5, GPOINTER_TO_UINT (count));
+		if (sqlite3_step (stmt) != SQLITE_DONE)
+			log_error ("import: rollup: %s\n", sqlite3_errmsg (db));
+		sqlite3_reset (stmt);
+		g_strfreev (fields);
+	}
+	g_hash_table_destroy (rollup);
+}
+
+/* Hands a full batch to the writer, blocks while it is behind */
+static void
+import_submit (import_parser *p)
+{
+	if (p->batch->rows->len == 0)
+		return;
+
+	pthread_mutex_lock (&in_flight_mtx);
+	while (in_flight >= IMPORT_IN_FLIGHT)
+		pthread_cond_wait (&in_flight_cond, &in_flight_mtx);
+	in_flight++;
+	pthread_mutex_unlock (&in_flight_mtx);
+
+	db_write (import_write_batch, p->batch, import_batch_free);
+	p->batch = import_batch_new ();
+}
+
+static void
+import_add_row (import_parser *p, const char *time, const char *channel, const char *nick, size_t nick_len, const char *message, size_t message_len, bool action)
+{
+	import_row row;
+
+	memcpy (row.time, time, sizeof (row.time));
+	row.channel = g_string_chunk_insert_const (p->batch->strings, channel);
+	row.nick = g_string_chunk_insert_len (p->batch->strings, nick, nick_len);
+	row.message = g_string_chunk_insert_len (p->batch->strings, message, message_len);
+	row.action = action;
+	g_array_append_val (p->batch->rows, row);
+	p->rows++;
+
+	if (p->batch->rows->len >= IMPORT_BATCH_ROWS)
+		import_submit (p);
+}
+
+static void
+format_utc (time_t t, char out[20])
+{
+	struct tm tm;
+	strftime (out, 20, "%Y-%m-%d %H:%M:%S", gmtime_r (&t, &tm));
+}
+
+/*
+ * Client logs are in the local time of the machine that wrote them,
+ * set TZ to match when importing. mktime takes a global lock, so the
+ * offset is only looked up when the hour changes.
+ */
+static void
+local_time (import_parser *p, int h, int m, int s, char out[20])
+{
+	struct tm tm = {
+		.tm_year = p->year - 1900,
+		.tm_mon = p->month - 1,
+		.tm_mday = p->day,
+		.tm_hour = h,
+		.tm_min = m,
+		.tm_sec = s,
+	};
+	int64_t hour = (((int64_t)p->year * 100 + p->month) * 100 + p->day) * 100 + h;
+
+	if (hour != p->offset_hour) {
+		struct tm utc = tm, local = tm;
+		local.tm_isdst = -1;
+		p->utc_offset = timegm (&utc) - mktime (&local);
+		p->offset_hour = hour;
+	}
+	format_utc (timegm (&tm) - p->utc_offset, out);
+}
+
+/* Reads HH:MM or HH:MM:SS, advancing *s */
+static bool
+parse_clock (const char **s, const char *end, int *h, int *m, int *sec)
+{
+	const char *c = *s;
+
+	if (end - c < 5 || !g_ascii_isdigit (c[0]) || !g_ascii_isdigit (c[1]) || c[2] != ':' ||
+	    !g_ascii_isdigit (c[3]) || !g_ascii_isdigit (c[4]))
+		return false;
+	*h = (c[0] - '0') * 10 + c[1] - '0';
+	*m = (c[3] - '0') * 10 + c[4] - '0';
+	*sec = 0;
+	c += 5;
+	if (end - c >= 3 && c[0] == ':' && g_ascii_isdigit (c[1]) && g_ascii_isdigit (c[2])) {
+		*sec = (c[1] - '0') * 10 + c[2] - '0';
+		c += 3;
+	}
+	*s = c;
+	return true;
+}
+
+/* Reads YYYY-MM-DD, advancing *s */
+static bool
+parse_date (const char **s, const char *end, int *y, int *mon, int *d)
+{
+	const char *c = *s;
+
+	if (end - c < 10 || c[4] != '-' || c[7] != '-')
+		return false;
+	for (int i = 0; i < 10; i++)
+		if (i != 4 && i != 7 && !g_ascii_isdigit (c[i]))
+			return false;
+	*y = (c[0] - '0') * 1000 + (c[1] - '0') * 100 + (c[2] - '0') * 10 + c[3] - '0';
+	*mon = (c[5] - '0') * 10 + c[6] - '0';
+	*d = (c[8] - '0') * 10 + c[9] - '0';
+	*s = c + 10;
+	return true;
+}
+
+/* Nicks are logged with their channel mode, which is not part of them */
+static void
+strip_mode (const char **nick, const char *end)
+{
+	while (*nick < end && strchr ("~&@%+ ", **nick) != NULL)
+		(*nick)++;
+}
+
+static bool
+has_prefix (const char *line, size_t len, const char *prefix)
+{
+	size_t n = strlen (prefix);
+	return len >= n && memcmp (line, prefix, n) == 0;
+}
+
+/* <nick> message or * nick action, the part after the timestamp */
+static void
+parse_message (import_parser *p, const char *time, const char *s, const char *end)
+{
+	if (end - s >= 2 && s[0] == '<') {
+		const char *nick = s + 1;
+		const char *close = memchr (nick, '>', end - nick);
+		if (close == NULL)
+			return;
+		strip_mode (&nick, close);
+		const char *text = close + 1 < end && close[1] == ' ' ? close + 2 : close + 1;
+		import_add_row (p, time, p->file->channel, nick, close - nick, text, end - text, false);
+	} else if (end - s >= 3 && s[0] == '*' && s[1] == ' ' && s[2] != '*') {
+		const char *nick = s + 2;
+		const char *space = memchr (nick, ' ', end - nick);
+		const char *text = space != NULL ? space + 1 : end;
+		import_add_row (p, time, p->file->channel, nick, (space != NULL ? space : end) - nick, text, end - text, true);
+	}
+}
+
+static char *
+path_basename (const char *path, const char *suffix)
+{
+	char *base = g_path_get_basename (path);
+	if (suffix != NULL && g_str_has_suffix (base, suffix))
+		base[strlen (base) - strlen (suffix)] = '\0';
+	return base;
+}
+
+/* irssi: <channel>.log, dated by its Log opened and Day changed lines */
+static bool
+irssi_file_init (import_file *f)
+{
+	f->channel = path_basename (f->path, ".log");
+	return true;
+}
+
+static bool
+irssi_parse_day (import_parser *p, const char *line, size_t len, const char *format)
+{
+	static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+					"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	char buf[128], mon[4];
+	int day, year;
+	size_t n = MIN (len, sizeof (buf) - 1);
+
+	/* Lines are not terminated in the mapped file */
+	memcpy (buf, line, n);
+	buf[n] = '\0';
+	if (sscanf (buf, format, mon, &day, &year) != 3)
+		return false;
+	for (int i = 0; i < 12; i++) {
+		if (strcmp (mon, months[i]) == 0) {
+			p->year = year;
+			p->month = i + 1;
+			p->day = day;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+irssi_parse_line (import_parser *p, const char *line, size_t len)
+{
+	const char *s = line, *end = line + len;
+	int h, m, sec;
+	char time[20];
+
+	if (has_prefix (line, len, "--- Log opened "))
+		irssi_parse_day (p, line, len, "--- Log opened %*s %3s %d %*d:%*d:%*d %d");
+	else if (has_prefix (line, len, "--- Day changed "))
+		irssi_parse_day (p, line, len, "--- Day changed %*s %3s %d %d");
+	else if (p->year != 0 && parse_clock (&s, end, &h, &m, &sec) && s < end && *s == ' ') {
+		local_time (p, h, m, sec, time);
+		/* Actions are indented by one more space */
+		parse_message (p, time, s + 1 + (end - s > 1 && s[1] == ' '), end);
+	}
+}
+
+/* weechat: irc.<server>.<channel>.weechatlog, a full date per line */
+static bool
+weechat_file_init (import_file *f)
+{
+	char *base = path_basename (f->path, ".weechatlog");
+	const char *channel = base;
+
+	if (g_str_has_prefix (channel, "irc.")) {
+		const char *dot = strchr (channel + 4, '.');
+		if (dot != NULL)
+			channel = dot + 1;
+	}
+	f->channel = g_strdup (channel);
+	g_free (base);
+	return true;
+}
+
+static void
+weechat_parse_line (import_parser *p, const char *line, size_t len)
+{
+	const char *s = line, *end = line + len;
+	int h, m, sec;
+	char time[20];
+
+	if (!parse_date (&s, end, &p->year, &p->month, &p->day) || s == end || *s++ != ' ' ||
+	    !parse_clock (&s, end, &h, &m, &sec) || s == end || *s++ != '\t')
+		return;
+
+	const char *prefix = s;
+	const char *tab = memchr (prefix, '\t', end - prefix);
+	if (tab == NULL)
+		return;
+	const char *text = tab + 1;
+	local_time (p, h, m, sec, time);
+
+	while (prefix < tab && *prefix == ' ')
+		prefix++;
+	if (tab - prefix == 1 && *prefix == '*') {
+		const char *space = memchr (text, ' ', end - text);
+		const char *message = space != NULL ? space + 1 : end;
+		import_add_row (p, time, p->file->channel, text, (space != NULL ? space : end) - text, message, end - message, true);
+		return;
+	}
+
+	/* Joins, parts and other events are prefixed by arrows or dashes */
+	if (prefix == tab || strchr ("-<>=", *prefix) != NULL)
+		return;
+	strip_mode (&prefix, tab);
+	import_add_row (p, time, p->file->channel, prefix, tab - prefix, text, end - text, false);
+}
+
+/* znc: <channel>/YYYY-MM-DD.log or <channel>_YYYYMMDD.log */
+static bool
+znc_file_init (import_file *f)
+{
+	char *base = path_basename (f->path, ".log");
+	const char *s = base;
+	const char *under = strrchr (base, '_');
+	bool ok = false;
+
+	if (parse_date (&s, base + strlen (base), &f->year, &f->month, &f->day) && *s == '\0') {
+		char *dir = g_path_get_dirname (f->path);
+		f->channel = g_path_get_basename (dir);
+		g_free (dir);
+		ok = true;
+	} else if (under != NULL && strlen (under + 1) == 8 &&
+		   sscanf (under + 1, "%4d%2d%2d", &f->year, &f->month, &f->day) == 3) {
+		f->channel = g_strndup (base, under - base);
+		ok = true;
+	}
+
+	if (!ok)
+		log_error ("import: %s: no date in the file name, skipped\n", f->path);
+	g_free (base);
+	return ok;
+}
+
+static void
+znc_parse_line (import_parser *p, const char *line, size_t len)
+{
+	const char *s = line + 1, *end = line + len;
+	int h, m, sec;
+	char time[20];
+
+	if (len < 2 || line[0] != '[' || !parse_clock (&s, end, &h, &m, &sec) ||
+	    end - s < 2 || s[0] != ']' || s[1] != ' ')
+		return;
+	local_time (p, h, m, sec, time);
+	parse_message (p, time, s + 2, end);
+}
+
+/* raw: IRC lines as received, timed by an IRCv3 time tag or by an ISO
+ * 8601 UTC timestamp in front of them
+ */
+static bool
+raw_file_init (import_file *f)
+{
+	f->channel = NULL;
+	return true;
+}
+
+/* YYYY-MM-DDTHH:MM:SS[.fff][Z] to a row time */
+static bool
+parse_iso_time (const char **s, const char *end, char out[20])
+{
+	struct tm tm = { 0 };
+	const char *c = *s;
+
+	if (!parse_date (&c, end, &tm.tm_year, &tm.tm_mon, &tm.tm_mday) || c == end ||
+	    (*c != 'T' && *c != ' '))
+		return false;
+	c++;
+	if (!parse_clock (&c, end, &tm.tm_hour, &tm.tm_min, &tm.tm_sec))
+		return false;
+	if (c < end && *c == '.')
+		for (c++; c < end && g_ascii_isdigit (*c); c++)
+			;
+	if (c < end && *c == 'Z')
+		c++;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	format_utc (timegm (&tm), out);
+	*s = c;
+	return true;
+}
+
+static void
+raw_parse_line (import_parser *p, const char *line, size_t len)
+{
+	const char *s = line, *end = line + len;
+	char time[20] = "";
+
+	if (len > 0 && g_ascii_isdigit (*s)) {
+		if (!parse_iso_time (&s, end, time))
+			return;
+		while (s < end && *s == ' ')
+			s++;
+	}
+	if (s == end)
+		return;
+
+	struct irc_msg *msg = alloc_msg ();
+	/* On error the parser frees msg itself */
+	if (ircmsg_parse ((const uint8_t *)s, end - s, &parse_cbs, msg) == 0)
+		return;
+
+	if (time[0] == '\0' && msg->tags != NULL) {
+		for (int i = 0; i < msg->tags->len; i++) {
+			const irc_msg_tag *tag = msg->tags->tags[i];
+			if (strcmp (tag->name, "time") == 0 && tag->value != NULL) {
+				const char *v = tag->value;
+				parse_iso_time (&v, v + strlen (v), time);
+			}
+		}
+	}
+
+	if (time[0] != '\0' && msg->command != NULL && strcmp (msg->command, "PRIVMSG") == 0 &&
+	    msg->params != NULL && msg->params->len >= 2 && msg->prefix != NULL) {
+		const char *target = msg->params->params[0];
+		const char *text = msg->params->params[1];
+		size_t text_len = strlen (text);
+		size_t nick_len = strcspn (msg->prefix, "!");
+		/* Same rows as the live logger: queries under the other nick,
+		 * CTCP ACTION unwrapped
+		 */
+		char *channel = target[0] == '#' ? g_strdup (target) : g_strndup (msg->prefix, nick_len);
+		bool action = text_len >= 9 && text[0] == '\x01' && text[text_len - 1] == '\x01' &&
+			      strncmp (text + 1, "ACTION ", 7) == 0;
+
+		if (action)
+			import_add_row (p, time, channel, msg->prefix, nick_len, text + 8, text_len - 9, true);
+		else
+			import_add_row (p, time, channel, msg->prefix, nick_len, text, text_len, false);
+		g_free (channel);
+	}
+	free_msg (msg);
+}
+
+static void
+import_file_free (import_file *f)
+{
+	munmap ((void *)f->map, f->size);
+	g_free (f->path);
+	g_free (f->channel);
+	free (f);
+}
+
+static void
+import_chunk_run (gpointer data, gpointer user_data)
+{
+	import_chunk *c = data;
+	const import_format *format = user_data;
+	import_parser p = {
+		.file = c->file,
+		.year = c->file->year,
+		.month = c->file->month,
+		.day = c->file->day,
+		.offset_hour = -1,
+		.batch = import_batch_new (),
+	};
+
+	const char *line = c->start, *end = c->start + c->len;
+	while (line < end) {
+		const char *nl = memchr (line, '\n', end - line);
+		const char *eol = nl != NULL ? nl : end;
+		size_t len = eol - line;
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		format->parse_line (&p, line, len);
+		p.lines++;
+		line = eol + 1;
+	}
+
+	import_submit (&p);
+	g_array_free (p.batch->rows, true);
+	g_string_chunk_free (p.batch->strings);
+	free (p.batch);
+
+	pthread_mutex_lock (&stats_mtx);
+	total_lines += p.lines;
+	total_rows += p.rows;
+	pthread_mutex_unlock (&stats_mtx);
+
+	if (g_atomic_int_dec_and_test (&c->file->chunks_left)) {
+		log_debug ("import: %s done\n", c->file->path);
+		import_file_free (c->file);
+	}
+	free (c);
+}
+
+/* Maps path and queues it in chunks ending at a newline */
+static void
+import_queue_file (GThreadPool *pool, const import_format *format, const char *path)
+{
+	struct stat st;
+	int fd = open (path, O_RDONLY);
+
+	if (fd < 0 || fstat (fd, &st) != 0) {
+		log_error ("import: %s: %s\n", path, strerror (errno));
+		if (fd >= 0)
+			close (fd);
+		return;
+	}
+	if (st.st_size == 0) {
+		close (fd);
+		return;
+	}
+
+	const char *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		log_error ("import: %s: %s\n", path, strerror (errno));
+		return;
+	}
+	madvise ((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+	import_file *f = calloc (1, sizeof (import_file));
+	f->path = g_strdup (path);
+	f->map = map;
+	f->size = st.st_size;
+	if (!format->file_init (f)) {
+		import_file_free (f);
+		return;
+	}
+
+	GPtrArray *chunks = g_ptr_array_new ();
+	size_t off = 0;
+	while (off < f->size) {
+		size_t stop = format->split ? off + IMPORT_CHUNK_SIZE : f->size;
+		if (stop >= f->size) {
+			stop = f->size;
+		} else {
+			const char *nl = memchr (map + stop, '\n', f->size - stop);
+			stop = nl != NULL ? (size_t)(nl - map) + 1 : f->size;
+		}
+
+		import_chunk *c = malloc (sizeof (import_chunk));
+		c->file = f;
+		c->start = map + off;
+		c->len = stop - off;
+		g_ptr_array_add (chunks, c);
+		off = stop;
+	}
+
+	/* Set before the first chunk can finish */
+	f->chunks_left = chunks->len;
+	for (guint i = 0; i < chunks->len; i++)
+		g_thread_pool_push (pool, g_ptr_array_index (chunks, i), NULL);
+	g_ptr_array_free (chunks, true);
+}
+
+static void
+import_queue_path (GThreadPool *pool, const import_format *format, const char *path)
+{
+	if (!g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		import_queue_file (pool, format, path);
+		return;
+	}
+
+	GDir *dir = g_dir_open (path, 0, NULL);
+	if (dir == NULL) {
+		log_error ("import: can not open %s\n", path);
+		return;
+	}
+
+	const char *name;
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (name[0] == '.')
+			continue;
+		char *child = g_build_filename (path, name, NULL);
+		import_queue_path (pool, format, child);
+		g_free (child);
+	}
+	g_dir_close (dir);
+}
+
+static void
+import_begin (db_conn *conn, void *data)
+{
+	sqlite3 *db = db_conn_handle (conn);
+
+	chanlog_schema_init (db);
+	chanlog_bulk_begin (db);
+	/* Room for the index builds at the end */
+	sqlite3_exec (db, "PRAGMA cache_size=-262144", NULL, NULL, NULL);
+}
+
+static void
+import_end (db_conn *conn, void *data)
+{
+	chanlog_bulk_end (db_conn_handle (conn));
+}
+
+static void
+import_usage (void)
+{
+	fprintf (stderr,
+		 "usage: circ --import <irssi|weechat|znc|raw> [--server <name>] <file|dir>...\n"
+		 "Client logs are read as local time, set TZ to the zone they were written in.\n"
+		 "Stop the bot while importing.\n");
+}
+
+int
+chanlog_import_main (int argc, char **argv)
+{
+	config_t *config = get_config ();
+	const import_format *format = NULL;
+	int i = 0;
+
+	for (size_t f = 0; argc > 0 && f < G_N_ELEMENTS (formats); f++)
+		if (strcmp (argv[0], formats[f].name) == 0)
+			format = &formats[f];
+	if (format == NULL) {
+		import_usage ();
+		return EXIT_FAILURE;
+	}
+	i++;
+
+	import_server = config->server->name;
+	if (i + 1 < argc && strcmp (argv[i], "--server") == 0) {
+		import_server = argv[i + 1];
+		i += 2;
+	}
+	if (i >= argc) {
+		import_usage ();
+		return EXIT_FAILURE;
+	}
+
+	/* Each writer transaction commits several batches, while the
+	 * parsers fill the next ones
+	 */
+	config->db_batch_size = IMPORT_IN_FLIGHT / 2;
+	if (db_init () != 0) {
+		log_error ("import: can not open %s\n", config->db_path);
+		return EXIT_FAILURE;
+	}
+	db_write (import_begin, NULL, NULL);
+
+	gint64 start = g_get_monotonic_time ();
+	GThreadPool *pool = g_thread_pool_new (import_chunk_run, (gpointer)format, g_get_num_processors (), true, NULL);
+	for (; i < argc; i++)
+		import_queue_path (pool, format, argv[i]);
+	g_thread_pool_free (pool, false, true);
+
+	log_info ("import: %" G_GUINT64_FORMAT " lines parsed, %" G_GUINT64_FORMAT " messages, indexing\n",
+		  (guint64)total_lines, (guint64)total_rows);
+	db_write (import_end, NULL, NULL);
+	db_shutdown ();
+
+	if (import_failed) {
+		log_error ("import: failed, not every message was written\n");
+		return EXIT_FAILURE;
+	}
+
+	double secs = (g_get_monotonic_time () - start) / 1e6;
+	log_info ("import: done in %.1fs, %.0f lines/s\n", secs, secs > 0 ? total_lines / secs : 0.0);
+	if (rows_archived > 0)
+		log_info ("import: %" G_GUINT64_FORMAT " messages skipped, their month is archived\n",
+			  (guint64)rows_archived);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,723 @@
+#define LOG_SUBSYS LOG_CHANLOG
+
+#include <errno.h>
+#include <glib.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chanlog.h"
+#include "config/config.h"
+#include "db/db.h"
+#include "log/log.h"
+#include "utlist/list.h"
+
+/*
+ * Logs are kept in one table per month, irc_logs_YYYY_MM, each with its
+ * own indexes and FTS5 index. Ids are unique across partitions: rows the
+ * bot logs count up from 1, each imported month gets a range of its own
+ * below that. An imported month can be newer than logged ones, so ids
+ * only order the rows of one partition and search pages with the month
+ * and id of a row. irc_logs is a view over every partition for modules
+ * that just want to read.
+ */
+
+/* Rows deleted per partition and policy on each idle run */
+#define CHANLOG_RETENTION_CHUNK 5000
+/* Pages given back to the filesystem on each idle run */
+#define CHANLOG_VACUUM_PAGES 1000
+/* Imported rows of a month take ids from a range of this size, the
+ * ranges of all months up to year 9999 fit below 0 in month order
+ */
+#define CHANLOG_IMPORT_RANGE ((int64_t)1 << 32)
+#define CHANLOG_IMPORT_MONTHS (1 << 17)
+
+/* archive is the file a partition was exported to, last_id its newest
+ * row so ids keep growing once the table itself is gone
+ */
+#define CHANLOG_CREATE_CATALOG                                             \
+	"CREATE TABLE IF NOT EXISTS irc_log_partitions (name TEXT PRIMARY "   \
+	"KEY, month TEXT NOT NULL, compacted INTEGER NOT NULL DEFAULT 0, "    \
+	"archive TEXT, last_id INTEGER)"
+
+/* Messages per hour per nick and channel, kept up to date on insert */
+#define CHANLOG_CREATE_ROLLUP                                              \
+	"CREATE TABLE IF NOT EXISTS irc_log_rollup (server TEXT, "            \
+	"channel TEXT, hour TEXT, nick TEXT, messages INTEGER NOT NULL, "     \
+	"PRIMARY KEY (server, channel, hour, nick)) WITHOUT ROWID"
+
+/* id is an alias of rowid so VACUUM keeps it stable for the FTS index */
+#define CHANLOG_CREATE_PARTITION                                                 \
+	"CREATE TABLE IF NOT EXISTS %1$s (id INTEGER PRIMARY KEY, "                 \
+	"time TIMESTAMP DEFAULT CURRENT_TIMESTAMP, server TEXT, "                   \
+	"channel TEXT, nick TEXT, message TEXT, action INTEGER);"                   \
+	"CREATE INDEX IF NOT EXISTS %1$s_channel_time ON %1$s "                     \
+	"(server, channel, time);"                                                  \
+	"CREATE INDEX IF NOT EXISTS %1$s_nick_time ON %1$s (nick, time);"           \
+	"CREATE VIRTUAL TABLE IF NOT EXISTS %1$s_fts USING fts5 "                   \
+	"(message, content='%1$s', content_rowid='id');"                            \
+	"CREATE TRIGGER IF NOT EXISTS %1$s_ai AFTER INSERT ON %1$s "                \
+	"BEGIN INSERT INTO %1$s_fts (rowid, message) "                              \
+	"VALUES (new.id, new.message); END;"                                        \
+	"CREATE TRIGGER IF NOT EXISTS %1$s_ad AFTER DELETE ON %1$s "                \
+	"BEGIN INSERT INTO %1$s_fts (%1$s_fts, rowid, message) "                    \
+	"VALUES ('delete', old.id, old.message); END;"                              \
+	"CREATE TRIGGER IF NOT EXISTS %1$s_au AFTER UPDATE ON %1$s "                \
+	"BEGIN INSERT INTO %1$s_fts (%1$s_fts, rowid, message) "                    \
+	"VALUES ('delete', old.id, old.message); "                                  \
+	"INSERT INTO %1$s_fts (rowid, message) VALUES (new.id, new.message); END;" \
+	"INSERT OR IGNORE INTO irc_log_partitions (name, month) VALUES ('%1$s', '%2$s')"
+
+#define CHANLOG_DROP_PARTITION                 \
+	"DROP TABLE IF EXISTS %1$s;"              \
+	"DROP TABLE IF EXISTS %1$s_fts;"          \
+	"DELETE FROM irc_log_partitions WHERE name = '%1$s'"
+
+/* Bulk loads write to bare tables, see chanlog_bulk_begin. A partition
+ * without its insert trigger was left so by an interrupted import
+ */
+#define CHANLOG_BULK_DROP                                        \
+	"DROP INDEX IF EXISTS %1$s_channel_time;"                   \
+	"DROP INDEX IF EXISTS %1$s_nick_time;"                      \
+	"DROP TRIGGER IF EXISTS %1$s_ai;"                           \
+	"DROP TRIGGER IF EXISTS %1$s_ad;"                           \
+	"DROP TRIGGER IF EXISTS %1$s_au"
+#define CHANLOG_BULK_REBUILD                                     \
+	"INSERT INTO %1$s_fts (%1$s_fts) VALUES ('rebuild');"       \
+	"UPDATE irc_log_partitions SET compacted = 0 WHERE name = '%1$s'"
+
+#define CHANLOG_BULK_STRIPPED                                    \
+	"SELECT 1 FROM sqlite_master WHERE name = '%s_ai' AND "     \
+	"type = 'trigger'"
+
+#define CHANLOG_LIST_PARTITIONS                                               \
+	"SELECT name, month, compacted, archive FROM irc_log_partitions ORDER " \
+	"BY month, rowid"
+#define CHANLOG_LIST_PARTITIONS_DESC                                          \
+	"SELECT name, month, compacted, archive FROM irc_log_partitions ORDER " \
+	"BY month DESC, rowid DESC"
+
+typedef struct archive_job
+{
+	char *name;
+	char *path;
+	int64_t last_id;
+} archive_job;
+
+/* Writer thread state */
+static char current_month[8];
+static char *current_table;
+static int64_t next_id;
+/* Last id given to an imported row of current_table */
+static int64_t import_id;
+/* Set while an archive export runs on its own thread */
+static gint archiving;
+/* The last export thread, joined before the next one starts or at
+ * shutdown, after which no more are started
+ */
+static pthread_mutex_t archive_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t archive_tid;
+static bool archive_started;
+static bool archive_stopped;
+/* Partitions created and stripped by a bulk load, name to month, NULL
+ * outside of one
+ */
+static GHashTable *bulk_tables;
+
+static void
+chanlog_exec (sqlite3 *db, const char *sql)
+{
+	char *errmsg = NULL;
+
+	if (sqlite3_exec (db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		log_error ("chanlog: %s\n", errmsg);
+		sqlite3_free (errmsg);
+	}
+}
+
+static bool
+schema_exists (sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	bool exists = false;
+
+	if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		exists = sqlite3_step (stmt) == SQLITE_ROW;
+		sqlite3_finalize (stmt);
+	}
+	return exists;
+}
+
+static void
+create_partition (sqlite3 *db, const char *name, const char *month)
+{
+	char *sql = g_strdup_printf (CHANLOG_CREATE_PARTITION, name, month);
+	chanlog_exec (db, sql);
+	g_free (sql);
+}
+
+GPtrArray *
+chanlog_list_partitions (sqlite3 *db, bool newest_first)
+{
+	sqlite3_stmt *stmt;
+	GPtrArray *parts = g_ptr_array_new ();
+	const char *sql = newest_first ? CHANLOG_LIST_PARTITIONS_DESC : CHANLOG_LIST_PARTITIONS;
+
+	if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return parts;
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		chanlog_partition *p = malloc (sizeof (chanlog_partition));
+		p->name = strdup ((const char *)sqlite3_column_text (stmt, 0));
+		g_strlcpy (p->month, (const char *)sqlite3_column_text (stmt, 1), sizeof (p->month));
+		p->compacted = sqlite3_column_int (stmt, 2);
+		p->archive = sqlite3_column_type (stmt, 3) == SQLITE_NULL
+			       ? NULL
+			       : strdup ((const char *)sqlite3_column_text (stmt, 3));
+		g_ptr_array_add (parts, p);
+	}
+	sqlite3_finalize (stmt);
+	return parts;
+}
+
+void
+chanlog_free_partitions (GPtrArray *parts)
+{
+	for (guint i = 0; i < parts->len; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		free (p->name);
+		free (p->archive);
+		free (p);
+	}
+	g_ptr_array_free (parts, true);
+}
+
+/* irc_logs is a plain union of every partition still in the database,
+ * rebuilt when one is added, archived or dropped
+ */
+static void
+rebuild_view (sqlite3 *db)
+{
+	GPtrArray *parts = chanlog_list_partitions (db, false);
+	GString *sql = g_string_new ("DROP VIEW IF EXISTS irc_logs;");
+
+	bool first = true;
+	for (guint i = 0; i < parts->len; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		if (p->archive != NULL)
+			continue;
+		g_string_append_printf (sql, "%sSELECT * FROM %s",
+					first ? "CREATE VIEW irc_logs AS " : " UNION ALL ",
+					p->name);
+		first = false;
+	}
+
+	chanlog_exec (db, sql->str);
+	g_string_free (sql, true);
+	chanlog_free_partitions (parts);
+}
+
+/*
+ * The single irc_logs table of older versions becomes partition
+ * irc_logs_legacy, dated by its newest row so retention only drops it
+ * once all of it has expired. Tables that already had ids keep them,
+ * search replies may have handed them out as page cursors.
+ */
+static void
+migrate_legacy (sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	char month[8] = "";
+	bool has_id = schema_exists (db, "SELECT 1 FROM pragma_table_info('irc_logs') WHERE name = 'id'");
+	const char *columns = has_id ? "id, time, server, channel, nick, message, action"
+				     : "time, server, channel, nick, message, action";
+
+	if (sqlite3_prepare_v2 (db, "SELECT substr(max(time), 1, 7) FROM irc_logs", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step (stmt) == SQLITE_ROW && sqlite3_column_text (stmt, 0) != NULL)
+			g_strlcpy (month, (const char *)sqlite3_column_text (stmt, 0), sizeof (month));
+		sqlite3_finalize (stmt);
+	}
+
+	if (month[0] != '\0') {
+		log_info ("chanlog: moving irc_logs into partition irc_logs_legacy\n");
+		create_partition (db, "irc_logs_legacy", month);
+		char *sql = g_strdup_printf ("INSERT INTO irc_logs_legacy (%1$s) SELECT %1$s FROM irc_logs ORDER BY rowid;"
+					     "INSERT INTO irc_log_rollup (server, channel, hour, nick, messages) "
+					     "SELECT server, channel, substr(time, 1, 13), nick, count(*) FROM irc_logs "
+					     "WHERE true GROUP BY 1, 2, 3, 4 ON CONFLICT DO UPDATE SET messages = messages + excluded.messages",
+					     columns);
+		chanlog_exec (db, sql);
+		g_free (sql);
+	}
+
+	/* With the table go its indexes and the triggers of the old FTS index */
+	chanlog_exec (db, "DROP TABLE irc_logs; DROP TABLE IF EXISTS irc_logs_fts");
+}
+
+/* Partitions left stripped by an import that did not finish get their
+ * indexes and FTS index back
+ */
+static void
+restore_stripped (sqlite3 *db)
+{
+	GPtrArray *parts = chanlog_list_partitions (db, false);
+
+	for (guint i = 0; i < parts->len; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		if (p->archive != NULL)
+			continue;
+
+		char *sql = g_strdup_printf (CHANLOG_BULK_STRIPPED, p->name);
+		bool stripped = !schema_exists (db, sql);
+		g_free (sql);
+		if (!stripped)
+			continue;
+
+		log_info ("chanlog: indexing %s, left unindexed by an import\n", p->name);
+		create_partition (db, p->name, p->month);
+		sql = g_strdup_printf (CHANLOG_BULK_REBUILD, p->name);
+		chanlog_exec (db, sql);
+		g_free (sql);
+	}
+	chanlog_free_partitions (parts);
+}
+
+/* First id of the import range of month, YYYY-MM */
+static int64_t
+import_range (const char *month)
+{
+	int index = atoi (month) * 12 + atoi (month + 5) - 1;
+	return -(CHANLOG_IMPORT_MONTHS - index) * CHANLOG_IMPORT_RANGE;
+}
+
+/* Imports of the same month continue after each other */
+static int64_t
+import_last_id (sqlite3 *db, const char *table, const char *month)
+{
+	int64_t first = import_range (month), last = first - 1;
+	char *sql = g_strdup_printf ("SELECT max(id) FROM %s WHERE id >= ?1 AND id < ?2", table);
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_bind_int64 (stmt, 1, first);
+		sqlite3_bind_int64 (stmt, 2, first + CHANLOG_IMPORT_RANGE);
+		if (sqlite3_step (stmt) == SQLITE_ROW && sqlite3_column_type (stmt, 0) != SQLITE_NULL)
+			last = sqlite3_column_int64 (stmt, 0);
+		sqlite3_finalize (stmt);
+	}
+	g_free (sql);
+	return last;
+}
+
+void
+chanlog_schema_init (sqlite3 *db)
+{
+	chanlog_exec (db, CHANLOG_CREATE_CATALOG);
+	if (!schema_exists (db, "SELECT 1 FROM pragma_table_info('irc_log_partitions') WHERE name = 'archive'"))
+		chanlog_exec (db, "ALTER TABLE irc_log_partitions ADD COLUMN archive TEXT;"
+				  "ALTER TABLE irc_log_partitions ADD COLUMN last_id INTEGER");
+	chanlog_exec (db, CHANLOG_CREATE_ROLLUP);
+
+	if (schema_exists (db, "SELECT 1 FROM sqlite_master WHERE name = 'irc_logs' AND type = 'table'"))
+		migrate_legacy (db);
+	restore_stripped (db);
+
+	rebuild_view (db);
+
+	/* Ids continue after the newest row of any partition or archive */
+	GPtrArray *parts = chanlog_list_partitions (db, false);
+	for (guint i = 0; i < parts->len; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		char *sql = p->archive != NULL
+			      ? g_strdup_printf ("SELECT last_id FROM irc_log_partitions WHERE name = '%s'", p->name)
+			      : g_strdup_printf ("SELECT max(id) FROM %s", p->name);
+		sqlite3_stmt *stmt;
+		if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+			if (sqlite3_step (stmt) == SQLITE_ROW && sqlite3_column_int64 (stmt, 0) > next_id)
+				next_id = sqlite3_column_int64 (stmt, 0);
+			sqlite3_finalize (stmt);
+		}
+		g_free (sql);
+	}
+	chanlog_free_partitions (parts);
+}
+
+const char *
+chanlog_partition_for (sqlite3 *db, const char *time)
+{
+	if (current_table != NULL && strncmp (time, current_month, 7) == 0)
+		return current_table;
+
+	g_strlcpy (current_month, time, sizeof (current_month));
+	g_free (current_table);
+	/* YYYY-MM to irc_logs_YYYY_MM */
+	current_table = g_strdup_printf ("irc_logs_%.4s_%.2s", current_month, current_month + 5);
+
+	char *sql = g_strdup_printf ("SELECT archive IS NULL FROM irc_log_partitions WHERE name = '%s'", current_table);
+	sqlite3_stmt *stmt;
+	int live = -1;
+	if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step (stmt) == SQLITE_ROW)
+			live = sqlite3_column_int (stmt, 0);
+		sqlite3_finalize (stmt);
+	}
+	g_free (sql);
+
+	if (live == 0) {
+		/* The month is archived, archives are never appended to */
+		g_free (current_table);
+		current_table = NULL;
+		return NULL;
+	}
+	if (live < 0) {
+		log_info ("chanlog: new partition %s\n", current_table);
+		create_partition (db, current_table, current_month);
+		rebuild_view (db);
+	}
+
+	if (bulk_tables != NULL) {
+		/* Partitions that were already there keep their indexes */
+		if (live < 0) {
+			sql = g_strdup_printf (CHANLOG_BULK_DROP, current_table);
+			chanlog_exec (db, sql);
+			g_free (sql);
+			g_hash_table_insert (bulk_tables, g_strdup (current_table), g_strdup (current_month));
+		}
+		import_id = import_last_id (db, current_table, current_month);
+	}
+
+	return current_table;
+}
+
+int64_t
+chanlog_next_id (void)
+{
+	return ++next_id;
+}
+
+int64_t
+chanlog_next_import_id (void)
+{
+	return ++import_id;
+}
+
+void
+chanlog_bulk_begin (sqlite3 *db)
+{
+	if (bulk_tables == NULL)
+		bulk_tables = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	/* The cached partition has to go through chanlog_partition_for again */
+	g_free (current_table);
+	current_table = NULL;
+}
+
+/* Indexes are built once over the loaded rows and the FTS index from
+ * the content table, both much cheaper than row by row maintenance
+ */
+void
+chanlog_bulk_end (sqlite3 *db)
+{
+	GHashTableIter iter;
+	gpointer name, month;
+
+	if (bulk_tables == NULL)
+		return;
+
+	g_hash_table_iter_init (&iter, bulk_tables);
+	while (g_hash_table_iter_next (&iter, &name, &month)) {
+		log_info ("chanlog: indexing %s\n", (char *)name);
+		create_partition (db, name, month);
+		char *sql = g_strdup_printf (CHANLOG_BULK_REBUILD, (char *)name);
+		chanlog_exec (db, sql);
+		g_free (sql);
+	}
+
+	g_hash_table_destroy (bulk_tables);
+	bulk_tables = NULL;
+}
+
+/* "YYYY-MM-DD HH:MM:SS" of now minus days, in UTC like the rows */
+static void
+cutoff_time (int days, char *buf, size_t len)
+{
+	time_t t = time (NULL) - (time_t)days * 24 * 60 * 60;
+	struct tm tm;
+	strftime (buf, len, "%Y-%m-%d %H:%M:%S", gmtime_r (&t, &tm));
+}
+
+static int
+delete_chunk (sqlite3 *db, const char *table, const char *where, const char *cutoff)
+{
+	char *sql = g_strdup_printf ("DELETE FROM %1$s WHERE id IN (SELECT id FROM %1$s WHERE %2$s LIMIT %3$d)",
+				     table, where, CHANLOG_RETENTION_CHUNK);
+	sqlite3_stmt *stmt;
+	int deleted = 0;
+
+	if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_bind_text (stmt, 1, cutoff, -1, SQLITE_STATIC);
+		if (sqlite3_step (stmt) == SQLITE_DONE)
+			deleted = sqlite3_changes (db);
+		sqlite3_finalize (stmt);
+	}
+	g_free (sql);
+	return deleted;
+}
+
+/*
+ * Retention: whole partitions go once every policy has expired them,
+ * otherwise expired rows are deleted a chunk at a time. Channels with
+ * their own policy are handled by it, the rest by retention_days.
+ * Archives are never rewritten, only deleted whole.
+ */
+static bool
+enforce_retention (sqlite3 *db, GPtrArray *parts)
+{
+	config_t *config = get_config ();
+	retention_policy *r;
+	char cutoff[20];
+	int max_days = config->chanlog_retention_days;
+
+	LL_FOREACH (config->chanlog_retention, r)
+	{
+		if (r->days <= 0 || max_days <= 0)
+			max_days = 0;
+		else if (r->days > max_days)
+			max_days = r->days;
+	}
+
+	if (max_days > 0) {
+		cutoff_time (max_days, cutoff, sizeof (cutoff));
+		for (guint i = 0; i < parts->len; i++) {
+			chanlog_partition *p = g_ptr_array_index (parts, i);
+			if (strncmp (p->month, cutoff, 7) < 0) {
+				log_info ("chanlog: dropping expired partition %s\n", p->name);
+				if (p->archive != NULL && unlink (p->archive) != 0)
+					log_error ("chanlog: %s: %s\n", p->archive, strerror (errno));
+				char *sql = g_strdup_printf (CHANLOG_DROP_PARTITION, p->name);
+				chanlog_exec (db, sql);
+				g_free (sql);
+				rebuild_view (db);
+				if (current_table != NULL && strcmp (current_table, p->name) == 0) {
+					g_free (current_table);
+					current_table = NULL;
+				}
+				return true;
+			}
+		}
+	}
+
+	LL_FOREACH (config->chanlog_retention, r)
+	{
+		if (r->days <= 0)
+			continue;
+		cutoff_time (r->days, cutoff, sizeof (cutoff));
+
+		char *where = sqlite3_mprintf ("server = %Q AND channel = %Q AND time < ?1",
+					       config->server->name, r->channel);
+		int deleted = 0;
+		for (guint i = 0; i < parts->len && deleted == 0; i++) {
+			chanlog_partition *p = g_ptr_array_index (parts, i);
+			if (p->archive == NULL && strncmp (p->month, cutoff, 7) <= 0)
+				deleted = delete_chunk (db, p->name, where, cutoff);
+		}
+		sqlite3_free (where);
+		if (deleted > 0)
+			return true;
+	}
+
+	if (config->chanlog_retention_days > 0) {
+		cutoff_time (config->chanlog_retention_days, cutoff, sizeof (cutoff));
+
+		GString *where = g_string_new ("time < ?1");
+		LL_FOREACH (config->chanlog_retention, r)
+		{
+			char *quoted = sqlite3_mprintf (" AND channel <> %Q", r->channel);
+			g_string_append (where, quoted);
+			sqlite3_free (quoted);
+		}
+
+		int deleted = 0;
+		for (guint i = 0; i < parts->len && deleted == 0; i++) {
+			chanlog_partition *p = g_ptr_array_index (parts, i);
+			if (p->archive == NULL && strncmp (p->month, cutoff, 7) <= 0)
+				deleted = delete_chunk (db, p->name, where->str, cutoff);
+		}
+		g_string_free (where, true);
+		if (deleted > 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* Partitions of past months are closed, merge their FTS b-trees once */
+static bool
+compact_closed_partition (sqlite3 *db, GPtrArray *parts)
+{
+	char month[8];
+	time_t now = time (NULL);
+	struct tm tm;
+	strftime (month, sizeof (month), "%Y-%m", gmtime_r (&now, &tm));
+
+	for (guint i = 0; i < parts->len; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		if (p->compacted || p->archive != NULL || strcmp (p->month, month) >= 0)
+			continue;
+
+		log_info ("chanlog: compacting %s\n", p->name);
+		char *sql = g_strdup_printf ("INSERT INTO %1$s_fts (%1$s_fts) VALUES ('optimize');"
+					     "ANALYZE %1$s;"
+					     "UPDATE irc_log_partitions SET compacted = 1 WHERE name = '%1$s'",
+					     p->name);
+		chanlog_exec (db, sql);
+		g_free (sql);
+		return true;
+	}
+	return false;
+}
+
+/* Writer side of a finished export: the rows now live in the archive */
+static void
+archive_commit (db_conn *conn, void *data)
+{
+	archive_job *job = data;
+	sqlite3 *db = db_conn_handle (conn);
+
+	char *sql = g_strdup_printf ("SELECT 1 FROM irc_log_partitions WHERE name = '%s'", job->name);
+	bool exists = schema_exists (db, sql);
+	g_free (sql);
+
+	if (!exists) {
+		/* Retention dropped the partition during the export */
+		unlink (job->path);
+	} else {
+		sql = sqlite3_mprintf ("DROP TABLE IF EXISTS %s; DROP TABLE IF EXISTS %s_fts;"
+				       "UPDATE irc_log_partitions SET archive = %Q, last_id = %lld WHERE name = '%s'",
+				       job->name, job->name, job->path, (long long)job->last_id, job->name);
+		chanlog_exec (db, sql);
+		sqlite3_free (sql);
+		rebuild_view (db);
+		if (current_table != NULL && strcmp (current_table, job->name) == 0) {
+			g_free (current_table);
+			current_table = NULL;
+		}
+		log_info ("chanlog: archived %s to %s\n", job->name, job->path);
+	}
+
+	g_atomic_int_set (&archiving, 0);
+}
+
+static void
+free_archive_job (void *data)
+{
+	archive_job *job = data;
+	g_free (job->name);
+	g_free (job->path);
+	free (job);
+}
+
+/* Exports on read connections, the writer is only needed to commit */
+static void *
+archive_thread (void *data)
+{
+	archive_job *job = data;
+	int rc = chanlog_archive_export (job->name, job->path, &job->last_id);
+
+	if (rc == 0) {
+		db_write (archive_commit, job, free_archive_job);
+	} else {
+		free_archive_job (job);
+		g_atomic_int_set (&archiving, 0);
+	}
+	return NULL;
+}
+
+/* Compacted partitions older than archive_after_days leave the database */
+static bool
+archive_closed_partition (GPtrArray *parts)
+{
+	config_t *config = get_config ();
+	char cutoff[20];
+
+	if (config->chanlog_archive_after_days <= 0 || g_atomic_int_get (&archiving))
+		return false;
+	cutoff_time (config->chanlog_archive_after_days, cutoff, sizeof (cutoff));
+
+	for (guint i = 0; i < parts->len; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		if (!p->compacted || p->archive != NULL || strncmp (p->month, cutoff, 7) >= 0)
+			continue;
+
+		if (g_mkdir_with_parents (config->chanlog_archive_dir, 0755) != 0) {
+			log_error ("chanlog: %s: %s\n", config->chanlog_archive_dir, strerror (errno));
+			return false;
+		}
+
+		archive_job *job = malloc (sizeof (archive_job));
+		job->name = g_strdup (p->name);
+		job->path = g_strdup_printf ("%s/%s.arc", config->chanlog_archive_dir, p->name);
+		job->last_id = 0;
+
+		pthread_mutex_lock (&archive_mtx);
+		/* Done with its export once archiving is clear */
+		if (archive_started)
+			pthread_join (archive_tid, NULL);
+		archive_started = false;
+		if (!archive_stopped) {
+			g_atomic_int_set (&archiving, 1);
+			archive_started = pthread_create (&archive_tid, NULL, archive_thread, job) == 0;
+			if (!archive_started) {
+				log_error ("chanlog: could not start archive thread\n");
+				g_atomic_int_set (&archiving, 0);
+			}
+		}
+		pthread_mutex_unlock (&archive_mtx);
+
+		if (!archive_started) {
+			free_archive_job (job);
+			return false;
+		}
+		log_info ("chanlog: archiving %s\n", p->name);
+		return true;
+	}
+	return false;
+}
+
+void
+chanlog_shutdown (void)
+{
+	pthread_mutex_lock (&archive_mtx);
+	archive_stopped = true;
+	if (archive_started) {
+		if (g_atomic_int_get (&archiving))
+			log_info ("chanlog: waiting for the archive export\n");
+		pthread_join (archive_tid, NULL);
+		archive_started = false;
+	}
+	pthread_mutex_unlock (&archive_mtx);
+}
+
+/*
+ * Idle job of the database writer. Does one step of retention,
+ * compaction or archiving per call and then hands some free pages back, so a long
+ * backlog of maintenance never holds the writer for long.
+ */
+void
+chanlog_maintain (db_conn *conn, void *data)
+{
+	sqlite3 *db = db_conn_handle (conn);
+	GPtrArray *parts = chanlog_list_partitions (db, false);
+
+	if (!enforce_retention (db, parts) && !compact_closed_partition (db, parts))
+		archive_closed_partition (parts);
+	chanlog_free_partitions (parts);
+
+	char *sql = g_strdup_printf ("PRAGMA incremental_vacuum(%d)", CHANLOG_VACUUM_PAGES);
+	chanlog_exec (db, sql);
+	g_free (sql);
+}
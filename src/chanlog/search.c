@@ -0,0 +1,319 @@
+#define LOG_SUBSYS LOG_CHANLOG
+
+#include <glib.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chanlog.h"
+#include "config/config.h"
+#include "db/db.h"
+#include "irc/hooks.h"
+#include "log/log.h"
+
+/* Rows replied per page of the search command */
+#define CHANLOG_SEARCH_PAGE 3
+/* Longest message quoted back, keeps replies under the line limit */
+#define CHANLOG_SEARCH_MAX_TEXT 300
+
+/* rowid order walks the FTS index of a partition backwards and stops
+ * after limit matches, the join only looks up the rows returned
+ */
+#define CHANLOG_SEARCH                                                   \
+	"SELECT l.id, l.time, l.channel, l.nick, l.message, l.action "      \
+	"FROM %1$s_fts f JOIN %1$s l ON l.id = f.rowid "                    \
+	"WHERE %1$s_fts MATCH ?1 AND l.server = ?2 "                        \
+	"AND (?3 IS NULL OR l.channel = ?3) AND f.rowid < ?4 "              \
+	"ORDER BY f.rowid DESC LIMIT ?5"
+
+typedef struct search_reply
+{
+	const irc_server *s;
+	const char *target;
+	chanlog_cursor last;
+} search_reply;
+
+/* Rows of one partition on their way to the caller's chanlog_row_fn */
+typedef struct partition_rows
+{
+	const char *month;
+	chanlog_row_fn fn;
+	void *data;
+} partition_rows;
+
+/* A search command on its way to a reader thread */
+typedef struct search_job
+{
+	const irc_server *s;
+	char *target;
+	char *query;
+	/* The words as typed, for the next page command */
+	char *words;
+	bool paged;
+	chanlog_cursor before;
+} search_job;
+
+static void
+chanlog_search_hook (const irc_server *s, const irc_msg *msg);
+static void
+search_run (db_conn *conn, void *data);
+
+/* Runs the FTS query on one partition still in the database */
+static int
+search_partition (db_conn *conn, const char *table, const char *server, const char *channel, const char *query, int64_t before, int limit, chanlog_row_fn fn, void *data)
+{
+	char *sql = g_strdup_printf (CHANLOG_SEARCH, table);
+	sqlite3_stmt *stmt = db_conn_prepare (conn, sql);
+	g_free (sql);
+	if (stmt == NULL)
+		return -1;
+
+	sqlite3_bind_text (stmt, 1, query, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 2, server, -1, SQLITE_STATIC);
+	if (channel != NULL)
+		sqlite3_bind_text (stmt, 3, channel, -1, SQLITE_STATIC);
+	sqlite3_bind_int64 (stmt, 4, before);
+	sqlite3_bind_int (stmt, 5, limit);
+
+	int n = 0, rc;
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		chanlog_row row = {
+			.id = sqlite3_column_int64 (stmt, 0),
+			.time = (const char *)sqlite3_column_text (stmt, 1),
+			.channel = (const char *)sqlite3_column_text (stmt, 2),
+			.nick = (const char *)sqlite3_column_text (stmt, 3),
+			.message = (const char *)sqlite3_column_text (stmt, 4),
+			.action = sqlite3_column_int (stmt, 5),
+		};
+		fn (&row, data);
+		n++;
+	}
+	if (rc != SQLITE_DONE) {
+		log_error ("chanlog: search %s: %s\n", table, sqlite3_errmsg (db_conn_handle (conn)));
+		n = -1;
+	}
+	sqlite3_reset (stmt);
+	return n;
+}
+
+static void
+partition_row (const chanlog_row *row, void *data)
+{
+	partition_rows *pr = data;
+	chanlog_row r = *row;
+
+	r.month = pr->month;
+	pr->fn (&r, pr->data);
+}
+
+bool
+chanlog_cursor_parse (const char *text, chanlog_cursor *cursor)
+{
+	char *end;
+
+	/* YYYY-MM:<id> */
+	if (strlen (text) < 9 || text[4] != '-' || text[7] != ':')
+		return false;
+	memcpy (cursor->month, text, 7);
+	cursor->month[7] = '\0';
+	cursor->id = g_ascii_strtoll (text + 8, &end, 10);
+	return end != text + 8 && (*end == '\0' || *end == ' ');
+}
+
+/*
+ * Partitions are visited newest first until limit rows are found. The
+ * cursor skips the partitions newer than its month and the rows of its
+ * month up to its id. Ids are only compared within a partition, since
+ * imported months have negative ones whatever their date.
+ */
+int
+chanlog_search (db_conn *conn, const char *server, const char *channel, const char *query, const chanlog_cursor *before, int limit, chanlog_row_fn fn, void *data)
+{
+	GPtrArray *parts = chanlog_list_partitions (db_conn_handle (conn), true);
+	int n = 0;
+
+	for (guint i = 0; i < parts->len && n < limit; i++) {
+		chanlog_partition *p = g_ptr_array_index (parts, i);
+		partition_rows pr = { .month = p->month, .fn = fn, .data = data };
+		int64_t before_id = INT64_MAX;
+		int found;
+
+		if (before != NULL) {
+			int cmp = strcmp (p->month, before->month);
+			if (cmp > 0)
+				continue;
+			if (cmp == 0)
+				before_id = before->id;
+		}
+
+		if (p->archive != NULL) {
+			chanlog_archive *a = chanlog_archive_open (p->archive);
+			if (a == NULL)
+				continue;
+			found = chanlog_archive_search (a, server, channel, query, before_id, limit - n, partition_row, &pr);
+			chanlog_archive_close (a);
+		} else {
+			found = search_partition (conn, p->name, server, channel, query, before_id, limit - n, partition_row, &pr);
+		}
+
+		if (found < 0) {
+			n = -1;
+			break;
+		}
+		n += found;
+	}
+
+	chanlog_free_partitions (parts);
+	return n;
+}
+
+char *
+chanlog_quote_query (const char *text)
+{
+	GString *q = g_string_new (NULL);
+	char **words = g_strsplit_set (text, " \t", -1);
+
+	for (char **w = words; *w != NULL; w++) {
+		if (**w == '\0')
+			continue;
+		if (q->len > 0)
+			g_string_append_c (q, ' ');
+		g_string_append_c (q, '"');
+		for (const char *c = *w; *c != '\0'; c++) {
+			if (*c == '"')
+				g_string_append_c (q, '"');
+			g_string_append_c (q, *c);
+		}
+		g_string_append_c (q, '"');
+	}
+
+	g_strfreev (words);
+	return g_string_free (q, false);
+}
+
+void
+chanlog_search_init (void)
+{
+	add_hook ("PRIVMSG", chanlog_search_hook);
+}
+
+static void
+reply_row (const chanlog_row *row, void *data)
+{
+	search_reply *r = data;
+	char *line;
+
+	if (row->action)
+		line = g_strdup_printf ("PRIVMSG %s :[%s] %s * %s %.*s\r\n",
+					r->target, row->time, row->channel, row->nick,
+					CHANLOG_SEARCH_MAX_TEXT, row->message);
+	else
+		line = g_strdup_printf ("PRIVMSG %s :[%s] %s <%s> %.*s\r\n",
+					r->target, row->time, row->channel, row->nick,
+					CHANLOG_SEARCH_MAX_TEXT, row->message);
+	irc_push_string (r->s, line);
+	g_free (line);
+
+	g_strlcpy (r->last.month, row->month, sizeof (r->last.month));
+	r->last.id = row->id;
+}
+
+/*
+ * <prefix>search [before:<month>:<id>] <words...>
+ * Replies with the newest matches of the channel it is sent to and the
+ * command for the next page. Only that channel is searched, so nobody
+ * reads the logs of a channel they are not in, and queries get nothing.
+ */
+static void
+chanlog_search_hook (const irc_server *s, const irc_msg *msg)
+{
+	config_t *config = get_config ();
+
+	if (msg->params == NULL || msg->params->len < 2 || msg->prefix == NULL)
+		return;
+
+	const char *text = msg->params->params[1];
+	size_t prefix_len = strlen (config->cmd_prefix);
+	if (strncmp (text, config->cmd_prefix, prefix_len) != 0 ||
+	    strncmp (text + prefix_len, "search ", 7) != 0)
+		return;
+	const char *args = text + prefix_len + 7;
+
+	const char *target = msg->params->params[0];
+	if (target[0] != '#') {
+		const char *bang = strchr (msg->prefix, '!');
+		char *nick = bang != NULL ? g_strndup (msg->prefix, bang - msg->prefix) : g_strdup (msg->prefix);
+		char *line = g_strdup_printf ("PRIVMSG %s :Search only works in a channel\r\n", nick);
+		irc_push_string (s, line);
+		g_free (line);
+		g_free (nick);
+		return;
+	}
+
+	const char *channel = target;
+	chanlog_cursor before;
+	bool paged = false;
+	for (;;) {
+		while (*args == ' ')
+			args++;
+		const char *end = args + strcspn (args, " ");
+		/* Naming the channel itself is fine, any other is refused */
+		if (*args == '#') {
+			if ((size_t)(end - args) != strlen (channel) || g_ascii_strncasecmp (args, channel, end - args) != 0) {
+				char *line = g_strdup_printf ("PRIVMSG %s :Only %s can be searched from here\r\n", target, channel);
+				irc_push_string (s, line);
+				g_free (line);
+				return;
+			}
+		} else if (strncmp (args, "before:", 7) == 0 && !paged && chanlog_cursor_parse (args + 7, &before))
+			paged = true;
+		else
+			break;
+		args = end;
+	}
+
+	/* FTS and archive blocks take a while, keep them off the loop */
+	search_job *job = g_new (search_job, 1);
+	job->s = s;
+	job->target = g_strdup (target);
+	job->query = chanlog_quote_query (args);
+	job->words = g_strdup (args);
+	job->paged = paged;
+	if (paged)
+		job->before = before;
+	db_read (search_run, job);
+}
+
+/* Runs on a reader thread, the replies are queued from there */
+static void
+search_run (db_conn *conn, void *data)
+{
+	config_t *config = get_config ();
+	search_job *job = data;
+	const char *target = job->target;
+
+	search_reply r = { .s = job->s, .target = target };
+	int n = conn != NULL && *job->query != '\0'
+		  ? chanlog_search (conn, irc_get_server_name (job->s), target, job->query, job->paged ? &job->before : NULL, CHANLOG_SEARCH_PAGE, reply_row, &r)
+		  : -1;
+
+	char *line = NULL;
+	if (n == 0)
+		line = g_strdup_printf ("PRIVMSG %s :No matches\r\n", target);
+	else if (n < 0)
+		line = g_strdup_printf ("PRIVMSG %s :Search failed\r\n", target);
+	else if (n == CHANLOG_SEARCH_PAGE)
+		line = g_strdup_printf ("PRIVMSG %s :More: %ssearch before:" CHANLOG_CURSOR_FORMAT " %s\r\n",
+					target, config->cmd_prefix, r.last.month, r.last.id, job->words);
+	if (line != NULL) {
+		irc_push_string (job->s, line);
+		g_free (line);
+	}
+	irc_wakeup (job->s);
+
+	g_free (job->target);
+	g_free (job->query);
+	g_free (job->words);
+	g_free (job);
+}
@@ -0,0 +1,156 @@
+#include <glib.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chanlog.h"
+#include "config/config.h"
+#include "db/db.h"
+#include "irc/hooks.h"
+#include "log/log.h"
+
+/* Nicks listed by the stats command */
+#define CHANLOG_STATS_TOP 5
+/* Days covered when none are given */
+#define CHANLOG_STATS_DAYS 7
+
+/* Both read the hourly rollup, one primary key range per channel */
+#define CHANLOG_STATS_TOTAL                                       \
+	"SELECT coalesce(sum(messages), 0) FROM irc_log_rollup "     \
+	"WHERE server = ?1 AND channel = ?2 AND hour >= ?3"
+#define CHANLOG_STATS_NICKS                                       \
+	"SELECT nick, sum(messages) AS n FROM irc_log_rollup "       \
+	"WHERE server = ?1 AND channel = ?2 AND hour >= ?3 "         \
+	"GROUP BY nick ORDER BY n DESC LIMIT ?4"
+
+/* A stats command on its way to a reader thread */
+typedef struct stats_job
+{
+	const irc_server *s;
+	char *target;
+	char *channel;
+	int days;
+	char since[14];
+} stats_job;
+
+static void
+chanlog_stats_hook (const irc_server *s, const irc_msg *msg);
+static void
+stats_run (db_conn *conn, void *data);
+
+void
+chanlog_stats_init (void)
+{
+	add_hook_nonessential ("PRIVMSG", chanlog_stats_hook);
+}
+
+static void
+bind_range (sqlite3_stmt *stmt, const char *server, const char *channel, const char *since)
+{
+	sqlite3_bind_text (stmt, 1, server, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 2, channel, -1, SQLITE_STATIC);
+	sqlite3_bind_text (stmt, 3, since, -1, SQLITE_STATIC);
+}
+
+/*
+ * <prefix>stats [#channel] [days]
+ * Replies with the message count and most active nicks of a channel.
+ */
+static void
+chanlog_stats_hook (const irc_server *s, const irc_msg *msg)
+{
+	config_t *config = get_config ();
+
+	if (msg->params == NULL || msg->params->len < 2)
+		return;
+
+	const char *text = msg->params->params[1];
+	size_t prefix_len = strlen (config->cmd_prefix);
+	if (strncmp (text, config->cmd_prefix, prefix_len) != 0 ||
+	    strncmp (text + prefix_len, "stats", 5) != 0 ||
+	    (text[prefix_len + 5] != '\0' && text[prefix_len + 5] != ' '))
+		return;
+
+	const char *target = msg->params->params[0];
+	if (target[0] != '#')
+		return;
+
+	char *channel = NULL;
+	int days = CHANLOG_STATS_DAYS;
+	char **args = g_strsplit (text + prefix_len + 5, " ", -1);
+	for (char **arg = args; *arg != NULL; arg++) {
+		if (**arg == '#')
+			channel = g_strdup (*arg);
+		else if (**arg != '\0' && atoi (*arg) > 0)
+			days = atoi (*arg);
+	}
+	g_strfreev (args);
+	if (channel == NULL)
+		channel = g_strdup (target);
+
+	stats_job *job = g_new (stats_job, 1);
+	job->s = s;
+	job->target = g_strdup (target);
+	job->channel = channel;
+	job->days = days;
+	time_t t = time (NULL) - (time_t)days * 24 * 60 * 60;
+	struct tm tm;
+	strftime (job->since, sizeof (job->since), "%Y-%m-%d %H", gmtime_r (&t, &tm));
+
+	/* A reader may be busy for a while, keep the loop out of the wait */
+	db_read (stats_run, job);
+}
+
+static void
+stats_job_free (stats_job *job)
+{
+	g_free (job->target);
+	g_free (job->channel);
+	g_free (job);
+}
+
+/* Runs on a reader thread, the reply is queued from there */
+static void
+stats_run (db_conn *conn, void *data)
+{
+	stats_job *job = data;
+	if (conn == NULL) {
+		stats_job_free (job);
+		return;
+	}
+
+	const char *server = irc_get_server_name (job->s);
+	int64_t total = 0;
+	GString *reply = g_string_new (NULL);
+
+	sqlite3_stmt *stmt = db_conn_prepare (conn, CHANLOG_STATS_TOTAL);
+	if (stmt != NULL) {
+		bind_range (stmt, server, job->channel, job->since);
+		if (sqlite3_step (stmt) == SQLITE_ROW)
+			total = sqlite3_column_int64 (stmt, 0);
+		sqlite3_reset (stmt);
+	}
+	g_string_append_printf (reply, "PRIVMSG %s :%s, last %d days: %" G_GINT64_FORMAT " messages",
+				job->target, job->channel, job->days, total);
+
+	stmt = total > 0 ? db_conn_prepare (conn, CHANLOG_STATS_NICKS) : NULL;
+	if (stmt != NULL) {
+		bind_range (stmt, server, job->channel, job->since);
+		sqlite3_bind_int (stmt, 4, CHANLOG_STATS_TOP);
+		for (int i = 0; sqlite3_step (stmt) == SQLITE_ROW; i++)
+			g_string_append_printf (reply, "%s%s (%" G_GINT64_FORMAT ")",
+						i == 0 ? ", top: " : ", ",
+						sqlite3_column_text (stmt, 0),
+						(gint64)sqlite3_column_int64 (stmt, 1));
+		sqlite3_reset (stmt);
+	}
+
+	g_string_append (reply, "\r\n");
+	irc_push_string (job->s, reply->str);
+	irc_wakeup (job->s);
+
+	g_string_free (reply, true);
+	stats_job_free (job);
+}
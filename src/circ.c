@@ -1,44 +1,86 @@
 #include <err.h>    // err for panics
 #include <errno.h>  // errno
+#include <signal.h> // signal, sig_atomic_t
 #include <unistd.h> // read, write
 
 #include <stdbool.h> // malloc
 #include <stdio.h>   // puts
 #include <stdlib.h>  // malloc
+#include <string.h>  // strcmp
 
 #include <glib.h>
 
 #include "config/config.h"
 
-#include "b64/b64.h"
 #include "utlist/list.h"
 
 #include "irc/hooks.h"
 #include "log/log.h"
-
+#include "metrics/metrics.h"
+#include "trace/alloc_trace.h"
+#include "trace/trace.h"
+
+#include "chanlog/chanlog.h"
+#include "db/db.h"
+#include "journal/journal.h"
+#include "replay/replay.h"
 #include "scheme/scheme.h"
 
+static volatile sig_atomic_t exit_signal;
+
+/*
+ * Only stops the event loop, main shuts down once it returns. A second
+ * signal is not caught, so it ends circ if the shutdown hangs.
+ */
 void
 exitHandler (int sig)
 {
-	log_debug ("Exiting\n");
-	config_t *config = get_config ();
-	quit_irc_connection (config->server);
-	free_config ();
+	exit_signal = sig;
+	signal (sig, SIG_DFL);
+	irc_stop (get_config ()->server);
 }
 
 int
 main (int argc, char **argv)
 {
-	signal (SIGHUP, exitHandler);
-	signal (SIGINT, exitHandler);
-	signal (SIGQUIT, exitHandler);
-	signal (SIGILL, exitHandler);
-	signal (SIGTRAP, exitHandler);
-	signal (SIGABRT, exitHandler);
+	/* Binary logs to text, needs no config */
+	if (argc == 3 && strcmp (argv[1], "--decode-log") == 0) {
+		FILE *in = fopen (argv[2], "rb");
+		if (in == NULL || log_decode (in, stdout) != 0)
+			errx (1, "%s: not a binary log", argv[2]);
+		fclose (in);
+		return 0;
+	}
+
+	/* Journal segments to a replay capture, needs no config either */
+	if (argc > 2 && strcmp (argv[1], "--dump-journal") == 0) {
+		bool all = strcmp (argv[2], "--all") == 0;
+		if (argc < (all ? 4 : 3))
+			errx (1, "usage: circ --dump-journal [--all] <dir|segment>...");
+		return journal_dump (stdout, argc - (all ? 3 : 2), argv + (all ? 3 : 2), all) == 0 ? 0 : 1;
+	}
 
 	const char *config_file_path = "./config.json";
 	parse_config (config_file_path);
+	log_init (&get_config ()->log);
+
+	/* Offline modes, no connection is made */
+	if (argc > 1 && strcmp (argv[1], "--import") == 0)
+		return chanlog_import_main (argc - 2, argv + 2);
+
+	metrics_init (&get_config ()->metrics);
+	trace_init (&get_config ()->trace);
+
+	/* Recorded traffic instead of a server */
+	if (argc > 1 && strcmp (argv[1], "--replay") == 0)
+		return replay_main (argc - 2, argv + 2);
+
+	journal_init (&get_config ()->journal);
+
+	signal (SIGHUP, exitHandler);
+	signal (SIGINT, exitHandler);
+	signal (SIGQUIT, exitHandler);
+	signal (SIGTERM, exitHandler);
 
 	struct config_t *config = get_config ();
 
@@ -62,11 +104,18 @@ main (int argc, char **argv)
 	}
 
 	init_hooks ();
+	register_core_hooks ();
+	db_init ();
+	chanlog_init ();
+
+	/* Modules are loaded in the background while we connect and
+	 * register, messages for them are buffered until they are ready
+	 */
 	setenv ("CHIBI_MODULE_PATH", "chibi-scheme/lib:scheme_libs", 1);
 	scm_init ();
-	register_core_hooks ();
 
 	log_info ("setting up connection\n");
+	irc_set_queue_options (&config->queue);
 	int ret = irc_server_connect (config->server);
 	if (ret == -1) {
 		err (1, "Error Connecting");
@@ -78,7 +127,15 @@ main (int argc, char **argv)
 	/* Init Event Loop handels auth via sasl and breaks on
 	 * receiving either a MODE or WELCOME message.
 	 */
-	irc_do_event_loop (config->server);
+	if (!exit_signal)
+		irc_do_event_loop (config->server);
+
+	log_debug ("Exiting\n");
+	quit_irc_connection (config->server);
+	chanlog_shutdown ();
+	db_shutdown ();
+	alloc_trace_report (stderr);
+	free_config ();
 
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include "config.h"
 #include "cJSON/cJSON.h"
+#include "cap/sasl.h"
 #include "irc/irc.h"
 #include "log/log.h"
 #include "utlist/list.h"
@@ -29,12 +30,21 @@ cjson_parse_string (const cJSON *json, char *field, char *defaultv)
 {
 	cJSON *value = cJSON_GetObjectItemCaseSensitive (json, field);
 	if (cJSON_IsString (value) && value->valuestring != NULL) {
-		strdup (value->valuestring);
+		return strdup (value->valuestring);
 	} else {
-		strdup (defaultv);
+		return strdup (defaultv);
 	}
 }
 
+static int
+cjson_parse_int (const cJSON *json, char *field, int defaultv)
+{
+	cJSON *value = cJSON_GetObjectItemCaseSensitive (json, field);
+	if (cJSON_IsNumber (value))
+		return value->valueint;
+	return defaultv;
+}
+
 static struct config_t *config;
 
 struct config_t *
@@ -55,8 +65,18 @@ free_config ()
 	free (config->server->user->realname);
 	free (config->server->user->sasl_user);
 	free (config->server->user->sasl_pass);
+	free (config->server->user->sasl_mechanism);
+	free (config->server->user->tls_cert);
+	free (config->server->user->tls_key);
 	free (config->server->user);
 
+	struct retention_policy *r, *rtmp;
+	LL_FOREACH_SAFE (config->chanlog_retention, r, rtmp) {
+		LL_DELETE (config->chanlog_retention, r);
+		free (r->channel);
+		free (r);
+	}
+
 	/* now delete each element, use the safe iterator */
 	struct irc_channel *l, *tmp;
 	LL_FOREACH_SAFE (config->server->channels, l, tmp) {
@@ -110,9 +130,105 @@ parse_config (const char *config_file_path)
 
 	config->debug = cjson_parse_bool (json, "debug", false);
 
+	/* Logging, debug alone still turns on debug messages */
+	cJSON *log = cJSON_GetObjectItemCaseSensitive (json, "log");
+	char *level = cjson_parse_string (log, "level", config->debug ? "debug" : "info");
+	config->log.level = log_level_from_name (level);
+	if (config->log.level < 0)
+		err (1, "config: unknown log level %s", level);
+	free (level);
+	for (int i = 0; i < LOG_SUBSYS_COUNT; i++)
+		config->log.levels[i] = -1;
+
+	cJSON *subsys = NULL;
+	cJSON *subsystems = cJSON_GetObjectItemCaseSensitive (log, "subsystems");
+	cJSON_ArrayForEach (subsys, subsystems)
+	{
+		int s = log_subsys_from_name (subsys->string);
+		int l = cJSON_IsString (subsys) ? log_level_from_name (subsys->valuestring) : -1;
+		if (s < 0 || l < 0)
+			err (1, "config: log: bad subsystem level %s", subsys->string);
+		config->log.levels[s] = l;
+	}
+
+	char *format = cjson_parse_string (log, "format", "text");
+	config->log.binary = strcmp (format, "binary") == 0;
+	free (format);
+	cJSON *file = cJSON_GetObjectItemCaseSensitive (log, "file");
+	config->log.path = cJSON_IsString (file) ? strdup (file->valuestring) : NULL;
+
+	/* Metrics export, off unless a socket or file is given */
+	cJSON *metrics = cJSON_GetObjectItemCaseSensitive (json, "metrics");
+	cJSON *socket = cJSON_GetObjectItemCaseSensitive (metrics, "socket");
+	config->metrics.socket = cJSON_IsString (socket) ? strdup (socket->valuestring) : NULL;
+	cJSON *textfile = cJSON_GetObjectItemCaseSensitive (metrics, "textfile");
+	config->metrics.textfile = cJSON_IsString (textfile) ? strdup (textfile->valuestring) : NULL;
+	config->metrics.interval_ms = cjson_parse_int (metrics, "interval_ms", 15000);
+
+	/* Message tracing, off unless a file is given */
+	cJSON *trace = cJSON_GetObjectItemCaseSensitive (json, "trace");
+	cJSON *trace_file = cJSON_GetObjectItemCaseSensitive (trace, "file");
+	config->trace.path = cJSON_IsString (trace_file) ? strdup (trace_file->valuestring) : NULL;
+	config->trace.sample = cjson_parse_int (trace, "sample", 100);
+
+	/* Raw traffic journal, off unless a directory is given */
+	cJSON *journal = cJSON_GetObjectItemCaseSensitive (json, "journal");
+	cJSON *journal_dir = cJSON_GetObjectItemCaseSensitive (journal, "dir");
+	config->journal.dir = cJSON_IsString (journal_dir) ? strdup (journal_dir->valuestring) : NULL;
+	config->journal.segment_size = (size_t)cjson_parse_int (journal, "segment_mb", 64) << 20;
+	config->journal.segments = cjson_parse_int (journal, "segments", 16);
+
+	/* Read queue bound and what to do when it is full */
+	cJSON *queue = cJSON_GetObjectItemCaseSensitive (json, "queue");
+	config->queue.max_lines = cjson_parse_int (queue, "max_lines", 2000);
+	config->queue.deadline_ms = cjson_parse_int (queue, "deadline_ms", 5000);
+	char *queue_policy = cjson_parse_string (queue, "policy", "shed");
+	if (strcmp (queue_policy, "shed") == 0)
+		config->queue.policy = IRC_QUEUE_SHED;
+	else if (strcmp (queue_policy, "block") == 0)
+		config->queue.policy = IRC_QUEUE_BLOCK;
+	else
+		err (1, "config: unknown queue policy %s", queue_policy);
+	free (queue_policy);
+
 	config->cmd_prefix = cjson_parse_string (json, "cmd_prefix", "%");
 	config->db_path = cjson_parse_string (json, "db_path", "db.sqlite3");
 	config->scheme_mod_dir = cjson_parse_string (json, "scheme_mod_dir", "scheme_mods/");
+	/* 0 means one loader thread per CPU */
+	config->scheme_load_threads = cjson_parse_int (json, "scheme_load_threads", 0);
+	config->scheme_hot_reload = cjson_parse_bool (json, "scheme_hot_reload", false);
+
+	/* Database service, parsed with defaults even if absent */
+	cJSON *db = cJSON_GetObjectItemCaseSensitive (json, "db");
+	config->db_readers = cjson_parse_int (db, "readers", 4);
+	config->db_flush_ms = cjson_parse_int (db, "flush_ms", 1000);
+	config->db_batch_size = cjson_parse_int (db, "batch_size", 512);
+	config->db_checkpoint_idle_ms = cjson_parse_int (db, "checkpoint_idle_ms", 5000);
+	config->db_wal_limit = cjson_parse_int (db, "wal_limit", 10000);
+
+	/* Channel logger */
+	config->chanlog_enabled = false;
+	config->chanlog_retention = NULL;
+	cJSON *chanlog = cJSON_GetObjectItemCaseSensitive (json, "chanlog");
+	if (cJSON_IsObject (chanlog))
+		config->chanlog_enabled = cjson_parse_bool (chanlog, "enabled", true);
+	config->chanlog_retention_days = cjson_parse_int (chanlog, "retention_days", 0);
+	/* 0 keeps closed partitions in the database */
+	config->chanlog_archive_after_days = cjson_parse_int (chanlog, "archive_after_days", 0);
+	config->chanlog_archive_dir = cjson_parse_string (chanlog, "archive_dir", "archive");
+
+	cJSON *policy = NULL;
+	cJSON *retention = cJSON_GetObjectItemCaseSensitive (chanlog, "retention");
+	cJSON_ArrayForEach (policy, retention)
+	{
+		if (!cJSON_IsNumber (policy))
+			err (1, "config: retention of %s is not a number", policy->string);
+
+		struct retention_policy *item = malloc (sizeof *item);
+		item->channel = strdup (policy->string);
+		item->days = policy->valueint;
+		LL_APPEND (config->chanlog_retention, item);
+	}
 
 	/* Parse Servers section */
 	cJSON *server = cJSON_GetObjectItemCaseSensitive (json, "server");
@@ -135,6 +251,13 @@ parse_config (const char *config_file_path)
 			config->server->user->sasl_enabled = cjson_parse_bool (user, "sasl_enabled", false);
 			config->server->user->sasl_user = cjson_parse_string (user, "sasl_user", "circ");
 			config->server->user->sasl_pass = cjson_parse_string (user, "sasl_pass", "circ");
+			config->server->user->sasl_mechanism = cjson_parse_string (user, "sasl_mechanism", "PLAIN");
+			if (!sasl_mechanism_supported (config->server->user->sasl_mechanism))
+				err (1, "config: unknown SASL mechanism %s", config->server->user->sasl_mechanism);
+			cJSON *cert = cJSON_GetObjectItemCaseSensitive (user, "tls_cert");
+			config->server->user->tls_cert = cJSON_IsString (cert) ? strdup (cert->valuestring) : NULL;
+			cJSON *key = cJSON_GetObjectItemCaseSensitive (user, "tls_key");
+			config->server->user->tls_key = cJSON_IsString (key) ? strdup (key->valuestring) : NULL;
 		}
 
 		/* Iter channels and add to the server */
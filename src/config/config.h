@@ -3,7 +3,11 @@
 
 #include <stdbool.h>
 
-#define DEBUG (get_config () && get_config ()->debug)
+#include "irc/irc.h"
+#include "journal/journal.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "trace/trace.h"
 
 typedef struct module_t
 {
@@ -14,12 +18,37 @@ typedef struct module_t
 	char **matchers;
 } module_t;
 
+/* Days of logs kept for one channel, 0 keeps them forever */
+typedef struct retention_policy
+{
+	char *channel;
+	int days;
+	struct retention_policy *next;
+} retention_policy;
+
 typedef struct config_t
 {
 	bool debug;
+	log_options log;
+	metrics_options metrics;
+	trace_options trace;
+	journal_options journal;
+	irc_queue_options queue;
 	char *cmd_prefix;
 	char *db_path;
 	char *scheme_mod_dir;
+	int scheme_load_threads;
+	bool scheme_hot_reload;
+	int db_readers;
+	int db_flush_ms;
+	int db_batch_size;
+	int db_checkpoint_idle_ms;
+	int db_wal_limit;
+	bool chanlog_enabled;
+	int chanlog_retention_days;
+	int chanlog_archive_after_days;
+	char *chanlog_archive_dir;
+	struct retention_policy *chanlog_retention;
 	struct irc_server *server;
 	struct module_t **modules;
 } config_t;
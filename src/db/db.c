@@ -0,0 +1,594 @@
+#define LOG_SUBSYS LOG_DB
+
+#include <errno.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config/config.h"
+#include "db.h"
+#include "log/log.h"
+
+/* Statements cached per connection, the least recently used go first */
+#define DB_STMT_CACHE_MAX 256
+
+typedef struct db_stmt
+{
+	char *sql;
+	sqlite3_stmt *stmt;
+	/* In db_conn.lru, most recently used first */
+	GList link;
+} db_stmt;
+
+struct db_conn
+{
+	sqlite3 *db;
+	GHashTable *stmts; /* sql -> db_stmt */
+	GQueue lru;
+};
+
+typedef struct db_job
+{
+	db_write_fn fn;
+	void *data;
+	db_free_fn free_fn;
+	struct db_job *next;
+} db_job;
+
+typedef struct db_idle_job
+{
+	db_write_fn fn;
+	void *data;
+	struct db_idle_job *next;
+} db_idle_job;
+
+typedef struct db_sql_job
+{
+	char *sql;
+	db_value *params;
+	size_t n_params;
+} db_sql_job;
+
+typedef struct db_read_job
+{
+	db_read_fn fn;
+	void *data;
+} db_read_job;
+
+typedef struct db_service
+{
+	db_conn *writer;
+	pthread_t writer_thread;
+	bool running;
+	int wal_frames;
+
+	/* write jobs waiting for the next batch, appended at tail */
+	db_job *queue;
+	db_job **queue_tail;
+	size_t queue_len;
+	struct timespec first_queued;
+	pthread_mutex_t queue_mtx;
+	pthread_cond_t queue_cond;
+
+	/* maintenance run when no writes are queued */
+	db_idle_job *idle_jobs;
+
+	/* idle read connections */
+	db_conn **readers;
+	int n_readers;
+	int n_idle;
+	pthread_mutex_t readers_mtx;
+	pthread_cond_t readers_cond;
+	/* runs db_read jobs, one thread per read connection */
+	GThreadPool *read_pool;
+} db_service;
+
+static db_service *dbs;
+
+static db_conn *
+db_conn_open (const char *path, int flags);
+static void
+db_conn_close (db_conn *conn);
+static void *
+db_writer_thread (void *data);
+static void
+db_run_batch (db_job *jobs);
+static void
+db_run_idle (void);
+static void
+db_checkpoint (void);
+static int
+db_wal_hook (void *data, sqlite3 *db, const char *name, int frames);
+static void
+db_read_worker (gpointer data, gpointer user_data);
+
+static void
+timespec_add_ms (struct timespec *ts, int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+int
+db_init (void)
+{
+	config_t *config = get_config ();
+
+	if (dbs != NULL)
+		return 0;
+
+	dbs = calloc (1, sizeof (db_service));
+
+	/* The writer creates the file and switches it to WAL before any
+	 * reader opens it read-only
+	 */
+	dbs->writer = db_conn_open (config->db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	if (dbs->writer == NULL) {
+		free (dbs);
+		dbs = NULL;
+		return -1;
+	}
+	sqlite3 *w = dbs->writer->db;
+	/* Only takes effect on a new database, lets idle jobs give
+	 * pages back to the filesystem a few at a time
+	 */
+	sqlite3_exec (w, "PRAGMA auto_vacuum=INCREMENTAL", NULL, NULL, NULL);
+	sqlite3_exec (w, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+	sqlite3_exec (w, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+	/* Checkpoints are run by the writer thread when it is idle */
+	sqlite3_wal_autocheckpoint (w, 0);
+	sqlite3_wal_hook (w, db_wal_hook, NULL);
+
+	dbs->n_readers = config->db_readers > 0 ? config->db_readers : 1;
+	dbs->readers = calloc (dbs->n_readers, sizeof (db_conn *));
+	for (int i = 0; i < dbs->n_readers; i++) {
+		db_conn *r = db_conn_open (config->db_path, SQLITE_OPEN_READONLY);
+		if (r == NULL)
+			break;
+		dbs->readers[dbs->n_idle++] = r;
+	}
+	dbs->n_readers = dbs->n_idle;
+	pthread_mutex_init (&dbs->readers_mtx, NULL);
+	pthread_cond_init (&dbs->readers_cond, NULL);
+	if (dbs->n_readers > 0)
+		dbs->read_pool = g_thread_pool_new (db_read_worker, NULL, dbs->n_readers, TRUE, NULL);
+
+	dbs->queue = NULL;
+	dbs->queue_tail = &dbs->queue;
+	dbs->running = true;
+	pthread_mutex_init (&dbs->queue_mtx, NULL);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&dbs->queue_cond, &attr);
+	pthread_condattr_destroy (&attr);
+
+	pthread_create (&dbs->writer_thread, NULL, db_writer_thread, NULL);
+
+	log_info ("db: %s, %d readers\n", config->db_path, dbs->n_readers);
+	return 0;
+}
+
+/* Commit whatever is still queued, checkpoint and close */
+void
+db_shutdown (void)
+{
+	if (dbs == NULL)
+		return;
+
+	/* Queued reads still run, their connections are closed below */
+	if (dbs->read_pool != NULL)
+		g_thread_pool_free (dbs->read_pool, FALSE, TRUE);
+
+	pthread_mutex_lock (&dbs->queue_mtx);
+	dbs->running = false;
+	pthread_cond_signal (&dbs->queue_cond);
+	pthread_mutex_unlock (&dbs->queue_mtx);
+
+	pthread_join (dbs->writer_thread, NULL);
+
+	db_idle_job *idle, *idle_next;
+	for (idle = dbs->idle_jobs; idle != NULL; idle = idle_next) {
+		idle_next = idle->next;
+		free (idle);
+	}
+
+	for (int i = 0; i < dbs->n_idle; i++)
+		db_conn_close (dbs->readers[i]);
+	free (dbs->readers);
+	db_conn_close (dbs->writer);
+
+	pthread_mutex_destroy (&dbs->queue_mtx);
+	pthread_cond_destroy (&dbs->queue_cond);
+	pthread_mutex_destroy (&dbs->readers_mtx);
+	pthread_cond_destroy (&dbs->readers_cond);
+	free (dbs);
+	dbs = NULL;
+}
+
+static void
+db_stmt_free (gpointer data)
+{
+	db_stmt *s = data;
+	sqlite3_finalize (s->stmt);
+	free (s->sql);
+	free (s);
+}
+
+static db_conn *
+db_conn_open (const char *path, int flags)
+{
+	sqlite3 *db;
+
+	if (sqlite3_open_v2 (path, &db, flags | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+		log_error ("db: cannot open %s: %s\n", path, sqlite3_errmsg (db));
+		sqlite3_close (db);
+		return NULL;
+	}
+	sqlite3_busy_timeout (db, 5000);
+
+	db_conn *conn = malloc (sizeof (db_conn));
+	conn->db = db;
+	conn->stmts = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, db_stmt_free);
+	g_queue_init (&conn->lru);
+	return conn;
+}
+
+static void
+db_conn_close (db_conn *conn)
+{
+	g_hash_table_destroy (conn->stmts);
+	sqlite3_close (conn->db);
+	free (conn);
+}
+
+sqlite3 *
+db_conn_handle (db_conn *conn)
+{
+	return conn->db;
+}
+
+sqlite3_stmt *
+db_conn_prepare (db_conn *conn, const char *sql)
+{
+	db_stmt *s = g_hash_table_lookup (conn->stmts, sql);
+	if (s != NULL) {
+		g_queue_unlink (&conn->lru, &s->link);
+		g_queue_push_head_link (&conn->lru, &s->link);
+		sqlite3_reset (s->stmt);
+		sqlite3_clear_bindings (s->stmt);
+		return s->stmt;
+	}
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2 (conn->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		log_error ("db: %s: %s\n", sql, sqlite3_errmsg (conn->db));
+		return NULL;
+	}
+
+	/* Modules generating SQL on the fly should not grow this forever,
+	 * the statements a job is still using were used last and stay
+	 */
+	if (g_hash_table_size (conn->stmts) >= DB_STMT_CACHE_MAX) {
+		db_stmt *old = g_queue_pop_tail_link (&conn->lru)->data;
+		g_hash_table_remove (conn->stmts, old->sql);
+	}
+
+	s = malloc (sizeof (db_stmt));
+	s->sql = strdup (sql);
+	s->stmt = stmt;
+	s->link = (GList){ .data = s };
+	g_queue_push_head_link (&conn->lru, &s->link);
+	g_hash_table_insert (conn->stmts, s->sql, s);
+	return stmt;
+}
+
+int
+db_bind_values (sqlite3_stmt *stmt, const db_value *params, size_t n_params)
+{
+	int rc = SQLITE_OK;
+
+	for (size_t i = 0; i < n_params && rc == SQLITE_OK; i++) {
+		const db_value *v = &params[i];
+		switch (v->type) {
+		case DB_NULL:
+			rc = sqlite3_bind_null (stmt, i + 1);
+			break;
+		case DB_INTEGER:
+			rc = sqlite3_bind_int64 (stmt, i + 1, v->i);
+			break;
+		case DB_FLOAT:
+			rc = sqlite3_bind_double (stmt, i + 1, v->f);
+			break;
+		case DB_TEXT:
+			rc = sqlite3_bind_text (stmt, i + 1, v->s.data, v->s.len, SQLITE_TRANSIENT);
+			break;
+		case DB_BLOB:
+			rc = sqlite3_bind_blob (stmt, i + 1, v->s.data, v->s.len, SQLITE_TRANSIENT);
+			break;
+		default:
+			rc = SQLITE_MISMATCH;
+			break;
+		}
+	}
+	return rc;
+}
+
+void
+db_free_values (db_value *params, size_t n_params)
+{
+	for (size_t i = 0; i < n_params; i++)
+		if (params[i].type == DB_TEXT || params[i].type == DB_BLOB)
+			free (params[i].s.data);
+	free (params);
+}
+
+void
+db_write (db_write_fn fn, void *data, db_free_fn free_fn)
+{
+	config_t *config = get_config ();
+
+	if (dbs == NULL) {
+		if (free_fn != NULL)
+			free_fn (data);
+		return;
+	}
+
+	db_job *job = malloc (sizeof (db_job));
+	job->fn = fn;
+	job->data = data;
+	job->free_fn = free_fn;
+	job->next = NULL;
+
+	pthread_mutex_lock (&dbs->queue_mtx);
+	if (dbs->queue == NULL) {
+		clock_gettime (CLOCK_MONOTONIC, &dbs->first_queued);
+		pthread_cond_signal (&dbs->queue_cond);
+	}
+	*dbs->queue_tail = job;
+	dbs->queue_tail = &job->next;
+	dbs->queue_len++;
+	if (dbs->queue_len >= (size_t)config->db_batch_size)
+		pthread_cond_signal (&dbs->queue_cond);
+	pthread_mutex_unlock (&dbs->queue_mtx);
+}
+
+static void
+db_sql_job_run (db_conn *conn, void *data)
+{
+	db_sql_job *job = data;
+
+	sqlite3_stmt *stmt = db_conn_prepare (conn, job->sql);
+	if (stmt == NULL)
+		return;
+
+	int rc = db_bind_values (stmt, job->params, job->n_params);
+	while (rc == SQLITE_OK || rc == SQLITE_ROW)
+		rc = sqlite3_step (stmt);
+	if (rc != SQLITE_DONE)
+		log_error ("db: %s: %s\n", job->sql, sqlite3_errmsg (conn->db));
+	sqlite3_reset (stmt);
+}
+
+static void
+db_sql_job_free (void *data)
+{
+	db_sql_job *job = data;
+	free (job->sql);
+	db_free_values (job->params, job->n_params);
+	free (job);
+}
+
+void
+db_write_sql (const char *sql, db_value *params, size_t n_params)
+{
+	db_sql_job *job = malloc (sizeof (db_sql_job));
+	job->sql = strdup (sql);
+	job->params = params;
+	job->n_params = n_params;
+	db_write (db_sql_job_run, job, db_sql_job_free);
+}
+
+void
+db_on_idle (db_write_fn fn, void *data)
+{
+	if (dbs == NULL)
+		return;
+
+	db_idle_job *job = malloc (sizeof (db_idle_job));
+	job->fn = fn;
+	job->data = data;
+
+	pthread_mutex_lock (&dbs->queue_mtx);
+	job->next = dbs->idle_jobs;
+	dbs->idle_jobs = job;
+	pthread_mutex_unlock (&dbs->queue_mtx);
+}
+
+static void
+db_read_worker (gpointer data, gpointer user_data)
+{
+	db_read_job *job = data;
+	db_conn *conn = db_reader_acquire ();
+
+	job->fn (conn, job->data);
+	if (conn != NULL)
+		db_reader_release (conn);
+	free (job);
+}
+
+void
+db_read (db_read_fn fn, void *data)
+{
+	if (dbs == NULL || dbs->read_pool == NULL) {
+		fn (NULL, data);
+		return;
+	}
+
+	db_read_job *job = malloc (sizeof (db_read_job));
+	job->fn = fn;
+	job->data = data;
+	g_thread_pool_push (dbs->read_pool, job, NULL);
+}
+
+db_conn *
+db_reader_acquire (void)
+{
+	if (dbs == NULL || dbs->n_readers == 0)
+		return NULL;
+
+	pthread_mutex_lock (&dbs->readers_mtx);
+	while (dbs->n_idle == 0)
+		pthread_cond_wait (&dbs->readers_cond, &dbs->readers_mtx);
+	db_conn *conn = dbs->readers[--dbs->n_idle];
+	pthread_mutex_unlock (&dbs->readers_mtx);
+	return conn;
+}
+
+void
+db_reader_release (db_conn *conn)
+{
+	pthread_mutex_lock (&dbs->readers_mtx);
+	dbs->readers[dbs->n_idle++] = conn;
+	pthread_cond_signal (&dbs->readers_cond);
+	pthread_mutex_unlock (&dbs->readers_mtx);
+}
+
+/*
+ * Waits until either the batch is full or the oldest queued job has
+ * waited db_flush_ms, then runs the whole queue in one transaction.
+ * With nothing queued for db_checkpoint_idle_ms the idle jobs run and
+ * the WAL is checkpointed, so both stay out of the way of busy periods.
+ */
+static void *
+db_writer_thread (void *data)
+{
+	config_t *config = get_config ();
+	struct timespec deadline;
+
+	pthread_mutex_lock (&dbs->queue_mtx);
+	for (;;) {
+		while (dbs->running && dbs->queue == NULL) {
+			clock_gettime (CLOCK_MONOTONIC, &deadline);
+			timespec_add_ms (&deadline, config->db_checkpoint_idle_ms);
+			int rc = pthread_cond_timedwait (&dbs->queue_cond, &dbs->queue_mtx, &deadline);
+			if (rc == ETIMEDOUT && dbs->queue == NULL) {
+				pthread_mutex_unlock (&dbs->queue_mtx);
+				db_run_idle ();
+				if (dbs->wal_frames > 0)
+					db_checkpoint ();
+				pthread_mutex_lock (&dbs->queue_mtx);
+			}
+		}
+
+		deadline = dbs->first_queued;
+		timespec_add_ms (&deadline, config->db_flush_ms);
+		while (dbs->running &&
+		       dbs->queue_len < (size_t)config->db_batch_size &&
+		       pthread_cond_timedwait (&dbs->queue_cond, &dbs->queue_mtx, &deadline) != ETIMEDOUT)
+			;
+
+		db_job *jobs = dbs->queue;
+		dbs->queue = NULL;
+		dbs->queue_tail = &dbs->queue;
+		dbs->queue_len = 0;
+		bool running = dbs->running;
+		pthread_mutex_unlock (&dbs->queue_mtx);
+
+		if (jobs != NULL)
+			db_run_batch (jobs);
+
+		/* Never let the WAL grow without bound under constant load */
+		if (dbs->wal_frames >= config->db_wal_limit || !running)
+			db_checkpoint ();
+
+		if (!running)
+			return NULL;
+
+		pthread_mutex_lock (&dbs->queue_mtx);
+	}
+}
+
+static void
+db_run_batch (db_job *jobs)
+{
+	db_job *job, *next;
+	sqlite3 *w = dbs->writer->db;
+
+	/* Outside a transaction every job would commit on its own, and
+	 * the COMMIT or ROLLBACK below would mean nothing
+	 */
+	bool failed = sqlite3_exec (w, "BEGIN", NULL, NULL, NULL) != SQLITE_OK;
+	if (failed)
+		log_error ("db: begin failed, dropping the batch: %s\n", sqlite3_errmsg (w));
+
+	for (job = jobs; job != NULL; job = next) {
+		next = job->next;
+		if (!failed)
+			job->fn (dbs->writer, job->data);
+		if (job->free_fn != NULL)
+			job->free_fn (job->data);
+		free (job);
+	}
+
+	if (failed)
+		return;
+	if (sqlite3_exec (w, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		log_error ("db: commit failed: %s\n", sqlite3_errmsg (w));
+		sqlite3_exec (w, "ROLLBACK", NULL, NULL, NULL);
+	}
+}
+
+static void
+db_run_idle (void)
+{
+	sqlite3 *w = dbs->writer->db;
+
+	/* Jobs are only ever prepended, the list read here stays valid */
+	pthread_mutex_lock (&dbs->queue_mtx);
+	db_idle_job *jobs = dbs->idle_jobs;
+	pthread_mutex_unlock (&dbs->queue_mtx);
+
+	if (jobs == NULL)
+		return;
+
+	if (sqlite3_exec (w, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		log_error ("db: idle begin failed: %s\n", sqlite3_errmsg (w));
+		return;
+	}
+	for (db_idle_job *job = jobs; job != NULL; job = job->next)
+		job->fn (dbs->writer, job->data);
+	if (sqlite3_exec (w, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		log_error ("db: idle commit failed: %s\n", sqlite3_errmsg (w));
+		sqlite3_exec (w, "ROLLBACK", NULL, NULL, NULL);
+	}
+}
+
+static void
+db_checkpoint (void)
+{
+	int log_frames, checkpointed;
+
+	if (sqlite3_wal_checkpoint_v2 (dbs->writer->db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed) != SQLITE_OK)
+		return;
+
+	/* A reader may still pin part of the WAL, whatever was not
+	 * copied back is retried on the next idle period
+	 */
+	dbs->wal_frames = log_frames - checkpointed;
+}
+
+static int
+db_wal_hook (void *data, sqlite3 *db, const char *name, int frames)
+{
+	dbs->wal_frames = frames;
+	return SQLITE_OK;
+}
@@ -0,0 +1,90 @@
+#ifndef DB_H
+#define DB_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Database service
+ * One writer connection fed by a serialized write queue, committed in
+ * batches from its own thread, and a pool of WAL read connections for
+ * concurrent lookups. Every user of the database goes through here.
+ */
+
+typedef enum db_value_type
+{
+	DB_NULL,
+	DB_INTEGER,
+	DB_FLOAT,
+	DB_TEXT,
+	DB_BLOB,
+} db_value_type;
+
+typedef struct db_value
+{
+	db_value_type type;
+	union
+	{
+		int64_t i;
+		double f;
+		struct
+		{
+			char *data;
+			size_t len;
+		} s;
+	};
+} db_value;
+
+/* A connection together with its prepared statement cache */
+typedef struct db_conn db_conn;
+
+typedef void (*db_write_fn) (db_conn *conn, void *data);
+typedef void (*db_read_fn) (db_conn *conn, void *data);
+typedef void (*db_free_fn) (void *data);
+
+int
+db_init (void);
+void
+db_shutdown (void);
+
+/* Queue fn to run on the writer connection inside the next batch
+ * transaction, free_fn is called on data afterwards
+ */
+void
+db_write (db_write_fn fn, void *data, db_free_fn free_fn);
+/* Queue sql with the given parameters, takes ownership of params */
+void
+db_write_sql (const char *sql, db_value *params, size_t n_params);
+
+/* Run fn on the writer connection, in a transaction, every time the
+ * write queue has been empty for db_checkpoint_idle_ms. Jobs should do
+ * a bounded amount of work per call.
+ */
+void
+db_on_idle (db_write_fn fn, void *data);
+
+/* Run fn on a read connection on one of the db threads, returns without
+ * waiting. conn is NULL when the database is not available.
+ */
+void
+db_read (db_read_fn fn, void *data);
+
+/* Borrow a read connection from the pool, blocks if all are in use */
+db_conn *
+db_reader_acquire (void);
+void
+db_reader_release (db_conn *conn);
+
+sqlite3 *
+db_conn_handle (db_conn *conn);
+/* Returns the cached statement for sql on conn, reset and unbound */
+sqlite3_stmt *
+db_conn_prepare (db_conn *conn, const char *sql);
+
+int
+db_bind_values (sqlite3_stmt *stmt, const db_value *params, size_t n_params);
+void
+db_free_values (db_value *params, size_t n_params);
+
+#endif /* DB_H */
@@ -0,0 +1,317 @@
+#define LOG_SUBSYS LOG_CORE
+
+#include <errno.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "replay.h"
+#include "chanlog/chanlog.h"
+#include "config/config.h"
+#include "db/db.h"
+#include "irc/hooks.h"
+#include "irc/irc.h"
+#include "log/log.h"
+#include "scheme/scheme.h"
+#include "trace/alloc_trace.h"
+
+/*
+ * A capture is a file of IRC lines as received, like the raw import
+ * format: each is timed by an ISO 8601 UTC timestamp in front of it or
+ * by its IRCv3 time tag, and untimed lines follow the one before.
+ *
+ *     2024-03-01T12:00:00.250Z :nick!u@h PRIVMSG #chan :hello
+ *
+ * Lines are read into memory before the replay starts, so the disk is
+ * not part of what is measured. As fast as possible, the latency of a
+ * line is the time it takes to handle. In real time, lines are due at
+ * their recorded offset on a virtual clock running at --speed times the
+ * wall clock, and the latency is from when a line was due until it was
+ * handled, so a backlog after a spike counts against every line in it.
+ */
+
+/* Seconds to wait for the modules to load */
+#define REPLAY_LOAD_TIMEOUT 60
+
+typedef struct replay_line
+{
+	char *line;
+	/* Recorded UTC time in ns, 0 if untimed */
+	int64_t time_ns;
+} replay_line;
+
+static int64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* YYYY-MM-DDTHH:MM:SS[.fff][Z] to ns since the epoch, 0 if it is not one */
+static int64_t
+parse_iso_ns (const char *s, const char **end)
+{
+	struct tm tm = { 0 };
+	int n = 0;
+
+	if (sscanf (s, "%4d-%2d-%2d%*1[T ]%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 6 || n == 0)
+		return 0;
+	s += n;
+
+	int64_t frac = 0, scale = 1000000000;
+	if (*s == '.')
+		for (s++; g_ascii_isdigit (*s); s++)
+			if (scale > 1) {
+				scale /= 10;
+				frac += (*s - '0') * scale;
+			}
+	if (*s == 'Z')
+		s++;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*end = s;
+	return (int64_t)timegm (&tm) * 1000000000 + frac;
+}
+
+static int64_t
+tag_time_ns (const char *line)
+{
+	if (line[0] != '@')
+		return 0;
+
+	/* Only tags, no command to replay */
+	const char *tags_end = strchr (line, ' ');
+	if (tags_end == NULL)
+		return 0;
+
+	for (const char *t = line + 1; t != NULL && t < tags_end; t = strchr (t, ';')) {
+		if (*t == ';')
+			t++;
+		if (strncmp (t, "time=", 5) == 0) {
+			const char *end;
+			return parse_iso_ns (t + 5, &end);
+		}
+	}
+	return 0;
+}
+
+static GArray *
+load_capture (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	if (f == NULL) {
+		log_error ("replay: %s: %s\n", path, strerror (errno));
+		return NULL;
+	}
+
+	GArray *lines = g_array_new (false, false, sizeof (replay_line));
+	char *buf = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline (&buf, &cap, f)) > 0) {
+		while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+			buf[--len] = '\0';
+
+		const char *s = buf;
+		replay_line l = { 0 };
+		if (g_ascii_isdigit (*s)) {
+			l.time_ns = parse_iso_ns (s, &s);
+			while (*s == ' ')
+				s++;
+		}
+		/* No IRC line starts with #, those are comments */
+		if (*s == '\0' || *s == '#')
+			continue;
+		if (l.time_ns == 0)
+			l.time_ns = tag_time_ns (s);
+
+		/* As irc_read_message hands them over */
+		l.line = g_strdup_printf ("%s\r\n", s);
+		g_array_append_val (lines, l);
+	}
+	free (buf);
+	fclose (f);
+	return lines;
+}
+
+static int
+compare_i64 (const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us (const int64_t *sorted, size_t n, double p)
+{
+	if (n == 0)
+		return 0;
+	size_t i = (size_t)(p * (n - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+static void
+replay_usage (void)
+{
+	fprintf (stderr,
+		 "usage: circ --replay [--realtime] [--speed <factor>] [--out <file>] [--db <file>]\n"
+		 "                     [--alloc-budget <allocations>] <capture>\n"
+		 "Lines sent by the bot go to --out, by default they are dropped.\n"
+		 "The channel log and modules use --db, replay.sqlite3 by default.\n"
+		 "--alloc-budget fails the replay if the second half of it allocated more\n"
+		 "per message, in builds with CIRC_ALLOC_TRACE.\n");
+}
+
+int
+replay_main (int argc, char **argv)
+{
+	config_t *config = get_config ();
+	const char *out_path = NULL;
+	const char *capture_path = NULL;
+	/* Never the database of the running bot */
+	const char *db_path = "replay.sqlite3";
+	bool realtime = false;
+	/* Allocations per message allowed in the steady state, < 0 for any */
+	double alloc_budget = -1;
+	double speed = 1.0;
+
+	for (int i = 0; i < argc; i++) {
+		if (strcmp (argv[i], "--realtime") == 0) {
+			realtime = true;
+		} else if (strcmp (argv[i], "--speed") == 0 && i + 1 < argc) {
+			speed = g_ascii_strtod (argv[++i], NULL);
+			realtime = true;
+		} else if (strcmp (argv[i], "--out") == 0 && i + 1 < argc) {
+			out_path = argv[++i];
+		} else if (strcmp (argv[i], "--alloc-budget") == 0 && i + 1 < argc) {
+			alloc_budget = g_ascii_strtod (argv[++i], NULL);
+		} else if (strcmp (argv[i], "--db") == 0 && i + 1 < argc) {
+			db_path = argv[++i];
+		} else if (capture_path == NULL && argv[i][0] != '-') {
+			capture_path = argv[i];
+		} else {
+			replay_usage ();
+			return EXIT_FAILURE;
+		}
+	}
+	if (capture_path == NULL || speed <= 0) {
+		replay_usage ();
+		return EXIT_FAILURE;
+	}
+#ifndef CIRC_ALLOC_TRACE
+	if (alloc_budget >= 0) {
+		log_error ("replay: --alloc-budget needs a build with CIRC_ALLOC_TRACE\n");
+		return EXIT_FAILURE;
+	}
+#endif
+	config->db_path = g_strdup (db_path);
+
+	GArray *lines = load_capture (capture_path);
+	if (lines == NULL)
+		return EXIT_FAILURE;
+
+	FILE *out = NULL;
+	if (out_path != NULL && (out = fopen (out_path, "w")) == NULL) {
+		log_error ("replay: %s: %s\n", out_path, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	const irc_server *s = config->server;
+	init_hooks ();
+	register_core_hooks ();
+	if (db_init () != 0) {
+		log_error ("replay: can not open %s\n", config->db_path);
+		return EXIT_FAILURE;
+	}
+	chanlog_init ();
+	setenv ("CHIBI_MODULE_PATH", "chibi-scheme/lib:scheme_libs", 1);
+	scm_init ();
+	if (irc_server_connect_offline (s, out) != 0) {
+		log_error ("replay: can not set up the connection\n");
+		return EXIT_FAILURE;
+	}
+
+	/* The live bot buffers messages until the modules are loaded, a
+	 * replay waits instead so the load is not part of the latencies
+	 */
+	for (int waited = 0; !scm_modules_ready (); waited++) {
+		if (waited > REPLAY_LOAD_TIMEOUT * 100) {
+			log_error ("replay: modules did not load in %d seconds\n", REPLAY_LOAD_TIMEOUT);
+			return EXIT_FAILURE;
+		}
+		usleep (10000);
+	}
+	exec_hooks (s, "PREINIT", NULL);
+	irc_flush_write_queue (s);
+
+	int64_t *latency = g_new (int64_t, lines->len);
+	int64_t first_time = 0, last_time = 0, max_lag = 0;
+	int64_t start = now_ns ();
+
+	for (guint i = 0; i < lines->len; i++) {
+		replay_line *l = &g_array_index (lines, replay_line, i);
+		/* The first half warms up caches, tables and modules */
+		if (i == lines->len / 2)
+			alloc_trace_reset ();
+		if (l->time_ns != 0)
+			last_time = l->time_ns;
+		if (first_time == 0)
+			first_time = last_time;
+
+		int64_t due = now_ns ();
+		if (realtime && last_time != 0) {
+			due = start + (int64_t)((last_time - first_time) / speed);
+			struct timespec ts = { due / 1000000000, due % 1000000000 };
+			while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+			int64_t lag = now_ns () - due;
+			if (lag > max_lag)
+				max_lag = lag;
+		}
+
+		irc_handle_line (s, l->line);
+		latency[i] = now_ns () - due;
+	}
+
+	int64_t elapsed = now_ns () - start;
+
+	size_t n = lines->len;
+	qsort (latency, n, sizeof (int64_t), compare_i64);
+	printf ("{\n  \"capture\": \"%s\",\n  \"mode\": \"%s\",\n  \"speed\": %.2f,\n", capture_path, realtime ? "realtime" : "fast", realtime ? speed : 0);
+	printf ("  \"lines\": %zu,\n  \"recorded_seconds\": %.3f,\n  \"elapsed_seconds\": %.3f,\n", n, (last_time - first_time) / 1e9, elapsed / 1e9);
+	printf ("  \"lines_per_sec\": %.0f,\n  \"max_lag_us\": %.1f,\n", elapsed > 0 ? n * 1e9 / elapsed : 0, max_lag / 1000.0);
+	printf ("  \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}\n}\n",
+		percentile_us (latency, n, 0.5),
+		percentile_us (latency, n, 0.9),
+		percentile_us (latency, n, 0.99),
+		percentile_us (latency, n, 0.999),
+		n > 0 ? latency[n - 1] / 1000.0 : 0);
+
+	alloc_totals allocs;
+	alloc_trace_totals (&allocs);
+	double allocs_per_msg = allocs.messages > 0 ? (double)allocs.allocs / allocs.messages : 0;
+	alloc_trace_report (stderr);
+	int ret = EXIT_SUCCESS;
+	if (alloc_budget >= 0 && allocs_per_msg > alloc_budget) {
+		log_error ("replay: %.2f allocations per message, the budget is %.2f\n", allocs_per_msg, alloc_budget);
+		ret = EXIT_FAILURE;
+	}
+
+	for (guint i = 0; i < lines->len; i++)
+		g_free (g_array_index (lines, replay_line, i).line);
+	g_array_free (lines, true);
+	g_free (latency);
+	quit_irc_connection (s);
+	if (out != NULL)
+		fclose (out);
+	chanlog_shutdown ();
+	db_shutdown ();
+	return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/*
+ * Offline replay of recorded traffic
+ * Lines of a capture are fed through the same path as lines read from
+ * the socket, handle_message and every hook, with lines sent by the bot
+ * written to a file. Reports throughput and latency percentiles.
+ */
+int
+replay_main (int argc, char **argv);
+
+#endif /* REPLAY_H */
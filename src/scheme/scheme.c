@@ -1,16 +1,26 @@
+#define LOG_SUBSYS LOG_SCHEME
+
 #include <fts.h>
 #include <glib.h>
 #include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include "config/config.h"
 #include "irc/hooks.h"
+#include "irc/rcu.h"
 #include "log/log.h"
+#include "trace/probes.h"
+#include "trace/trace.h"
 #include "scheme.h"
 
 #define MAX_COMMAND_SIZE 4096
+/* Module files written, moved or removed, and directories created */
+#define SCM_WATCH_EVENTS \
+	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR)
 
 typedef struct mod_entry
 {
@@ -27,72 +37,366 @@ typedef struct regex_hook
 	struct regex_hook *next;
 } regex_hook;
 
-static unsigned int mod_ids = 0;
-static scm_module *module_list;
+/*
+ * A hook registration made while its module was still being loaded.
+ * Modules are loaded in parallel, so registrations are kept on the
+ * module and only committed to the shared tables once every module
+ * has finished loading.
+ */
+typedef enum pending_hook_type
+{
+	PENDING_IRC_HOOK,
+	PENDING_COMMAND_HOOK,
+	PENDING_REGEX_HOOK,
+} pending_hook_type;
+
+typedef struct pending_hook
+{
+	pending_hook_type type;
+	char *key;
+	sexp func;
+	struct pending_hook *next;
+} pending_hook;
+
+typedef struct backlog_entry
+{
+	const irc_server *serv;
+	irc_msg *msg;
+} backlog_entry;
+
+/* A call queued by scm_call_later */
+typedef struct deferred_call
+{
+	int mod_id;
+	const irc_server *serv;
+	sexp func;
+	scm_args_fn args;
+	void *data;
+} deferred_call;
 
 /*
- * Executes hooks to chat commands
- * The command name without prefix is used as key
- * A linked list of modules entries is used as value
- * chat command -> mod_entry*
+ * A reload or unload, evaluated on reload_pool and then swapped in on
+ * the loop thread. mod is NULL when the file was removed and the module
+ * is unloaded.
  */
-static GHashTable *command_hooks;
+typedef struct reload_entry
+{
+	char *path;
+	bool unload;
+	scm_module *mod;
+} reload_entry;
+
+/*
+ * One version of the hook tables. A published version is never
+ * modified: writers copy the current one, change the copy and publish
+ * it, so dispatch reads the tables without taking any lock.
+ * The regex_t of a regex_hook is shared between versions and only
+ * free'd when the hook is removed.
+ */
+typedef struct hook_tables
+{
+	/*
+	 * Executes hooks to chat commands
+	 * The command name without prefix is used as key
+	 * A linked list of modules entries is used as value
+	 * chat command -> mod_entry*
+	 */
+	GHashTable *command_hooks;
+	/*
+	 * Executes hooks to IRC commands
+	 * The IRC command is used as key
+	 * A linked list of module entries is used as value
+	 * IRC command -> mod_entry*
+	 */
+	GHashTable *irc_hooks;
+	/*
+	 * A linked list of regex hooks
+	 * All of the element of this list are tried
+	 * against every PRIVMSG that comes in
+	 */
+	regex_hook *regex_hooks;
+} hook_tables;
+
+static unsigned int mod_ids = 0;
 /*
- * Executes hooks to IRC commands
- * The IRC command is used as key
- * A linked list of module entries is used as value
- * IRC command -> mod_entry*
+ * Readers walk module_list under rcu_read_lock, writers serialize on
+ * module_list_mtx. Unlinked modules are free'd after a grace period.
  */
-static GHashTable *irc_hooks;
+static scm_module *module_list;
+static pthread_mutex_t module_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 /*
- * A linked list of regex hooks
- * All of the element of this list are tried
- * against every PRIVMSG that comes in
+ * Set once the loader thread has committed every module's hooks.
+ * Until then scm_entry copies messages into the backlog instead of
+ * dispatching them, which is drained in order on the loop thread.
  */
-static regex_hook *regex_hooks;
+static gint modules_ready;
+static GQueue backlog = G_QUEUE_INIT;
+
+/* Reloads are evaluated one at a time on reload_pool */
+static GThreadPool *reload_pool;
+static GQueue reload_queue = G_QUEUE_INIT;
+static pthread_mutex_t reload_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Calls waiting for the loop thread, see scm_call_later */
+static GQueue deferred_calls = G_QUEUE_INIT;
+static pthread_mutex_t deferred_calls_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* The published hook tables, see hook_tables */
+static hook_tables *tables;
+static pthread_mutex_t tables_write_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static void
-scm_exec_irc_hooks (const irc_server *s, const irc_msg *msg);
+scm_exec_irc_hooks (const hook_tables *t, const irc_server *s, const irc_msg *msg);
 static void
-scm_exec_command_hooks (const irc_server *s, const irc_msg *msg);
+scm_exec_command_hooks (const hook_tables *t, const irc_server *s, const irc_msg *msg);
 static void
-scm_exec_regex_hooks (const irc_server *s, const irc_msg *msg);
+scm_exec_regex_hooks (const hook_tables *t, const irc_server *s, const irc_msg *msg);
 static void
 scm_run_module (scm_module *mod,
 		sexp func,
 		const irc_server *s,
 		const irc_msg *msg);
 static void
+scm_apply_locked (scm_module *mod, sexp func, sexp args);
+static void
+scm_run_deferred_calls (void);
+static hook_tables *
+scm_tables_new (void);
+static hook_tables *
+scm_tables_begin (scm_module *except);
+static void
+scm_tables_publish (hook_tables *t);
+static void
+scm_tables_free (void *data);
+static void
+scm_free_regex (void *data);
+static void
+scm_tables_add_entry (GHashTable *table, const char *key, sexp func, scm_module *mod);
+static void
+scm_tables_add_regex (hook_tables *t, const char *rx_str, sexp func, scm_module *mod);
+static void
+scm_tables_commit_pending (hook_tables *t, scm_module *mod);
+static void
+scm_drain_backlog (void);
+static void
+scm_reload_worker (gpointer data, gpointer user_data);
+static void
+scm_push_reload (const char *name, bool unload);
+static void
+scm_queue_reload (reload_entry *re);
+static void
+scm_swap_reloaded_modules (void);
+static gpointer
+scm_watch_thread (gpointer data);
+static bool
+scm_is_module_file (const char *name);
+static char *
+scm_module_path (const char *dir, const char *name);
+static scm_module *
+scm_find_module_by_path (const char *path, const scm_module *except);
+static void
+scm_unregister_module (scm_module *mod);
+static void
+scm_free_module (void *data);
+static gpointer
+scm_loader_thread (gpointer data);
+static void
 scm_load_modules (char *dir);
+static void
+scm_load_module_worker (gpointer data, gpointer user_data);
 static scm_module *
 scm_create_module (char *path);
+static bool
+scm_eval_module (scm_module *mod);
 static void
 scm_register_module (scm_module *mod);
+static void
+scm_defer_hook (scm_module *mod,
+		pending_hook_type type,
+		const char *key,
+		sexp func);
 
 static void
-scm_entry (const irc_server *s, const irc_msg *msg)
+scm_dispatch (const irc_server *s, const irc_msg *msg)
 {
-	scm_exec_irc_hooks (s, msg);
+	rcu_read_lock ();
+	const hook_tables *t = rcu_dereference (tables);
+
+	scm_exec_irc_hooks (t, s, msg);
 	if (strcmp (msg->command, "PRIVMSG") == 0) {
-		scm_exec_command_hooks (s, msg);
-		scm_exec_regex_hooks (s, msg);
+		scm_exec_command_hooks (t, s, msg);
+		scm_exec_regex_hooks (t, s, msg);
+	}
+	rcu_read_unlock ();
+}
+
+static void
+scm_entry (const irc_server *s, const irc_msg *msg)
+{
+	if (!g_atomic_int_get (&modules_ready)) {
+		backlog_entry *be = malloc (sizeof (backlog_entry));
+		be->serv = s;
+		be->msg = irc_msg_copy (msg);
+		g_queue_push_tail (&backlog, be);
+		return;
+	}
+
+	scm_drain_backlog ();
+	scm_dispatch (s, msg);
+}
+
+/* Runs on the loop thread whenever the read queue has been processed */
+static void
+scm_idle_hook (const irc_server *s, const irc_msg *msg)
+{
+	if (!g_atomic_int_get (&modules_ready))
+		return;
+
+	scm_drain_backlog ();
+	scm_run_deferred_calls ();
+	scm_swap_reloaded_modules ();
+}
+
+static void
+scm_drain_backlog (void)
+{
+	backlog_entry *be;
+	while ((be = g_queue_pop_head (&backlog)) != NULL) {
+		scm_dispatch (be->serv, be->msg);
+		free_msg (be->msg);
+		free (be);
 	}
 }
 
+static void
+free_mod_entries (gpointer data)
+{
+	mod_entry *me = data, *next;
+	for (; me != NULL; me = next) {
+		next = me->next;
+		free (me);
+	}
+}
+
+static hook_tables *
+scm_tables_new (void)
+{
+	hook_tables *t = malloc (sizeof (hook_tables));
+	t->command_hooks =
+	  g_hash_table_new_full (g_str_hash, g_str_equal, free, free_mod_entries);
+	t->irc_hooks =
+	  g_hash_table_new_full (g_str_hash, g_str_equal, free, free_mod_entries);
+	t->regex_hooks = NULL;
+
+	return t;
+}
+
+static void
+copy_mod_entries (GHashTable *from, GHashTable *to, scm_module *except)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, from);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		mod_entry *head = NULL, **tail = &head;
+		for (const mod_entry *me = value; me != NULL; me = me->next) {
+			if (me->mod == except)
+				continue;
+			*tail = malloc (sizeof (mod_entry));
+			**tail = *me;
+			(*tail)->next = NULL;
+			tail = &(*tail)->next;
+		}
+		if (head != NULL)
+			g_hash_table_insert (to, strdup (key), head);
+	}
+}
+
+/*
+ * Lock the tables for writing and return a copy of the current version.
+ * The hooks of except are left out of the copy, its regexes are free'd
+ * after a grace period.
+ */
+static hook_tables *
+scm_tables_begin (scm_module *except)
+{
+	pthread_mutex_lock (&tables_write_mtx);
+
+	hook_tables *t = scm_tables_new ();
+	if (tables == NULL)
+		return t;
+
+	copy_mod_entries (tables->command_hooks, t->command_hooks, except);
+	copy_mod_entries (tables->irc_hooks, t->irc_hooks, except);
+
+	regex_hook **tail = &t->regex_hooks;
+	for (const regex_hook *rx_hook = tables->regex_hooks; rx_hook != NULL; rx_hook = rx_hook->next) {
+		if (rx_hook->mod == except) {
+			rcu_call (scm_free_regex, rx_hook->regex);
+			continue;
+		}
+		*tail = malloc (sizeof (regex_hook));
+		**tail = *rx_hook;
+		(*tail)->next = NULL;
+		tail = &(*tail)->next;
+	}
+
+	return t;
+}
+
+/* Publish t as the current version and unlock the tables */
+static void
+scm_tables_publish (hook_tables *t)
+{
+	hook_tables *old = tables;
+	rcu_assign_pointer (tables, t);
+	pthread_mutex_unlock (&tables_write_mtx);
+
+	if (old != NULL)
+		rcu_call (scm_tables_free, old);
+}
+
+static void
+scm_tables_free (void *data)
+{
+	hook_tables *t = data;
+	regex_hook *rx_hook, *next;
+
+	g_hash_table_destroy (t->command_hooks);
+	g_hash_table_destroy (t->irc_hooks);
+	for (rx_hook = t->regex_hooks; rx_hook != NULL; rx_hook = next) {
+		next = rx_hook->next;
+		free (rx_hook);
+	}
+	free (t);
+}
+
+static void
+scm_free_regex (void *data)
+{
+	regfree ((regex_t *)data);
+	free (data);
+}
+
 void
 scm_add_irc_hook (const char *command, sexp func, scm_module *mod)
 {
-	mod_entry *me = malloc (sizeof (mod_entry));
-	me->mod = mod;
-	me->func = func;
-	me->next = NULL;
-	g_hash_table_insert (irc_hooks, strdup (command), me);
+	if (mod->loading) {
+		scm_defer_hook (mod, PENDING_IRC_HOOK, command, func);
+		return;
+	}
+
+	hook_tables *t = scm_tables_begin (NULL);
+	scm_tables_add_entry (t->irc_hooks, command, func, mod);
+	scm_tables_publish (t);
 }
 
 static void
-scm_exec_irc_hooks (const irc_server *s, const irc_msg *msg)
+scm_exec_irc_hooks (const hook_tables *t, const irc_server *s, const irc_msg *msg)
 {
-	mod_entry *me = g_hash_table_lookup (irc_hooks, msg->command);
+	mod_entry *me = g_hash_table_lookup (t->irc_hooks, msg->command);
 	if (me == NULL)
 		return;
 
@@ -104,15 +408,18 @@ scm_exec_irc_hooks (const irc_server *s, const irc_msg *msg)
 void
 scm_add_command_hook (const char *command, sexp func, scm_module *mod)
 {
-	mod_entry *me = malloc (sizeof (mod_entry));
-	me->mod = mod;
-	me->func = func;
-	me->next = NULL;
-	g_hash_table_insert (command_hooks, strdup (command), me);
+	if (mod->loading) {
+		scm_defer_hook (mod, PENDING_COMMAND_HOOK, command, func);
+		return;
+	}
+
+	hook_tables *t = scm_tables_begin (NULL);
+	scm_tables_add_entry (t->command_hooks, command, func, mod);
+	scm_tables_publish (t);
 }
 
 static void
-scm_exec_command_hooks (const irc_server *s, const irc_msg *msg)
+scm_exec_command_hooks (const hook_tables *t, const irc_server *s, const irc_msg *msg)
 {
 	config_t *config = get_config ();
 
@@ -133,7 +440,7 @@ scm_exec_command_hooks (const irc_server *s, const irc_msg *msg)
 		cmd[j++] = text[i++];
 	cmd[j] = '\0';
 
-	mod_entry *me = g_hash_table_lookup (command_hooks, cmd);
+	mod_entry *me = g_hash_table_lookup (t->command_hooks, cmd);
 	if (me == NULL)
 		return;
 
@@ -144,6 +451,49 @@ scm_exec_command_hooks (const irc_server *s, const irc_msg *msg)
 
 void
 scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod)
+{
+	if (mod->loading) {
+		scm_defer_hook (mod, PENDING_REGEX_HOOK, rx_str, func);
+		return;
+	}
+
+	hook_tables *t = scm_tables_begin (NULL);
+	scm_tables_add_regex (t, rx_str, func, mod);
+	scm_tables_publish (t);
+}
+
+static void
+scm_exec_regex_hooks (const hook_tables *t, const irc_server *s, const irc_msg *msg)
+{
+	regex_hook *hooks;
+	char *text = msg->params->params[1];
+	for (hooks = t->regex_hooks; hooks != NULL; hooks = hooks->next)
+		if (regexec (hooks->regex, text, 0, NULL, 0) == 0)
+			scm_run_module (hooks->mod, hooks->func, s, msg);
+}
+
+/* Append an entry to the list stored under key, keeping earlier ones */
+static void
+scm_tables_add_entry (GHashTable *table, const char *key, sexp func, scm_module *mod)
+{
+	mod_entry *me = malloc (sizeof (mod_entry));
+	me->mod = mod;
+	me->func = func;
+	me->next = NULL;
+
+	mod_entry *head = g_hash_table_lookup (table, key);
+	if (head == NULL) {
+		g_hash_table_insert (table, strdup (key), me);
+		return;
+	}
+
+	while (head->next != NULL)
+		head = head->next;
+	head->next = me;
+}
+
+static void
+scm_tables_add_regex (hook_tables *t, const char *rx_str, sexp func, scm_module *mod)
 {
 	regex_t *rx = malloc (sizeof (regex_t));
 	char errbuf[4096];
@@ -151,6 +501,7 @@ scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod)
 	if (ret) {
 		regerror (ret, rx, errbuf, sizeof (errbuf));
 		log_info (errbuf);
+		free (rx);
 		return;
 	}
 
@@ -160,24 +511,37 @@ scm_add_regex_hook (const char *rx_str, sexp func, scm_module *mod)
 	rx_hook->regex = rx;
 	rx_hook->next = NULL;
 
-	regex_hook *hooks;
-	if (regex_hooks == NULL)
-		regex_hooks = rx_hook;
-	else {
-		for (hooks = regex_hooks; hooks->next != NULL; hooks = hooks->next)
-			;
-		hooks->next = rx_hook;
-	}
+	regex_hook **tail = &t->regex_hooks;
+	while (*tail != NULL)
+		tail = &(*tail)->next;
+	*tail = rx_hook;
 }
 
+/* Add the hooks mod registered while loading to t */
 static void
-scm_exec_regex_hooks (const irc_server *s, const irc_msg *msg)
+scm_tables_commit_pending (hook_tables *t, scm_module *mod)
 {
-	regex_hook *hooks;
-	char *text = msg->params->params[1];
-	for (hooks = regex_hooks; hooks != NULL; hooks = hooks->next)
-		if (regexec (hooks->regex, text, 0, NULL, 0) == 0)
-			scm_run_module (hooks->mod, hooks->func, s, msg);
+	pending_hook *ph = mod->pending_hooks, *next;
+
+	mod->loading = false;
+	mod->pending_hooks = NULL;
+
+	for (; ph != NULL; ph = next) {
+		next = ph->next;
+		switch (ph->type) {
+			case PENDING_IRC_HOOK:
+				scm_tables_add_entry (t->irc_hooks, ph->key, ph->func, mod);
+				break;
+			case PENDING_COMMAND_HOOK:
+				scm_tables_add_entry (t->command_hooks, ph->key, ph->func, mod);
+				break;
+			case PENDING_REGEX_HOOK:
+				scm_tables_add_regex (t, ph->key, ph->func, mod);
+				break;
+		}
+		free (ph->key);
+		free (ph);
+	}
 }
 
 static void
@@ -187,42 +551,146 @@ scm_run_module (scm_module *mod,
 		const irc_msg *msg)
 {
 	pthread_mutex_lock (&mod->mtx);
-	sexp ctx = mod->scm_ctx;
 	mod->mod_ctx.serv = s;
-	mod->mod_ctx.msg = msg;
+	mod->mod_ctx.msg = (irc_msg *)msg;
+	scm_apply_locked (mod, func, SEXP_NULL);
+	mod->mod_ctx.msg = NULL;
+	pthread_mutex_unlock (&mod->mtx);
+}
+
+/* Apply func of mod to args, with mod->mtx held */
+static void
+scm_apply_locked (scm_module *mod, sexp func, sexp args)
+{
+	sexp ctx = mod->scm_ctx;
+	sexp_gc_var1 (a);
+	sexp_gc_preserve1 (ctx, a);
+	a = args;
 
 	sexp id_obj = sexp_make_integer (ctx, mod->id);
 	sexp id_sym = sexp_intern (ctx, "circ-module-id", -1);
 	sexp_env_define (ctx, sexp_context_env (ctx), id_sym, id_obj);
 
-	sexp res = sexp_apply (ctx, func, SEXP_NULL);
+	CIRC_PROBE (scheme_entry, mod->id, mod->path);
+	uint64_t start = metric_now_ns ();
+	sexp res = sexp_apply (ctx, func, a);
+	uint64_t end = metric_now_ns ();
+	CIRC_PROBE (scheme_return, mod->id, mod->path, end - start);
+	metric_observe_ns (mod->latency, end - start);
+	trace_span (trace_current, "scheme", mod->path, start, end);
 	if (sexp_exceptionp (res))
 		sexp_print_exception (ctx, res, sexp_current_error_port (ctx));
 
-	pthread_mutex_unlock (&mod->mtx);
+	sexp_gc_release1 (ctx);
 }
 
+void
+scm_call_later (int mod_id, const irc_server *s, sexp func, scm_args_fn args, void *data)
+{
+	deferred_call *dc = malloc (sizeof (deferred_call));
+	dc->mod_id = mod_id;
+	dc->serv = s;
+	dc->func = func;
+	dc->args = args;
+	dc->data = data;
+
+	pthread_mutex_lock (&deferred_calls_mtx);
+	g_queue_push_tail (&deferred_calls, dc);
+	pthread_mutex_unlock (&deferred_calls_mtx);
+
+	irc_wakeup (get_config ()->server);
+}
+
+/* Calls whose module was reloaded or unloaded meanwhile are dropped */
+static void
+scm_run_deferred_calls (void)
+{
+	deferred_call *dc;
+
+	for (;;) {
+		pthread_mutex_lock (&deferred_calls_mtx);
+		dc = g_queue_pop_head (&deferred_calls);
+		pthread_mutex_unlock (&deferred_calls_mtx);
+		if (dc == NULL)
+			break;
+
+		scm_module *mod = scm_get_module_from_id (dc->mod_id);
+		if (mod == NULL) {
+			dc->args (NULL, dc->data);
+			free (dc);
+			continue;
+		}
+
+		pthread_mutex_lock (&mod->mtx);
+		sexp ctx = mod->scm_ctx;
+		mod->mod_ctx.serv = dc->serv;
+		scm_apply_locked (mod, dc->func, dc->args (ctx, dc->data));
+		sexp_release_object (ctx, dc->func);
+		pthread_mutex_unlock (&mod->mtx);
+		free (dc);
+	}
+}
+
+/*
+ * Start loading the modules in the background and return immediately,
+ * so the connection can be set up while they are being evaluated.
+ * Messages that arrive before loading is done are buffered.
+ */
 void
 scm_init ()
 {
-	config_t *config = get_config ();
+	if (tables == NULL)
+		scm_tables_publish (scm_tables_begin (NULL));
+	if (reload_pool == NULL)
+		reload_pool = g_thread_pool_new (scm_reload_worker, NULL, 1, TRUE, NULL);
+
+	add_hook ("*", scm_entry);
+	add_hook ("IDLE", scm_idle_hook);
+
+	g_thread_unref (g_thread_new ("scm-loader", scm_loader_thread, NULL));
+}
 
-	if (irc_hooks == NULL)
-		irc_hooks = g_hash_table_new (g_str_hash, g_str_equal);
-	if (command_hooks == NULL)
-		command_hooks = g_hash_table_new (g_str_hash, g_str_equal);
+bool
+scm_modules_ready (void)
+{
+	return g_atomic_int_get (&modules_ready);
+}
+
+static gpointer
+scm_loader_thread (gpointer data)
+{
+	config_t *config = get_config ();
 
 	scm_load_modules (config->scheme_mod_dir);
-	add_hook ("*", scm_entry);
+	g_atomic_int_set (&modules_ready, 1);
+
+	/* Let the event loop drain the backlog even if the server is quiet */
+	irc_wakeup (config->server);
+
+	if (config->scheme_hot_reload)
+		g_thread_unref (g_thread_new ("scm-watch", scm_watch_thread, NULL));
+
+	return NULL;
 }
 
 static void
 scm_load_modules (char *dir)
 {
+	config_t *config = get_config ();
 	char *paths[] = { dir, NULL };
 	FTS *f = fts_open (paths, FTS_LOGICAL | FTS_NOSTAT, NULL);
 	FTSENT *fe;
 
+	/* chibi's global state has to exist before the workers start
+	 * creating contexts
+	 */
+	sexp_scheme_init ();
+
+	/* Modules are created in directory walk order so their ids and
+	 * the order of their hooks don't depend on which worker finishes
+	 * first. The list is complete before any worker starts looking
+	 * modules up by id.
+	 */
 	log_info ("-----\nLoading Modules:\n");
 	while ((fe = fts_read (f)))
 		if (strlen (fe->fts_name) > 4 &&
@@ -231,9 +699,36 @@ scm_load_modules (char *dir)
 			log_info ("%s\n", fe->fts_name);
 			scm_create_module (fe->fts_path);
 		}
-	log_info ("-----\n");
 
 	fts_close (f);
+
+	int threads = config->scheme_load_threads;
+	if (threads <= 0)
+		threads = g_get_num_processors ();
+
+	/* Only the evaluation itself runs on the pool */
+	GThreadPool *pool =
+	  g_thread_pool_new (scm_load_module_worker, NULL, threads, TRUE, NULL);
+
+	scm_module *mod;
+	for (mod = module_list; mod != NULL; mod = mod->next)
+		g_thread_pool_push (pool, mod, NULL);
+
+	/* Wait for every queued module to be evaluated */
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	/* All modules' hooks become visible at once */
+	hook_tables *t = scm_tables_begin (NULL);
+	for (mod = module_list; mod != NULL; mod = mod->next)
+		scm_tables_commit_pending (t, mod);
+	scm_tables_publish (t);
+	log_info ("-----\n");
+}
+
+static void
+scm_load_module_worker (gpointer data, gpointer user_data)
+{
+	scm_eval_module ((scm_module *)data);
 }
 
 static scm_module *
@@ -242,13 +737,30 @@ scm_create_module (char *path)
 	scm_module *mod = malloc (sizeof (scm_module));
 	mod->id = ++mod_ids;
 	mod->path = strdup (path);
+	mod->scm_ctx = NULL;
+	mod->mod_ctx.serv = NULL;
+	mod->mod_ctx.msg = NULL;
+	mod->loading = true;
+	mod->pending_hooks = NULL;
+	mod->latency = metric_histogram_labeled (
+	  "circ_scheme_handler_duration_seconds", "Time spent in Scheme module handlers", "module", path);
 	mod->next = NULL;
 	pthread_mutex_init (&mod->mtx, NULL);
 
-	pthread_mutex_lock (&mod->mtx);
-
 	scm_register_module (mod);
 
+	return mod;
+}
+
+/*
+ * Build the chibi context of mod and evaluate its file,
+ * returns false if evaluating it raised an exception
+ */
+static bool
+scm_eval_module (scm_module *mod)
+{
+	pthread_mutex_lock (&mod->mtx);
+
 	mod->scm_ctx = sexp_make_eval_context (NULL, NULL, NULL, 0, 0);
 	sexp ctx = mod->scm_ctx;
 	sexp_load_standard_env (ctx, NULL, SEXP_SEVEN);
@@ -260,14 +772,38 @@ scm_create_module (char *path)
 
 	scmapi_define_foreign_functions (ctx);
 
-	sexp obj = sexp_c_string (ctx, path, -1);
+	sexp obj = sexp_c_string (ctx, mod->path, -1);
 	sexp res = sexp_load (ctx, obj, NULL);
-	if (sexp_exceptionp (res))
+	bool ok = !sexp_exceptionp (res);
+	if (!ok)
 		sexp_print_exception (ctx, res, sexp_current_error_port (ctx));
 
 	pthread_mutex_unlock (&mod->mtx);
 
-	return mod;
+	return ok;
+}
+
+static void
+scm_defer_hook (scm_module *mod,
+		pending_hook_type type,
+		const char *key,
+		sexp func)
+{
+	pending_hook *ph = malloc (sizeof (pending_hook));
+	ph->type = type;
+	ph->key = strdup (key);
+	ph->func = func;
+	ph->next = NULL;
+
+	pending_hook *tail = mod->pending_hooks;
+	if (tail == NULL) {
+		mod->pending_hooks = ph;
+		return;
+	}
+
+	while (tail->next != NULL)
+		tail = tail->next;
+	tail->next = ph;
 }
 
 static void
@@ -276,28 +812,328 @@ scm_register_module (scm_module *mod)
 	if (mod == NULL)
 		return;
 
-	scm_module *modlist = module_list;
-	if (modlist == NULL) {
-		module_list = mod;
-		return;
-	}
+	pthread_mutex_lock (&module_list_mtx);
+	scm_module **link = &module_list;
+	while (*link != NULL)
+		link = &(*link)->next;
+	rcu_assign_pointer (*link, mod);
+	pthread_mutex_unlock (&module_list_mtx);
+}
 
-	while (modlist->next != NULL)
-		modlist = modlist->next;
-	modlist->next = mod;
+/* Unlink mod from module_list, it may only be free'd after a grace period */
+static void
+scm_unregister_module (scm_module *mod)
+{
+	scm_module **link;
+
+	pthread_mutex_lock (&module_list_mtx);
+	for (link = &module_list; *link != NULL; link = &(*link)->next)
+		if (*link == mod) {
+			rcu_assign_pointer (*link, mod->next);
+			break;
+		}
+	pthread_mutex_unlock (&module_list_mtx);
 }
 
 scm_module *
 scm_get_module_from_id (int id)
 {
-	scm_module *mod = module_list;
-	if (mod == NULL)
+	rcu_read_lock ();
+	scm_module *mod = rcu_dereference (module_list);
+	while (mod != NULL && mod->id != id)
+		mod = rcu_dereference (mod->next);
+	rcu_read_unlock ();
+
+	return mod;
+}
+
+/* Returns the loaded module at path, ignoring except and pending reloads */
+static scm_module *
+scm_find_module_by_path (const char *path, const scm_module *except)
+{
+	rcu_read_lock ();
+	scm_module *mod = rcu_dereference (module_list);
+	while (mod != NULL &&
+	       (mod == except || mod->loading || strcmp (mod->path, path) != 0))
+		mod = rcu_dereference (mod->next);
+	rcu_read_unlock ();
+
+	return mod;
+}
+
+/* Build a module path the same way the fts walk in scm_load_modules does */
+static char *
+scm_module_path (const char *dir, const char *name)
+{
+	size_t dir_len = strlen (dir);
+	while (dir_len > 1 && dir[dir_len - 1] == '/')
+		dir_len--;
+
+	return g_strdup_printf ("%.*s/%s", (int)dir_len, dir, name);
+}
+
+/*
+ * Reload the module called name in the module directory, or load it
+ * if it is new. The new context is built in the background and only
+ * replaces the old one between two messages on the loop thread.
+ * Safe to call from any thread.
+ */
+void
+scm_reload_module (const char *name)
+{
+	scm_push_reload (name, false);
+}
+
+/* Unload the module called name once the loop thread is between messages */
+void
+scm_unload_module (const char *name)
+{
+	scm_push_reload (name, true);
+}
+
+/* Unloads go through reload_pool too, so they can't overtake a reload */
+static void
+scm_push_reload (const char *name, bool unload)
+{
+	config_t *config = get_config ();
+
+	reload_entry *re = malloc (sizeof (reload_entry));
+	re->path = scm_module_path (config->scheme_mod_dir, name);
+	re->unload = unload;
+	re->mod = NULL;
+
+	g_thread_pool_push (reload_pool, re, NULL);
+}
+
+static void
+scm_reload_worker (gpointer data, gpointer user_data)
+{
+	reload_entry *re = data;
+
+	if (!re->unload) {
+		log_info ("Reloading module %s\n", re->path);
+
+		/* Keep the running version if the new one doesn't evaluate */
+		scm_module *mod = scm_create_module (re->path);
+		if (!scm_eval_module (mod)) {
+			log_error ("Module %s failed to load, keeping the old one\n", re->path);
+			scm_unregister_module (mod);
+			rcu_call (scm_free_module, mod);
+			g_free (re->path);
+			free (re);
+			return;
+		}
+		re->mod = mod;
+	}
+
+	scm_queue_reload (re);
+}
+
+static void
+scm_queue_reload (reload_entry *re)
+{
+	config_t *config = get_config ();
+
+	pthread_mutex_lock (&reload_queue_mtx);
+	g_queue_push_tail (&reload_queue, re);
+	pthread_mutex_unlock (&reload_queue_mtx);
+
+	irc_wakeup (config->server);
+}
+
+/*
+ * Runs on the loop thread between messages. The hooks of each replaced
+ * module are swapped for those of its replacement in a single new
+ * version of the tables, the connection and other modules are left
+ * alone. The old context is destroyed after a grace period.
+ */
+static void
+scm_swap_reloaded_modules (void)
+{
+	reload_entry *re;
+
+	for (;;) {
+		pthread_mutex_lock (&reload_queue_mtx);
+		re = g_queue_pop_head (&reload_queue);
+		pthread_mutex_unlock (&reload_queue_mtx);
+		if (re == NULL)
+			break;
+
+		scm_module *old = scm_find_module_by_path (re->path, re->mod);
+
+		/* Nothing to do for an unload of a module that isn't loaded */
+		if (re->mod != NULL || old != NULL) {
+			hook_tables *t = scm_tables_begin (old);
+			if (re->mod != NULL)
+				scm_tables_commit_pending (t, re->mod);
+			scm_tables_publish (t);
+
+			if (old != NULL) {
+				scm_unregister_module (old);
+				rcu_call (scm_free_module, old);
+			}
+
+			log_info ("Module %s %s\n",
+				  re->path,
+				  re->mod == NULL ? "unloaded" : old == NULL ? "loaded" : "reloaded");
+		}
+
+		g_free (re->path);
+		free (re);
+	}
+}
+
+static void
+scm_free_module (void *data)
+{
+	scm_module *mod = data;
+	pending_hook *ph, *next;
+
+	for (ph = mod->pending_hooks; ph != NULL; ph = next) {
+		next = ph->next;
+		free (ph->key);
+		free (ph);
+	}
+
+	if (mod->scm_ctx != NULL)
+		sexp_destroy_context (mod->scm_ctx);
+	pthread_mutex_destroy (&mod->mtx);
+	free (mod->path);
+	free (mod);
+}
+
+static bool
+scm_is_module_file (const char *name)
+{
+	size_t len = strlen (name);
+	return len > 4 &&
+	       (strcmp (name + len - 4, ".scm") == 0 ||
+		strcmp (name + len - 3, ".ss") == 0);
+}
+
+/* Path of the module file or directory below the module directory, e.g. sub/foo.scm */
+static const char *
+scm_relative_path (const char *path)
+{
+	config_t *config = get_config ();
+	const char *rel = path + strlen (config->scheme_mod_dir);
+	while (*rel == '/')
+		rel++;
+	return rel;
+}
+
+/*
+ * Watch the directory rel and the ones below it, rel is relative to the
+ * module directory and empty for the directory itself. With load, the
+ * modules found are loaded, e.g. in a directory that was moved in.
+ */
+static void
+scm_watch_dir (int fd, GHashTable *dirs, const char *rel, bool load)
+{
+	config_t *config = get_config ();
+	char *path = rel[0] == '\0' ? g_strdup (config->scheme_mod_dir) : scm_module_path (config->scheme_mod_dir, rel);
+	char *paths[] = { path, NULL };
+	FTS *f = fts_open (paths, FTS_LOGICAL | FTS_NOSTAT, NULL);
+	FTSENT *fe;
+
+	while (f != NULL && (fe = fts_read (f)) != NULL) {
+		if (fe->fts_info == FTS_D) {
+			int wd = inotify_add_watch (fd, fe->fts_path, SCM_WATCH_EVENTS);
+			if (wd == -1)
+				log_error ("scheme: cannot watch %s\n", fe->fts_path);
+			else
+				g_hash_table_insert (dirs, GINT_TO_POINTER (wd), g_strdup (scm_relative_path (fe->fts_path)));
+		} else if (load && scm_is_module_file (fe->fts_name)) {
+			scm_reload_module (scm_relative_path (fe->fts_path));
+		}
+	}
+
+	if (f != NULL)
+		fts_close (f);
+	g_free (path);
+}
+
+/* Stop watching the directory rel, which is gone, and unload its modules */
+static void
+scm_unwatch_dir (int fd, GHashTable *dirs, const char *rel)
+{
+	size_t len = strlen (rel);
+	GHashTableIter iter;
+	gpointer wd, dir;
+
+	/* Watches are forgotten on their IN_IGNORED */
+	g_hash_table_iter_init (&iter, dirs);
+	while (g_hash_table_iter_next (&iter, &wd, &dir))
+		if (strncmp (dir, rel, len) == 0 && (((char *)dir)[len] == '\0' || ((char *)dir)[len] == '/'))
+			inotify_rm_watch (fd, GPOINTER_TO_INT (wd));
+
+	rcu_read_lock ();
+	for (scm_module *mod = rcu_dereference (module_list); mod != NULL; mod = rcu_dereference (mod->next)) {
+		const char *name = scm_relative_path (mod->path);
+		if (!mod->loading && strncmp (name, rel, len) == 0 && name[len] == '/')
+			scm_unload_module (name);
+	}
+	rcu_read_unlock ();
+}
+
+/* Watch the module directory and reload modules whose file changed */
+static gpointer
+scm_watch_thread (gpointer data)
+{
+	config_t *config = get_config ();
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+	int fd = inotify_init1 (IN_CLOEXEC);
+	if (fd == -1) {
+		log_error ("scheme: inotify_init1 failed, hot reload disabled\n");
 		return NULL;
+	}
 
-	do {
-		if (mod->id == id)
-			return mod;
-	} while ((mod = mod->next));
+	/* Watch descriptor -> directory relative to the module directory */
+	GHashTable *dirs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	scm_watch_dir (fd, dirs, "", false);
+	if (g_hash_table_size (dirs) == 0) {
+		log_error ("scheme: cannot watch %s, hot reload disabled\n",
+			   config->scheme_mod_dir);
+		g_hash_table_destroy (dirs);
+		close (fd);
+		return NULL;
+	}
+
+	for (;;) {
+		ssize_t len = read (fd, buf, sizeof (buf));
+		if (len <= 0)
+			break;
+
+		const struct inotify_event *ev;
+		for (char *p = buf; p < buf + len; p += sizeof (*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_IGNORED) {
+				g_hash_table_remove (dirs, GINT_TO_POINTER (ev->wd));
+				continue;
+			}
+
+			const char *dir = g_hash_table_lookup (dirs, GINT_TO_POINTER (ev->wd));
+			if (dir == NULL || ev->len == 0)
+				continue;
+
+			char *name = dir[0] == '\0' ? g_strdup (ev->name) : g_strdup_printf ("%s/%s", dir, ev->name);
+			if (ev->mask & IN_ISDIR) {
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+					scm_watch_dir (fd, dirs, name, true);
+				else
+					scm_unwatch_dir (fd, dirs, name);
+			} else if (scm_is_module_file (ev->name)) {
+				if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+					scm_reload_module (name);
+				else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+					scm_unload_module (name);
+			}
+			g_free (name);
+		}
+	}
 
+	g_hash_table_destroy (dirs);
+	close (fd);
 	return NULL;
 }
@@ -2,6 +2,7 @@
 #define SCHEME_H
 
 #include "irc/irc.h"
+#include "metrics/metrics.h"
 #include <chibi/eval.h>
 
 typedef struct mod_context
@@ -17,11 +18,36 @@ typedef struct scm_module
 	sexp scm_ctx;
 	mod_context mod_ctx;
 	pthread_mutex_t mtx;
+	bool loading;
+	struct pending_hook *pending_hooks;
+	/* Handler time, kept across reloads of the same path */
+	metric *latency;
 	struct scm_module *next;
 } scm_module;
 
 void
 scm_init (void);
+/* True once every module found by scm_init has been loaded */
+bool
+scm_modules_ready (void);
+/*
+ * Builds the arguments of a deferred call in ctx and frees data, or only
+ * frees it when ctx is NULL because the module is gone
+ */
+typedef sexp (*scm_args_fn) (sexp ctx, void *data);
+
+/*
+ * Call func of the module with id mod_id on the loop thread, with the
+ * argument list args returns, e.g. once work done on another thread is
+ * finished. func must be preserved, it is released after the call.
+ * Safe to call from any thread.
+ */
+void
+scm_call_later (int mod_id, const irc_server *s, sexp func, scm_args_fn args, void *data);
+void
+scm_reload_module (const char *name);
+void
+scm_unload_module (const char *name);
 scm_module *
 scm_get_module_from_id (int id);
 void
@@ -1,6 +1,13 @@
+#define LOG_SUBSYS LOG_SCHEME
+
+#include <glib.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../chanlog/chanlog.h"
 #include "../config/config.h"
+#include "../db/db.h"
+#include "../log/log.h"
 #include "scheme.h"
 
 static scm_module *
@@ -68,6 +75,428 @@ scmapi_send_raw (sexp ctx, sexp self, sexp n, sexp raw)
 	return SEXP_NULL;
 }
 
+sexp
+scmapi_reload_module (sexp ctx, sexp self, sexp n, sexp name)
+{
+	if (!sexp_stringp (name))
+		return SEXP_FALSE;
+
+	scm_reload_module (sexp_string_data (name));
+	return SEXP_TRUE;
+}
+
+/* Copy a list of scheme values into db values the db threads can own,
+ * returns NULL and sets *n to -1 on a value with no sql type
+ */
+static db_value *
+scheme_list_to_db_values (sexp ctx, sexp params, long *n)
+{
+	sexp p;
+	long i = 0;
+
+	for (p = params, *n = 0; sexp_pairp (p); p = sexp_cdr (p))
+		(*n)++;
+
+	db_value *values = calloc (*n > 0 ? *n : 1, sizeof (db_value));
+	for (p = params; sexp_pairp (p); p = sexp_cdr (p), i++) {
+		sexp v = sexp_car (p);
+		db_value *dv = &values[i];
+
+		if (sexp_fixnump (v)) {
+			dv->type = DB_INTEGER;
+			dv->i = sexp_unbox_fixnum (v);
+		} else if (sexp_flonump (v)) {
+			dv->type = DB_FLOAT;
+			dv->f = sexp_flonum_value (v);
+		} else if (sexp_booleanp (v)) {
+			dv->type = DB_INTEGER;
+			dv->i = sexp_truep (v);
+		} else if (sexp_stringp (v)) {
+			dv->type = DB_TEXT;
+			dv->s.len = sexp_string_size (v);
+			dv->s.data = strndup (sexp_string_data (v), dv->s.len);
+		} else if (sexp_bytesp (v)) {
+			dv->type = DB_BLOB;
+			dv->s.len = sexp_bytes_length (v);
+			dv->s.data = malloc (dv->s.len);
+			memcpy (dv->s.data, sexp_bytes_data (v), dv->s.len);
+		} else if (v == sexp_intern (ctx, "NULL", -1)) {
+			/* 'NULL, as db-query and the sqlite3 library return it */
+			dv->type = DB_NULL;
+		} else {
+			db_free_values (values, i);
+			*n = -1;
+			return NULL;
+		}
+	}
+	return values;
+}
+
+static sexp
+db_value_to_scheme (sexp ctx, const db_value *v)
+{
+	switch (v->type) {
+	case DB_INTEGER:
+		return sexp_make_integer (ctx, v->i);
+	case DB_FLOAT:
+		return sexp_make_flonum (ctx, v->f);
+	case DB_TEXT:
+		return sexp_c_string (ctx, v->s.data, v->s.len);
+	case DB_BLOB: {
+		sexp bytes = sexp_make_bytes (ctx, sexp_make_fixnum (v->s.len), SEXP_ZERO);
+		memcpy (sexp_bytes_data (bytes), v->s.data, v->s.len);
+		return bytes;
+	}
+	default:
+		return sexp_intern (ctx, "NULL", -1);
+	}
+}
+
+/* Copy column col of the current row, the statement is reset before
+ * the loop thread converts it
+ */
+static void
+db_column_copy (sqlite3_stmt *stmt, int col, db_value *v)
+{
+	switch (sqlite3_column_type (stmt, col)) {
+	case SQLITE_INTEGER:
+		v->type = DB_INTEGER;
+		v->i = sqlite3_column_int64 (stmt, col);
+		break;
+	case SQLITE_FLOAT:
+		v->type = DB_FLOAT;
+		v->f = sqlite3_column_double (stmt, col);
+		break;
+	case SQLITE_NULL:
+		v->type = DB_NULL;
+		break;
+	case SQLITE_BLOB:
+		v->type = DB_BLOB;
+		v->s.len = sqlite3_column_bytes (stmt, col);
+		v->s.data = malloc (v->s.len > 0 ? v->s.len : 1);
+		memcpy (v->s.data, sqlite3_column_blob (stmt, col), v->s.len);
+		break;
+	default:
+		/* Text may hold NULs, len is what gets converted */
+		v->type = DB_TEXT;
+		const unsigned char *text = sqlite3_column_text (stmt, col);
+		v->s.len = sqlite3_column_bytes (stmt, col);
+		v->s.data = malloc (v->s.len + 1);
+		memcpy (v->s.data, text, v->s.len);
+		v->s.data[v->s.len] = '\0';
+		break;
+	}
+}
+
+/* Queue a write on the shared database, returns without waiting */
+sexp
+scmapi_db_exec (sexp ctx, sexp self, sexp n, sexp sql, sexp params)
+{
+	long n_params;
+
+	if (!sexp_stringp (sql))
+		return sexp_xtype_exception (ctx, self, "not a string", sql);
+
+	db_value *values = scheme_list_to_db_values (ctx, params, &n_params);
+	if (n_params < 0)
+		return sexp_user_exception (ctx, self, "db-exec: unsupported parameter", params);
+
+	db_write_sql (sexp_string_data (sql), values, n_params);
+	return SEXP_TRUE;
+}
+
+/* A db-query on its way to a db thread and back */
+typedef struct db_query
+{
+	char *sql;
+	db_value *params;
+	long n_params;
+	int mod_id;
+	const irc_server *serv;
+	sexp func;
+	/* Rows of n_cols values each */
+	GPtrArray *rows;
+	int n_cols;
+	bool failed;
+} db_query;
+
+static sexp
+db_query_args (sexp ctx, void *data);
+
+static void
+db_query_free_row (gpointer row, gpointer n_cols)
+{
+	db_free_values (row, GPOINTER_TO_INT (n_cols));
+}
+
+static void
+db_query_free (db_query *q)
+{
+	g_ptr_array_foreach (q->rows, db_query_free_row, GINT_TO_POINTER (q->n_cols));
+	g_ptr_array_free (q->rows, true);
+	db_free_values (q->params, q->n_params);
+	free (q->sql);
+	free (q);
+}
+
+/* Runs on a db thread */
+static void
+db_query_run (db_conn *conn, void *data)
+{
+	db_query *q = data;
+	sqlite3_stmt *stmt = conn != NULL ? db_conn_prepare (conn, q->sql) : NULL;
+
+	if (stmt == NULL) {
+		log_error ("db-query: %s: %s\n", q->sql, conn != NULL ? sqlite3_errmsg (db_conn_handle (conn)) : "database unavailable");
+		q->failed = true;
+	} else if (db_bind_values (stmt, q->params, q->n_params) != SQLITE_OK) {
+		log_error ("db-query: %s: %s\n", q->sql, sqlite3_errmsg (db_conn_handle (conn)));
+		q->failed = true;
+	} else {
+		int rc;
+		q->n_cols = sqlite3_column_count (stmt);
+		while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+			db_value *row = calloc (q->n_cols > 0 ? q->n_cols : 1, sizeof (db_value));
+			for (int i = 0; i < q->n_cols; i++)
+				db_column_copy (stmt, i, &row[i]);
+			g_ptr_array_add (q->rows, row);
+		}
+		if (rc != SQLITE_DONE) {
+			log_error ("db-query: %s: %s\n", q->sql, sqlite3_errmsg (db_conn_handle (conn)));
+			q->failed = true;
+		}
+	}
+	/* Reset ends the read transaction so checkpoints are not held back */
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+
+	scm_call_later (q->mod_id, q->serv, q->func, db_query_args, q);
+}
+
+/* The rows as a list of vectors, #f if the query failed */
+static sexp
+db_query_args (sexp ctx, void *data)
+{
+	db_query *q = data;
+
+	if (ctx == NULL) {
+		db_query_free (q);
+		return SEXP_NULL;
+	}
+
+	sexp_gc_var3 (res, row, val);
+	sexp_gc_preserve3 (ctx, res, row, val);
+	res = SEXP_NULL;
+
+	for (guint r = q->rows->len; !q->failed && r > 0; r--) {
+		const db_value *values = g_ptr_array_index (q->rows, r - 1);
+		row = sexp_make_vector (ctx, sexp_make_fixnum (q->n_cols), SEXP_FALSE);
+		for (int i = 0; i < q->n_cols; i++) {
+			val = db_value_to_scheme (ctx, &values[i]);
+			sexp_vector_set (row, sexp_make_fixnum (i), val);
+		}
+		res = sexp_cons (ctx, row, res);
+	}
+	res = sexp_cons (ctx, q->failed ? SEXP_FALSE : res, SEXP_NULL);
+	db_query_free (q);
+
+	sexp_gc_release3 (ctx);
+	return res;
+}
+
+/*
+ * (db-query sql params callback)
+ * Run a read query on a db thread, then call callback on the loop
+ * thread with the rows as a list of vectors, or #f if it failed
+ */
+sexp
+scmapi_db_query (sexp ctx, sexp self, sexp n, sexp sql, sexp params, sexp func)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL)
+		return SEXP_FALSE;
+
+	if (!sexp_stringp (sql))
+		return sexp_xtype_exception (ctx, self, "not a string", sql);
+	if (!sexp_procedurep (func) && !sexp_opcodep (func))
+		return sexp_xtype_exception (ctx, self, "not a procedure", func);
+
+	long n_params;
+	db_value *values = scheme_list_to_db_values (ctx, params, &n_params);
+	if (n_params < 0)
+		return sexp_user_exception (ctx, self, "db-query: unsupported parameter", params);
+
+	db_query *q = calloc (1, sizeof (db_query));
+	q->sql = strdup (sexp_string_data (sql));
+	q->params = values;
+	q->n_params = n_params;
+	q->mod_id = mod->id;
+	q->serv = mod->mod_ctx.serv != NULL ? mod->mod_ctx.serv : get_config ()->server;
+	q->func = func;
+	q->rows = g_ptr_array_new ();
+	sexp_preserve_object (ctx, func);
+
+	db_read (db_query_run, q);
+	return SEXP_TRUE;
+}
+
+/* One row of a log-search, copied off the reader thread */
+typedef struct log_hit
+{
+	int64_t id;
+	char month[8];
+	char *time;
+	char *channel;
+	char *nick;
+	char *message;
+	bool action;
+} log_hit;
+
+/* A log-search on its way to a reader thread and back */
+typedef struct log_search
+{
+	char *query;
+	char *channel;
+	bool paged;
+	chanlog_cursor before;
+	int limit;
+	int mod_id;
+	const irc_server *serv;
+	sexp func;
+	GPtrArray *hits;
+	bool failed;
+} log_search;
+
+static sexp
+log_search_args (sexp ctx, void *data);
+
+static void
+log_hit_free (gpointer data)
+{
+	log_hit *h = data;
+	free (h->time);
+	free (h->channel);
+	free (h->nick);
+	free (h->message);
+	free (h);
+}
+
+static void
+log_search_add (const chanlog_row *row, void *data)
+{
+	log_search *ls = data;
+	log_hit *h = malloc (sizeof (log_hit));
+
+	h->id = row->id;
+	g_strlcpy (h->month, row->month, sizeof (h->month));
+	h->time = strdup (row->time);
+	h->channel = strdup (row->channel);
+	h->nick = strdup (row->nick);
+	h->message = strdup (row->message);
+	h->action = row->action;
+	g_ptr_array_add (ls->hits, h);
+}
+
+/* Runs on a db thread */
+static void
+log_search_run (db_conn *conn, void *data)
+{
+	log_search *ls = data;
+
+	ls->failed = conn == NULL ||
+		     chanlog_search (conn, irc_get_server_name (ls->serv), ls->channel,
+				     ls->query, ls->paged ? &ls->before : NULL, ls->limit, log_search_add, ls) < 0;
+
+	scm_call_later (ls->mod_id, ls->serv, ls->func, log_search_args, ls);
+}
+
+/* The rows as a list of #(id time channel nick message action cursor), or #f */
+static sexp
+log_search_args (sexp ctx, void *data)
+{
+	log_search *ls = data;
+	sexp res = SEXP_NULL;
+
+	if (ctx != NULL) {
+		sexp_gc_var3 (list, vec, val);
+		sexp_gc_preserve3 (ctx, list, vec, val);
+		list = SEXP_NULL;
+
+		for (guint i = ls->hits->len; !ls->failed && i > 0; i--) {
+			const log_hit *h = g_ptr_array_index (ls->hits, i - 1);
+			vec = sexp_make_vector (ctx, sexp_make_fixnum (7), SEXP_FALSE);
+			val = sexp_make_integer (ctx, h->id);
+			sexp_vector_set (vec, sexp_make_fixnum (0), val);
+			val = sexp_c_string (ctx, h->time, -1);
+			sexp_vector_set (vec, sexp_make_fixnum (1), val);
+			val = sexp_c_string (ctx, h->channel, -1);
+			sexp_vector_set (vec, sexp_make_fixnum (2), val);
+			val = sexp_c_string (ctx, h->nick, -1);
+			sexp_vector_set (vec, sexp_make_fixnum (3), val);
+			val = sexp_c_string (ctx, h->message, -1);
+			sexp_vector_set (vec, sexp_make_fixnum (4), val);
+			sexp_vector_set (vec, sexp_make_fixnum (5), h->action ? SEXP_TRUE : SEXP_FALSE);
+			char *cursor = g_strdup_printf (CHANLOG_CURSOR_FORMAT, h->month, h->id);
+			val = sexp_c_string (ctx, cursor, -1);
+			g_free (cursor);
+			sexp_vector_set (vec, sexp_make_fixnum (6), val);
+			list = sexp_cons (ctx, vec, list);
+		}
+		res = sexp_cons (ctx, ls->failed ? SEXP_FALSE : list, SEXP_NULL);
+
+		sexp_gc_release3 (ctx);
+	}
+
+	g_ptr_array_free (ls->hits, true);
+	free (ls->query);
+	free (ls->channel);
+	free (ls);
+	return res;
+}
+
+/*
+ * (log-search query channel before limit callback)
+ * Full-text search of this server's logs, or the configured server's
+ * outside a handler, on a db thread. channel may be #f and before is the
+ * cursor of the last row of the previous page, or #f. callback is then
+ * called on the loop thread with a list of #(id time channel nick
+ * message action cursor), newest first, or #f if the search failed.
+ */
+sexp
+scmapi_log_search (sexp ctx, sexp self, sexp n, sexp query, sexp channel, sexp before, sexp limit, sexp func)
+{
+	scm_module *mod = get_module (ctx);
+	if (mod == NULL)
+		return SEXP_FALSE;
+
+	if (!sexp_stringp (query))
+		return sexp_xtype_exception (ctx, self, "not a string", query);
+	if (!sexp_fixnump (limit))
+		return sexp_xtype_exception (ctx, self, "not an integer", limit);
+	chanlog_cursor cursor;
+	if (before != SEXP_FALSE && (!sexp_stringp (before) || !chanlog_cursor_parse (sexp_string_data (before), &cursor)))
+		return sexp_xtype_exception (ctx, self, "not a search cursor", before);
+	if (!sexp_procedurep (func) && !sexp_opcodep (func))
+		return sexp_xtype_exception (ctx, self, "not a procedure", func);
+
+	log_search *ls = calloc (1, sizeof (log_search));
+	ls->query = strdup (sexp_string_data (query));
+	ls->channel = sexp_stringp (channel) ? strdup (sexp_string_data (channel)) : NULL;
+	ls->paged = before != SEXP_FALSE;
+	if (ls->paged)
+		ls->before = cursor;
+	ls->limit = sexp_unbox_fixnum (limit);
+	ls->mod_id = mod->id;
+	/* Not set while the module loads */
+	ls->serv = mod->mod_ctx.serv != NULL ? mod->mod_ctx.serv : get_config ()->server;
+	ls->func = func;
+	ls->hits = g_ptr_array_new_with_free_func (log_hit_free);
+	sexp_preserve_object (ctx, func);
+
+	db_read (log_search_run, ls);
+	return SEXP_TRUE;
+}
+
 sexp
 scmapi_get_cmd_prefix (sexp ctx, sexp self, sexp n)
 {
@@ -161,6 +590,14 @@ scmapi_define_foreign_functions (sexp ctx)
 	/* Server interactions */
 	sexp_define_foreign (ctx, env, "send-raw", 1, scmapi_send_raw);
 
+	/* Module management */
+	sexp_define_foreign (ctx, env, "reload-module", 1, scmapi_reload_module);
+
+	/* Shared database */
+	sexp_define_foreign (ctx, env, "db-exec", 2, scmapi_db_exec);
+	sexp_define_foreign (ctx, env, "db-query", 3, scmapi_db_query);
+	sexp_define_foreign (ctx, env, "log-search", 5, scmapi_log_search);
+
 	/* IRC config information */
 	sexp_define_foreign (ctx, env, "get-cmd-prefix", 0, scmapi_get_cmd_prefix);
 	sexp_define_foreign (ctx, env, "get-db-path", 0, scmapi_get_db_path);
@@ -0,0 +1,891 @@
+/*
+ * mockircd, a local IRC server for load and soak tests of circ
+ *
+ * Speaks enough of the server side for the bot: registration, CAP and
+ * SASL PLAIN, JOIN/PART/NAMES and PING, over plaintext and TLS. Clients
+ * that joined channels get synthetic channel traffic at a target rate,
+ * and faults can be injected: disconnects, slow reads and lines sent in
+ * pieces. Every report interval a line with the sustained rates and the
+ * memory of the process given with -p is printed, and a summary at exit.
+ *
+ * Without -C and -K the TLS port uses a self-signed certificate made at
+ * startup, circ does not verify certificates.
+ */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ev.h>
+#include <gnutls/crypto.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#define SERVER_NAME "mock.irc"
+#define MAX_LINE 8192
+#define MAX_PARAMS 15
+#define MAX_CHANNELS 32
+/* Period of traffic, slow reads and partial writes */
+#define TICK_SECONDS 0.01
+#define PING_SECONDS 30.0
+/* Fake members of every channel, also the senders of the traffic */
+#define FAKE_USERS 50
+
+typedef struct options
+{
+	int port;
+	int tls_port;
+	const char *cert;
+	const char *key;
+	/* Lines per second to each client, spread over its channels */
+	double rate;
+	int line_length;
+	/* Close a client this many seconds after it registered, 0 never */
+	double disconnect;
+	/* Bytes per second read from a client, 0 unlimited */
+	int slow_read;
+	/* Send lines in pieces of at most this many bytes per tick */
+	int partial;
+	/* Backlog in bytes per client before traffic is dropped */
+	size_t max_backlog;
+	const char *sasl;
+	double report;
+	double duration;
+	pid_t pid;
+} options;
+
+typedef struct client
+{
+	int fd;
+	bool tls;
+	bool handshaking;
+	gnutls_session_t session;
+	ev_io io;
+
+	char in[MAX_LINE];
+	size_t in_len;
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+
+	char nick[64];
+	char user[64];
+	bool registered;
+	/* Registration waits for CAP END once CAP is used */
+	bool cap_negotiating;
+	bool server_time;
+	ev_tstamp registered_at;
+	char channels[MAX_CHANNELS][64];
+	int n_channels;
+
+	double traffic_due;
+	int next_channel;
+	long read_budget;
+
+	struct client *next;
+} client;
+
+typedef struct stats
+{
+	uint64_t generated;
+	uint64_t dropped;
+	uint64_t lines_written;
+	uint64_t bytes_written;
+	uint64_t lines_read;
+	uint64_t privmsgs_read;
+	uint64_t pongs;
+	uint64_t connects;
+	uint64_t disconnects;
+} stats;
+
+static options opts = {
+	.port = 6667,
+	.tls_port = 6697,
+	.rate = 100,
+	.line_length = 80,
+	.max_backlog = 4 << 20,
+	.report = 5,
+};
+static gnutls_certificate_credentials_t tls_creds;
+static client *clients;
+static stats total, last;
+static ev_tstamp started, last_report;
+static long rss_start;
+static ev_tstamp rss_start_at;
+
+static void
+client_read_cb (EV_P_ ev_io *w, int revents);
+static void
+client_close (EV_P_ client *c, const char *reason);
+
+static void
+set_nonblock (int fd)
+{
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* RSS in kB of the process under test, 0 if there is none */
+static long
+rss_kb (void)
+{
+	char path[64], line[256];
+	long kb = 0;
+
+	if (opts.pid == 0)
+		return 0;
+	snprintf (path, sizeof (path), "/proc/%d/status", (int)opts.pid);
+	FILE *f = fopen (path, "r");
+	if (f == NULL)
+		return 0;
+	while (fgets (line, sizeof (line), f) != NULL)
+		if (sscanf (line, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose (f);
+	return kb;
+}
+
+static void
+update_events (EV_P_ client *c)
+{
+	int events = 0;
+	if (c->handshaking || c->read_budget > 0 || opts.slow_read == 0)
+		events |= EV_READ;
+	if (c->handshaking ? gnutls_record_get_direction (c->session) == 1 : (c->out_len > 0 && opts.partial == 0))
+		events |= EV_WRITE;
+
+	if (events != (c->io.events & (EV_READ | EV_WRITE))) {
+		ev_io_stop (EV_A_ & c->io);
+		ev_io_set (&c->io, c->fd, events);
+		if (events != 0)
+			ev_io_start (EV_A_ & c->io);
+	}
+}
+
+/* Queue a line, "\r\n" is added */
+static void
+client_send (client *c, const char *fmt, ...)
+{
+	char line[MAX_LINE];
+	va_list ap;
+
+	va_start (ap, fmt);
+	int len = vsnprintf (line, sizeof (line) - 2, fmt, ap);
+	va_end (ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof (line) - 3)
+		len = sizeof (line) - 3;
+	memcpy (line + len, "\r\n", 3);
+	len += 2;
+
+	if (c->out_len + len > c->out_cap) {
+		c->out_cap = (c->out_len + len) * 2;
+		c->out = realloc (c->out, c->out_cap);
+	}
+	memcpy (c->out + c->out_len, line, len);
+	c->out_len += len;
+}
+
+static ssize_t
+client_write_raw (client *c, const char *buf, size_t len)
+{
+	if (c->tls) {
+		ssize_t ret = gnutls_record_send (c->session, buf, len);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+			return 0;
+		return ret < 0 ? -1 : ret;
+	}
+	ssize_t ret = send (c->fd, buf, len, MSG_NOSIGNAL);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	return ret;
+}
+
+/* Write up to max bytes of the backlog, false if the client is gone */
+static bool
+client_flush (EV_P_ client *c, size_t max)
+{
+	size_t n = c->out_len < max ? c->out_len : max;
+	if (n == 0)
+		return true;
+
+	ssize_t ret = client_write_raw (c, c->out, n);
+	if (ret < 0) {
+		client_close (EV_A_ c, "write error");
+		return false;
+	}
+	for (ssize_t i = 0; i < ret; i++)
+		if (c->out[i] == '\n')
+			total.lines_written++;
+	total.bytes_written += ret;
+	memmove (c->out, c->out + ret, c->out_len - ret);
+	c->out_len -= ret;
+	return true;
+}
+
+static void
+client_close (EV_P_ client *c, const char *reason)
+{
+	ev_io_stop (EV_A_ & c->io);
+	if (c->tls) {
+		gnutls_bye (c->session, GNUTLS_SHUT_WR);
+		gnutls_deinit (c->session);
+	}
+	close (c->fd);
+	total.disconnects++;
+	fprintf (stderr, "mockircd: %s disconnected: %s\n", c->nick[0] != '\0' ? c->nick : "client", reason);
+
+	for (client **p = &clients; *p != NULL; p = &(*p)->next)
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	free (c->out);
+	free (c);
+}
+
+static void
+try_register (client *c)
+{
+	if (c->registered || c->cap_negotiating || c->nick[0] == '\0' || c->user[0] == '\0')
+		return;
+
+	c->registered = true;
+	c->registered_at = ev_now (EV_DEFAULT);
+	client_send (c, ":%s 001 %s :Welcome to the mock network %s", SERVER_NAME, c->nick, c->nick);
+	client_send (c, ":%s 002 %s :Your host is %s", SERVER_NAME, c->nick, SERVER_NAME);
+	client_send (c, ":%s 003 %s :This server was created just now", SERVER_NAME, c->nick);
+	client_send (c, ":%s 004 %s %s mockircd-1 io ntk", SERVER_NAME, c->nick, SERVER_NAME);
+	client_send (c, ":%s 005 %s CHANTYPES=# PREFIX=(ov)@+ NETWORK=Mock :are supported by this server", SERVER_NAME, c->nick);
+	client_send (c, ":%s 375 %s :- %s Message of the day -", SERVER_NAME, c->nick, SERVER_NAME);
+	client_send (c, ":%s 372 %s :- Load test server, nothing is real", SERVER_NAME, c->nick);
+	client_send (c, ":%s 376 %s :End of /MOTD command.", SERVER_NAME, c->nick);
+}
+
+static bool
+has_channel (client *c, const char *channel)
+{
+	for (int i = 0; i < c->n_channels; i++)
+		if (strcmp (c->channels[i], channel) == 0)
+			return true;
+	return false;
+}
+
+static void
+handle_join (client *c, char *targets)
+{
+	for (char *chan = strtok (targets, ","); chan != NULL; chan = strtok (NULL, ",")) {
+		if (chan[0] != '#' || strlen (chan) >= sizeof (c->channels[0])) {
+			client_send (c, ":%s 403 %s %s :No such channel", SERVER_NAME, c->nick, chan);
+			continue;
+		}
+		if (!has_channel (c, chan) && c->n_channels < MAX_CHANNELS)
+			strcpy (c->channels[c->n_channels++], chan);
+
+		client_send (c, ":%s!%s@mock.client JOIN %s", c->nick, c->user, chan);
+		client_send (c, ":%s 332 %s %s :Synthetic traffic at %.0f lines/s", SERVER_NAME, c->nick, chan, opts.rate);
+		char names[MAX_LINE - 128];
+		int len = snprintf (names, sizeof (names), "@%s", c->nick);
+		for (int i = 0; i < FAKE_USERS && len < (int)sizeof (names) - 32; i++)
+			len += snprintf (names + len, sizeof (names) - len, " %suser%d", i % 10 == 0 ? "+" : "", i);
+		client_send (c, ":%s 353 %s = %s :%s", SERVER_NAME, c->nick, chan, names);
+		client_send (c, ":%s 366 %s %s :End of /NAMES list.", SERVER_NAME, c->nick, chan);
+	}
+}
+
+static void
+handle_part (client *c, char *targets)
+{
+	for (char *chan = strtok (targets, ","); chan != NULL; chan = strtok (NULL, ",")) {
+		for (int i = 0; i < c->n_channels; i++)
+			if (strcmp (c->channels[i], chan) == 0) {
+				memmove (c->channels[i], c->channels[i + 1], (c->n_channels - i - 1) * sizeof (c->channels[0]));
+				c->n_channels--;
+				break;
+			}
+		client_send (c, ":%s!%s@mock.client PART %s", c->nick, c->user, chan);
+	}
+}
+
+static void
+handle_cap (client *c, int argc, char **argv)
+{
+	static const char *caps[] = { "sasl", "server-time", "multi-prefix" };
+	const char *nick = c->nick[0] != '\0' ? c->nick : "*";
+
+	if (argc < 1)
+		return;
+	if (strcmp (argv[0], "LS") == 0) {
+		c->cap_negotiating = true;
+		client_send (c, ":%s CAP %s LS :sasl=PLAIN server-time multi-prefix", SERVER_NAME, nick);
+	} else if (strcmp (argv[0], "REQ") == 0 && argc > 1) {
+		c->cap_negotiating = true;
+		char req[512];
+		snprintf (req, sizeof (req), "%s", argv[1]);
+
+		bool ok = true, server_time = false;
+		for (char *cap = strtok (req, " "); cap != NULL; cap = strtok (NULL, " ")) {
+			bool known = false;
+			for (size_t i = 0; i < sizeof (caps) / sizeof (caps[0]); i++)
+				known |= strcmp (cap, caps[i]) == 0;
+			ok &= known;
+			server_time |= strcmp (cap, "server-time") == 0;
+		}
+		if (ok)
+			c->server_time |= server_time;
+		client_send (c, ":%s CAP %s %s :%s", SERVER_NAME, nick, ok ? "ACK" : "NAK", argv[1]);
+	} else if (strcmp (argv[0], "END") == 0) {
+		c->cap_negotiating = false;
+		try_register (c);
+	}
+}
+
+/* Only PLAIN, checked against -s user:pass if given */
+static void
+handle_authenticate (client *c, const char *arg)
+{
+	const char *nick = c->nick[0] != '\0' ? c->nick : "*";
+
+	if (strcmp (arg, "PLAIN") == 0) {
+		client_send (c, "AUTHENTICATE +");
+		return;
+	}
+	if (strcmp (arg, "*") == 0) {
+		client_send (c, ":%s 906 %s :SASL authentication aborted", SERVER_NAME, nick);
+		return;
+	}
+
+	gnutls_datum_t in = { (unsigned char *)arg, strlen (arg) }, out = { 0 };
+	bool ok = gnutls_base64_decode2 (&in, &out) == 0;
+	if (ok && opts.sasl != NULL) {
+		/* authzid \0 authcid \0 password */
+		const char *authcid = memchr (out.data, '\0', out.size);
+		const char *end = (const char *)out.data + out.size;
+		const char *pass = authcid != NULL ? memchr (authcid + 1, '\0', end - authcid - 1) : NULL;
+		char given[512];
+		if (pass != NULL) {
+			snprintf (given, sizeof (given), "%.*s:%.*s", (int)(pass - authcid - 1), authcid + 1, (int)(end - pass - 1), pass + 1);
+			ok = strcmp (given, opts.sasl) == 0;
+		} else {
+			ok = false;
+		}
+	}
+	gnutls_free (out.data);
+
+	if (ok) {
+		client_send (c, ":%s 900 %s %s!%s@mock.client %s :You are now logged in", SERVER_NAME, nick, nick, c->user[0] != '\0' ? c->user : "*", nick);
+		client_send (c, ":%s 903 %s :SASL authentication successful", SERVER_NAME, nick);
+	} else {
+		client_send (c, ":%s 904 %s :SASL authentication failed", SERVER_NAME, nick);
+	}
+}
+
+/* Splits line in place into the command and its parameters */
+static int
+split_line (char *line, char **command, char **argv)
+{
+	int argc = 0;
+	char *s = line;
+
+	if (*s == '@')
+		s = strchr (s, ' ') != NULL ? strchr (s, ' ') + 1 : s + strlen (s);
+	while (*s == ' ')
+		s++;
+	if (*s == ':')
+		s = strchr (s, ' ') != NULL ? strchr (s, ' ') + 1 : s + strlen (s);
+	while (*s == ' ')
+		s++;
+
+	*command = s;
+	s += strcspn (s, " ");
+	while (*s != '\0' && argc < MAX_PARAMS) {
+		*s++ = '\0';
+		while (*s == ' ')
+			s++;
+		if (*s == '\0')
+			break;
+		if (*s == ':') {
+			argv[argc++] = s + 1;
+			break;
+		}
+		argv[argc++] = s;
+		s += strcspn (s, " ");
+	}
+	return argc;
+}
+
+static void
+handle_line (EV_P_ client *c, char *line)
+{
+	char *command, *argv[MAX_PARAMS];
+	int argc = split_line (line, &command, argv);
+
+	total.lines_read++;
+	if (*command == '\0')
+		return;
+
+	if (strcmp (command, "CAP") == 0) {
+		handle_cap (c, argc, argv);
+	} else if (strcmp (command, "AUTHENTICATE") == 0 && argc > 0) {
+		handle_authenticate (c, argv[0]);
+	} else if (strcmp (command, "NICK") == 0 && argc > 0) {
+		if (c->registered)
+			client_send (c, ":%s!%s@mock.client NICK %s", c->nick, c->user, argv[0]);
+		snprintf (c->nick, sizeof (c->nick), "%s", argv[0]);
+		try_register (c);
+	} else if (strcmp (command, "USER") == 0 && argc > 0) {
+		snprintf (c->user, sizeof (c->user), "%s", argv[0]);
+		try_register (c);
+	} else if (strcmp (command, "PING") == 0) {
+		client_send (c, ":%s PONG %s :%s", SERVER_NAME, SERVER_NAME, argc > 0 ? argv[0] : "");
+	} else if (strcmp (command, "PONG") == 0) {
+		total.pongs++;
+	} else if (strcmp (command, "QUIT") == 0) {
+		client_send (c, "ERROR :Closing link (Quit: %s)", argc > 0 ? argv[0] : "");
+		/* A failed flush closed it already */
+		if (client_flush (EV_A_ c, c->out_len))
+			client_close (EV_A_ c, "quit");
+	} else if (!c->registered) {
+		client_send (c, ":%s 451 * :You have not registered", SERVER_NAME);
+	} else if (strcmp (command, "JOIN") == 0 && argc > 0) {
+		handle_join (c, argv[0]);
+	} else if (strcmp (command, "PART") == 0 && argc > 0) {
+		handle_part (c, argv[0]);
+	} else if (strcmp (command, "PRIVMSG") == 0 || strcmp (command, "NOTICE") == 0) {
+		total.privmsgs_read++;
+	} else if (strcmp (command, "MODE") != 0 && strcmp (command, "WHO") != 0) {
+		client_send (c, ":%s 421 %s %s :Unknown command", SERVER_NAME, c->nick, command);
+	}
+}
+
+static ssize_t
+client_read_raw (client *c, char *buf, size_t len)
+{
+	if (c->tls) {
+		ssize_t ret = gnutls_record_recv (c->session, buf, len);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+			return -2;
+		return ret < 0 ? -1 : ret;
+	}
+	ssize_t ret = recv (c->fd, buf, len, 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return -2;
+	return ret;
+}
+
+static void
+client_read_cb (EV_P_ ev_io *w, int revents)
+{
+	client *c = w->data;
+
+	if (c->handshaking) {
+		int ret = gnutls_handshake (c->session);
+		if (ret == 0) {
+			c->handshaking = false;
+		} else if (gnutls_error_is_fatal (ret)) {
+			client_close (EV_A_ c, gnutls_strerror (ret));
+			return;
+		}
+		update_events (EV_A_ c);
+		return;
+	}
+
+	if ((revents & EV_WRITE) && !client_flush (EV_A_ c, c->out_len))
+		return;
+
+	if (revents & EV_READ) {
+		size_t want = sizeof (c->in) - c->in_len;
+		if (opts.slow_read > 0 && (long)want > c->read_budget)
+			want = c->read_budget;
+
+		ssize_t n = client_read_raw (c, c->in + c->in_len, want);
+		if (n == 0 || n == -1) {
+			client_close (EV_A_ c, n == 0 ? "connection closed" : "read error");
+			return;
+		}
+		if (n > 0) {
+			c->in_len += n;
+			if (opts.slow_read > 0)
+				c->read_budget -= n;
+
+			char *start = c->in, *nl;
+			while ((nl = memchr (start, '\n', c->in + c->in_len - start)) != NULL) {
+				*nl = '\0';
+				if (nl > start && nl[-1] == '\r')
+					nl[-1] = '\0';
+				handle_line (EV_A_ c, start);
+				/* The client may have quit */
+				bool alive = false;
+				for (client *it = clients; it != NULL; it = it->next)
+					alive |= it == c;
+				if (!alive)
+					return;
+				start = nl + 1;
+			}
+			c->in_len -= start - c->in;
+			memmove (c->in, start, c->in_len);
+			/* A line longer than the buffer is dropped */
+			if (c->in_len == sizeof (c->in))
+				c->in_len = 0;
+		}
+	}
+	update_events (EV_A_ c);
+}
+
+static void
+accept_cb (EV_P_ ev_io *w, int revents)
+{
+	bool tls = w->data != NULL;
+	int fd = accept (w->fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	set_nonblock (fd);
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof (int));
+
+	client *c = calloc (1, sizeof (client));
+	c->fd = fd;
+	c->tls = tls;
+	c->handshaking = tls;
+	c->read_budget = opts.slow_read;
+	if (tls) {
+		gnutls_init (&c->session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
+		gnutls_set_default_priority (c->session);
+		gnutls_credentials_set (c->session, GNUTLS_CRD_CERTIFICATE, tls_creds);
+		gnutls_certificate_server_set_request (c->session, GNUTLS_CERT_IGNORE);
+		gnutls_transport_set_int (c->session, fd);
+	}
+	c->next = clients;
+	clients = c;
+	total.connects++;
+
+	ev_io_init (&c->io, client_read_cb, fd, EV_READ);
+	c->io.data = c;
+	ev_io_start (EV_A_ & c->io);
+	fprintf (stderr, "mockircd: %s connection\n", tls ? "TLS" : "plaintext");
+}
+
+static void
+send_traffic (client *c)
+{
+	static const char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor" };
+	char text[MAX_LINE / 2];
+
+	c->traffic_due += opts.rate * TICK_SECONDS;
+	for (; c->traffic_due >= 1; c->traffic_due--) {
+		total.generated++;
+		if (c->out_len > opts.max_backlog) {
+			total.dropped++;
+			continue;
+		}
+
+		int len = 0;
+		for (int w = rand (); len < opts.line_length && len < (int)sizeof (text) - 16; w = rand ())
+			len += snprintf (text + len, sizeof (text) - len, "%s%s", len > 0 ? " " : "", words[w % (sizeof (words) / sizeof (words[0]))]);
+		int user = rand () % FAKE_USERS;
+		const char *chan = c->channels[c->next_channel++ % c->n_channels];
+
+		if (c->server_time) {
+			struct timespec ts;
+			struct tm tm;
+			char stamp[32];
+			clock_gettime (CLOCK_REALTIME, &ts);
+			strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", gmtime_r (&ts.tv_sec, &tm));
+			client_send (c, "@time=%s.%03ldZ :user%d!u%d@mock.user PRIVMSG %s :%s", stamp, ts.tv_nsec / 1000000, user, user, chan, text);
+		} else {
+			client_send (c, ":user%d!u%d@mock.user PRIVMSG %s :%s", user, user, chan, text);
+		}
+	}
+}
+
+static void
+tick_cb (EV_P_ ev_timer *w, int revents)
+{
+	ev_tstamp now = ev_now (EV_A);
+	client *next;
+
+	for (client *c = clients; c != NULL; c = next) {
+		next = c->next;
+		if (c->handshaking)
+			continue;
+		/* Read by gnutls already, the socket will not tell */
+		if (c->tls && gnutls_record_check_pending (c->session) > 0)
+			ev_feed_event (EV_A_ & c->io, EV_READ);
+
+		if (c->registered && opts.disconnect > 0 && now - c->registered_at >= opts.disconnect) {
+			client_send (c, "ERROR :Closing link (fault injected)");
+			if (client_flush (EV_A_ c, c->out_len))
+				client_close (EV_A_ c, "fault injected");
+			continue;
+		}
+		if (c->registered && c->n_channels > 0 && opts.rate > 0)
+			send_traffic (c);
+		if (opts.slow_read > 0)
+			c->read_budget = opts.slow_read * TICK_SECONDS > 1 ? opts.slow_read * TICK_SECONDS : 1;
+		/* One piece per tick, so the client sees partial lines */
+		if (opts.partial > 0 && !client_flush (EV_A_ c, 1 + rand () % opts.partial))
+			continue;
+		update_events (EV_A_ c);
+	}
+}
+
+static void
+ping_cb (EV_P_ ev_timer *w, int revents)
+{
+	for (client *c = clients; c != NULL; c = c->next)
+		if (c->registered) {
+			client_send (c, "PING :%s", SERVER_NAME);
+			update_events (EV_A_ c);
+		}
+}
+
+static void
+report_cb (EV_P_ ev_timer *w, int revents)
+{
+	ev_tstamp now = ev_now (EV_A);
+	double dt = now - last_report;
+	size_t backlog = 0;
+	int n = 0;
+
+	for (client *c = clients; c != NULL; c = c->next, n++)
+		backlog += c->out_len;
+	long rss = rss_kb ();
+	/* The baseline is the first report, after startup */
+	if (rss_start == 0) {
+		rss_start = rss;
+		rss_start_at = now;
+	}
+
+	printf ("t=%.0fs clients=%d sent=%.0f/s read=%.0f/s replies=%.0f/s dropped=%.0f/s backlog=%zuB rss=%ldkB (%+ldkB)\n",
+		now - started,
+		n,
+		(total.lines_written - last.lines_written) / dt,
+		(total.lines_read - last.lines_read) / dt,
+		(total.privmsgs_read - last.privmsgs_read) / dt,
+		(total.dropped - last.dropped) / dt,
+		backlog,
+		rss,
+		rss - rss_start);
+	fflush (stdout);
+	last = total;
+	last_report = now;
+}
+
+static void
+stop_cb (EV_P_ ev_signal *w, int revents)
+{
+	ev_break (EV_A_ EVBREAK_ALL);
+}
+
+static void
+duration_cb (EV_P_ ev_timer *w, int revents)
+{
+	ev_break (EV_A_ EVBREAK_ALL);
+}
+
+static int
+listen_on (int port)
+{
+	int fd = socket (AF_INET6, SOCK_STREAM, 0);
+	if (fd < 0)
+		err (1, "socket");
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof (int));
+	setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 0 }, sizeof (int));
+
+	struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons (port), .sin6_addr = in6addr_any };
+	if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+		err (1, "bind port %d", port);
+	if (listen (fd, 64) < 0)
+		err (1, "listen");
+	set_nonblock (fd);
+	return fd;
+}
+
+/* Self-signed ECDSA certificate for localhost, valid for a year */
+static void
+make_certificate (void)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	unsigned char serial[8];
+	time_t now = time (NULL);
+
+	gnutls_x509_privkey_init (&key);
+	if (gnutls_x509_privkey_generate (key, GNUTLS_PK_ECDSA, GNUTLS_CURVE_TO_BITS (GNUTLS_ECC_CURVE_SECP256R1), 0) < 0)
+		errx (1, "can not generate a TLS key");
+
+	gnutls_x509_crt_init (&crt);
+	gnutls_x509_crt_set_version (crt, 3);
+	gnutls_rnd (GNUTLS_RND_NONCE, serial, sizeof (serial));
+	serial[0] &= 0x7f;
+	gnutls_x509_crt_set_serial (crt, serial, sizeof (serial));
+	gnutls_x509_crt_set_activation_time (crt, now - 3600);
+	gnutls_x509_crt_set_expiration_time (crt, now + 365 * 24 * 3600);
+	gnutls_x509_crt_set_dn_by_oid (crt, GNUTLS_OID_X520_COMMON_NAME, 0, "localhost", strlen ("localhost"));
+	gnutls_x509_crt_set_subject_alt_name (crt, GNUTLS_SAN_DNSNAME, "localhost", strlen ("localhost"), GNUTLS_FSAN_SET);
+	gnutls_x509_crt_set_key (crt, key);
+	if (gnutls_x509_crt_sign2 (crt, crt, key, GNUTLS_DIG_SHA256, 0) < 0)
+		errx (1, "can not sign the TLS certificate");
+
+	if (gnutls_certificate_set_x509_key (tls_creds, &crt, 1, key) < 0)
+		errx (1, "can not use the TLS certificate");
+	gnutls_x509_crt_deinit (crt);
+	gnutls_x509_privkey_deinit (key);
+}
+
+static void
+usage (const char *argv0)
+{
+	fprintf (stderr,
+		 "usage: %s [options]\n"
+		 "  -l port      plaintext port, 0 for none (6667)\n"
+		 "  -t port      TLS port, 0 for none (6697)\n"
+		 "  -C file -K file  PEM certificate and key, self-signed if not given\n"
+		 "  -r rate      channel lines per second to each client (100)\n"
+		 "  -L length    length of the lines in characters (80)\n"
+		 "  -d seconds   disconnect clients this long after registering\n"
+		 "  -S bytes     read at most this many bytes per second from a client\n"
+		 "  -P bytes     send lines in pieces of at most this many bytes\n"
+		 "  -b bytes     backlog per client before traffic is dropped (4194304)\n"
+		 "  -s user:pass accept only these SASL credentials\n"
+		 "  -p pid       report the memory of this process, e.g. circ\n"
+		 "  -i seconds   report interval (5)\n"
+		 "  -T seconds   stop after this long\n",
+		 argv0);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt (argc, argv, "l:t:C:K:r:L:d:S:P:b:s:p:i:T:")) != -1) {
+		switch (opt) {
+		case 'l':
+			opts.port = atoi (optarg);
+			break;
+		case 't':
+			opts.tls_port = atoi (optarg);
+			break;
+		case 'C':
+			opts.cert = optarg;
+			break;
+		case 'K':
+			opts.key = optarg;
+			break;
+		case 'r':
+			opts.rate = atof (optarg);
+			break;
+		case 'L':
+			opts.line_length = atoi (optarg);
+			break;
+		case 'd':
+			opts.disconnect = atof (optarg);
+			break;
+		case 'S':
+			opts.slow_read = atoi (optarg);
+			break;
+		case 'P':
+			opts.partial = atoi (optarg);
+			break;
+		case 'b':
+			opts.max_backlog = strtoul (optarg, NULL, 10);
+			break;
+		case 's':
+			opts.sasl = optarg;
+			break;
+		case 'p':
+			opts.pid = atoi (optarg);
+			break;
+		case 'i':
+			opts.report = atof (optarg);
+			break;
+		case 'T':
+			opts.duration = atof (optarg);
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	if (optind < argc || opts.report <= 0 || (opts.port == 0 && opts.tls_port == 0))
+		usage (argv[0]);
+
+	signal (SIGPIPE, SIG_IGN);
+	struct ev_loop *loop = EV_DEFAULT;
+	ev_io plain_w, tls_w;
+
+	if (opts.port != 0) {
+		ev_io_init (&plain_w, accept_cb, listen_on (opts.port), EV_READ);
+		plain_w.data = NULL;
+		ev_io_start (loop, &plain_w);
+	}
+	if (opts.tls_port != 0) {
+		gnutls_global_init ();
+		gnutls_certificate_allocate_credentials (&tls_creds);
+		if (opts.cert != NULL && opts.key != NULL) {
+			if (gnutls_certificate_set_x509_key_file (tls_creds, opts.cert, opts.key, GNUTLS_X509_FMT_PEM) < 0)
+				errx (1, "can not load %s and %s", opts.cert, opts.key);
+		} else {
+			make_certificate ();
+		}
+		ev_io_init (&tls_w, accept_cb, listen_on (opts.tls_port), EV_READ);
+		tls_w.data = &tls_w;
+		ev_io_start (loop, &tls_w);
+	}
+
+	ev_timer tick_w, ping_w, report_w, duration_w;
+	ev_timer_init (&tick_w, tick_cb, TICK_SECONDS, TICK_SECONDS);
+	ev_timer_start (loop, &tick_w);
+	ev_timer_init (&ping_w, ping_cb, PING_SECONDS, PING_SECONDS);
+	ev_timer_start (loop, &ping_w);
+	ev_timer_init (&report_w, report_cb, opts.report, opts.report);
+	ev_timer_start (loop, &report_w);
+	if (opts.duration > 0) {
+		ev_timer_init (&duration_w, duration_cb, opts.duration, 0);
+		ev_timer_start (loop, &duration_w);
+	}
+
+	ev_signal int_w, term_w;
+	ev_signal_init (&int_w, stop_cb, SIGINT);
+	ev_signal_start (loop, &int_w);
+	ev_signal_init (&term_w, stop_cb, SIGTERM);
+	ev_signal_start (loop, &term_w);
+
+	started = last_report = ev_now (loop);
+	if (opts.port != 0)
+		fprintf (stderr, "mockircd: listening on %d\n", opts.port);
+	if (opts.tls_port != 0)
+		fprintf (stderr, "mockircd: listening on %d with TLS\n", opts.tls_port);
+	ev_run (loop, 0);
+
+	double elapsed = ev_now (loop) - started;
+	double measured = ev_now (loop) - rss_start_at;
+	long rss = rss_kb ();
+	printf ("{\"seconds\": %.1f, \"connects\": %llu, \"disconnects\": %llu, "
+		"\"lines_per_sec\": %.1f, \"replies_per_sec\": %.2f, \"dropped\": %llu, \"pongs\": %llu, "
+		"\"rss_start_kb\": %ld, \"rss_end_kb\": %ld, \"rss_growth_kb_per_hour\": %.1f, \"pid_alive\": %s}\n",
+		elapsed,
+		(unsigned long long)total.connects,
+		(unsigned long long)total.disconnects,
+		elapsed > 0 ? total.lines_written / elapsed : 0,
+		elapsed > 0 ? total.privmsgs_read / elapsed : 0,
+		(unsigned long long)total.dropped,
+		(unsigned long long)total.pongs,
+		rss_start,
+		rss,
+		rss_start != 0 && measured > 0 ? (rss - rss_start) * 3600.0 / measured : 0,
+		opts.pid != 0 && kill (opts.pid, 0) == 0 ? "true" : "false");
+	return 0;
+}
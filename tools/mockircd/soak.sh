@@ -0,0 +1,17 @@
+#!/bin/sh
+# Soak test: circ against mockircd until it stops, reporting the sustained
+# rates and the memory growth of circ. Run it from the build directory,
+# with a config.json whose server is localhost on port 6667, or 6697 with
+# "secure" set.
+#     ../tools/mockircd/soak.sh [seconds] [mockircd options]
+set -e
+
+seconds=${1:-3600}
+[ $# -gt 0 ] && shift
+
+# The pid of the shell is the pid of circ after the exec
+sh -c 'sleep 1; exec ./circ' > soak-circ.log 2>&1 &
+circ=$!
+trap 'kill $circ 2>/dev/null' EXIT INT TERM
+
+./tools/mockircd/mockircd -T "$seconds" -p "$circ" "$@"
@@ -0,0 +1,173 @@
+#define ALLOC_TRACE_NO_MACROS
+#include "alloc_trace.h"
+
+#ifdef CIRC_ALLOC_TRACE
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* In case the header was forced in before ALLOC_TRACE_NO_MACROS */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef strndup
+#undef free
+
+/* Lines listed in the report, the rest only count in their file */
+#define ALLOC_REPORT_LINES 20
+
+static _Atomic(alloc_site *) sites;
+static _Atomic uint64_t messages;
+
+static void
+site_count (alloc_site *site, size_t bytes)
+{
+	if (!atomic_load_explicit (&site->registered, memory_order_acquire) &&
+	    atomic_exchange (&site->registered, 1) == 0) {
+		site->next = atomic_load_explicit (&sites, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit (&sites, &site->next, site, memory_order_release, memory_order_relaxed))
+			;
+	}
+	atomic_fetch_add_explicit (&site->allocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&site->bytes, bytes, memory_order_relaxed);
+}
+
+void *
+alloc_trace_malloc (alloc_site *site, size_t size)
+{
+	site_count (site, size);
+	return malloc (size);
+}
+
+void *
+alloc_trace_calloc (alloc_site *site, size_t n, size_t size)
+{
+	site_count (site, n * size);
+	return calloc (n, size);
+}
+
+void *
+alloc_trace_realloc (alloc_site *site, void *p, size_t size)
+{
+	site_count (site, size);
+	return realloc (p, size);
+}
+
+char *
+alloc_trace_strdup (alloc_site *site, const char *s)
+{
+	site_count (site, strlen (s) + 1);
+	return strdup (s);
+}
+
+char *
+alloc_trace_strndup (alloc_site *site, const char *s, size_t n)
+{
+	site_count (site, strnlen (s, n) + 1);
+	return strndup (s, n);
+}
+
+void
+alloc_trace_free (alloc_site *site, void *p)
+{
+	if (p == NULL)
+		return;
+	/* Frees are only counted, sites that never allocate are not listed */
+	atomic_fetch_add_explicit (&site->frees, 1, memory_order_relaxed);
+	free (p);
+}
+
+void
+alloc_trace_message (void)
+{
+	atomic_fetch_add_explicit (&messages, 1, memory_order_relaxed);
+}
+
+void
+alloc_trace_totals (alloc_totals *out)
+{
+	memset (out, 0, sizeof (*out));
+	for (alloc_site *s = atomic_load_explicit (&sites, memory_order_acquire); s != NULL; s = s->next) {
+		out->allocs += atomic_load_explicit (&s->allocs, memory_order_relaxed);
+		out->bytes += atomic_load_explicit (&s->bytes, memory_order_relaxed);
+	}
+	out->messages = atomic_load_explicit (&messages, memory_order_relaxed);
+}
+
+void
+alloc_trace_reset (void)
+{
+	for (alloc_site *s = atomic_load_explicit (&sites, memory_order_acquire); s != NULL; s = s->next) {
+		atomic_store_explicit (&s->allocs, 0, memory_order_relaxed);
+		atomic_store_explicit (&s->bytes, 0, memory_order_relaxed);
+		atomic_store_explicit (&s->frees, 0, memory_order_relaxed);
+	}
+	atomic_store_explicit (&messages, 0, memory_order_relaxed);
+}
+
+/* The directory and name, libirc/parser.c and ircmsg/src/parser.c differ */
+static const char *
+short_path (const char *path)
+{
+	const char *name = strrchr (path, '/');
+	if (name == NULL)
+		return path;
+	const char *dir = name;
+	while (dir > path && dir[-1] != '/')
+		dir--;
+	return dir;
+}
+
+static int
+compare_allocs (const void *a, const void *b)
+{
+	const alloc_site *x = *(alloc_site *const *)a, *y = *(alloc_site *const *)b;
+	return x->allocs < y->allocs ? 1 : x->allocs > y->allocs ? -1 : 0;
+}
+
+void
+alloc_trace_report (FILE *out)
+{
+	size_t n = 0;
+	for (alloc_site *s = atomic_load_explicit (&sites, memory_order_acquire); s != NULL; s = s->next)
+		n++;
+	alloc_site **sorted = malloc (n * sizeof (alloc_site *));
+	n = 0;
+	for (alloc_site *s = atomic_load_explicit (&sites, memory_order_acquire); s != NULL; s = s->next)
+		sorted[n++] = s;
+	qsort (sorted, n, sizeof (alloc_site *), compare_allocs);
+
+	uint64_t msgs = atomic_load_explicit (&messages, memory_order_relaxed);
+	double per = msgs > 0 ? 1.0 / msgs : 1;
+	fprintf (out, "allocations over %llu messages%s\n", (unsigned long long)msgs, msgs > 0 ? ", per message" : "");
+
+	/* Files in order of their busiest line */
+	fprintf (out, "%-28s %10s %12s\n", "file", "allocs", "bytes");
+	bool *done = calloc (n, sizeof (bool));
+	for (size_t i = 0; i < n; i++) {
+		if (done[i])
+			continue;
+		const char *file = short_path (sorted[i]->file);
+		uint64_t allocs = 0, bytes = 0;
+		for (size_t j = i; j < n; j++)
+			if (!done[j] && strcmp (short_path (sorted[j]->file), file) == 0) {
+				allocs += sorted[j]->allocs;
+				bytes += sorted[j]->bytes;
+				done[j] = true;
+			}
+		if (allocs > 0)
+			fprintf (out, "%-28s %10.2f %12.1f\n", file, allocs * per, bytes * per);
+	}
+
+	fprintf (out, "%-28s %10s %12s\n", "line", "allocs", "bytes");
+	for (size_t i = 0; i < n && i < ALLOC_REPORT_LINES && sorted[i]->allocs > 0; i++) {
+		char site[256];
+		snprintf (site, sizeof (site), "%s:%d", short_path (sorted[i]->file), sorted[i]->line);
+		fprintf (out, "%-28s %10.2f %12.1f\n", site, sorted[i]->allocs * per, sorted[i]->bytes * per);
+	}
+	free (done);
+	free (sorted);
+}
+
+#endif
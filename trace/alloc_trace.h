@@ -0,0 +1,98 @@
+#ifndef TRACE_ALLOC_TRACE_H
+#define TRACE_ALLOC_TRACE_H
+
+/*
+ * Allocation counting by call site
+ * In builds with CIRC_ALLOC_TRACE this header is included first in every
+ * source of libirc and circ, and turns malloc, calloc, realloc, strdup,
+ * strndup and free into counted calls that remember their file and line.
+ * Memory allocated elsewhere (glib, chibi's heap, libc) is not counted.
+ *
+ * alloc_trace_message marks one handled message, so the report can give
+ * allocations per message. Without CIRC_ALLOC_TRACE everything here is
+ * a no-op.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct alloc_site
+{
+	const char *file;
+	int line;
+	_Atomic uint64_t allocs;
+	_Atomic uint64_t bytes;
+	_Atomic uint64_t frees;
+	_Atomic int registered;
+	struct alloc_site *next;
+} alloc_site;
+
+typedef struct alloc_totals
+{
+	uint64_t allocs;
+	uint64_t bytes;
+	uint64_t frees;
+	uint64_t messages;
+} alloc_totals;
+
+#ifdef CIRC_ALLOC_TRACE
+
+void *
+alloc_trace_malloc (alloc_site *site, size_t size);
+void *
+alloc_trace_calloc (alloc_site *site, size_t n, size_t size);
+void *
+alloc_trace_realloc (alloc_site *site, void *p, size_t size);
+char *
+alloc_trace_strdup (alloc_site *site, const char *s);
+char *
+alloc_trace_strndup (alloc_site *site, const char *s, size_t n);
+void
+alloc_trace_free (alloc_site *site, void *p);
+
+void
+alloc_trace_message (void);
+void
+alloc_trace_totals (alloc_totals *out);
+/* Per file and the busiest lines, per message since the last reset */
+void
+alloc_trace_report (FILE *out);
+void
+alloc_trace_reset (void);
+
+/* Each expansion is its own site, registered on its first call */
+#define ALLOC_SITE_CALL(fn, ...)                                           \
+	({                                                                   \
+		static alloc_site alloc_site_ = { .file = __FILE__, .line = __LINE__ }; \
+		fn (&alloc_site_, __VA_ARGS__);                                  \
+	})
+
+#ifndef ALLOC_TRACE_NO_MACROS
+#undef strdup
+#undef strndup
+#define malloc(size) ALLOC_SITE_CALL (alloc_trace_malloc, (size))
+#define calloc(n, size) ALLOC_SITE_CALL (alloc_trace_calloc, (n), (size))
+#define realloc(p, size) ALLOC_SITE_CALL (alloc_trace_realloc, (p), (size))
+#define strdup(s) ALLOC_SITE_CALL (alloc_trace_strdup, (s))
+#define strndup(s, n) ALLOC_SITE_CALL (alloc_trace_strndup, (s), (n))
+#define free(p) ALLOC_SITE_CALL (alloc_trace_free, (p))
+#endif
+
+#else
+
+#define alloc_trace_message() \
+	do {                  \
+	} while (0)
+#define alloc_trace_totals(out) memset ((out), 0, sizeof (alloc_totals))
+#define alloc_trace_report(out) \
+	do {                    \
+	} while (0)
+#define alloc_trace_reset() \
+	do {                \
+	} while (0)
+
+#endif
+
+#endif /* TRACE_ALLOC_TRACE_H */
@@ -0,0 +1,31 @@
+#ifndef TRACE_PROBES_H
+#define TRACE_PROBES_H
+
+/*
+ * USDT probes for bpftrace, perf and systemtap, provider "circ".
+ * Each one is a single nop until a tracer attaches, and without
+ * sys/sdt.h they are not compiled in at all. Arguments, in order:
+ *
+ * line_received    char *line, size_t len
+ * parse_done       char *line, int ok, char *command (NULL unless ok)
+ * hook_entry       char *command, char *hook
+ * hook_return      char *command, char *hook, uint64 ns
+ * scheme_entry     int module_id, char *path
+ * scheme_return    int module_id, char *path, uint64 ns
+ * message_enqueue  char *line, uint64 trace_id
+ * bytes_sent       char *buf, size_t len, int ret
+ * tls_handshake    char *host, int ret
+ *
+ * Example scripts are in tools/bpftrace.
+ */
+
+#ifdef CIRC_USDT
+#include <sys/sdt.h>
+#define CIRC_PROBE(...) STAP_PROBEV (circ, __VA_ARGS__)
+#else
+#define CIRC_PROBE(...) \
+	do {            \
+	} while (0)
+#endif
+
+#endif /* TRACE_PROBES_H */
@@ -0,0 +1,129 @@
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Spans are buffered, a sampled message seldom waits on the disk */
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+_Thread_local uint64_t trace_current;
+
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static FILE *out;
+static char *buffer;
+static int sample;
+static _Atomic uint64_t messages;
+static _Atomic uint64_t next_id;
+static _Atomic int next_tid;
+static _Thread_local int own_tid;
+static int pid;
+
+uint64_t
+trace_now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+trace_begin (void)
+{
+	if (sample <= 0)
+		return 0;
+	if (atomic_fetch_add_explicit (&messages, 1, memory_order_relaxed) % sample != 0)
+		return 0;
+	return atomic_fetch_add_explicit (&next_id, 1, memory_order_relaxed) + 1;
+}
+
+static void
+write_string (const char *s)
+{
+	fputc ('"', out);
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf (out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf (out, "\\u%04x", c);
+		else
+			fputc (c, out);
+	}
+	fputc ('"', out);
+}
+
+/* Must hold trace_mtx */
+static void
+write_event (uint64_t id, const char *cat, const char *name, char phase, uint64_t ns)
+{
+	/* One track per trace: every span shares the category and id */
+	fputs ("{\"cat\":\"message\",\"name\":", out);
+	write_string (name);
+	fprintf (out,
+		 ",\"ph\":\"%c\",\"id\":\"0x%llx\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"stage\":",
+		 phase,
+		 (unsigned long long)id,
+		 (unsigned long long)(ns / 1000),
+		 (unsigned)(ns % 1000),
+		 pid,
+		 own_tid);
+	write_string (cat);
+	fputs ("}},\n", out);
+}
+
+void
+trace_span (uint64_t id, const char *cat, const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+	if (id == 0)
+		return;
+	if (own_tid == 0)
+		own_tid = atomic_fetch_add_explicit (&next_tid, 1, memory_order_relaxed) + 1;
+
+	pthread_mutex_lock (&trace_mtx);
+	if (out != NULL) {
+		write_event (id, cat, name, 'b', start_ns);
+		write_event (id, cat, name, 'e', end_ns);
+	}
+	pthread_mutex_unlock (&trace_mtx);
+}
+
+void
+trace_init (const trace_options *opts)
+{
+	if (out != NULL || opts->path == NULL || opts->sample <= 0)
+		return;
+
+	out = fopen (opts->path, "w");
+	if (out == NULL) {
+		fprintf (stderr, "Error: trace: %s: %s\n", opts->path, strerror (errno));
+		return;
+	}
+	buffer = malloc (TRACE_BUFFER_SIZE);
+	setvbuf (out, buffer, _IOFBF, TRACE_BUFFER_SIZE);
+
+	pid = getpid ();
+	fputs ("[\n", out);
+	sample = opts->sample;
+	atexit (trace_shutdown);
+}
+
+void
+trace_shutdown (void)
+{
+	pthread_mutex_lock (&trace_mtx);
+	if (out != NULL) {
+		sample = 0;
+		/* Every event ends in a comma, so close with a metadata one */
+		fprintf (out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"circ\"}}]\n", pid);
+		fclose (out);
+		out = NULL;
+		free (buffer);
+	}
+	pthread_mutex_unlock (&trace_mtx);
+}
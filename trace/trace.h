@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Per-message tracing
+ * A sampled inbound message gets a trace id at the socket read, and
+ * every pipeline stage it passes records a span under that id: the
+ * read, the read queue wait, parsing, each hook and Scheme handler,
+ * and the write queue wait and send of the replies it caused.
+ *
+ * Spans are written to a file in the Chrome trace event format, which
+ * Perfetto and chrome://tracing open directly. Each trace shows up as
+ * its own track. Id 0 means not sampled and makes every call a no-op.
+ *
+ * Times are CLOCK_MONOTONIC ns, the same clock as metric_now_ns.
+ */
+
+typedef struct trace_options
+{
+	/* NULL turns tracing off */
+	const char *path;
+	/* Traces one in sample messages */
+	int sample;
+} trace_options;
+
+/* Trace of the message being handled by this thread, 0 for none */
+extern _Thread_local uint64_t trace_current;
+
+void
+trace_init (const trace_options *opts);
+/* Closes the JSON array, the file is valid without it too */
+void
+trace_shutdown (void);
+
+/* Id for a new message, 0 unless it is sampled */
+uint64_t
+trace_begin (void);
+void
+trace_span (uint64_t id, const char *cat, const char *name, uint64_t start_ns, uint64_t end_ns);
+uint64_t
+trace_now_ns (void);
+
+#endif /* TRACE_H */